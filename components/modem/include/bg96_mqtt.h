@@ -0,0 +1,149 @@
+// Copyright 2015-2018 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "esp_modem_dce.h"
+
+/**
+ * @brief Limits and timeouts of the BG96 MQTT client
+ *
+ */
+#define BG96_MQTT_MAX_TOPIC_LENGTH (64)     /*!< Max length of a topic */
+#define BG96_MQTT_SSL_CTX_ID (2)            /*!< SSL context used for the MQTT connection */
+#define BG96_MQTT_OPEN_TIMEOUT_MS (45000)   /*!< TCP + TLS setup, +QMTOPEN */
+#define BG96_MQTT_CONN_TIMEOUT_MS (30000)   /*!< MQTT CONNECT, +QMTCONN */
+#define BG96_MQTT_SUB_TIMEOUT_MS (15000)    /*!< +QMTSUB */
+#define BG96_MQTT_PUB_TIMEOUT_MS (15000)    /*!< +QMTPUB */
+#define BG96_MQTT_DISC_TIMEOUT_MS (5000)    /*!< +QMTDISC */
+#define BG96_MQTT_PROMPT_TIMEOUT_MS (1000)  /*!< "> " after AT+QMTPUB */
+#define BG96_MQTT_FILE_TIMEOUT_MS (10000)   /*!< AT+QFUPL of a certificate */
+
+/**
+ * @brief Message received on a subscribed topic. Runs in the UART event task, keep it short.
+ *
+ * @param topic topic of the message
+ * @param payload payload, nul terminated
+ * @param payload_len length of payload
+ * @param ctx user context given in the config
+ */
+typedef void (*bg96_mqtt_recv_cb_t)(const char *topic, const char *payload, size_t payload_len, void *ctx);
+
+/**
+ * @brief BG96 MQTT client configuration
+ *
+ */
+typedef struct {
+    const char *host;           /*!< Broker host name */
+    uint16_t port;              /*!< Broker port, TLS is always used */
+    const char *client_id;      /*!< MQTT client ID */
+    uint16_t keepalive_s;       /*!< MQTT keep alive */
+    bg96_mqtt_recv_cb_t recv_cb; /*!< Called for every received message, can be NULL */
+    void *recv_ctx;             /*!< Passed to recv_cb */
+} bg96_mqtt_config_t;
+
+/**
+ * @brief Configure the MQTT client of the BG96. Requires the AT engine to be running.
+ *
+ * @param dce Modem DCE object
+ * @param config client configuration, the strings must stay valid
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_FAIL on error
+ */
+esp_err_t bg96_mqtt_init(modem_dce_t *dce, const bg96_mqtt_config_t *config);
+
+/**
+ * @brief Store a file, e.g. a certificate, on the BG96 file system (UFS).
+ * Nothing is written when a file of the same name and size is already there.
+ *
+ * @param name file name
+ * @param data file content
+ * @param len length of data
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_FAIL on error
+ */
+esp_err_t bg96_mqtt_store_file(const char *name, const char *data, size_t len);
+
+/**
+ * @brief Set up TLS of the MQTT connection with certificates stored on the BG96 file system
+ *
+ * @param ca_file root CA file name
+ * @param cert_file client certificate file name
+ * @param key_file client private key file name
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_FAIL on error
+ */
+esp_err_t bg96_mqtt_set_tls(const char *ca_file, const char *cert_file, const char *key_file);
+
+/**
+ * @brief Open the network connection to the broker and connect
+ *
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_ERR_TIMEOUT if the modem didn't report a result in time
+ *      - ESP_FAIL on error
+ */
+esp_err_t bg96_mqtt_connect(void);
+
+/**
+ * @brief Disconnect from the broker and close the network connection
+ *
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_FAIL on error
+ */
+esp_err_t bg96_mqtt_disconnect(void);
+
+/**
+ * @brief Subscribe to a topic
+ *
+ * @param topic topic filter
+ * @param qos 0 or 1
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_ERR_TIMEOUT if the modem didn't report a result in time
+ *      - ESP_FAIL on error
+ */
+esp_err_t bg96_mqtt_subscribe(const char *topic, int qos);
+
+/**
+ * @brief Publish a message and wait for the modem to report the result
+ *
+ * @param topic topic
+ * @param payload payload string, must not contain Ctrl-Z (0x1A)
+ * @param qos 0 or 1
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_STATE if not connected
+ *      - ESP_ERR_TIMEOUT if the modem didn't report a result in time
+ *      - ESP_FAIL on error
+ */
+esp_err_t bg96_mqtt_publish(const char *topic, const char *payload, int qos);
+
+/**
+ * @brief Whether the client is connected. Turns false as soon as the modem reports +QMTSTAT
+ *
+ * @return true if connected
+ */
+bool bg96_mqtt_is_connected(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -132,6 +132,18 @@ esp_err_t esp_modem_setup_ppp(modem_dte_t *dte);
  */
 esp_err_t esp_modem_exit_ppp(modem_dte_t *dte);
 
+/**
+ * @brief Abort a PPP session which may already be lost and bring DTE and DCE back to command mode
+ * Unlike esp_modem_exit_ppp() it doesn't need a live session or a responsive DCE. The DTE always
+ * ends up in command mode, the return value tells whether the DCE answered
+ *
+ * @param dte Modem DTE Object
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_FAIL if the DCE doesn't answer AT
+ */
+esp_err_t esp_modem_abort_ppp(modem_dte_t *dte);
+
 #ifdef __cplusplus
 }
 #endif
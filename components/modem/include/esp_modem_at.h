@@ -0,0 +1,148 @@
+// Copyright 2015-2018 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "esp_modem_dce.h"
+
+/**
+ * @brief Sizes of the AT engine
+ *
+ */
+#define MODEM_AT_QUEUE_LENGTH (8)         /*!< Commands that can be queued before submit fails */
+#define MODEM_AT_MAX_CMD_LENGTH (128)     /*!< Max length of a command string, including "\r" */
+#define MODEM_AT_MAX_PREFIX_LENGTH (16)   /*!< Max length of a response prefix */
+#define MODEM_AT_MAX_RESPONSE_LENGTH (128) /*!< Max length of the collected intermediate response */
+#define MODEM_AT_MAX_LINE_LENGTH (512)    /*!< Max length of a line handed to URC handlers, e.g. +QMTRECV with its payload */
+#define MODEM_AT_MAX_URC_HANDLERS (12)    /*!< Max number of registered URC handlers */
+#define MODEM_AT_TASK_STACK_SIZE (3072)   /*!< Stack size of the AT engine task */
+#define MODEM_AT_TASK_PRIORITY (4)        /*!< Must be lower than the UART event task which delivers the lines */
+
+/**
+ * @brief Final result of an AT command
+ *
+ */
+typedef enum {
+    MODEM_AT_RESULT_OK = 0,     /*!< "OK" */
+    MODEM_AT_RESULT_CONNECT,    /*!< "CONNECT" */
+    MODEM_AT_RESULT_ERROR,      /*!< "ERROR" */
+    MODEM_AT_RESULT_CME_ERROR,  /*!< "+CME ERROR: <n>", the line is left in the response */
+    MODEM_AT_RESULT_CMS_ERROR,  /*!< "+CMS ERROR: <n>", the line is left in the response */
+    MODEM_AT_RESULT_NO_CARRIER, /*!< "NO CARRIER" */
+    MODEM_AT_RESULT_TIMEOUT,    /*!< No final result code within the command timeout */
+    MODEM_AT_RESULT_NOT_READY   /*!< DCE is not in command mode, command was not sent */
+} modem_at_result_t;
+
+/**
+ * @brief Completion callback of a queued command. Runs in the AT engine task.
+ *
+ * @param result final result of the command
+ * @param response intermediate response lines matching the prefix, separated by '\n'
+ * @param ctx user context given at submit time
+ */
+typedef void (*modem_at_cb_t)(modem_at_result_t result, const char *response, void *ctx);
+
+/**
+ * @brief Unsolicited result code handler. Runs in the UART event task, keep it short.
+ *
+ * @param line the URC line with "\r\n" stripped
+ * @param ctx user context given at registration time
+ */
+typedef void (*modem_at_urc_cb_t)(const char *line, void *ctx);
+
+/**
+ * @brief Start the AT engine on a DCE. Installs the URC dispatcher as dce->handle_urc.
+ *
+ * @param dce Modem DCE object
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_FAIL on error
+ */
+esp_err_t esp_modem_at_init(modem_dce_t *dce);
+
+/**
+ * @brief Queue a command. Returns immediately, cb is called once the final result code arrives
+ *
+ * @param command command string, must end with "\r"
+ * @param prefix only intermediate lines starting with this prefix are collected. NULL collects every line
+ * @param timeout_ms time allowed for the final result code once the command is on the wire
+ * @param cb completion callback, can be NULL
+ * @param ctx passed to cb
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if a string is too long
+ *      - ESP_ERR_NO_MEM if the command queue is full
+ */
+esp_err_t esp_modem_at_submit(const char *command, const char *prefix, uint32_t timeout_ms,
+                              modem_at_cb_t cb, void *ctx);
+
+/**
+ * @brief Queue a command and block until it completes
+ *
+ * @param command command string, must end with "\r"
+ * @param prefix see esp_modem_at_submit()
+ * @param timeout_ms see esp_modem_at_submit()
+ * @param response buffer for the collected response, can be NULL
+ * @param response_len size of response buffer
+ * @return modem_at_result_t final result of the command
+ */
+modem_at_result_t esp_modem_at_send(const char *command, const char *prefix, uint32_t timeout_ms,
+                                    char *response, size_t response_len);
+
+/**
+ * @brief Register a handler for unsolicited result codes starting with prefix
+ *
+ * @param prefix URC prefix, e.g. "+CPIN:" or "UNDER-VOLTAGE"
+ * @param cb handler
+ * @param ctx passed to cb
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_ERR_NO_MEM if the handler table is full
+ */
+esp_err_t esp_modem_at_register_urc(const char *prefix, modem_at_urc_cb_t cb, void *ctx);
+
+/**
+ * @brief Wait until every queued command has completed
+ *
+ * @param timeout_ms max time to wait
+ * @return esp_err_t
+ *      - ESP_OK when the engine is idle
+ *      - ESP_ERR_TIMEOUT otherwise
+ */
+esp_err_t esp_modem_at_wait_idle(uint32_t timeout_ms);
+
+/**
+ * @brief Take exclusive access to the command channel.
+ * Callers which still drive dce->handle_line and dte->send_cmd directly (e.g. the DCE methods)
+ * must hold this lock while the engine is running. The lock is recursive.
+ *
+ * @param timeout_ms max time to wait
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_ERR_TIMEOUT otherwise
+ */
+esp_err_t esp_modem_at_lock(uint32_t timeout_ms);
+
+/**
+ * @brief Release the lock taken by esp_modem_at_lock()
+ *
+ */
+void esp_modem_at_unlock(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -79,6 +79,7 @@ struct modem_dce {
     modem_mode_t mode;                                                                /*!< Working mode */
     modem_dte_t *dte;                                                                 /*!< DTE which connect to DCE */
     esp_err_t (*handle_line)(modem_dce_t *dce, const char *line);                     /*!< Handle line strategy */
+    esp_err_t (*handle_urc)(modem_dce_t *dce, const char *line);                      /*!< Handle lines not claimed by handle_line */
     esp_err_t (*sync)(modem_dce_t *dce);                                              /*!< Synchronization */
     esp_err_t (*echo_mode)(modem_dce_t *dce, bool on);                                /*!< Echo command on or off */
     esp_err_t (*store_profile)(modem_dce_t *dce);                                     /*!< Store user settings */
@@ -28,6 +28,15 @@ extern "C" {
  */
 modem_dce_t *sim800_init(modem_dte_t *dte);
 
+/**
+ * @brief Create and initialize SIM800 object without reading module name, IMEI, IMSI and operator.
+ * Only sync and echo off are sent, the caller fills in the identity fields (e.g. from a cache)
+ *
+ * @param dte Modem DTE object
+ * @return modem_dce_t* Modem DCE object
+ */
+modem_dce_t *sim800_init_minimal(modem_dte_t *dte);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,389 @@
+// Copyright 2015-2018 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_modem_dce_service.h"
+#include "esp_modem_at.h"
+#include "bg96_mqtt.h"
+
+#define BG96_MQTT_CLIENT_IDX (0)        /*!< The modem has 6 clients, one is enough */
+#define BG96_MQTT_CMD_TIMEOUT_MS (3000) /*!< Configuration commands and the immediate OK of the async ones */
+#define BG96_MQTT_CTRL_Z "\x1a"
+
+#define BG96_MQTT_OPEN_BIT BIT0
+#define BG96_MQTT_CONN_BIT BIT1
+#define BG96_MQTT_SUB_BIT BIT2
+#define BG96_MQTT_PUB_BIT BIT3
+#define BG96_MQTT_DISC_BIT BIT4
+
+/**
+ * @brief Macro defined for error checking
+ *
+ */
+static const char *MQTT_TAG = "bg96_mqtt";
+extern uint8_t modem_failures_counter;
+#define MQTT_CHECK(a, str, goto_tag, ...)                                              \
+    do                                                                                 \
+    {                                                                                  \
+        if (!(a))                                                                      \
+        {                                                                              \
+            ESP_LOGE(MQTT_TAG, "%s(%d): " str, __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+            goto goto_tag;                                                             \
+        }                                                                              \
+    } while (0)
+
+/**
+ * @brief BG96 MQTT client state
+ *
+ */
+typedef struct {
+    modem_dce_t *dce;                                  /*!< DCE the client runs on */
+    bg96_mqtt_config_t config;                         /*!< Client configuration */
+    EventGroupHandle_t events;                         /*!< Async results reported by +QMTxxx URCs */
+    volatile bool connected;                           /*!< Connected to the broker */
+    volatile int result;                               /*!< <result> of the last async URC */
+    uint16_t msg_id;                                   /*!< Last message ID used */
+    volatile modem_state_t raw_state;                  /*!< Final result of a raw exchange (QMTPUB, QFUPL) */
+    char cmd[MODEM_AT_MAX_CMD_LENGTH];                 /*!< Command being built */
+    char topic[BG96_MQTT_MAX_TOPIC_LENGTH];            /*!< Topic of the received message */
+    char payload[MODEM_AT_MAX_LINE_LENGTH];            /*!< Payload of the received message */
+} bg96_mqtt_t;
+
+static bg96_mqtt_t s_mqtt;
+
+/**
+ * @brief Whether line is the result code, ignoring the surrounding "\r\n"
+ */
+static bool bg96_mqtt_is_code(const char *line, const char *code)
+{
+    size_t len = strlen(code);
+    while (*line == '\r' || *line == '\n') {
+        line++;
+    }
+    return !strncmp(line, code, len) && (line[len] == '\r' || line[len] == '\n' || line[len] == '\0');
+}
+
+/**
+ * @brief Handler installed as dce->handle_line during a raw exchange
+ */
+static esp_err_t bg96_mqtt_handle_raw(modem_dce_t *dce, const char *line)
+{
+    if (bg96_mqtt_is_code(line, MODEM_RESULT_CODE_SUCCESS) || bg96_mqtt_is_code(line, MODEM_RESULT_CODE_CONNECT)) {
+        s_mqtt.raw_state = MODEM_STATE_SUCCESS;
+        return esp_modem_process_command_done(dce, MODEM_STATE_SUCCESS);
+    }
+    if (bg96_mqtt_is_code(line, MODEM_RESULT_CODE_ERROR) || strstr(line, "+CME ERROR")) {
+        s_mqtt.raw_state = MODEM_STATE_FAIL;
+        return esp_modem_process_command_done(dce, MODEM_STATE_FAIL);
+    }
+    /* +QMTxxx must reach the URC handler, other lines (+QFUPL: <size>,<checksum>) are dropped */
+    return strstr(line, "+QMT") ? ESP_FAIL : ESP_OK;
+}
+
+/**
+ * @brief Send a command, or data when command is NULL, and wait for its final result code.
+ * The AT engine lock must be held. The previous line handler is put back afterwards, so URCs
+ * and later result codes don't end up in bg96_mqtt_handle_raw().
+ */
+static esp_err_t bg96_mqtt_raw(const char *command, const char *data, size_t len, uint32_t timeout_ms)
+{
+    modem_dte_t *dte = s_mqtt.dce->dte;
+    esp_err_t (*handle_line)(modem_dce_t *dce, const char *line) = s_mqtt.dce->handle_line;
+    s_mqtt.raw_state = MODEM_STATE_PROCESSING;
+    s_mqtt.dce->handle_line = bg96_mqtt_handle_raw;
+    if (data) {
+        /* The result code may come before send_cmd() waits for it, raw_state tells it apart */
+        MQTT_CHECK(dte->send_data(dte, data, len) == (int)len, "send data failed", err);
+    }
+    MQTT_CHECK(dte->send_cmd(dte, command ? command : "", timeout_ms) == ESP_OK || s_mqtt.raw_state != MODEM_STATE_PROCESSING,
+               "no result code", err);
+    MQTT_CHECK(s_mqtt.raw_state == MODEM_STATE_SUCCESS, "command failed", err);
+    s_mqtt.dce->handle_line = handle_line;
+    return ESP_OK;
+err:
+    s_mqtt.dce->handle_line = handle_line;
+    return ESP_FAIL;
+}
+
+/**
+ * @brief Send a configuration command through the AT engine
+ */
+static esp_err_t bg96_mqtt_send(const char *command)
+{
+    return esp_modem_at_send(command, NULL, BG96_MQTT_CMD_TIMEOUT_MS, NULL, 0) == MODEM_AT_RESULT_OK ? ESP_OK : ESP_FAIL;
+}
+
+/**
+ * @brief Send a command whose outcome comes later in a +QMTxxx URC and wait for it
+ */
+static esp_err_t bg96_mqtt_send_async(const char *command, EventBits_t bit, uint32_t timeout_ms)
+{
+    xEventGroupClearBits(s_mqtt.events, bit);
+    MQTT_CHECK(bg96_mqtt_send(command) == ESP_OK, "%.*s failed", err, (int)strcspn(command, "\r"), command);
+    MQTT_CHECK(xEventGroupWaitBits(s_mqtt.events, bit, pdTRUE, pdTRUE, pdMS_TO_TICKS(timeout_ms)) & bit,
+               "no result for %.*s", err_timeout, (int)strcspn(command, "\r"), command);
+    return ESP_OK;
+err_timeout:
+    return ESP_ERR_TIMEOUT;
+err:
+    return ESP_FAIL;
+}
+
+/**
+ * @brief Copy the next quoted string of a URC. Returns the position after the closing quote
+ */
+static const char *bg96_mqtt_unquote(const char *pos, char *out, size_t out_len, bool to_last_quote)
+{
+    const char *start = strchr(pos, '"');
+    const char *end = NULL;
+    if (!start) {
+        return NULL;
+    }
+    start++;
+    /* A JSON payload contains quotes itself, it ends at the last one of the line */
+    end = to_last_quote ? strrchr(start, '"') : strchr(start, '"');
+    if (!end || end < start) {
+        return NULL;
+    }
+    size_t len = MIN((size_t)(end - start), out_len - 1);
+    memcpy(out, start, len);
+    out[len] = '\0';
+    return end + 1;
+}
+
+/**
+ * @brief Handler of every +QMT URC. Runs in the UART event task
+ */
+static void bg96_mqtt_urc(const char *line, void *ctx)
+{
+    int client = 0, a = 0, b = 0, c = 0;
+    if (sscanf(line, "+QMTOPEN: %d,%d", &client, &a) == 2) {
+        s_mqtt.result = a;
+        xEventGroupSetBits(s_mqtt.events, BG96_MQTT_OPEN_BIT);
+    } else if (sscanf(line, "+QMTCONN: %d,%d,%d", &client, &a, &b) >= 2) {
+        s_mqtt.result = a ? a : b; /* <ret_code> is the CONNACK code */
+        xEventGroupSetBits(s_mqtt.events, BG96_MQTT_CONN_BIT);
+    } else if (sscanf(line, "+QMTSUB: %d,%d,%d,%d", &client, &a, &b, &c) >= 3) {
+        s_mqtt.result = (c == 0x80) ? 2 : b; /* <value> is the granted QoS, or 0x80 when refused */
+        xEventGroupSetBits(s_mqtt.events, BG96_MQTT_SUB_BIT);
+    } else if (sscanf(line, "+QMTPUB: %d,%d,%d", &client, &a, &b) == 3) {
+        s_mqtt.result = b;
+        xEventGroupSetBits(s_mqtt.events, BG96_MQTT_PUB_BIT);
+    } else if (sscanf(line, "+QMTDISC: %d,%d", &client, &a) == 2) {
+        s_mqtt.connected = false;
+        xEventGroupSetBits(s_mqtt.events, BG96_MQTT_DISC_BIT);
+    } else if (sscanf(line, "+QMTSTAT: %d,%d", &client, &a) == 2) {
+        ESP_LOGW(MQTT_TAG, "connection closed by the modem (%d)", a);
+        s_mqtt.connected = false;
+    } else if (!strncmp(line, "+QMTRECV:", 9)) {
+        /* +QMTRECV: <client>,<msgid>,"<topic>"[,<len>],"<payload>" */
+        const char *pos = bg96_mqtt_unquote(line, s_mqtt.topic, sizeof(s_mqtt.topic), false);
+        if (pos && (pos = bg96_mqtt_unquote(pos, s_mqtt.payload, sizeof(s_mqtt.payload), true)) != NULL) {
+            if (s_mqtt.config.recv_cb) {
+                s_mqtt.config.recv_cb(s_mqtt.topic, s_mqtt.payload, strlen(s_mqtt.payload), s_mqtt.config.recv_ctx);
+            }
+        } else {
+            ESP_LOGW(MQTT_TAG, "malformed +QMTRECV");
+        }
+    }
+}
+
+esp_err_t bg96_mqtt_init(modem_dce_t *dce, const bg96_mqtt_config_t *config)
+{
+    MQTT_CHECK(dce && config && config->host && config->client_id, "invalid config", err);
+    s_mqtt.dce = dce;
+    s_mqtt.config = *config;
+    if (!s_mqtt.events) {
+        s_mqtt.events = xEventGroupCreate();
+        MQTT_CHECK(s_mqtt.events, "create event group failed", err);
+        MQTT_CHECK(esp_modem_at_register_urc("+QMT", bg96_mqtt_urc, NULL) == ESP_OK, "register URC failed", err);
+    }
+    MQTT_CHECK(bg96_mqtt_send("AT+QMTCFG=\"version\",0,4\r") == ESP_OK, "set MQTT 3.1.1 failed", err);
+    snprintf(s_mqtt.cmd, sizeof(s_mqtt.cmd), "AT+QMTCFG=\"ssl\",%d,1,%d\r", BG96_MQTT_CLIENT_IDX, BG96_MQTT_SSL_CTX_ID);
+    MQTT_CHECK(bg96_mqtt_send(s_mqtt.cmd) == ESP_OK, "enable SSL failed", err);
+    snprintf(s_mqtt.cmd, sizeof(s_mqtt.cmd), "AT+QMTCFG=\"keepalive\",%d,%u\r", BG96_MQTT_CLIENT_IDX,
+             config->keepalive_s);
+    MQTT_CHECK(bg96_mqtt_send(s_mqtt.cmd) == ESP_OK, "set keep alive failed", err);
+    return ESP_OK;
+err:
+    modem_failures_counter++;
+    return ESP_FAIL;
+}
+
+esp_err_t bg96_mqtt_store_file(const char *name, const char *data, size_t len)
+{
+    char response[MODEM_AT_MAX_RESPONSE_LENGTH];
+    unsigned int size = 0;
+    esp_err_t err;
+
+    snprintf(s_mqtt.cmd, sizeof(s_mqtt.cmd), "AT+QFLST=\"%s\"\r", name);
+    if (esp_modem_at_send(s_mqtt.cmd, "+QFLST:", BG96_MQTT_CMD_TIMEOUT_MS, response, sizeof(response)) == MODEM_AT_RESULT_OK &&
+        sscanf(response, "+QFLST: %*[^,],%u", &size) == 1 && size == len) {
+        return ESP_OK; /* Already there, spare the modem's flash */
+    }
+    snprintf(s_mqtt.cmd, sizeof(s_mqtt.cmd), "AT+QFDEL=\"%s\"\r", name);
+    bg96_mqtt_send(s_mqtt.cmd); /* Fails when the file isn't there, that's fine */
+
+    snprintf(s_mqtt.cmd, sizeof(s_mqtt.cmd), "AT+QFUPL=\"%s\",%u,%u\r", name, (unsigned int)len,
+             BG96_MQTT_FILE_TIMEOUT_MS / 1000);
+    MQTT_CHECK(esp_modem_at_lock(BG96_MQTT_FILE_TIMEOUT_MS) == ESP_OK, "AT engine busy", err_lock);
+    err = bg96_mqtt_raw(s_mqtt.cmd, NULL, 0, BG96_MQTT_CMD_TIMEOUT_MS); /* Until CONNECT */
+    if (err == ESP_OK) {
+        err = bg96_mqtt_raw(NULL, data, len, BG96_MQTT_FILE_TIMEOUT_MS);
+    }
+    esp_modem_at_unlock();
+    MQTT_CHECK(err == ESP_OK, "upload of %s failed", err_lock, name);
+    ESP_LOGI(MQTT_TAG, "stored %s (%u bytes)", name, (unsigned int)len);
+    return ESP_OK;
+err_lock:
+    modem_failures_counter++;
+    return ESP_FAIL;
+}
+
+esp_err_t bg96_mqtt_set_tls(const char *ca_file, const char *cert_file, const char *key_file)
+{
+    const struct {
+        const char *option;
+        const char *value;
+        bool quoted;
+    } options[] = {
+        {"cacert", ca_file, true},
+        {"clientcert", cert_file, true},
+        {"clientkey", key_file, true},
+        {"seclevel", "2", false},           /* Server and client authentication */
+        {"sslversion", "4", false},         /* Any version */
+        {"ciphersuite", "0xFFFF", false},   /* Any cipher suite */
+        {"ignorelocaltime", "1", false},    /* The modem clock isn't set when certificates are checked */
+    };
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+        snprintf(s_mqtt.cmd, sizeof(s_mqtt.cmd), options[i].quoted ? "AT+QSSLCFG=\"%s\",%d,\"%s\"\r" :
+                 "AT+QSSLCFG=\"%s\",%d,%s\r", options[i].option, BG96_MQTT_SSL_CTX_ID, options[i].value);
+        MQTT_CHECK(bg96_mqtt_send(s_mqtt.cmd) == ESP_OK, "set %s failed", err, options[i].option);
+    }
+    /* SNI is needed by AWS IoT but older firmware doesn't know the option */
+    snprintf(s_mqtt.cmd, sizeof(s_mqtt.cmd), "AT+QSSLCFG=\"sni\",%d,1\r", BG96_MQTT_SSL_CTX_ID);
+    if (bg96_mqtt_send(s_mqtt.cmd) != ESP_OK) {
+        ESP_LOGW(MQTT_TAG, "SNI not supported by the modem firmware");
+    }
+    return ESP_OK;
+err:
+    modem_failures_counter++;
+    return ESP_FAIL;
+}
+
+esp_err_t bg96_mqtt_connect(void)
+{
+    esp_err_t err;
+
+    MQTT_CHECK(s_mqtt.events, "not initialized", err_state);
+    snprintf(s_mqtt.cmd, sizeof(s_mqtt.cmd), "AT+QMTOPEN=%d,\"%s\",%u\r", BG96_MQTT_CLIENT_IDX, s_mqtt.config.host,
+             s_mqtt.config.port);
+    err = bg96_mqtt_send_async(s_mqtt.cmd, BG96_MQTT_OPEN_BIT, BG96_MQTT_OPEN_TIMEOUT_MS);
+    MQTT_CHECK(err == ESP_OK, "open failed", err);
+    /* 2: the client is already open, e.g. after a lost MQTT session */
+    MQTT_CHECK(s_mqtt.result == 0 || s_mqtt.result == 2, "open failed (%d)", err_fail, s_mqtt.result);
+
+    snprintf(s_mqtt.cmd, sizeof(s_mqtt.cmd), "AT+QMTCONN=%d,\"%s\"\r", BG96_MQTT_CLIENT_IDX, s_mqtt.config.client_id);
+    err = bg96_mqtt_send_async(s_mqtt.cmd, BG96_MQTT_CONN_BIT, BG96_MQTT_CONN_TIMEOUT_MS);
+    MQTT_CHECK(err == ESP_OK, "connect failed", err);
+    MQTT_CHECK(s_mqtt.result == 0, "connect refused (%d)", err_fail, s_mqtt.result);
+    s_mqtt.connected = true;
+    return ESP_OK;
+err_fail:
+    err = ESP_FAIL;
+err:
+    modem_failures_counter++;
+    return err;
+err_state:
+    return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t bg96_mqtt_disconnect(void)
+{
+    s_mqtt.connected = false;
+    snprintf(s_mqtt.cmd, sizeof(s_mqtt.cmd), "AT+QMTDISC=%d\r", BG96_MQTT_CLIENT_IDX);
+    return bg96_mqtt_send_async(s_mqtt.cmd, BG96_MQTT_DISC_BIT, BG96_MQTT_DISC_TIMEOUT_MS);
+}
+
+esp_err_t bg96_mqtt_subscribe(const char *topic, int qos)
+{
+    esp_err_t err;
+
+    s_mqtt.msg_id = (s_mqtt.msg_id % UINT16_MAX) + 1; /* 0 isn't a valid ID for SUBSCRIBE */
+    MQTT_CHECK(snprintf(s_mqtt.cmd, sizeof(s_mqtt.cmd), "AT+QMTSUB=%d,%u,\"%s\",%d\r", BG96_MQTT_CLIENT_IDX,
+                        s_mqtt.msg_id, topic, qos) < (int)sizeof(s_mqtt.cmd), "topic too long", err_arg);
+    err = bg96_mqtt_send_async(s_mqtt.cmd, BG96_MQTT_SUB_BIT, BG96_MQTT_SUB_TIMEOUT_MS);
+    MQTT_CHECK(err == ESP_OK, "subscribe failed", err);
+    MQTT_CHECK(s_mqtt.result == 0, "subscribe refused (%d)", err_fail, s_mqtt.result);
+    return ESP_OK;
+err_fail:
+    err = ESP_FAIL;
+err:
+    modem_failures_counter++;
+    return err;
+err_arg:
+    return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t bg96_mqtt_publish(const char *topic, const char *payload, int qos)
+{
+    modem_dte_t *dte = s_mqtt.dce->dte;
+    uint16_t msg_id = 0;
+    esp_err_t err;
+
+    MQTT_CHECK(s_mqtt.connected, "not connected", err_state);
+    if (qos) {
+        s_mqtt.msg_id = (s_mqtt.msg_id % UINT16_MAX) + 1;
+        msg_id = s_mqtt.msg_id;
+    }
+    MQTT_CHECK(snprintf(s_mqtt.cmd, sizeof(s_mqtt.cmd), "AT+QMTPUB=%d,%u,%d,0,\"%s\"\r", BG96_MQTT_CLIENT_IDX,
+                        msg_id, qos, topic) < (int)sizeof(s_mqtt.cmd), "topic too long", err_arg);
+    xEventGroupClearBits(s_mqtt.events, BG96_MQTT_PUB_BIT);
+
+    MQTT_CHECK(esp_modem_at_lock(BG96_MQTT_PUB_TIMEOUT_MS) == ESP_OK, "AT engine busy", err_timeout);
+    err = dte->send_wait(dte, s_mqtt.cmd, strlen(s_mqtt.cmd), "\r\n> ", BG96_MQTT_PROMPT_TIMEOUT_MS);
+    if (err == ESP_OK) {
+        err = bg96_mqtt_raw(BG96_MQTT_CTRL_Z, payload, strlen(payload), BG96_MQTT_CMD_TIMEOUT_MS);
+    } else {
+        dte->send_data(dte, "\x1b", 1); /* ESC cancels a half entered message */
+    }
+    esp_modem_at_unlock();
+    MQTT_CHECK(err == ESP_OK, "publish failed", err_fail);
+
+    MQTT_CHECK(xEventGroupWaitBits(s_mqtt.events, BG96_MQTT_PUB_BIT, pdTRUE, pdTRUE,
+                                   pdMS_TO_TICKS(BG96_MQTT_PUB_TIMEOUT_MS)) & BG96_MQTT_PUB_BIT,
+               "no publish result", err_timeout);
+    /* 0: sent (and acknowledged for QoS 1), 1: being retransmitted, 2: failed */
+    MQTT_CHECK(s_mqtt.result != 2, "publish failed in the modem", err_fail);
+    return ESP_OK;
+err_fail:
+    modem_failures_counter++;
+    return ESP_FAIL;
+err_timeout:
+    modem_failures_counter++;
+    return ESP_ERR_TIMEOUT;
+err_arg:
+    return ESP_ERR_INVALID_ARG;
+err_state:
+    return ESP_ERR_INVALID_STATE;
+}
+
+bool bg96_mqtt_is_connected(void)
+{
+    return s_mqtt.connected;
+}
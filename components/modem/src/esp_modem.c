@@ -81,8 +81,11 @@ static esp_err_t esp_dte_handle_line(esp_modem_dte_t *esp_dte)
     const char *line = (const char *)(esp_dte->buffer);
     /* Skip pure "\r\n" lines */
     if (strlen(line) > 2) {
-        MODEM_CHECK(dce->handle_line, "no handler for line", err_handle);
-        MODEM_CHECK(dce->handle_line(dce, line) == ESP_OK, "handle line failed", err_handle);
+        MODEM_CHECK(dce->handle_line || dce->handle_urc, "no handler for line", err_handle);
+        /* Lines the command handler does not claim may be unsolicited result codes */
+        if (!dce->handle_line || dce->handle_line(dce, line) != ESP_OK) {
+            MODEM_CHECK(dce->handle_urc && dce->handle_urc(dce, line) == ESP_OK, "handle line failed", err_handle);
+        }
     }
     return ESP_OK;
 err_handle:
@@ -216,8 +219,10 @@ static esp_err_t esp_modem_dte_send_cmd(modem_dte_t *dte, const char *command, u
     /* Check timeout */
     MODEM_CHECK(xSemaphoreTake(esp_dte->process_sem, pdMS_TO_TICKS(timeout)) == pdTRUE, "process command timeout", err);
     ret = ESP_OK;
+    goto out;
 err:
-	modem_failures_counter++;
+	modem_failures_counter++; // Only unanswered commands. Every publish of the BG96 transport comes through here
+out:
     dce->handle_line = NULL;
     return ret;
 }
@@ -496,6 +501,7 @@ static void on_ppp_status_changed(ppp_pcb *pcb, int err_code, void *ctx)
         esp_event_post_to(esp_dte->event_loop_hdl, ESP_MODEM_EVENT, MODEM_EVENT_PPP_STOP, NULL, 0, 0);
         /* Free the PPP control block */
         pppapi_free(esp_dte->ppp);
+        esp_dte->ppp = NULL;
         break;
     case PPPERR_CONNECT: /* Connection lost */
         esp_event_post_to(esp_dte->event_loop_hdl, ESP_MODEM_EVENT, MODEM_EVENT_PPP_DISCONNECT, NULL, 0, 0);
@@ -503,17 +509,22 @@ static void on_ppp_status_changed(ppp_pcb *pcb, int err_code, void *ctx)
     case PPPERR_AUTHFAIL:
         ESP_LOGE(MODEM_TAG, "Failed authentication challenge");
         break;
+    /* The session is dead after any of the errors below, tell the application like a lost connection */
     case PPPERR_PROTOCOL:
         ESP_LOGE(MODEM_TAG, "Failed to meet protocol");
+        esp_event_post_to(esp_dte->event_loop_hdl, ESP_MODEM_EVENT, MODEM_EVENT_PPP_DISCONNECT, NULL, 0, 0);
         break;
     case PPPERR_PEERDEAD:
         ESP_LOGE(MODEM_TAG, "Connection timeout");
+        esp_event_post_to(esp_dte->event_loop_hdl, ESP_MODEM_EVENT, MODEM_EVENT_PPP_DISCONNECT, NULL, 0, 0);
         break;
     case PPPERR_IDLETIMEOUT:
         ESP_LOGE(MODEM_TAG, "Idle Timeout");
+        esp_event_post_to(esp_dte->event_loop_hdl, ESP_MODEM_EVENT, MODEM_EVENT_PPP_DISCONNECT, NULL, 0, 0);
         break;
     case PPPERR_CONNECTTIME:
         ESP_LOGE(MODEM_TAG, "Max connect time reached");
+        esp_event_post_to(esp_dte->event_loop_hdl, ESP_MODEM_EVENT, MODEM_EVENT_PPP_DISCONNECT, NULL, 0, 0);
         break;
     case PPPERR_LOOPBACK:
         ESP_LOGE(MODEM_TAG, "Loopback detected");
@@ -634,3 +645,28 @@ err:
 	modem_failures_counter++;
     return ESP_FAIL;
 }
+
+esp_err_t esp_modem_abort_ppp(modem_dte_t *dte)
+{
+    modem_dce_t *dce = dte->dce;
+    MODEM_CHECK(dce, "DTE has not yet bind with DCE", err);
+    esp_modem_dte_t *esp_dte = __containerof(dte, esp_modem_dte_t, parent);
+    /* Tear down without the LCP handshake. On a session which is already dead this only releases the control block */
+    if (esp_dte->ppp) {
+        pppapi_close(esp_dte->ppp, 1);
+    }
+    if (dce->mode == MODEM_PPP_MODE) {
+        /* +++ goes unanswered if the carrier is gone and the DCE already fell back to command mode.
+         * change_mode() has put the UART back in line mode by then, so only the DCE needs checking */
+        if (dte->change_mode(dte, MODEM_COMMAND_MODE) != ESP_OK) {
+            dce->mode = MODEM_COMMAND_MODE;
+            MODEM_CHECK(dce->sync(dce) == ESP_OK, "DCE not answering after leaving PPP mode", err);
+        }
+    }
+    /* Nothing to hang up if the network dropped the call */
+    dce->hang_up(dce);
+    return ESP_OK;
+err:
+	modem_failures_counter++;
+    return ESP_FAIL;
+}
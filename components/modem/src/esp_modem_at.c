@@ -0,0 +1,411 @@
+// Copyright 2015-2018 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_modem_dce_service.h"
+#include "esp_modem_at.h"
+
+#define MODEM_AT_URC_BUCKETS (32) /*!< Must be a power of 2 */
+#define MODEM_AT_IDLE_POLL_MS (10)
+
+/**
+ * @brief Macro defined for error checking
+ *
+ */
+static const char *AT_TAG = "modem_at";
+extern uint8_t modem_failures_counter;
+#define AT_CHECK(a, str, goto_tag, ...)                                              \
+    do                                                                               \
+    {                                                                                \
+        if (!(a))                                                                    \
+        {                                                                            \
+            ESP_LOGE(AT_TAG, "%s(%d): " str, __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+            goto goto_tag;                                                           \
+        }                                                                            \
+    } while (0)
+
+/**
+ * @brief One queued command
+ *
+ */
+typedef struct {
+    char command[MODEM_AT_MAX_CMD_LENGTH];   /*!< Command string sent as is */
+    char prefix[MODEM_AT_MAX_PREFIX_LENGTH]; /*!< Prefix of the intermediate lines to collect, "" collects all */
+    uint32_t timeout_ms;                     /*!< Timeout for the final result code */
+    modem_at_cb_t cb;                        /*!< Completion callback */
+    void *ctx;                               /*!< Completion callback context */
+} modem_at_cmd_t;
+
+/**
+ * @brief One registered URC handler. Handlers sharing a bucket are chained through next.
+ *
+ */
+typedef struct {
+    char prefix[MODEM_AT_MAX_PREFIX_LENGTH]; /*!< URC prefix */
+    size_t len;                              /*!< strlen(prefix) */
+    modem_at_urc_cb_t cb;                    /*!< Handler */
+    void *ctx;                               /*!< Handler context */
+    uint8_t next;                            /*!< Index + 1 of the next handler in the bucket, 0 ends the chain */
+} modem_at_urc_t;
+
+/**
+ * @brief Final result codes, matched in this order against the whole line (or its start if is_prefix)
+ *
+ */
+static const struct {
+    const char *code;
+    bool is_prefix;
+    modem_at_result_t result;
+} s_final_results[] = {
+    {MODEM_RESULT_CODE_SUCCESS, false, MODEM_AT_RESULT_OK},
+    {MODEM_RESULT_CODE_ERROR, false, MODEM_AT_RESULT_ERROR},
+    {"+CME ERROR:", true, MODEM_AT_RESULT_CME_ERROR},
+    {"+CMS ERROR:", true, MODEM_AT_RESULT_CMS_ERROR},
+    {MODEM_RESULT_CODE_CONNECT, true, MODEM_AT_RESULT_CONNECT},
+    {MODEM_RESULT_CODE_NO_CARRIER, false, MODEM_AT_RESULT_NO_CARRIER},
+};
+
+/**
+ * @brief AT engine state
+ *
+ */
+typedef struct {
+    modem_dce_t *dce;                                  /*!< DCE the engine drives */
+    QueueHandle_t cmd_queue;                           /*!< Commands waiting to be sent */
+    SemaphoreHandle_t lock;                            /*!< Owner of dce->handle_line and dte->send_cmd */
+    TaskHandle_t task_hdl;                             /*!< AT engine task */
+    volatile bool busy;                                /*!< A command has been taken off the queue and is not complete */
+    modem_at_cmd_t *current;                           /*!< Command on the wire */
+    modem_at_result_t result;                          /*!< Final result of current */
+    char line[MODEM_AT_MAX_LINE_LENGTH];               /*!< Scratch copy of the line being matched */
+    char response[MODEM_AT_MAX_RESPONSE_LENGTH];       /*!< Collected intermediate response of current */
+    size_t response_len;                               /*!< strlen(response) */
+    modem_at_urc_t urc[MODEM_AT_MAX_URC_HANDLERS];     /*!< URC handler pool */
+    uint8_t urc_count;                                 /*!< Used entries of urc */
+    uint8_t urc_bucket[MODEM_AT_URC_BUCKETS];          /*!< Index + 1 of the first handler per bucket */
+    portMUX_TYPE urc_mux;                              /*!< Guards URC registration */
+} modem_at_engine_t;
+
+static modem_at_engine_t s_at = {
+    .urc_mux = portMUX_INITIALIZER_UNLOCKED,
+};
+
+/**
+ * @brief Bucket of a line or prefix: the first character after an optional '+'
+ */
+static inline uint8_t modem_at_bucket(const char *str)
+{
+    char c = (str[0] == '+' && str[1]) ? str[1] : str[0];
+    return (uint8_t)c & (MODEM_AT_URC_BUCKETS - 1);
+}
+
+/**
+ * @brief Copy line into the scratch buffer without the surrounding "\r\n"
+ */
+static const char *modem_at_strip(const char *line)
+{
+    while (*line == '\r' || *line == '\n') {
+        line++;
+    }
+    size_t len = strlcpy(s_at.line, line, sizeof(s_at.line));
+    if (len >= sizeof(s_at.line)) {
+        len = sizeof(s_at.line) - 1;
+    }
+    while (len && (s_at.line[len - 1] == '\r' || s_at.line[len - 1] == '\n' || s_at.line[len - 1] == ' ')) {
+        s_at.line[--len] = '\0';
+    }
+    return s_at.line;
+}
+
+/**
+ * @brief Append one line to the response of the current command
+ */
+static void modem_at_collect(const char *text)
+{
+    size_t len = strlen(text);
+    size_t room = sizeof(s_at.response) - s_at.response_len;
+    if (s_at.response_len && room > 1) {
+        s_at.response[s_at.response_len++] = '\n';
+        room--;
+    }
+    if (len >= room) {
+        ESP_LOGW(AT_TAG, "response truncated");
+        len = room - 1;
+    }
+    memcpy(s_at.response + s_at.response_len, text, len);
+    s_at.response_len += len;
+    s_at.response[s_at.response_len] = '\0';
+}
+
+/**
+ * @brief Look up the URC table and run the handler
+ */
+static esp_err_t modem_at_dispatch_urc_text(const char *text)
+{
+    for (uint8_t i = s_at.urc_bucket[modem_at_bucket(text)]; i; i = s_at.urc[i - 1].next) {
+        modem_at_urc_t *urc = &s_at.urc[i - 1];
+        if (!strncmp(text, urc->prefix, urc->len)) {
+            urc->cb(text, urc->ctx);
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+/**
+ * @brief Handler installed as dce->handle_urc, used for lines arriving while no command is outstanding
+ */
+static esp_err_t modem_at_handle_urc(modem_dce_t *dce, const char *line)
+{
+    return modem_at_dispatch_urc_text(modem_at_strip(line));
+}
+
+/**
+ * @brief Handler installed as dce->handle_line while a queued command is on the wire
+ */
+static esp_err_t modem_at_handle_line(modem_dce_t *dce, const char *line)
+{
+    modem_at_cmd_t *cmd = s_at.current;
+    const char *text = modem_at_strip(line);
+    if (!cmd || !text[0]) {
+        return ESP_FAIL;
+    }
+    for (int i = 0; i < sizeof(s_final_results) / sizeof(s_final_results[0]); i++) {
+        const char *code = s_final_results[i].code;
+        bool match = s_final_results[i].is_prefix ? !strncmp(text, code, strlen(code)) : !strcmp(text, code);
+        if (match) {
+            s_at.result = s_final_results[i].result;
+            if (s_at.result == MODEM_AT_RESULT_CME_ERROR || s_at.result == MODEM_AT_RESULT_CMS_ERROR) {
+                modem_at_collect(text);
+            }
+            return esp_modem_process_command_done(dce, (s_at.result == MODEM_AT_RESULT_OK ||
+                                                  s_at.result == MODEM_AT_RESULT_CONNECT) ?
+                                                  MODEM_STATE_SUCCESS : MODEM_STATE_FAIL);
+        }
+    }
+    /* Echo of the command itself */
+    if (!strncmp(text, cmd->command, strlen(text)) && !strncmp(text, "AT", 2)) {
+        return ESP_OK;
+    }
+    if (cmd->prefix[0]) {
+        if (!strncmp(text, cmd->prefix, strlen(cmd->prefix))) {
+            modem_at_collect(text);
+            return ESP_OK;
+        }
+        return modem_at_dispatch_urc_text(text);
+    }
+    if (modem_at_dispatch_urc_text(text) != ESP_OK) {
+        modem_at_collect(text);
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief AT engine task entry. Sends queued commands back to back and runs their callbacks.
+ *
+ * @param param task parameter
+ */
+static void modem_at_task_entry(void *param)
+{
+    modem_at_cmd_t cmd;
+    while (1) {
+        /* Peek first so that busy is raised before the queue looks empty to esp_modem_at_wait_idle() */
+        if (xQueuePeek(s_at.cmd_queue, &cmd, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        s_at.busy = true;
+        xQueueReceive(s_at.cmd_queue, &cmd, 0);
+        modem_at_result_t result = MODEM_AT_RESULT_NOT_READY;
+        modem_dce_t *dce = s_at.dce;
+        xSemaphoreTakeRecursive(s_at.lock, portMAX_DELAY);
+        if (dce->dte && dce->mode == MODEM_COMMAND_MODE) {
+            modem_dte_t *dte = dce->dte;
+            s_at.response_len = 0;
+            s_at.response[0] = '\0';
+            s_at.result = MODEM_AT_RESULT_TIMEOUT;
+            s_at.current = &cmd;
+            dce->handle_line = modem_at_handle_line;
+            if (dte->send_cmd(dte, cmd.command, cmd.timeout_ms) == ESP_OK) {
+                result = s_at.result;
+            } else {
+                result = MODEM_AT_RESULT_TIMEOUT;
+            }
+            s_at.current = NULL;
+        }
+        xSemaphoreGiveRecursive(s_at.lock);
+        if (result != MODEM_AT_RESULT_OK && result != MODEM_AT_RESULT_CONNECT) {
+            ESP_LOGW(AT_TAG, "%.*s -> %d", (int)strcspn(cmd.command, "\r"), cmd.command, result);
+        }
+        if (cmd.cb) {
+            cmd.cb(result, s_at.response, cmd.ctx);
+        }
+        s_at.busy = false;
+    }
+    vTaskDelete(NULL);
+}
+
+esp_err_t esp_modem_at_init(modem_dce_t *dce)
+{
+    AT_CHECK(dce, "DCE is NULL", err);
+    AT_CHECK(!s_at.task_hdl, "AT engine already running", err);
+    s_at.dce = dce;
+    s_at.cmd_queue = xQueueCreate(MODEM_AT_QUEUE_LENGTH, sizeof(modem_at_cmd_t));
+    AT_CHECK(s_at.cmd_queue, "create command queue failed", err);
+    s_at.lock = xSemaphoreCreateRecursiveMutex();
+    AT_CHECK(s_at.lock, "create lock failed", err_lock);
+    BaseType_t ret = xTaskCreate(modem_at_task_entry,      //Task Entry
+                                 "modem_at",               //Task Name
+                                 MODEM_AT_TASK_STACK_SIZE, //Task Stack Size(Bytes)
+                                 NULL,                     //Task Parameter
+                                 MODEM_AT_TASK_PRIORITY,   //Task Priority
+                                 &s_at.task_hdl            //Task Handler
+                                );
+    AT_CHECK(ret == pdTRUE, "create AT engine task failed", err_task);
+    dce->handle_urc = modem_at_handle_urc;
+    return ESP_OK;
+err_task:
+    vSemaphoreDelete(s_at.lock);
+    s_at.lock = NULL;
+err_lock:
+    vQueueDelete(s_at.cmd_queue);
+    s_at.cmd_queue = NULL;
+err:
+    modem_failures_counter++;
+    return ESP_FAIL;
+}
+
+esp_err_t esp_modem_at_submit(const char *command, const char *prefix, uint32_t timeout_ms,
+                              modem_at_cb_t cb, void *ctx)
+{
+    modem_at_cmd_t cmd = {
+        .timeout_ms = timeout_ms,
+        .cb = cb,
+        .ctx = ctx,
+    };
+    AT_CHECK(s_at.cmd_queue, "AT engine not initialized", err_state);
+    AT_CHECK(command && strlcpy(cmd.command, command, sizeof(cmd.command)) < sizeof(cmd.command),
+             "command too long", err_arg);
+    if (prefix) {
+        AT_CHECK(strlcpy(cmd.prefix, prefix, sizeof(cmd.prefix)) < sizeof(cmd.prefix), "prefix too long", err_arg);
+    }
+    AT_CHECK(xQueueSend(s_at.cmd_queue, &cmd, 0) == pdTRUE, "command queue full", err_full);
+    return ESP_OK;
+err_state:
+    return ESP_ERR_INVALID_STATE;
+err_arg:
+    return ESP_ERR_INVALID_ARG;
+err_full:
+    modem_failures_counter++;
+    return ESP_ERR_NO_MEM;
+}
+
+/**
+ * @brief Context of a blocking esp_modem_at_send()
+ *
+ */
+typedef struct {
+    SemaphoreHandle_t done;
+    modem_at_result_t result;
+    char *response;
+    size_t response_len;
+} modem_at_sync_ctx_t;
+
+static void modem_at_sync_cb(modem_at_result_t result, const char *response, void *ctx)
+{
+    modem_at_sync_ctx_t *sync = (modem_at_sync_ctx_t *)ctx;
+    sync->result = result;
+    if (sync->response && sync->response_len) {
+        strlcpy(sync->response, response, sync->response_len);
+    }
+    xSemaphoreGive(sync->done);
+}
+
+modem_at_result_t esp_modem_at_send(const char *command, const char *prefix, uint32_t timeout_ms,
+                                    char *response, size_t response_len)
+{
+    modem_at_sync_ctx_t sync = {
+        .done = xSemaphoreCreateBinary(),
+        .result = MODEM_AT_RESULT_NOT_READY,
+        .response = response,
+        .response_len = response_len,
+    };
+    AT_CHECK(sync.done, "create semaphore failed", err);
+    AT_CHECK(xTaskGetCurrentTaskHandle() != s_at.task_hdl, "blocking send from a completion callback", err_sem);
+    AT_CHECK(esp_modem_at_submit(command, prefix, timeout_ms, modem_at_sync_cb, &sync) == ESP_OK,
+             "submit failed", err_sem);
+    /* Every queued command completes within its own timeout, so this cannot hang */
+    xSemaphoreTake(sync.done, portMAX_DELAY);
+err_sem:
+    vSemaphoreDelete(sync.done);
+err:
+    return sync.result;
+}
+
+esp_err_t esp_modem_at_register_urc(const char *prefix, modem_at_urc_cb_t cb, void *ctx)
+{
+    AT_CHECK(prefix && prefix[0] && cb, "invalid URC handler", err_arg);
+    AT_CHECK(strlen(prefix) < MODEM_AT_MAX_PREFIX_LENGTH, "URC prefix too long", err_arg);
+    AT_CHECK(s_at.urc_count < MODEM_AT_MAX_URC_HANDLERS, "URC table full", err_full);
+    modem_at_urc_t *urc = &s_at.urc[s_at.urc_count];
+    strcpy(urc->prefix, prefix);
+    urc->len = strlen(prefix);
+    urc->cb = cb;
+    urc->ctx = ctx;
+    /* The UART event task walks the chains without locking, link the entry only once it is complete */
+    uint8_t bucket = modem_at_bucket(prefix);
+    portENTER_CRITICAL(&s_at.urc_mux);
+    urc->next = s_at.urc_bucket[bucket];
+    s_at.urc_bucket[bucket] = ++s_at.urc_count;
+    portEXIT_CRITICAL(&s_at.urc_mux);
+    return ESP_OK;
+err_arg:
+    return ESP_ERR_INVALID_ARG;
+err_full:
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_modem_at_wait_idle(uint32_t timeout_ms)
+{
+    TickType_t start = xTaskGetTickCount();
+    if (!s_at.cmd_queue) {
+        return ESP_OK;
+    }
+    while (uxQueueMessagesWaiting(s_at.cmd_queue) || s_at.busy) {
+        if ((xTaskGetTickCount() - start) >= pdMS_TO_TICKS(timeout_ms)) {
+            return ESP_ERR_TIMEOUT;
+        }
+        vTaskDelay(pdMS_TO_TICKS(MODEM_AT_IDLE_POLL_MS));
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_modem_at_lock(uint32_t timeout_ms)
+{
+    if (!s_at.lock) { // Engine not started, nobody to share the channel with
+        return ESP_OK;
+    }
+    return xSemaphoreTakeRecursive(s_at.lock, pdMS_TO_TICKS(timeout_ms)) == pdTRUE ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+void esp_modem_at_unlock(void)
+{
+    if (s_at.lock) {
+        xSemaphoreGiveRecursive(s_at.lock);
+    }
+}
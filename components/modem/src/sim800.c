@@ -481,7 +481,14 @@ static esp_err_t sim800_deinit(modem_dce_t *dce)
     return ESP_OK;
 }
 
-modem_dce_t *sim800_init(modem_dte_t *dte)
+/**
+ * @brief Create SIM800 object, sync with it and optionally read its identity
+ *
+ * @param dte Modem DTE object
+ * @param query_identity true to read module name, IMEI, IMSI and operator from the module
+ * @return modem_dce_t* Modem DCE object
+ */
+static modem_dce_t *sim800_create(modem_dte_t *dte, bool query_identity)
 {
     DCE_CHECK(dte, "DCE should bind with a DTE", err);
     /* malloc memory for sim800_dce object */
@@ -508,6 +515,9 @@ modem_dce_t *sim800_init(modem_dte_t *dte)
     DCE_CHECK(esp_modem_dce_sync(&(sim800_dce->parent)) == ESP_OK, "sync failed", err_io);
     /* Close echo */
     DCE_CHECK(esp_modem_dce_echo(&(sim800_dce->parent), false) == ESP_OK, "close echo mode failed", err_io);
+    if (!query_identity) {
+        return &(sim800_dce->parent);
+    }
     /* Get Module name */
     DCE_CHECK(sim800_get_module_name(sim800_dce) == ESP_OK, "get module name failed", err_io);
     /* Get IMEI number */
@@ -518,8 +528,19 @@ modem_dce_t *sim800_init(modem_dte_t *dte)
     DCE_CHECK(sim800_get_operator_name(sim800_dce) == ESP_OK, "get operator name failed", err_io);
     return &(sim800_dce->parent);
 err_io:
+    dte->dce = NULL; // The UART task must not hand lines to a freed DCE while the caller retries
     free(sim800_dce);
 err:
 	modem_failures_counter++;
     return NULL;
 }
+
+modem_dce_t *sim800_init(modem_dte_t *dte)
+{
+    return sim800_create(dte, true);
+}
+
+modem_dce_t *sim800_init_minimal(modem_dte_t *dte)
+{
+    return sim800_create(dte, false);
+}
@@ -0,0 +1,64 @@
+/**************************************************************
+* boot_trace.c
+*
+* Times the phases of a boot: when each one is first reached,
+* in ms since the app started. The timeline is published as one
+* event with the first publish, which comes after the first
+* MQTT connection, and is shown on the /info page, so boot to
+* first data can be compared across firmware versions
+**************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "raahi.h"
+
+static const char *TAG = "boot_trace";
+
+extern struct debug_data_struct debug_data;
+
+static const char *boot_phase_names[BOOT_PHASE_COUNT] = {
+    "fs", "ap", "modem", "status", "link", "time", "mqtt", "pub"
+};
+
+static int64_t boot_phase_us[BOOT_PHASE_COUNT];
+
+/* -----------------------------------------------------------
+| boot_trace_mark
+|   Notes the time a phase was reached, the first time only.
+|   Reaching the first publish reports the timeline
+------------------------------------------------------------*/
+void boot_trace_mark(boot_phase_t phase)
+{
+    char timeline[BOOT_TRACE_STR_SIZE];
+
+    if (phase >= BOOT_PHASE_COUNT || boot_phase_us[phase] != 0) {
+        return;
+    }
+    boot_phase_us[phase] = esp_timer_get_time();
+
+    if (phase == BOOT_PHASE_FIRST_PUBLISH) {
+        boot_trace_format(timeline, sizeof(timeline));
+        RAAHI_LOGI(TAG, "Boot ms, fw %s: %s", debug_data.fw_ver, timeline);
+    }
+}
+
+/* -----------------------------------------------------------
+| boot_trace_format
+|   Writes the timeline as "<phase> <ms>" pairs. Phases not
+|   reached yet are left out
+------------------------------------------------------------*/
+void boot_trace_format(char *str, size_t str_len)
+{
+    size_t len = 0;
+    uint8_t phase;
+
+    str[0] = '\0';
+    for (phase = 0; phase < BOOT_PHASE_COUNT && len < str_len; phase++) {
+        if (boot_phase_us[phase] != 0) {
+            len += snprintf(&str[len], str_len - len, "%s%s %lld", len == 0 ? "" : " ",
+                            boot_phase_names[phase], boot_phase_us[phase] / 1000);
+        }
+    }
+}
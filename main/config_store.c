@@ -0,0 +1,448 @@
+/**************************************************************
+* config_store.c
+*
+* Keeps sysconfig in NVS, one key per field, instead of a raw
+* dump of struct config_struct in a file. A field that changes is
+* the only thing written, and a new firmware with more or fewer
+* fields keeps whatever it still knows about.
+*
+* Schema rules: a key is never reused for something else. A new
+* field gets a new key and its default until it is set. Changes
+* that need more than that (a key renamed, a value rescaled) get
+* a step in config_migrations[] and bump CONFIG_STORE_SCHEMA.
+* Older firmware ignores keys it doesn't know, and doesn't touch
+* the schema version of a newer store
+*
+* Updates are made on a shadow copy (config_store_edit()), checked
+* as a whole and then published to sysconfig and committed to NVS
+* together (config_store_commit()). Readers in other tasks take a
+* consistent copy with config_store_read(), a seqlock: the sequence
+* number is odd while sysconfig is being published
+**************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#include "raahi.h"
+
+#define CONFIG_STORE_NAMESPACE "sysconfig"
+#define CONFIG_STORE_SCHEMA_KEY "schema"
+#define CONFIG_STORE_SCHEMA 1   // Version of the key layout below
+#define MODBUS_MAX_SLAVE_ID 247
+
+static const char *TAG = "config_store";
+
+// One NVS key per field of struct config_struct
+typedef struct
+{
+    const char *key;            // At most 15 characters
+    nvs_type_t type;            // NVS_TYPE_U8, NVS_TYPE_U16 or NVS_TYPE_STR
+    size_t offset;              // In struct config_struct
+    size_t size;                // Of the field. Enums are stored as U8
+}config_field_t;
+
+#define CONFIG_FIELD(key, type, field) { key, type, offsetof(struct config_struct, field), \
+                                         sizeof(((struct config_struct *)0)->field) }
+
+static const config_field_t config_fields[] = {
+    CONFIG_FIELD("slave_id0", NVS_TYPE_U8, slave_id[0]),
+    CONFIG_FIELD("slave_id1", NVS_TYPE_U8, slave_id[1]),
+    CONFIG_FIELD("reg_addr0", NVS_TYPE_U16, reg_address[0]),
+    CONFIG_FIELD("reg_addr1", NVS_TYPE_U16, reg_address[1]),
+    CONFIG_FIELD("reg_addr2", NVS_TYPE_U16, reg_address[2]),
+    CONFIG_FIELD("period_s", NVS_TYPE_U16, sampling_period_in_sec),
+    CONFIG_FIELD("analog0", NVS_TYPE_U8, analog_sensor_type[0]),
+    CONFIG_FIELD("analog1", NVS_TYPE_U8, analog_sensor_type[1]),
+    CONFIG_FIELD("analog2", NVS_TYPE_U8, analog_sensor_type[2]),
+    CONFIG_FIELD("analog3", NVS_TYPE_U8, analog_sensor_type[3]),
+    CONFIG_FIELD("client_id", NVS_TYPE_STR, client_id),
+    CONFIG_FIELD("topic", NVS_TYPE_STR, topic),
+    CONFIG_FIELD("apn", NVS_TYPE_STR, apn),
+};
+#define CONFIG_FIELD_COUNT (sizeof(config_fields) / sizeof(config_fields[0]))
+
+static struct config_struct stored_config; // What NVS has, so that only changed fields are written
+static struct config_struct *live_config;   // sysconfig, published to the readers
+static volatile uint32_t config_seq;        // Odd while live_config is being written
+static SemaphoreHandle_t config_edit_mutex = NULL; // Held from config_store_edit() to config_store_commit()
+static volatile uint32_t client_id_generation; // Counts client ID changes, see config_store_client_id_generation()
+
+static esp_err_t config_migrate_legacy_file(nvs_handle handle);
+
+// config_migrations[n] brings a store of schema n to schema n + 1
+static esp_err_t (*const config_migrations[CONFIG_STORE_SCHEMA])(nvs_handle handle) = {
+    config_migrate_legacy_file,
+};
+
+
+/* -----------------------------------------------------------
+| config_defaults
+|   Values of fields that were never set
+------------------------------------------------------------*/
+static void config_defaults(struct config_struct *config)
+{
+    memset(config, 0, sizeof(struct config_struct));
+    config->slave_id[0] = CONFIG_FIRST_SLAVE_ID; // From sdkconfig
+    config->slave_id[1] = CONFIG_SECOND_SLAVE_ID;
+    config->reg_address[0] = CONFIG_FIRST_REG;
+    config->reg_address[1] = CONFIG_SECOND_REG;
+    config->reg_address[2] = CONFIG_THIRD_REG;
+    config->sampling_period_in_sec = CONFIG_SAMPLING_PERIOD;
+    config->analog_sensor_type[0] = NONE;
+    config->analog_sensor_type[1] = NONE;
+    config->analog_sensor_type[2] = NONE;
+    config->analog_sensor_type[3] = NONE;
+    strcpy(config->client_id, "raahi_new");
+    strcpy(config->topic, CONFIG_MQTT_TOPIC_ROOT);
+    strcpy(config->apn, CONFIG_EXAMPLE_MODEM_APN);
+}
+
+static const config_field_t *config_find_field(const char *key)
+{
+    uint8_t i;
+
+    for (i = 0; i < CONFIG_FIELD_COUNT; i++) {
+        if (strcmp(config_fields[i].key, key) == 0) {
+            return &config_fields[i];
+        }
+    }
+    return NULL;
+}
+
+// Integer fields are uint8_t, uint16_t or an enum
+static uint32_t config_get_int(const struct config_struct *config, const config_field_t *field)
+{
+    const uint8_t *p = (const uint8_t *)config + field->offset;
+
+    switch (field->size) {
+        case sizeof(uint8_t): return *p;
+        case sizeof(uint16_t): return *(const uint16_t *)p;
+        default: return *(const uint32_t *)p;
+    }
+}
+
+static void config_set_int(struct config_struct *config, const config_field_t *field, uint32_t value)
+{
+    uint8_t *p = (uint8_t *)config + field->offset;
+
+    switch (field->size) {
+        case sizeof(uint8_t): *p = value; break;
+        case sizeof(uint16_t): *(uint16_t *)p = value; break;
+        default: *(uint32_t *)p = value; break;
+    }
+}
+
+static bool config_field_differs(const struct config_struct *a, const struct config_struct *b, const config_field_t *field)
+{
+    if (field->type == NVS_TYPE_STR) {
+        return strncmp((const char *)a + field->offset, (const char *)b + field->offset, field->size) != 0;
+    }
+    return config_get_int(a, field) != config_get_int(b, field);
+}
+
+/* -----------------------------------------------------------
+| config_read_field
+|   Reads one field from NVS into config. A value of the wrong
+|   type or size is left out, so the field keeps its default
+------------------------------------------------------------*/
+static esp_err_t config_read_field(nvs_handle handle, const config_field_t *field, struct config_struct *config)
+{
+    uint8_t u8;
+    uint16_t u16;
+    size_t len;
+    esp_err_t err;
+
+    switch (field->type) {
+        case NVS_TYPE_U8:
+            if ((err = nvs_get_u8(handle, field->key, &u8)) == ESP_OK) {
+                config_set_int(config, field, u8);
+            }
+            return err;
+        case NVS_TYPE_U16:
+            if ((err = nvs_get_u16(handle, field->key, &u16)) == ESP_OK) {
+                config_set_int(config, field, u16);
+            }
+            return err;
+        default:
+            len = field->size;
+            return nvs_get_str(handle, field->key, (char *)config + field->offset, &len);
+    }
+}
+
+static esp_err_t config_write_field(nvs_handle handle, const config_field_t *field, const struct config_struct *config)
+{
+    switch (field->type) {
+        case NVS_TYPE_U8:
+            return nvs_set_u8(handle, field->key, config_get_int(config, field));
+        case NVS_TYPE_U16:
+            return nvs_set_u16(handle, field->key, config_get_int(config, field));
+        default:
+            return nvs_set_str(handle, field->key, (const char *)config + field->offset);
+    }
+}
+
+/* -----------------------------------------------------------
+| config_migrate_legacy_file
+|   Schema 0 to 1: the raw struct that read_sysconfig() kept in
+|   a file is split into keys, and the file is removed. A file of
+|   another size has an older struct layout that can't be mapped
+|   to fields, so it is dropped as read_sysconfig() did
+------------------------------------------------------------*/
+static esp_err_t config_migrate_legacy_file(nvs_handle handle)
+{
+    struct config_struct legacy;
+    struct stat st;
+    FILE *legacy_file;
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t err = ESP_OK;
+    uint8_t i;
+
+    if (stat(LEGACY_CONFIG_FILE_NAME, &st) != 0) {
+        return ESP_OK; // Nothing to migrate, a fresh device
+    }
+    if (st.st_size != sizeof(struct config_struct)) {
+        ESP_LOGW(TAG, "%s is %ld bytes, not the %u of this firmware. Not migrated", LEGACY_CONFIG_FILE_NAME, st.st_size,
+                 sizeof(struct config_struct));
+        remove(LEGACY_CONFIG_FILE_NAME);
+        return ESP_OK;
+    }
+    legacy_file = fopen(LEGACY_CONFIG_FILE_NAME, "rb");
+    if (legacy_file == NULL || fread(&legacy, sizeof(legacy), 1, legacy_file) != 1) {
+        ESP_LOGE(TAG, "Couldn't read %s", LEGACY_CONFIG_FILE_NAME);
+        if (legacy_file != NULL) {
+            fclose(legacy_file);
+        }
+        return ESP_FAIL;
+    }
+    fclose(legacy_file);
+    // Strings in the file were written by strcpy. Make sure they end within their fields anyway
+    legacy.client_id[MAX_CLIENT_ID_LEN] = legacy.topic[MAX_TOPIC_LEN] = legacy.apn[MAX_APN_LEN] = '\0';
+    for (i = 0; i < CONFIG_FIELD_COUNT && err == ESP_OK; i++) {
+        err = config_write_field(handle, &config_fields[i], &legacy);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err == ESP_OK) {
+        remove(LEGACY_CONFIG_FILE_NAME);
+        ESP_LOGI(TAG, "Migrated %s in %lld us", LEGACY_CONFIG_FILE_NAME, esp_timer_get_time() - start_us);
+    }
+    return err;
+}
+
+/* -----------------------------------------------------------
+| config_store_migrate
+|   Runs the migrations from the stored schema up to this
+|   firmware's. A store newer than this firmware is read as it
+|   is, the keys that are not known here are ignored
+------------------------------------------------------------*/
+static void config_store_migrate(nvs_handle handle)
+{
+    uint8_t schema = 0;
+
+    nvs_get_u8(handle, CONFIG_STORE_SCHEMA_KEY, &schema);
+    if (schema > CONFIG_STORE_SCHEMA) {
+        ESP_LOGW(TAG, "Config store has schema %u, newer than %u. Unknown keys are ignored", schema, CONFIG_STORE_SCHEMA);
+        return;
+    }
+    for (; schema < CONFIG_STORE_SCHEMA; schema++) {
+        if (config_migrations[schema](handle) != ESP_OK) {
+            ESP_LOGE(TAG, "Config migration from schema %u failed. Defaults are used for the rest", schema);
+            break;
+        }
+        ESP_LOGI(TAG, "Config store migrated to schema %u", schema + 1);
+        if (nvs_set_u8(handle, CONFIG_STORE_SCHEMA_KEY, schema + 1) != ESP_OK || nvs_commit(handle) != ESP_OK) {
+            break;
+        }
+    }
+}
+
+/* -----------------------------------------------------------
+| config_store_load
+|   Fills config with the defaults and whatever NVS has, in one
+|   pass over the namespace. Migrates older stores first. The
+|   time it takes is logged, it is on the boot path
+------------------------------------------------------------*/
+void config_store_load(struct config_struct *config)
+{
+    int64_t start_us = esp_timer_get_time();
+    nvs_handle handle;
+    nvs_iterator_t it;
+    nvs_entry_info_t info;
+    const config_field_t *field;
+    uint8_t loaded = 0, unknown = 0;
+
+    live_config = config;
+    if (config_edit_mutex == NULL) {
+        config_edit_mutex = xSemaphoreCreateMutex();
+    }
+    config_defaults(config);
+    if (nvs_open(CONFIG_STORE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Couldn't open the config store. Running with defaults");
+        stored_config = *config;
+        return;
+    }
+    config_store_migrate(handle);
+
+    for (it = nvs_entry_find(NVS_DEFAULT_PART_NAME, CONFIG_STORE_NAMESPACE, NVS_TYPE_ANY); it != NULL; it = nvs_entry_next(it)) {
+        nvs_entry_info(it, &info);
+        if ((field = config_find_field(info.key)) == NULL) {
+            unknown += (strcmp(info.key, CONFIG_STORE_SCHEMA_KEY) != 0);
+            continue;
+        }
+        if (info.type != field->type || config_read_field(handle, field, config) != ESP_OK) {
+            ESP_LOGW(TAG, "Config key %s doesn't fit its field. Default used", info.key);
+            continue;
+        }
+        loaded++;
+    }
+    nvs_close(handle);
+    stored_config = *config;
+    ESP_LOGI(TAG, "Config loaded in %lld us: %u of %u fields stored, %u keys of other firmware",
+             esp_timer_get_time() - start_us, loaded, CONFIG_FIELD_COUNT, unknown);
+}
+
+/* -----------------------------------------------------------
+| config_store_save
+|   Writes the fields of config that differ from what is stored,
+|   and commits them together
+------------------------------------------------------------*/
+static esp_err_t config_store_save(const struct config_struct *config)
+{
+    nvs_handle handle;
+    esp_err_t err;
+    uint8_t i, written = 0;
+
+    if ((err = nvs_open(CONFIG_STORE_NAMESPACE, NVS_READWRITE, &handle)) != ESP_OK) {
+        return err;
+    }
+    for (i = 0; i < CONFIG_FIELD_COUNT && err == ESP_OK; i++) {
+        if (config_field_differs(config, &stored_config, &config_fields[i])) {
+            err = config_write_field(handle, &config_fields[i], config);
+            written++;
+        }
+    }
+    if (err == ESP_OK && written > 0) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    if (err == ESP_OK) {
+        stored_config = *config;
+        ESP_LOGI(TAG, "%u config fields written", written);
+    }
+    return err;
+}
+
+/* -----------------------------------------------------------
+| config_validate
+|   Checks a whole configuration before it is published
+------------------------------------------------------------*/
+static bool config_validate(const struct config_struct *config)
+{
+    uint8_t i;
+
+    for (i = 0; i < MAX_MODBUS_SLAVES; i++) {
+        if (config->slave_id[i] > MODBUS_MAX_SLAVE_ID) {
+            ESP_LOGE(TAG, "Slave ID %u is not a Modbus slave address", config->slave_id[i]);
+            return false;
+        }
+    }
+    for (i = 0; i < MAX_ADC_CHANNELS; i++) {
+        if (config->analog_sensor_type[i] > DIRECT) {
+            ESP_LOGE(TAG, "Unknown analog sensor type %d", config->analog_sensor_type[i]);
+            return false;
+        }
+    }
+    if (config->sampling_period_in_sec == 0) {
+        ESP_LOGE(TAG, "Sampling period can't be 0");
+        return false;
+    }
+    if (config->client_id[0] == '\0' || strnlen(config->client_id, sizeof(config->client_id)) == sizeof(config->client_id)
+        || config->topic[0] == '\0' || strnlen(config->topic, sizeof(config->topic)) == sizeof(config->topic)
+        || config->apn[0] == '\0' || strnlen(config->apn, sizeof(config->apn)) == sizeof(config->apn)) {
+        ESP_LOGE(TAG, "Client ID, topic and APN must be set and fit their fields");
+        return false;
+    }
+    return true;
+}
+
+/* -----------------------------------------------------------
+| config_store_read
+|   Copies sysconfig as it was between two updates. Retries if
+|   an update was published meanwhile
+------------------------------------------------------------*/
+void config_store_read(struct config_struct *copy)
+{
+    uint32_t seq;
+
+    do {
+        while ((seq = config_seq) & 1) {
+            vTaskDelay(1); // The writer may be a lower priority task on this core
+        }
+        __sync_synchronize();
+        *copy = *live_config;
+        __sync_synchronize();
+    } while (seq != config_seq);
+}
+
+/* -----------------------------------------------------------
+| config_store_edit
+|   Starts an update. shadow gets the current configuration to
+|   be changed. Other updates wait until this one is committed
+|   or dropped
+------------------------------------------------------------*/
+void config_store_edit(struct config_struct *shadow)
+{
+    xSemaphoreTake(config_edit_mutex, portMAX_DELAY);
+    *shadow = *live_config;
+}
+
+void config_store_drop(void)
+{
+    xSemaphoreGive(config_edit_mutex);
+}
+
+/* -----------------------------------------------------------
+| config_store_commit
+|   Ends an update. A valid shadow is written to NVS with one
+|   commit and then published to the readers. Nothing changes
+|   if it isn't valid or can't be stored
+------------------------------------------------------------*/
+esp_err_t config_store_commit(const struct config_struct *shadow)
+{
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+    bool client_id_changed;
+
+    if (config_validate(shadow) == true && (err = config_store_save(shadow)) == ESP_OK) {
+        client_id_changed = (strcmp(shadow->client_id, live_config->client_id) != 0);
+        config_seq++;
+        __sync_synchronize();
+        *live_config = *shadow;
+        __sync_synchronize();
+        config_seq++;
+        if (client_id_changed == true) {
+            client_id_generation++;
+        }
+    }
+    xSemaphoreGive(config_edit_mutex);
+    return err;
+}
+
+/* -----------------------------------------------------------
+| config_store_client_id_generation
+|   Changes whenever a new client ID is published. The MQTT
+|   task reconnects with it when it sees a change
+------------------------------------------------------------*/
+uint32_t config_store_client_id_generation(void)
+{
+    return client_id_generation;
+}
@@ -0,0 +1,421 @@
+/**************************************************************
+* crash_report.c
+*
+* A panic (abort(), an exception or the task watchdog) writes a
+* core dump to the "coredump" partition. On the next boot the
+* dump is reduced to what is needed to symbolize the crash
+* offline against the ELF of the firmware that crashed: the
+* crashed task, its PC and backtrace, and the saved PC and free
+* stack of every other task. It is published on the query topic
+* as "crash" and "crash_tasks" messages. The dump is only erased
+* once they have gone out, so a restart before MQTT is up
+* reports it again on the next boot.
+*
+* The lowest free stack the long running tasks have had (the
+* stack high-water mark) can't be taken from a dump, which only
+* holds the used part of the stacks. It is sampled into RTC
+* memory from the data sampling loop instead, along with the
+* firmware version and ELF hash, and reported with the next
+* crash. The OTA task isn't sampled, it deletes itself and its
+* handle is left dangling. While a dump waits to be published,
+* what the boot that crashed left is stashed next to the
+* samples of the running boot, with the checksum of the dump.
+*
+* The dump parsing follows the binary format (version 1) and
+* the FreeRTOS TCB layout of ESP-IDF v4.0
+**************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "esp_system.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "raahi.h"
+
+#define CRASH_STACKS_MAGIC 0x43525355      // A stacks record left in RTC memory by the last boot
+#define CRASH_DUMP_VERSION 1
+#define CRASH_CURR_TASK_MARKER 0xdeadbeef  // Exit field of the crashed task's frame (COREDUMP_CURR_TASK_MARKER)
+#define CRASH_REASON_LEN 30
+#define CRASH_MAX_WATCHED_TASKS 2
+#define CRASH_BACKTRACE_DEPTH 8
+#define CRASH_MAX_TASK_MESSAGES 2
+#define TCB_PX_STACK_OFFSET 48             // pxTopOfStack, xStateListItem, xEventListItem, uxPriority
+#define TCB_NAME_OFFSET 52                 // After pxStack
+#define XT_SOL_FRAME_EXIT 0                // The exit field of a solicited (blocked task) frame
+#define XT_EXC_PC_OFFSET 4                 // XtExcFrame: exit, pc, ps, a0, a1, ...
+#define XT_EXC_A0_OFFSET 12
+#define XT_EXC_A1_OFFSET 16
+#define XT_SOL_PC_OFFSET 4                 // XtSolFrame: exit, pc, ps, next, a0, a1, ...
+
+static const char *TAG = "crash_report";
+
+typedef struct
+{
+    uint32_t data_len;      // Whole dump, this header and the checksum included
+    uint32_t version;
+    uint32_t tasks_num;
+    uint32_t tcb_sz;
+}crash_dump_header_t;
+
+typedef struct
+{
+    uint32_t tcb_addr;
+    uint32_t stack_start;   // Saved stack pointer, the dump holds the stack from here...
+    uint32_t stack_end;     // ...to its top
+}crash_dump_task_header_t;
+
+typedef struct
+{
+    char fw_ver[32];        // Empty when not known
+    char elf_sha[9];        // First bytes of the ELF SHA256, enough to pick the ELF
+    char task_name[CRASH_MAX_WATCHED_TASKS][configMAX_TASK_NAME_LEN];
+    uint32_t min_free[CRASH_MAX_WATCHED_TASKS];
+}crash_boot_t;
+
+typedef struct
+{
+    uint32_t magic;
+    crash_boot_t current;               // Sampled by the running boot
+    uint32_t pending_dump;              // Checksum of a dump queued but not published yet, 0 if none
+    char pending_reason[CRASH_REASON_LEN];
+    crash_boot_t pending;               // Left by the boot that wrote that dump
+}crash_stacks_t;
+
+extern char user_mqtt_str[MAX_DEVICE_ID_LEN];
+extern TaskHandle_t dataSamplingTaskHandle;
+extern TaskHandle_t awsTaskHandle;
+extern struct query_json_struct query_json;
+esp_reset_reason_t stringify_reset_reason(char* reset_reason_str);
+
+static RTC_NOINIT_ATTR crash_stacks_t crash_stacks;
+static const esp_partition_t *crash_partition = NULL;
+static bool crash_report_queued = false;    // The dump is erased once the query queue has drained past it
+
+/* -----------------------------------------------------------
+| crash_read_stack_word
+|   Reads a word of a task's stack from the dump. Fails outside
+|   the part of the stack the dump holds
+------------------------------------------------------------*/
+static bool crash_read_stack_word(const esp_partition_t *partition, size_t stack_offset,
+                                  const crash_dump_task_header_t *task, uint32_t addr, uint32_t *value)
+{
+    if (addr < task->stack_start || addr + sizeof(uint32_t) > task->stack_end || (addr & 3) != 0) {
+        return false;
+    }
+    return esp_partition_read(partition, stack_offset + (addr - task->stack_start), value, sizeof(uint32_t)) == ESP_OK;
+}
+
+/* -----------------------------------------------------------
+| crash_code_addr
+|   Turns a windowed ABI return address, which keeps the window
+|   increment in its top bits, into the address of the call
+------------------------------------------------------------*/
+static uint32_t crash_code_addr(uint32_t ra)
+{
+    return ((ra & 0x3fffffff) | 0x40000000) - 3;
+}
+
+/* -----------------------------------------------------------
+| crash_backtrace
+|   Walks the crashed task's stack from its exception frame the
+|   way the panic handler does: the caller's return address and
+|   stack pointer are in the base save area below each frame's
+|   stack pointer. Returns the number of addresses found
+------------------------------------------------------------*/
+static uint8_t crash_backtrace(const esp_partition_t *partition, size_t stack_offset,
+                               const crash_dump_task_header_t *task, uint32_t *backtrace)
+{
+    uint32_t pc, ra, sp, next_sp;
+    uint8_t depth = 0;
+
+    if (!crash_read_stack_word(partition, stack_offset, task, task->stack_start + XT_EXC_PC_OFFSET, &pc)
+        || !crash_read_stack_word(partition, stack_offset, task, task->stack_start + XT_EXC_A0_OFFSET, &ra)
+        || !crash_read_stack_word(partition, stack_offset, task, task->stack_start + XT_EXC_A1_OFFSET, &sp)) {
+        return 0;
+    }
+    backtrace[depth++] = pc;
+    while (depth < CRASH_BACKTRACE_DEPTH && ra >= 0x40000000) {
+        backtrace[depth++] = crash_code_addr(ra);
+        if (!crash_read_stack_word(partition, stack_offset, task, sp - 12, &next_sp)
+            || !crash_read_stack_word(partition, stack_offset, task, sp - 16, &ra)) {
+            break;
+        }
+        sp = next_sp;
+    }
+    return depth;
+}
+
+/* -----------------------------------------------------------
+| crash_report_erase
+|   The dump starts with its length, erasing the first sector is
+|   enough to drop it
+------------------------------------------------------------*/
+static void crash_report_erase(void)
+{
+    if (esp_partition_erase_range(crash_partition, 0, SPI_FLASH_SEC_SIZE) != ESP_OK) {
+        ESP_LOGE(TAG, "Couldn't erase the core dump");
+    }
+}
+
+/* -----------------------------------------------------------
+| crash_watched_min_free
+|   The lowest free stack sampled for a task of the boot that
+|   crashed, -1 if it wasn't one of the watched tasks
+------------------------------------------------------------*/
+static int32_t crash_watched_min_free(const crash_boot_t *boot, const char *task_name)
+{
+    uint8_t i;
+
+    for (i = 0; i < CRASH_MAX_WATCHED_TASKS; i++) {
+        if (boot->task_name[i][0] != '\0'
+            && strncmp(boot->task_name[i], task_name, configMAX_TASK_NAME_LEN) == 0) {
+            return boot->min_free[i] == UINT32_MAX ? -1 : (int32_t)boot->min_free[i];
+        }
+    }
+    return -1;
+}
+
+/* -----------------------------------------------------------
+| crash_read_task
+|   Reads the header, pxStack and name of the task at offset and
+|   moves offset past its stack. stack_offset is where the dump
+|   holds the stack from task->stack_start on
+------------------------------------------------------------*/
+static bool crash_read_task(const esp_partition_t *partition, const crash_dump_header_t *header, size_t *offset,
+                            crash_dump_task_header_t *task, char *task_name, uint32_t *px_stack, size_t *stack_offset)
+{
+    if (*offset + sizeof(*task) + header->tcb_sz > header->data_len
+        || esp_partition_read(partition, *offset, task, sizeof(*task)) != ESP_OK
+        || task->stack_end < task->stack_start
+        || *offset + sizeof(*task) + header->tcb_sz + (task->stack_end - task->stack_start) > header->data_len
+        || esp_partition_read(partition, *offset + sizeof(*task) + TCB_PX_STACK_OFFSET, px_stack, sizeof(*px_stack)) != ESP_OK
+        || esp_partition_read(partition, *offset + sizeof(*task) + TCB_NAME_OFFSET, task_name, configMAX_TASK_NAME_LEN) != ESP_OK) {
+        return false;
+    }
+    task_name[configMAX_TASK_NAME_LEN] = '\0';
+    *stack_offset = *offset + sizeof(*task) + header->tcb_sz;
+    *offset = *stack_offset + (task->stack_end - task->stack_start);
+    return true;
+}
+
+/* -----------------------------------------------------------
+| crash_report_dump
+|   Queues the summary of the core dump in the partition. The
+|   dump lists the tasks in scheduler order, the crashed one is
+|   marked in the exit field of its exception frame. boot is
+|   what the boot that crashed left. Returns whether the crash
+|   message was queued
+------------------------------------------------------------*/
+static bool crash_report_dump(const esp_partition_t *partition, const char *reset_reason, const crash_boot_t *boot)
+{
+    crash_dump_header_t header;
+    crash_dump_task_header_t task, crashed;
+    char json[QUERY_JSON_STR_SIZE], entry[64];
+    char task_name[configMAX_TASK_NAME_LEN + 1], crashed_name[configMAX_TASK_NAME_LEN + 1];
+    uint32_t backtrace[CRASH_BACKTRACE_DEPTH];
+    uint32_t frame_exit, pc, px_stack;
+    size_t offset, stack_offset, crashed_offset = 0, json_len, header_len;
+    uint16_t omitted = 0;
+    uint8_t depth, i, messages = 0;
+    int32_t min_free;
+    uint32_t task_idx;
+    bool queued, marked;
+
+    if (esp_partition_read(partition, 0, &header, sizeof(header)) != ESP_OK) {
+        return false;
+    }
+    if (header.version != CRASH_DUMP_VERSION || header.data_len > partition->size
+        || header.tcb_sz < TCB_NAME_OFFSET + configMAX_TASK_NAME_LEN) {
+        RAAHI_LOGE(TAG, "Core dump of an unknown format, version %u", header.version);
+        return false;
+    }
+
+    // Find the crashed task. Without a marked one, go with the first
+    offset = sizeof(header);
+    for (task_idx = 0; task_idx < header.tasks_num; task_idx++) {
+        if (!crash_read_task(partition, &header, &offset, &task, task_name, &px_stack, &stack_offset)) {
+            break;
+        }
+        marked = crash_read_stack_word(partition, stack_offset, &task, task.stack_start, &frame_exit)
+                 && frame_exit == CRASH_CURR_TASK_MARKER;
+        if (task_idx == 0 || marked) {
+            crashed = task;
+            crashed_offset = stack_offset;
+            strcpy(crashed_name, task_name);
+        }
+        if (marked) {
+            break;
+        }
+    }
+    if (crashed_offset == 0) {
+        RAAHI_LOGE(TAG, "Core dump without tasks");
+        return false;
+    }
+
+    depth = crash_backtrace(partition, crashed_offset, &crashed, backtrace); // PC first
+    json_len = snprintf(json, sizeof(json), "{\"deviceId\": \"%s\", \"timestamp\": %lu, \"type\": \"crash\", "
+                        "\"reason\": \"%s\", \"fw\": \"%s\", \"elf\": \"%s\", \"task\": \"%s\", \"bt\": [",
+                        user_mqtt_str, time(NULL), reset_reason,
+                        boot->fw_ver[0] != '\0' ? boot->fw_ver : "?",
+                        boot->fw_ver[0] != '\0' ? boot->elf_sha : "?", crashed_name);
+    for (i = 0; i < depth && json_len + sizeof(", \"0x00000000\"]}") < sizeof(json); i++) {
+        json_len += snprintf(&json[json_len], sizeof(json) - json_len, "%s\"0x%08x\"", i == 0 ? "" : ", ", backtrace[i]);
+    }
+    snprintf(&json[json_len], sizeof(json) - json_len, "]}");
+    queued = queue_mqtt_query(json);
+    RAAHI_LOGE(TAG, "%s: %s at 0x%08x", reset_reason, crashed_name, depth > 0 ? backtrace[0] : 0);
+
+    // Every task: saved PC, free stack at the crash and the lowest seen, where it was sampled
+    header_len = snprintf(json, sizeof(json), "{\"deviceId\": \"%s\", \"timestamp\": %lu, \"type\": \"crash_tasks\", "
+                          "\"tasks\": [", user_mqtt_str, time(NULL));
+    json_len = header_len;
+    offset = sizeof(header);
+    for (task_idx = 0; task_idx < header.tasks_num; task_idx++) {
+        if (!crash_read_task(partition, &header, &offset, &task, task_name, &px_stack, &stack_offset)) {
+            RAAHI_LOGE(TAG, "Core dump truncated at task %u", task_idx);
+            break;
+        }
+        pc = 0;
+        if (crash_read_stack_word(partition, stack_offset, &task, task.stack_start, &frame_exit)) {
+            crash_read_stack_word(partition, stack_offset, &task, task.stack_start
+                                  + (frame_exit == XT_SOL_FRAME_EXIT ? XT_SOL_PC_OFFSET : XT_EXC_PC_OFFSET), &pc);
+        }
+        min_free = crash_watched_min_free(boot, task_name);
+        snprintf(entry, sizeof(entry), "[\"%s\", \"0x%08x\", %d, %d]", task_name, pc,
+                 task.stack_start > px_stack ? (int)(task.stack_start - px_stack) : 0, min_free);
+        if (json_len > header_len && json_len + 2 + strlen(entry) + sizeof("]}") > sizeof(json)) {
+            strcpy(&json[json_len], "]}");
+            if (messages < CRASH_MAX_TASK_MESSAGES && queue_mqtt_query(json)) {
+                messages++;
+            }
+            json_len = header_len;
+        }
+        if (messages >= CRASH_MAX_TASK_MESSAGES) {
+            omitted++;
+        } else {
+            json_len += sprintf(&json[json_len], "%s%s", json_len > header_len ? ", " : "", entry);
+        }
+    }
+    if (json_len > header_len && messages < CRASH_MAX_TASK_MESSAGES) {
+        strcpy(&json[json_len], "]}");
+        queue_mqtt_query(json);
+    }
+    if (omitted > 0) {
+        RAAHI_LOGW(TAG, "%u tasks left out of the crash report", omitted);
+    }
+    return queued;
+}
+
+/* -----------------------------------------------------------
+| crash_report_init
+|   Called once at boot, after the query queue is set up and
+|   before the tasks start. Queues the summary of a core dump
+|   left by the last boot, then starts sampling stacks anew. A
+|   dump that was already queued by the last boot, which
+|   restarted before publishing it, is summarized with what was
+|   stashed for it
+------------------------------------------------------------*/
+void crash_report_init(void)
+{
+    const esp_app_desc_t *app_desc;
+    crash_boot_t boot;
+    char reset_reason[CRASH_REASON_LEN];
+    uint32_t data_len, dump_id = 0;
+    uint8_t i;
+
+    stringify_reset_reason(reset_reason);
+    memset(&boot, 0, sizeof(boot));
+    crash_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_COREDUMP, NULL);
+    if (crash_partition == NULL) {
+        ESP_LOGW(TAG, "No coredump partition, crashes won't be reported");
+    } else if (esp_partition_read(crash_partition, 0, &data_len, sizeof(data_len)) == ESP_OK
+               && data_len != 0xffffffff && data_len != 0) {
+        // The dump ends with its checksum, which tells whether it was queued before
+        if (data_len < sizeof(crash_dump_header_t) + sizeof(dump_id) || data_len > crash_partition->size
+            || esp_partition_read(crash_partition, data_len - sizeof(dump_id), &dump_id, sizeof(dump_id)) != ESP_OK) {
+            dump_id = 0;
+        }
+        if (crash_stacks.magic == CRASH_STACKS_MAGIC) {
+            if (dump_id != 0 && crash_stacks.pending_dump == dump_id) {
+                memcpy(&boot, &crash_stacks.pending, sizeof(boot));
+                strlcpy(reset_reason, crash_stacks.pending_reason, sizeof(reset_reason));
+                ESP_LOGI(TAG, "Core dump not published by the last boot, reporting it again");
+            } else {
+                memcpy(&boot, &crash_stacks.current, sizeof(boot));
+            }
+        }
+        crash_report_queued = crash_report_dump(crash_partition, reset_reason, &boot);
+        if (crash_report_queued == false || dump_id == 0) {
+            crash_report_queued = false;
+            crash_report_erase();
+        }
+    }
+
+    memset(&crash_stacks, 0, sizeof(crash_stacks));
+    if (crash_report_queued == true) {
+        crash_stacks.pending_dump = dump_id;
+        strlcpy(crash_stacks.pending_reason, reset_reason, sizeof(crash_stacks.pending_reason));
+        memcpy(&crash_stacks.pending, &boot, sizeof(boot));
+    }
+    app_desc = esp_ota_get_app_description();
+    strlcpy(crash_stacks.current.fw_ver, app_desc->version, sizeof(crash_stacks.current.fw_ver));
+    for (i = 0; i < (sizeof(crash_stacks.current.elf_sha) - 1) / 2; i++) {
+        sprintf(&crash_stacks.current.elf_sha[i * 2], "%02x", app_desc->app_elf_sha256[i]);
+    }
+    for (i = 0; i < CRASH_MAX_WATCHED_TASKS; i++) {
+        crash_stacks.current.min_free[i] = UINT32_MAX;
+    }
+    crash_stacks.magic = CRASH_STACKS_MAGIC;
+}
+
+/* -----------------------------------------------------------
+| crash_report_check_sent
+|   Called from the data sampling loop. The MQTT task only frees
+|   a query slot once it is published, so when the queue is
+|   empty the crash report queued at boot has gone out and the
+|   dump can be erased
+------------------------------------------------------------*/
+void crash_report_check_sent(void)
+{
+    if (crash_report_queued == false || query_json.write_ptr != query_json.read_ptr) {
+        return;
+    }
+    crash_report_queued = false;
+    crash_stacks.pending_dump = 0;
+    crash_report_erase();
+    ESP_LOGI(TAG, "Crash report published, core dump erased");
+}
+
+/* -----------------------------------------------------------
+| crash_report_sample_stacks
+|   Keeps the stack high-water marks of our tasks in RTC memory,
+|   where a crash leaves them for the next boot
+------------------------------------------------------------*/
+void crash_report_sample_stacks(void)
+{
+    TaskHandle_t tasks[CRASH_MAX_WATCHED_TASKS] = { dataSamplingTaskHandle, awsTaskHandle };
+    uint32_t min_free;
+    uint8_t i;
+
+    if (crash_stacks.magic != CRASH_STACKS_MAGIC) {
+        return;
+    }
+    for (i = 0; i < CRASH_MAX_WATCHED_TASKS; i++) {
+        if (tasks[i] == NULL) {
+            continue;
+        }
+        min_free = uxTaskGetStackHighWaterMark(tasks[i]);
+        if (strncmp(crash_stacks.current.task_name[i], pcTaskGetTaskName(tasks[i]), configMAX_TASK_NAME_LEN) != 0) {
+            strlcpy(crash_stacks.current.task_name[i], pcTaskGetTaskName(tasks[i]), configMAX_TASK_NAME_LEN);
+            crash_stacks.current.min_free[i] = min_free;
+        }
+        if (min_free < crash_stacks.current.min_free[i]) {
+            crash_stacks.current.min_free[i] = min_free;
+        }
+    }
+}
@@ -14,11 +14,13 @@
 #include "esp_task_wdt.h"
 #include "freertos/event_groups.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "soc/uart_struct.h"
 #include "driver/uart.h"
 #include "driver/i2c.h"
 #include "esp32/rom/gpio.h"
 #include "esp_modem.h"
+#include "esp_modem_at.h"
 #include "sim800.h"
 #include "raahi.h"
 #include "esp_sntp.h"
@@ -40,6 +42,7 @@
 #define GPGLL_LEN       (47)
 #define PACKET_READ_TICS        (100 / portTICK_RATE_MS)
 #define DATA_SAMPLING_UART      (UART_NUM_2)
+#define DATA_JSON_WAKE_MARGIN   (3) // Packets a sampling round can add to the data queue
 static const int RX_BUF_SIZE = 1024;
 
 #define MODBUS_BUF_SIZE 128
@@ -260,6 +263,24 @@ static esp_err_t modbus_read(uint8_t slave_id, uint16_t reg_address, uint16_t* r
 	return(return_val);
 }
 
+/* -----------------------------------------------------------
+| 	data_json_push
+| 	Adds a data packet to the queue, stamped with the time its
+|	sample was read and the time it was queued (see latency.c).
+|	A full queue keeps the older packets
+------------------------------------------------------------*/
+static void data_json_push(const char *payload, int64_t capture_us)
+{
+	live_publish("data", payload);
+	if ((data_json.write_ptr + 1) % DATA_JSON_QUEUE_SIZE == data_json.read_ptr) {
+		debug_data.data_json_dropped++;
+		return;
+	}
+	strcpy(data_json.packet[data_json.write_ptr], payload);
+	data_json.capture_us[data_json.write_ptr] = capture_us;
+	data_json.enqueue_us[data_json.write_ptr] = esp_timer_get_time();
+	data_json.write_ptr = (data_json.write_ptr+1) % DATA_JSON_QUEUE_SIZE;
+}
 
 /* -----------------------------------------------------------
 | 	modbus_sensor_task
@@ -274,52 +295,58 @@ void modbus_sensor_task()
 	uint8_t slave_id_idx, reg_address_idx;
 	esp_err_t modbus_read_ret_val;
 	time_t now;
+	int64_t capture_us;
+	struct config_struct config;
 
+	config_store_read(&config); // Slaves and registers as of this round, even if they are updated meanwhile
 	for (slave_id_idx = 0; slave_id_idx < MAX_MODBUS_SLAVES; slave_id_idx++)
 	{	
-		if (sysconfig.slave_id[slave_id_idx] == 0) {// Slave ID of 0 is considered to be an uninitialized entry
+		if (config.slave_id[slave_id_idx] == 0) {// Slave ID of 0 is considered to be an uninitialized entry
 			break;
 		}
 		
 		for (reg_address_idx = 0; reg_address_idx < MAX_MODBUS_REGISTERS; reg_address_idx++)
 		{
-			if (sysconfig.reg_address[reg_address_idx] == 0) {// reg address 0 is considered to be unintialized entry
+			if (config.reg_address[reg_address_idx] == 0) {// reg address 0 is considered to be unintialized entry
 				break;
 			}
 
-			modbus_read_ret_val = modbus_read(sysconfig.slave_id[slave_id_idx], sysconfig.reg_address[reg_address_idx], &modbus_read_result);
+			modbus_read_ret_val = modbus_read(config.slave_id[slave_id_idx], config.reg_address[reg_address_idx], &modbus_read_result);
+			capture_us = esp_timer_get_time();
 			if(modbus_read_ret_val == ESP_OK) {	
         	   	time(&now);
 				if (user_mqtt_str != NULL) {
 					sprintf(cPayload, "{\"%s\": \"%s\", \"%s\": %lu, \"%s\": %d, \"%s\": %u, \"%s\": %u}", \
 							"deviceId", user_mqtt_str, \
         	                "timestamp", now, \
-							"slave_id", sysconfig.slave_id[slave_id_idx], \
-							"reg_address", sysconfig.reg_address[reg_address_idx], \
+							"slave_id", config.slave_id[slave_id_idx], \
+							"reg_address", config.reg_address[reg_address_idx], \
 							"reg_value", modbus_read_result);
     			} else {
 					sprintf(cPayload, "{\"%s\": \"%s\", \"%s\": %lu, \"%s\": %d, \"%s\": %u, \"%s\": %u}", \
 							"deviceId", "user_id_NA", \
         	                "timestamp", now, \
-							"slave_id", sysconfig.slave_id[slave_id_idx], \
-							"reg_address", sysconfig.reg_address[reg_address_idx], \
+							"slave_id", config.slave_id[slave_id_idx], \
+							"reg_address", config.reg_address[reg_address_idx], \
 							"reg_value", modbus_read_result);
 				}
-				strcpy(data_json.packet[data_json.write_ptr], cPayload);
-				data_json.write_ptr = (data_json.write_ptr+1) % DATA_JSON_QUEUE_SIZE;
+				data_json_push(cPayload, capture_us);
 
 				ESP_LOGI(TAG, "Json: %s", cPayload);
 
 				// Updata debug data
 				debug_data.slave_info[slave_id_idx].status = CONNECTED_AND_UPDATING;
 				debug_data.slave_info[slave_id_idx].data[reg_address_idx] = modbus_read_result;
+				debug_data.slave_info[slave_id_idx].reads_ok++;
 	
 			} else if (modbus_read_ret_val == ESP_ERR_INVALID_RESPONSE) {// There was CRC error
 				debug_data.slave_info[slave_id_idx].status = CONNECTED_WITH_ISSUES;
 				debug_data.slave_info[slave_id_idx].data[reg_address_idx] = 0;
+				debug_data.slave_info[slave_id_idx].crc_errors++;
 			} else { // Slave didn't even respond
 				debug_data.slave_info[slave_id_idx].status = NOT_CONNECTED;
 				debug_data.slave_info[slave_id_idx].data[reg_address_idx] = 0;
+				debug_data.slave_info[slave_id_idx].timeouts++;
 			}
 
 	
@@ -384,6 +411,7 @@ void gps_sampling_task()
     	  	} else if (valid == 'A') {
     	   		ESP_LOGI(RX_TASK_TAG, "GPGLL Active line '%s'",gpgll_line);
     	   		float gps_lat, gps_lng;
+    	   		int64_t capture_us = esp_timer_get_time();
     	   		parse_gpgll(&gps_lat, &gps_lng, gpgll_line); 
     	   		time(&now);
     	   		ESP_LOGI(RX_TASK_TAG, "GPGLL lat:'%.5f' lng:'%.5f'",gps_lat,gps_lng);
@@ -401,8 +429,7 @@ void gps_sampling_task()
     	                "lng", gps_lng);
     	   		}
 
-    	   		strcpy(data_json.packet[data_json.write_ptr], cPayload);
-    	   		data_json.write_ptr = (data_json.write_ptr+1) % DATA_JSON_QUEUE_SIZE;
+    	   		data_json_push(cPayload, capture_us);
     	   		/* parse line to extract location */
     	  	}
 		} // End of if (ptr != NULL)
@@ -493,8 +520,12 @@ void adc_sensor_task()
 	uint16_t data;
 	float voltage_mV, mV_per_bit, current_mA, resistance_ohms, terminal_voltage_mV;
 	esp_err_t result;
+	struct config_struct config;
+
+	config_store_read(&config);
 
 	time_t now;	
+	int64_t capture_us;
     char cPayload[DATA_JSON_STR_SIZE];
 
 	switch(ADC_RESOLUTION)	//Reference: MCP342x datasheet
@@ -518,7 +549,7 @@ void adc_sensor_task()
 
 	for (channel = 0; channel < MAX_ADC_CHANNELS; channel++)
 	{
-		if(sysconfig.analog_sensor_type[channel] == NONE)
+		if(config.analog_sensor_type[channel] == NONE)
 		{
 			continue;
 		}
@@ -530,9 +561,10 @@ void adc_sensor_task()
 			continue;
 		}
 
+		capture_us = esp_timer_get_time();
 		voltage_mV = data * mV_per_bit;
 		time(&now);
-		switch(sysconfig.analog_sensor_type[channel])
+		switch(config.analog_sensor_type[channel])
 		{
 			case FOURTWENTY:
 				current_mA = voltage_mV / CONFIG_CURRENT_LOOP_RECEIVER_RESISTOR;					
@@ -569,8 +601,7 @@ void adc_sensor_task()
 				continue;			
 		}
         
-		strcpy(data_json.packet[data_json.write_ptr], cPayload);
-        data_json.write_ptr = (data_json.write_ptr+1) % DATA_JSON_QUEUE_SIZE;
+		data_json_push(cPayload, capture_us);
 		
 	}	
 
@@ -587,6 +618,7 @@ void data_sampling_task(void *param)
     
   	time_t now;
     struct tm timeinfo;
+	uint32_t daily_restart_s = device_jitter_ms(CONFIG_DAILY_RESTART_WINDOW_MIN * 60 * 1000, JITTER_DAILY_RESTART) / 1000;
 
 	uart_config_t uart_config = {
         .baud_rate = BAUD_RATE,
@@ -598,6 +630,7 @@ void data_sampling_task(void *param)
     };
 
     ESP_ERROR_CHECK(i2c_master_init());
+	ESP_LOGI(TAG, "Daily restart at %02u:%02u", daily_restart_s / 3600, (daily_restart_s / 60) % 60);
 	while(1) {
         //Reset watchdog timer for _this_ task 
         CHECK_ERROR_CODE(esp_task_wdt_reset(), ESP_OK);	
@@ -639,6 +672,11 @@ void data_sampling_task(void *param)
 		//adc_sensor_task();
 
         vTaskDelay((sysconfig.sampling_period_in_sec * 1000) / portTICK_RATE_MS);
+		event_log_flush(false);
+		crash_report_sample_stacks();
+		crash_report_check_sent();
+		metrics_collect();
+		latency_report();
 	
 		// We should restart every 1 day to make sure the code isn't stuck in some place forever
     	if(xEventGroupGetBits(esp_event_group)  & SNTP_CONNECT_BIT)
@@ -658,7 +696,9 @@ void data_sampling_task(void *param)
                     RAAHI_LOGI(TAG, "SNTP Server: %s, Availability: %d", sntp_getservername(server_idx), sntp_getreachability(server_idx));
                 }
             }
-			if (timeinfo.tm_mday != today) {
+			// Each device restarts at its own time after midnight, not the whole fleet at once
+			if (timeinfo.tm_mday != today 
+				&& (uint32_t)(timeinfo.tm_hour * 3600 + timeinfo.tm_min * 60 + timeinfo.tm_sec) >= daily_restart_s) {
 				today = timeinfo.tm_mday; // TODO: Is this even necessary?
 				ESP_LOGI(TAG, "Restarting since 24hrs have passed");
                 strcpy(zombie_info.esp_restart_reason, "24hr Passed");
@@ -666,6 +706,15 @@ void data_sampling_task(void *param)
 			}
 		}
 
+		// A duty-cycled modem is woken up early if the data queue is about to overflow
+		if (((data_json.write_ptr + DATA_JSON_QUEUE_SIZE - data_json.read_ptr) % DATA_JSON_QUEUE_SIZE) >= (DATA_JSON_QUEUE_SIZE - DATA_JSON_WAKE_MARGIN)) {
+			modem_link_wake();
+		}
+
+		if (modem_link_is_up() == false) { // modem_link.c is recovering the link, the counters below don't mean much till then
+			continue;
+		}
+
 		// Check if any error counters have crossed their respective thresholds and restart if so
 		if (aws_failures_counter > MAX_AWS_FAILURE_COUNT) {
     		ESP_LOGE(TAG, "Too many failures in AWS loop");
@@ -707,6 +756,8 @@ void raahi_restart()
 
     if(dce_g != NULL && dte_g != NULL)
     {
+        // Keep the AT engine off the UART while we drive the DCE directly. Never released, we restart below
+        esp_modem_at_lock(MODEM_COMMAND_TIMEOUT_HANG_UP);
         // Stop PPP, switch dte, dce to command mode and sample signal parameters
         if(dce_g->mode == MODEM_PPP_MODE) // This check is required when change to PPP mode (below) doesn't work
         {  
@@ -746,5 +797,6 @@ void raahi_restart()
         //}while(try < 2);
     }
     vTaskDelay(5000 / portTICK_RATE_MS);
+	event_log_append(LOCAL_TAG, ESP_LOG_WARN, zombie_info.esp_restart_reason); // Written out by the shutdown handler
 	esp_restart();
 }
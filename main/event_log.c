@@ -0,0 +1,373 @@
+/**************************************************************
+* event_log.c
+*
+* Keeps the RAAHI_LOGx events on the storage partition, so the
+* ones leading up to a restart can be read after it. Records are
+* binary (event_record_t and then the tag and the message) and
+* collected in a batch in RTC memory, which survives a panic or
+* a watchdog reset. A batch is appended to the active file when
+* it is full, every CONFIG_EVENT_LOG_FLUSH_S and before a
+* restart. Files are only ever appended to, and when the active
+* one would grow past CONFIG_EVENT_LOG_FILE_KB the other one is
+* emptied and takes over, so the log holds between one and two
+* files' worth of the latest events.
+*
+* The "send_event_log" command publishes the whole log, oldest
+* first, as "event_log" messages on the query topic
+**************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "esp_system.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp32/rom/crc.h"
+#include "nvs.h"
+
+#include "raahi.h"
+
+#define EVENT_LOG_NAMESPACE "eventlog"
+#define EVENT_LOG_FILE_SIZE (CONFIG_EVENT_LOG_FILE_KB * 1024)
+#define EVENT_LOG_BATCH_SIZE 1024
+#define EVENT_LOG_BATCH_MAGIC 0x4556424c    // A batch left in RTC memory by the last boot
+#define EVENT_RECORD_MAGIC 0xe5
+#define EVENT_LOG_MAX_TEXT 200              // Tag and message of a record together
+#define EVENT_LOG_UPLOAD_STACK_SIZE 4096
+#define EVENT_LOG_QUEUE_WAIT_MS 500
+#define ESP_CORE_0 0
+
+static const char *TAG = "event_log";
+static const char *event_log_files[2] = { STORAGE_BASE_PATH "/events0.bin", STORAGE_BASE_PATH "/events1.bin" };
+
+typedef struct __attribute__((packed))
+{
+    uint8_t magic;          // EVENT_RECORD_MAGIC, where a record starts
+    uint8_t level;          // esp_log_level_t
+    uint8_t tag_len;
+    uint8_t msg_len;
+    uint32_t timestamp;     // Unix time, seconds since boot until the time is set
+    uint16_t boot;          // Boot count, tells the restarts apart
+    uint16_t crc;           // CRC16 of the header, with this 0, and the text
+}event_record_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t used;
+    uint32_t dropped;       // Records that didn't fit while the log was being uploaded
+    int64_t first_us;       // When the oldest record of the batch was added
+    uint8_t data[EVENT_LOG_BATCH_SIZE];
+}event_batch_t;
+
+extern char user_mqtt_str[MAX_DEVICE_ID_LEN];
+esp_reset_reason_t stringify_reset_reason(char* reset_reason_str);
+
+static RTC_NOINIT_ATTR event_batch_t event_batch;
+static SemaphoreHandle_t event_log_mutex = NULL;
+static uint8_t active_file;
+static uint16_t boot_count;
+static bool uploading = false;
+
+/* -----------------------------------------------------------
+| event_log_write_batch
+|   Appends the batch to the active file, switching files first
+|   if it would grow too large. Called with the mutex held
+------------------------------------------------------------*/
+static void event_log_write_batch(void)
+{
+    struct stat st;
+    nvs_handle handle;
+    FILE *file;
+
+    if (event_batch.used == 0) {
+        return;
+    }
+    if (stat(event_log_files[active_file], &st) == 0 && st.st_size + event_batch.used > EVENT_LOG_FILE_SIZE) {
+        active_file ^= 1;
+        file = fopen(event_log_files[active_file], "wb"); // Drops the oldest events
+        if (file != NULL) {
+            fclose(file);
+        }
+        if (nvs_open(EVENT_LOG_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+            nvs_set_u8(handle, "active", active_file);
+            nvs_commit(handle);
+            nvs_close(handle);
+        }
+    }
+    file = fopen(event_log_files[active_file], "ab");
+    if (file == NULL || fwrite(event_batch.data, 1, event_batch.used, file) != event_batch.used) {
+        ESP_LOGE(TAG, "Couldn't append to %s", event_log_files[active_file]);
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    event_batch.used = 0;
+}
+
+/* -----------------------------------------------------------
+| event_log_add
+|   Adds a record to the batch, writing the batch out first if
+|   it is full. Called with the mutex held
+------------------------------------------------------------*/
+static void event_log_add(const char *tag, esp_log_level_t level, const char *msg)
+{
+    event_record_t record;
+    size_t tag_len = strnlen(tag, UINT8_MAX), msg_len = strlen(msg);
+
+    if (tag_len + msg_len > EVENT_LOG_MAX_TEXT) {
+        msg_len = EVENT_LOG_MAX_TEXT - MIN(tag_len, EVENT_LOG_MAX_TEXT);
+    }
+    if (event_batch.used + sizeof(record) + tag_len + msg_len > EVENT_LOG_BATCH_SIZE) {
+        if (uploading == true) { // The files are being read, keep them as they are
+            event_batch.dropped++;
+            return;
+        }
+        event_log_write_batch();
+    }
+    if (event_batch.used == 0) {
+        event_batch.first_us = esp_timer_get_time();
+    }
+    record.magic = EVENT_RECORD_MAGIC;
+    record.level = level;
+    record.tag_len = tag_len;
+    record.msg_len = msg_len;
+    record.timestamp = time(NULL);
+    record.boot = boot_count;
+    record.crc = 0;
+    record.crc = crc16_le(0, (const uint8_t *)&record, sizeof(record));
+    record.crc = crc16_le(record.crc, (const uint8_t *)tag, tag_len);
+    record.crc = crc16_le(record.crc, (const uint8_t *)msg, msg_len);
+    memcpy(&event_batch.data[event_batch.used], &record, sizeof(record));
+    memcpy(&event_batch.data[event_batch.used + sizeof(record)], tag, tag_len);
+    memcpy(&event_batch.data[event_batch.used + sizeof(record) + tag_len], msg, msg_len);
+    event_batch.used += sizeof(record) + tag_len + msg_len;
+}
+
+/* -----------------------------------------------------------
+| event_log_append
+|   Called by the RAAHI_LOGx macros. Cheap: the record goes to
+|   RAM and reaches flash with the rest of its batch
+------------------------------------------------------------*/
+void event_log_append(const char *tag, esp_log_level_t level, const char *msg)
+{
+    if (event_log_mutex == NULL) { // Before event_log_init()
+        return;
+    }
+    xSemaphoreTake(event_log_mutex, portMAX_DELAY);
+    event_log_add(tag, level, msg);
+    xSemaphoreGive(event_log_mutex);
+}
+
+/* -----------------------------------------------------------
+| event_log_flush
+|   Writes out the batch if it has waited CONFIG_EVENT_LOG_FLUSH_S
+|   or if forced to, before a restart
+------------------------------------------------------------*/
+void event_log_flush(bool force)
+{
+    char dropped[40];
+
+    if (event_log_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(event_log_mutex, portMAX_DELAY);
+    if (uploading == false && event_batch.used > 0
+        && (force == true || esp_timer_get_time() - event_batch.first_us >= CONFIG_EVENT_LOG_FLUSH_S * 1000000LL)) {
+        if (event_batch.dropped > 0) {
+            snprintf(dropped, sizeof(dropped), "%u events dropped during the upload", event_batch.dropped);
+            event_batch.dropped = 0;
+            event_log_add(TAG, ESP_LOG_WARN, dropped);
+        }
+        event_log_write_batch();
+    }
+    xSemaphoreGive(event_log_mutex);
+}
+
+/* -----------------------------------------------------------
+| event_log_shutdown
+|   Shutdown handler, esp_restart() gets the batch written
+------------------------------------------------------------*/
+static void event_log_shutdown(void)
+{
+    event_log_flush(true);
+}
+
+/* -----------------------------------------------------------
+| event_log_init
+|   Picks up the batch a panic or a watchdog reset left in RTC
+|   memory and starts this boot's records with the reset reason
+------------------------------------------------------------*/
+void event_log_init(void)
+{
+    nvs_handle handle;
+    char reset_reason[40];
+
+    if (nvs_open(EVENT_LOG_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+        nvs_get_u16(handle, "boot", &boot_count);
+        nvs_get_u8(handle, "active", &active_file);
+        boot_count++;
+        nvs_set_u16(handle, "boot", boot_count);
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+    active_file &= 1;
+
+    // RTC memory holds garbage after a power cycle. Records are checked again as they are read
+    if (event_batch.magic != EVENT_LOG_BATCH_MAGIC || event_batch.used > EVENT_LOG_BATCH_SIZE
+        || esp_reset_reason() == ESP_RST_POWERON || esp_reset_reason() == ESP_RST_BROWNOUT) {
+        event_batch.magic = EVENT_LOG_BATCH_MAGIC;
+        event_batch.used = 0;
+        event_batch.dropped = 0;
+    } else if (event_batch.used > 0) {
+        ESP_LOGI(TAG, "%u bytes of events from before the reset", event_batch.used);
+    }
+    event_batch.first_us = 0; // Timer of the last boot, so the leftovers go out with the first flush
+
+    event_log_mutex = xSemaphoreCreateMutex();
+    stringify_reset_reason(reset_reason);
+    event_log_append("boot", ESP_LOG_INFO, reset_reason);
+    esp_register_shutdown_handler(event_log_shutdown);
+    ESP_LOGI(TAG, "Boot %u, logging to %s", boot_count, event_log_files[active_file]);
+}
+
+/* -----------------------------------------------------------
+| event_log_queue_query
+|   Queues a message on the query topic, waiting for a free slot
+|   rather than overwriting one that isn't sent yet
+------------------------------------------------------------*/
+static void event_log_queue_query(const char *json)
+{
+    while (queue_mqtt_query(json) == false) {
+        vTaskDelay(EVENT_LOG_QUEUE_WAIT_MS / portTICK_RATE_MS);
+    }
+}
+
+/* -----------------------------------------------------------
+| event_log_json_text
+|   Copies record text into a JSON string, quotes and control
+|   characters replaced
+------------------------------------------------------------*/
+static void event_log_json_text(char *dst, const uint8_t *src, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        dst[i] = (src[i] == '"' || src[i] == '\\') ? '\'' : (src[i] < ' ' ? ' ' : src[i]);
+    }
+    dst[len] = '\0';
+}
+
+/* -----------------------------------------------------------
+| event_log_upload_task
+|   Reads both files, oldest first, and queues their records as
+|   [timestamp, boot, level, tag, message] entries of "event_log"
+|   messages, as many as fit in a query message. A corrupt record
+|   (a write cut short by a power loss) is skipped by looking
+|   for the next record start
+------------------------------------------------------------*/
+static void event_log_upload_task(void *param)
+{
+    static const char levels[] = "NEWIDV";
+    uint8_t buffer[sizeof(event_record_t) + 2 * UINT8_MAX];
+    char json[QUERY_JSON_STR_SIZE], entry[QUERY_JSON_STR_SIZE], tag[UINT8_MAX + 1], msg[UINT8_MAX + 1];
+    event_record_t record;
+    size_t have = 0, text_len, json_len = 0, header_len, entry_len;
+    int msg_room;
+    uint16_t crc, records = 0, messages = 0;
+    FILE *file;
+    uint8_t i, file_idx;
+
+    file_idx = active_file ^ 1; // Doesn't change while uploading is set
+
+    header_len = snprintf(json, sizeof(json), "{\"deviceId\": \"%s\", \"timestamp\": %lu, \"type\": \"event_log\", "
+                          "\"records\": [", user_mqtt_str, time(NULL));
+    for (i = 0; i < 2; i++, file_idx ^= 1) {
+        file = fopen(event_log_files[file_idx], "rb");
+        if (file == NULL) {
+            continue;
+        }
+        have = 0;
+        while (1) {
+            have += fread(&buffer[have], 1, sizeof(buffer) - have, file);
+            if (have < sizeof(record)) {
+                break;
+            }
+            memcpy(&record, buffer, sizeof(record));
+            text_len = record.tag_len + record.msg_len;
+            crc = record.crc;
+            record.crc = 0;
+            if (record.magic != EVENT_RECORD_MAGIC || have < sizeof(record) + text_len
+                || crc16_le(crc16_le(0, (const uint8_t *)&record, sizeof(record)), &buffer[sizeof(record)], text_len) != crc) {
+                memmove(buffer, &buffer[1], --have); // Resynchronise one byte further
+                continue;
+            }
+            event_log_json_text(tag, &buffer[sizeof(record)], record.tag_len);
+            event_log_json_text(msg, &buffer[sizeof(record) + record.tag_len], record.msg_len);
+            // A record too long for a message of its own loses the end of its message
+            entry_len = snprintf(entry, sizeof(entry), "[%u, %u, \"%c\", \"%.40s\", \"", record.timestamp,
+                                 record.boot, levels[record.level < sizeof(levels) - 1 ? record.level : 0], tag);
+            msg_room = sizeof(json) - header_len - entry_len - sizeof("\"]]}");
+            entry_len += snprintf(&entry[entry_len], sizeof(entry) - entry_len, "%.*s\"]", MAX(msg_room, 0), msg);
+            if (json_len > 0 && json_len + 2 + entry_len + sizeof("]}") > sizeof(json)) {
+                strcpy(&json[json_len], "]}");
+                event_log_queue_query(json);
+                messages++;
+                json_len = 0;
+            }
+            if (json_len == 0) {
+                json_len = header_len;
+            } else {
+                json_len += sprintf(&json[json_len], ", ");
+            }
+            strcpy(&json[json_len], entry);
+            json_len += entry_len;
+            records++;
+            have -= sizeof(record) + text_len;
+            memmove(buffer, &buffer[sizeof(record) + text_len], have);
+        }
+        fclose(file);
+    }
+    if (json_len > 0) {
+        strcpy(&json[json_len], "]}");
+        event_log_queue_query(json);
+        messages++;
+    }
+
+    xSemaphoreTake(event_log_mutex, portMAX_DELAY);
+    uploading = false;
+    xSemaphoreGive(event_log_mutex);
+    RAAHI_LOGI(TAG, "Event log sent: %u records in %u messages", records, messages);
+    vTaskDelete(NULL);
+}
+
+/* -----------------------------------------------------------
+| event_log_upload
+|   Starts sending the log, unless it is already being sent
+------------------------------------------------------------*/
+void event_log_upload(void)
+{
+    bool started = false;
+
+    if (event_log_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(event_log_mutex, portMAX_DELAY);
+    if (uploading == false) {
+        event_log_write_batch(); // Everything up to the command goes out
+        uploading = true;
+        started = true;
+    }
+    xSemaphoreGive(event_log_mutex);
+    if (started == false) {
+        RAAHI_LOGW(TAG, "Event log upload already running");
+        return;
+    }
+    xTaskCreatePinnedToCore(&event_log_upload_task, "event_log_upload", EVENT_LOG_UPLOAD_STACK_SIZE, NULL, 4, NULL,
+                            ESP_CORE_0);
+}
@@ -5,11 +5,14 @@
 **************************************************************/
 // Header files
 #include <string.h>
+#include <stdarg.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_vfs_fat.h"
+#include "esp_heap_caps.h"
 
 #include <esp_http_server.h>
 #include "raahi.h"
@@ -25,10 +28,18 @@ extern struct debug_data_struct debug_data;
 extern char raahi_log_str[EVENT_JSON_STR_SIZE];
 extern char user_mqtt_str[MAX_DEVICE_ID_LEN];
 extern zombie_info_struct zombie_info;
+extern TaskHandle_t awsTaskHandle;
+extern struct data_json_struct data_json;
+extern struct event_json_struct event_json;
+extern struct query_json_struct query_json;
+extern uint8_t aws_failures_counter, other_aws_failures_counter;
+extern uint8_t modem_failures_counter;
+extern uint8_t fragmented_ota_error_counter;
 
 extern void create_sysconfig_json(char* json_str, uint16_t json_str_len);
 extern void raahi_restart(void);
 extern void display_sysconfig();
+extern esp_err_t live_get_handler(httpd_req_t *req);
 
 // Function declarations
 int32_t str2num(char* input_str, const char delimiter, uint8_t max_parse_len);
@@ -94,14 +105,17 @@ static esp_err_t infopage_get_handler(httpd_req_t *req)
     extern const unsigned char infopage_start[] asm("_binary_info_html_start");
     extern const unsigned char infopage_end[]   asm("_binary_info_html_end");
     const size_t infopage_size = (infopage_end - infopage_start);
-	uint8_t slave_id_idx, reg_address_idx;
+	uint8_t slave_id_idx, reg_address_idx, task_idx;
 	char tempStr[200];
+	struct config_struct config;
+	static metrics_t task_metrics; // Too big for the httpd stack
 	
+	config_store_read(&config);
 	//httpd_resp_set_type(req, "text/html"); 
     httpd_resp_send_chunk(req, (const char *)infopage_start, infopage_size);
 	
 	tempStr[0] = '\0';
-	sprintf(tempStr, "\t\t<tr><td>Client ID</td><td>%s</td></tr>\n", sysconfig.client_id); 
+	sprintf(tempStr, "\t\t<tr><td>Client ID</td><td>%s</td></tr>\n", config.client_id); 
 	httpd_resp_sendstr_chunk(req, tempStr);
 	
 	tempStr[0] = '\0';
@@ -154,25 +168,104 @@ static esp_err_t infopage_get_handler(httpd_req_t *req)
 	}
 	httpd_resp_sendstr_chunk(req, tempStr);
 	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>Link Recoveries</td><td>%u</td></tr>\n", debug_data.link_recoveries);
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>Last Link Recovery (ms)</td><td>%u / MQTT %u</td></tr>\n", debug_data.last_link_recovery_ms, debug_data.last_mqtt_recovery_ms);
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>Max Link Recovery (ms)</td><td>%u</td></tr>\n", debug_data.max_link_recovery_ms);
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>Modem Awake Last Hour (s)</td><td>%u</td></tr>\n", debug_data.modem_awake_s_last_hour);
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>Modem Sleeps</td><td>%u</td></tr>\n", debug_data.modem_sleeps);
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>MQTT Publishes</td><td>%u (%u bytes)</td></tr>\n", debug_data.mqtt_tx_msgs, debug_data.mqtt_tx_bytes);
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>MQTT Throughput (B/s)</td><td>%u</td></tr>\n", 
+		(debug_data.mqtt_tx_time_ms == 0) ? 0 : (uint32_t)((uint64_t)debug_data.mqtt_tx_bytes * 1000 / debug_data.mqtt_tx_time_ms));
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>Avg Publish Time (ms)</td><td>%u</td></tr>\n", 
+		(debug_data.mqtt_tx_msgs == 0) ? 0 : debug_data.mqtt_tx_time_ms / debug_data.mqtt_tx_msgs);
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>Max Publish Time (ms)</td><td>%u</td></tr>\n", debug_data.mqtt_tx_max_ms);
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>Avg Publish Time During OTA (ms)</td><td>%u (%u publishes)</td></tr>\n", 
+		(debug_data.mqtt_tx_msgs_during_ota == 0) ? 0 : debug_data.mqtt_tx_time_ms_during_ota / debug_data.mqtt_tx_msgs_during_ota,
+		debug_data.mqtt_tx_msgs_during_ota);
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>OTA Download (B/s)</td><td>%u, longest read %u ms</td></tr>\n", 
+		debug_data.ota_rate_bps, debug_data.ota_read_max_ms);
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>OTA Held Back (ms)</td><td>%u rate limit / %u telemetry</td></tr>\n", 
+		debug_data.ota_shaped_ms, debug_data.ota_yielded_ms);
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>Free Heap (min, largest block)</td><td>%u (%u, %u)</td></tr>\n", esp_get_free_heap_size(),
+		esp_get_minimum_free_heap_size(), heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
+	metrics_get(&task_metrics); // As of the last collection
+	for (task_idx = 0; task_idx < task_metrics.task_count; task_idx++)
+	{
+		tempStr[0] = '\0';
+		sprintf(tempStr, "\t\t<tr><td>Task %s</td><td>CPU %u%%, stack free %u</td></tr>\n", task_metrics.tasks[task_idx].name,
+			task_metrics.tasks[task_idx].cpu_percent, task_metrics.tasks[task_idx].stack_free);
+		httpd_resp_sendstr_chunk(req, tempStr);
+	}
+	
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>MQTT Task Stack Free</td><td>%u</td></tr>\n", 
+		(awsTaskHandle == NULL) ? 0 : uxTaskGetStackHighWaterMark(awsTaskHandle));
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
     tempStr[0] = '\0';
 	sprintf(tempStr, "\t\t<tr><td>Reset Reason</td><td>%s</td></tr>\n", debug_data.reset_reason_str); 
 	httpd_resp_sendstr_chunk(req, tempStr);
 	
+	char boot_timeline[BOOT_TRACE_STR_SIZE];
+	boot_trace_format(boot_timeline, sizeof(boot_timeline));
+	tempStr[0] = '\0';
+	sprintf(tempStr, "\t\t<tr><td>Boot Timeline (ms)</td><td>%s</td></tr>\n", boot_timeline);
+	httpd_resp_sendstr_chunk(req, tempStr);
+	
 	
 	for (slave_id_idx = 0; slave_id_idx < MAX_MODBUS_SLAVES; slave_id_idx++)
 	{	
-		if (sysconfig.slave_id[slave_id_idx] == 0) {// Slave ID of 0 is considered to be an uninitialized entry
+		if (config.slave_id[slave_id_idx] == 0) {// Slave ID of 0 is considered to be an uninitialized entry
 			break;
 		}
 		
 		for (reg_address_idx = 0; reg_address_idx < MAX_MODBUS_REGISTERS; reg_address_idx++)
 		{
-			if (sysconfig.reg_address[reg_address_idx] == 0) {// reg address 0 is considered to be unintialized entry
+			if (config.reg_address[reg_address_idx] == 0) {// reg address 0 is considered to be unintialized entry
 				break;
 			}
 	
 			tempStr[0] = '\0';
-			sprintf(tempStr, "\t\t<tr><td>Slave %u, Reg %u</td><td>0x%.4X</td></tr>\n", (slave_id_idx+1), sysconfig.reg_address[reg_address_idx], debug_data.slave_info[slave_id_idx].data[reg_address_idx]);
+			sprintf(tempStr, "\t\t<tr><td>Slave %u, Reg %u</td><td>0x%.4X</td></tr>\n", (slave_id_idx+1), config.reg_address[reg_address_idx], debug_data.slave_info[slave_id_idx].data[reg_address_idx]);
 			httpd_resp_sendstr_chunk(req, tempStr);
 		}
 	}
@@ -222,125 +315,239 @@ static const httpd_uri_t sysconfig_get = {
     .user_ctx  = NULL
 };
 
+/* -----------------------------------------------------------
+| 	metrics_printf()
+|	Adds a line to the /metrics response, sending the buffer
+| 	as a chunk when the line doesn't fit
+------------------------------------------------------------*/
+static void metrics_printf(httpd_req_t *req, char *buf, size_t buf_size, const char *format, ...)
+{
+	char line[256];
+	size_t used = strlen(buf);
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (used + strlen(line) >= buf_size) {
+		httpd_resp_sendstr_chunk(req, buf);
+		buf[0] = '\0';
+		used = 0;
+	}
+	strcpy(&buf[used], line);
+}
+
+/* -----------------------------------------------------------
+| 	metrics_page_get_handler()
+|	HTTP server side handler for GET reuests on /metrics. The
+| 	counters and gauges in the Prometheus text format, for a
+| 	collector on the site LAN or the AP to scrape
+------------------------------------------------------------*/
+static esp_err_t metrics_page_get_handler(httpd_req_t *req)
+{
+	static metrics_t task_metrics; // Too big for the httpd stack
+	static latency_hist_t latency;
+	struct config_struct config;
+	char buf[512];
+	uint32_t cumulative;
+	uint8_t idx, bucket;
+
+	buf[0] = '\0';
+	httpd_resp_set_type(req, "text/plain; version=0.0.4");
+
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_uptime_seconds gauge\nraahi_uptime_seconds %lld\n",
+		esp_timer_get_time() / 1000000);
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_info gauge\nraahi_info{fw=\"%s\",device=\"%s\"} 1\n",
+		debug_data.fw_ver, user_mqtt_str);
+
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_queue_depth gauge\n");
+	metrics_printf(req, buf, sizeof(buf), "raahi_queue_depth{queue=\"data\"} %u\n",
+		(data_json.write_ptr + DATA_JSON_QUEUE_SIZE - data_json.read_ptr) % DATA_JSON_QUEUE_SIZE);
+	metrics_printf(req, buf, sizeof(buf), "raahi_queue_depth{queue=\"event\"} %u\n",
+		(event_json.write_ptr + EVENT_JSON_QUEUE_SIZE - event_json.read_ptr) % EVENT_JSON_QUEUE_SIZE);
+	metrics_printf(req, buf, sizeof(buf), "raahi_queue_depth{queue=\"query\"} %u\n",
+		(query_json.write_ptr + QUERY_JSON_QUEUE_SIZE - query_json.read_ptr) % QUERY_JSON_QUEUE_SIZE);
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_queue_dropped_total counter\n"
+		"raahi_queue_dropped_total{queue=\"data\"} %u\nraahi_queue_dropped_total{queue=\"event\"} %u\n",
+		debug_data.data_json_dropped, debug_data.event_json_dropped);
+
+	config_store_read(&config);
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_modbus_reads_total counter\n");
+	for (idx = 0; idx < MAX_MODBUS_SLAVES; idx++)
+	{
+		if (config.slave_id[idx] == 0) {
+			break;
+		}
+		metrics_printf(req, buf, sizeof(buf), "raahi_modbus_reads_total{slave=\"%u\",result=\"ok\"} %u\n",
+			config.slave_id[idx], debug_data.slave_info[idx].reads_ok);
+		metrics_printf(req, buf, sizeof(buf), "raahi_modbus_reads_total{slave=\"%u\",result=\"crc_error\"} %u\n",
+			config.slave_id[idx], debug_data.slave_info[idx].crc_errors);
+		metrics_printf(req, buf, sizeof(buf), "raahi_modbus_reads_total{slave=\"%u\",result=\"timeout\"} %u\n",
+			config.slave_id[idx], debug_data.slave_info[idx].timeouts);
+	}
+
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_modem_rssi gauge\nraahi_modem_rssi %u\n"
+		"# TYPE raahi_modem_ber gauge\nraahi_modem_ber %u\n", debug_data.rssi, debug_data.ber);
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_connected gauge\nraahi_connected{to=\"internet\"} %u\n"
+		"raahi_connected{to=\"mqtt\"} %u\n", debug_data.connected_to_internet, debug_data.connected_to_aws);
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_link_recoveries_total counter\nraahi_link_recoveries_total %u\n",
+		debug_data.link_recoveries);
+	// Consecutive failures, reset on success. A restart follows when one reaches its limit
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_failures gauge\nraahi_failures{counter=\"aws\"} %u\n"
+		"raahi_failures{counter=\"aws_other\"} %u\n", aws_failures_counter, other_aws_failures_counter);
+	metrics_printf(req, buf, sizeof(buf), "raahi_failures{counter=\"modem\"} %u\nraahi_failures{counter=\"ota\"} %u\n",
+		modem_failures_counter, fragmented_ota_error_counter);
+
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_mqtt_sent_messages_total counter\nraahi_mqtt_sent_messages_total %u\n"
+		"# TYPE raahi_mqtt_sent_bytes_total counter\nraahi_mqtt_sent_bytes_total %u\n",
+		debug_data.mqtt_tx_msgs, debug_data.mqtt_tx_bytes);
+
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_heap_free_bytes gauge\nraahi_heap_free_bytes %u\n",
+		esp_get_free_heap_size());
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_heap_min_free_bytes gauge\nraahi_heap_min_free_bytes %u\n",
+		esp_get_minimum_free_heap_size());
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_heap_largest_free_block_bytes gauge\nraahi_heap_largest_free_block_bytes %u\n",
+		heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+
+	metrics_get(&task_metrics); // As of the last collection
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_task_stack_free_bytes gauge\n");
+	for (idx = 0; idx < task_metrics.task_count; idx++)
+	{
+		metrics_printf(req, buf, sizeof(buf), "raahi_task_stack_free_bytes{task=\"%s\"} %u\n",
+			task_metrics.tasks[idx].name, task_metrics.tasks[idx].stack_free);
+	}
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_task_cpu_percent gauge\n");
+	for (idx = 0; idx < task_metrics.task_count; idx++)
+	{
+		metrics_printf(req, buf, sizeof(buf), "raahi_task_cpu_percent{task=\"%s\"} %u\n",
+			task_metrics.tasks[idx].name, task_metrics.tasks[idx].cpu_percent);
+	}
+
+	latency_get(&latency);
+	metrics_printf(req, buf, sizeof(buf), "# TYPE raahi_sample_latency_seconds histogram\n");
+	for (idx = 0; idx < LATENCY_STAGES; idx++)
+	{
+		cumulative = 0;
+		for (bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++)
+		{
+			cumulative += latency.count[idx][bucket];
+			metrics_printf(req, buf, sizeof(buf), "raahi_sample_latency_seconds_bucket{stage=\"%s\",le=\"%.3f\"} %u\n",
+				latency_stage_names[idx], (float)(1UL << bucket) / 1000, cumulative);
+		}
+		metrics_printf(req, buf, sizeof(buf), "raahi_sample_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %u\n"
+			"raahi_sample_latency_seconds_sum{stage=\"%s\"} %.3f\nraahi_sample_latency_seconds_count{stage=\"%s\"} %u\n",
+			latency_stage_names[idx], latency.samples, latency_stage_names[idx], (double)latency.sum_ms[idx] / 1000, latency_stage_names[idx], latency.samples);
+	}
+
+	httpd_resp_sendstr_chunk(req, buf);
+	httpd_resp_sendstr_chunk(req, NULL);
+	return(ESP_OK);
+}
+
+static const httpd_uri_t metrics_page = {
+    .uri       = "/metrics",
+    .method    = HTTP_GET,
+    .handler   = metrics_page_get_handler,
+    .user_ctx  = NULL
+};
+
+static const httpd_uri_t live_page = {
+    .uri       = "/live",   // Server-Sent Events, see live.c
+    .method    = HTTP_GET,
+    .handler   = live_get_handler,
+    .user_ctx  = NULL
+};
+
 
 /* -----------------------------------------------------------
 | 	update_sysconfig()
 |	Parses the form string from HTTP client and updates the 
 | 	sysconfig values (runtime values as well as in the 
-| 	sysconfig.txt
+| 	config store)
 ------------------------------------------------------------*/
 void update_sysconfig(char* form_str)
 {
 	char* tmpStr;
 	uint8_t tmpIndex;
 	int32_t  tmpVal;
-	uint8_t client_id_updated = 0;
-	
-	static const char* config_file_name = "/spiffs/sysconfig.txt";
-	FILE* config_file = NULL;
+	struct config_struct shadow;
 	
+	config_store_edit(&shadow);
 	
 	// Parse the received string to obtain sysconfig information
 	tmpStr = strstr(form_str, "first_slave_id=") + strlen("first_slave_id=");
 	if((tmpVal = str2num(tmpStr, '&', 4)) >= 0) {
-		sysconfig.slave_id[0] = (uint8_t)tmpVal;
+		shadow.slave_id[0] = (uint8_t)tmpVal;
 	}
  
 	tmpStr = strstr(form_str, "second_slave_id=") + strlen("second_slave_id=");
 	if((tmpVal = str2num(tmpStr, '&', 4)) >= 0) {
-		sysconfig.slave_id[1] = (uint8_t)tmpVal;
+		shadow.slave_id[1] = (uint8_t)tmpVal;
 	}
 
 	tmpStr = strstr(form_str, "first_reg_address=") + strlen("first_reg_address=");
 	if((tmpVal = str2num(tmpStr, '&', 6)) >= 0) {
-		sysconfig.reg_address[0] = (uint16_t)tmpVal;
+		shadow.reg_address[0] = (uint16_t)tmpVal;
 	}	
 	
 	tmpStr = strstr(form_str, "second_reg_address=") + strlen("second_reg_address=");
 	if((tmpVal = str2num(tmpStr, '&', 6)) >= 0) {
-		sysconfig.reg_address[1] = (uint16_t)tmpVal;
+		shadow.reg_address[1] = (uint16_t)tmpVal;
 	}	
 	
 	tmpStr = strstr(form_str, "third_reg_address=") + strlen("third_reg_address=");
 	if((tmpVal = str2num(tmpStr, '&', 6)) >= 0) {
-		sysconfig.reg_address[2] = (uint16_t)tmpVal;
+		shadow.reg_address[2] = (uint16_t)tmpVal;
 	}	
 
 	tmpStr = strstr(form_str, "sampling_period_in_sec=") + strlen("sampling_period_in_sec=");
 	if((tmpVal = str2num(tmpStr, '&', 4)) >= 0) {
-		sysconfig.sampling_period_in_sec = (uint8_t)tmpVal;
+		shadow.sampling_period_in_sec = (uint16_t)tmpVal;
 	}
  	
 	tmpStr = strstr(form_str, "client_id=") + strlen("client_id=");
 	tmpIndex = 0;
-	while(tmpStr[tmpIndex] != '&') 
+	while(tmpStr[tmpIndex] != '&' && tmpIndex < MAX_CLIENT_ID_LEN) // Stay within the field, the rest of the shadow is published too
 	{
-		sysconfig.client_id[tmpIndex] = tmpStr[tmpIndex];
-		if (tmpIndex > MAX_CLIENT_ID_LEN) {
-			break;
-		}
+		shadow.client_id[tmpIndex] = tmpStr[tmpIndex];
 		tmpIndex++;
 	}
 	if (tmpIndex != 0) { // Update only if user entered a value	
-		sysconfig.client_id[tmpIndex] = '\0';
-		client_id_updated = 1;
+		shadow.client_id[tmpIndex] = '\0';
 	}
 
 	tmpStr = strstr(form_str, "topic=") + strlen("topic=");
 	tmpIndex = 0;
-	while(tmpStr[tmpIndex] != '&') 
+	while(tmpStr[tmpIndex] != '&' && tmpIndex < MAX_TOPIC_LEN)
 	{
-		sysconfig.topic[tmpIndex] = tmpStr[tmpIndex];
-		if (tmpIndex > MAX_TOPIC_LEN) {
-			break;
-		}
+		shadow.topic[tmpIndex] = tmpStr[tmpIndex];
 		tmpIndex++;
 	}
 	if (tmpIndex != 0) { // Update only if user entered a value	
-		sysconfig.topic[tmpIndex] = '\0';
+		shadow.topic[tmpIndex] = '\0';
 	}
 	
 
 	tmpStr = strstr(form_str, "apn=") + strlen("apn=");
 	tmpIndex = 0;
-	while(tmpStr[tmpIndex] != '&') 
+	while(tmpStr[tmpIndex] != '&' && tmpIndex < MAX_APN_LEN)
 	{
-		sysconfig.apn[tmpIndex] = tmpStr[tmpIndex];
-		if (tmpIndex > MAX_APN_LEN) {
-			break;
-		}
+		shadow.apn[tmpIndex] = tmpStr[tmpIndex];
 		tmpIndex++;
 	}
 	if (tmpIndex != 0) { // Update only if user entered a value	
-		sysconfig.apn[tmpIndex] = '\0';
-	}
-
-	// Debug prints
-	display_sysconfig();
-
-	config_file = fopen(config_file_name, "rb");
-	if (config_file == NULL) { // If config file isnt' present 
-		RAAHI_LOGE(TAG, "Config file not present. Can't update sysconfig!");
-		abort();
+		shadow.apn[tmpIndex] = '\0';
 	}
-	
-	fclose(config_file);
-	config_file = fopen(config_file_name, "wb");
 
-	if(fwrite(&sysconfig, sizeof(struct config_struct), 1, config_file) != 1) {
-		RAAHI_LOGE(TAG, "Couldn't update sysconfig file although it is present");
-		abort();
+	// The form is applied as a whole, or not at all. A new client ID is picked up by the MQTT task
+	if(config_store_commit(&shadow) != ESP_OK) {
+		RAAHI_LOGE(TAG, "Sysconfig update rejected, nothing changed");
 	} else {
-		RAAHI_LOGI(TAG, "Successfully updated sysconfig file");
+		RAAHI_LOGI(TAG, "Successfully updated the config store");
 	}
-	fclose(config_file);
 
-	if(client_id_updated == 1) {
-		ESP_LOGI(TAG, "Client ID updated. So restarting");
-        strcpy(zombie_info.esp_restart_reason, "Client ID Updated (http)");
-       	vTaskDelay(5000 / portTICK_RATE_MS);
-		raahi_restart();
-	}
+	// Debug prints
+	display_sysconfig();
 }
 
 /* -----------------------------------------------------------
@@ -412,6 +619,8 @@ httpd_handle_t start_webserver(void)
         httpd_register_uri_handler(server, &homepage);
         httpd_register_uri_handler(server, &infopage);
         httpd_register_uri_handler(server, &sysconfig_get);
+        httpd_register_uri_handler(server, &metrics_page);
+        httpd_register_uri_handler(server, &live_page);
 		httpd_register_uri_handler(server, &favicon_ico);
 		httpd_register_uri_handler(server, &submit);
 			
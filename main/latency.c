@@ -0,0 +1,167 @@
+/**************************************************************
+* latency.c
+*
+* How long samples take from the sensor to MQTT, per stage:
+*   read     sensor read to the data queue (composing the JSON)
+*   queue    waiting in the data queue: the MQTT yield, link and
+*            MQTT recoveries, a dozing modem
+*   publish  the publish call. Data goes out with QoS 0, so this
+*            is up to the packet being handed to the transport,
+*            there is no PUBACK to wait for
+*   total    sensor read to the end of the publish
+* The times come from the esp_timer stamps data_json keeps next
+* to each packet. Each stage has a histogram with power-of-two
+* ms buckets, for the period and since boot. Percentiles of the
+* period are published every CONFIG_METRICS_PERIOD_S as a
+* "latency" message on the query topic
+**************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "raahi.h"
+
+static const char *TAG = "latency";
+const char *latency_stage_names[LATENCY_STAGES] = { "read", "queue", "publish", "total" };
+
+extern char user_mqtt_str[MAX_DEVICE_ID_LEN];
+extern struct data_json_struct data_json;
+
+static portMUX_TYPE latency_mux = portMUX_INITIALIZER_UNLOCKED;
+static latency_hist_t latency_period;
+static latency_hist_t latency_since_boot;
+static int64_t last_report_us = 0;
+
+/* -----------------------------------------------------------
+| latency_bucket
+|   Bucket 0 holds durations under 1 ms, bucket i those from
+|   2^(i-1) up to 2^i ms. The last one is open ended
+------------------------------------------------------------*/
+static uint8_t latency_bucket(uint32_t ms)
+{
+    uint8_t bucket = (ms == 0) ? 0 : 32 - __builtin_clz(ms);
+
+    return (bucket < LATENCY_BUCKETS) ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/* -----------------------------------------------------------
+| latency_percentile
+|   Upper bound of the bucket holding the percentile, capped by
+|   the longest duration seen
+------------------------------------------------------------*/
+static uint32_t latency_percentile(const latency_hist_t *hist, uint8_t stage, uint8_t percent)
+{
+    uint32_t seen = 0;
+    uint8_t bucket;
+
+    for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += hist->count[stage][bucket];
+        if ((uint64_t)seen * 100 >= (uint64_t)hist->samples * percent) {
+            break;
+        }
+    }
+    if (bucket >= LATENCY_BUCKETS - 1) {
+        return hist->max_ms[stage];
+    }
+    return MIN((uint32_t)1 << bucket, hist->max_ms[stage]);
+}
+
+static void latency_add(latency_hist_t *hist, const uint32_t *ms)
+{
+    uint8_t stage;
+
+    hist->samples++;
+    for (stage = 0; stage < LATENCY_STAGES; stage++) {
+        hist->count[stage][latency_bucket(ms[stage])]++;
+        hist->sum_ms[stage] += ms[stage];
+        if (ms[stage] > hist->max_ms[stage]) {
+            hist->max_ms[stage] = ms[stage];
+        }
+    }
+}
+
+/* -----------------------------------------------------------
+| latency_note_sent
+|   Called by the MQTT tasks when the data packet in a slot has
+|   been published, before the slot is freed
+------------------------------------------------------------*/
+void latency_note_sent(uint8_t slot, int64_t publish_start_us)
+{
+    int64_t now_us = esp_timer_get_time();
+    uint32_t ms[LATENCY_STAGES];
+
+    if (data_json.capture_us[slot] == 0) { // Queued without a capture time
+        return;
+    }
+    ms[LATENCY_READ] = (data_json.enqueue_us[slot] - data_json.capture_us[slot]) / 1000;
+    ms[LATENCY_QUEUE] = (publish_start_us - data_json.enqueue_us[slot]) / 1000;
+    ms[LATENCY_PUBLISH] = (now_us - publish_start_us) / 1000;
+    ms[LATENCY_TOTAL] = (now_us - data_json.capture_us[slot]) / 1000;
+
+    portENTER_CRITICAL(&latency_mux);
+    latency_add(&latency_period, ms);
+    latency_add(&latency_since_boot, ms);
+    portEXIT_CRITICAL(&latency_mux);
+}
+
+/* -----------------------------------------------------------
+| latency_report
+|   Called from the data sampling loop. Every
+|   CONFIG_METRICS_PERIOD_S queues the p50, p90, p99 and max of
+|   each stage in ms, over the samples sent in the period
+------------------------------------------------------------*/
+void latency_report(void)
+{
+    static latency_hist_t hist; // Too big for the stack of the caller
+    char json[QUERY_JSON_STR_SIZE];
+    size_t json_len;
+    int64_t now_us = esp_timer_get_time();
+    uint8_t stage;
+
+    if (now_us - last_report_us < CONFIG_METRICS_PERIOD_S * 1000000LL) {
+        return;
+    }
+    last_report_us = now_us;
+
+    portENTER_CRITICAL(&latency_mux);
+    memcpy(&hist, &latency_period, sizeof(hist));
+    memset(&latency_period, 0, sizeof(latency_period));
+    portEXIT_CRITICAL(&latency_mux);
+    if (hist.samples == 0) {
+        return;
+    }
+
+    json_len = snprintf(json, sizeof(json), "{\"deviceId\": \"%s\", \"timestamp\": %lu, \"type\": \"latency\", \"samples\": %u",
+                        user_mqtt_str, time(NULL), hist.samples);
+    for (stage = 0; stage < LATENCY_STAGES && json_len < sizeof(json); stage++) {
+        json_len += snprintf(&json[json_len], sizeof(json) - json_len, ", \"%s\": [%u, %u, %u, %u]", latency_stage_names[stage],
+                             latency_percentile(&hist, stage, 50), latency_percentile(&hist, stage, 90),
+                             latency_percentile(&hist, stage, 99), hist.max_ms[stage]);
+    }
+    if (json_len + sizeof("}") > sizeof(json)) {
+        ESP_LOGE(TAG, "Latency report too long");
+        return;
+    }
+    strcpy(&json[json_len], "}");
+    ESP_LOGI(TAG, "%s", json);
+
+    if (queue_mqtt_query(json) == false) {
+        ESP_LOGW(TAG, "Query queue full, latency not published");
+    }
+}
+
+/* -----------------------------------------------------------
+| latency_get
+|   Copies the histograms since boot
+------------------------------------------------------------*/
+void latency_get(latency_hist_t *hist)
+{
+    portENTER_CRITICAL(&latency_mux);
+    memcpy(hist, &latency_since_boot, sizeof(*hist));
+    portEXIT_CRITICAL(&latency_mux);
+}
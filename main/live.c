@@ -0,0 +1,216 @@
+/**************************************************************
+* live.c
+*
+* /live on the local HTTP server streams each data sample and
+* event as it is queued for MQTT, as Server-Sent Events ("data"
+* and "event"), for a technician on the soft AP. The HTTP
+* server of this IDF has no WebSocket support, SSE only needs a
+* response that doesn't end.
+*
+* The handler answers with the event stream header and leaves
+* the socket to a sender task of its own, so the server goes on
+* serving other requests. Producers only copy the message into
+* the bounded queue of each client, without waiting: when a
+* slow client's queue is full its messages are dropped, and the
+* producer never blocks. The session's free_ctx callback tells
+* the sender task when the server closes the socket, and the
+* task frees the client slot on its way out
+**************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include <esp_http_server.h>
+
+#include "raahi.h"
+
+#define LIVE_MAX_CLIENTS 2
+#define LIVE_QUEUE_LEN 6
+#define LIVE_MSG_SIZE MAX(DATA_JSON_STR_SIZE, EVENT_JSON_STR_SIZE)
+#define LIVE_TYPE_SIZE 8
+#define LIVE_KEEPALIVE_MS 15000         // Comment line, so that proxies and the client see the stream alive
+#define LIVE_TASK_STACK_SIZE 3072
+#define LIVE_TASK_PRIORITY 4
+
+static const char *TAG = "live";
+static const char *live_header = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+                                 "Cache-Control: no-cache\r\nConnection: keep-alive\r\n\r\nretry: 5000\n\n";
+
+typedef struct
+{
+    char type[LIVE_TYPE_SIZE];  // Empty to only wake the sender task up
+    char json[LIVE_MSG_SIZE];
+}live_msg_t;
+
+typedef struct
+{
+    bool in_use;                // Till the sender task has cleaned up
+    volatile bool closed;       // The server has closed the session
+    int fd;
+    httpd_handle_t server;
+    QueueHandle_t queue;
+    SemaphoreHandle_t send_lock; // Keeps the socket from being closed in the middle of a send
+    uint32_t dropped;
+}live_client_t;
+
+static SemaphoreHandle_t live_mutex = NULL;
+static live_client_t live_clients[LIVE_MAX_CLIENTS];
+static volatile uint8_t live_client_count = 0;
+static live_msg_t live_msg;     // Built under live_mutex, too big for the stacks of some producers
+
+/* -----------------------------------------------------------
+| live_publish
+|   Hands a message to every client. Never waits, a full client
+|   queue drops the message
+------------------------------------------------------------*/
+void live_publish(const char *type, const char *json)
+{
+    uint8_t i;
+
+    if (live_client_count == 0 || live_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(live_mutex, portMAX_DELAY);
+    strlcpy(live_msg.type, type, sizeof(live_msg.type));
+    strlcpy(live_msg.json, json, sizeof(live_msg.json));
+    for (i = 0; i < LIVE_MAX_CLIENTS; i++) {
+        if (live_clients[i].in_use == true && live_clients[i].closed == false
+            && xQueueSend(live_clients[i].queue, &live_msg, 0) != pdTRUE) {
+            live_clients[i].dropped++;
+        }
+    }
+    xSemaphoreGive(live_mutex);
+}
+
+/* -----------------------------------------------------------
+| live_session_closed
+|   free_ctx of a /live session, called by the server when it
+|   closes the socket
+------------------------------------------------------------*/
+static void live_session_closed(void *ctx)
+{
+    live_client_t *client = (live_client_t *)ctx;
+    live_msg_t wake = { .type = "" };
+
+    xSemaphoreTake(client->send_lock, portMAX_DELAY);
+    client->closed = true;
+    xSemaphoreGive(client->send_lock);
+    xQueueSend(client->queue, &wake, 0); // If the queue is full the task is awake anyway
+}
+
+/* -----------------------------------------------------------
+| live_client_task
+|   Writes the queued messages of a client to its socket. After
+|   a failed write it asks the server to close the session, and
+|   exits once the server has done so
+------------------------------------------------------------*/
+static void live_client_task(void *param)
+{
+    live_client_t *client = (live_client_t *)param;
+    live_msg_t msg;
+    char out[LIVE_MSG_SIZE + LIVE_TYPE_SIZE + 20];
+    bool failed = false;
+    int len;
+
+    while (client->closed == false) {
+        if (xQueueReceive(client->queue, &msg, LIVE_KEEPALIVE_MS / portTICK_PERIOD_MS) == pdTRUE) {
+            if (msg.type[0] == '\0') {
+                continue;
+            }
+            len = snprintf(out, sizeof(out), "event: %s\ndata: %s\n\n", msg.type, msg.json);
+        } else {
+            len = snprintf(out, sizeof(out), ": %u dropped\n\n", client->dropped);
+        }
+        if (failed == true) {
+            continue;
+        }
+        xSemaphoreTake(client->send_lock, portMAX_DELAY);
+        if (client->closed == false && send(client->fd, out, MIN((size_t)len, sizeof(out) - 1), 0) < 0) {
+            ESP_LOGI(TAG, "Client on socket %d gone", client->fd);
+            failed = true;
+            httpd_sess_trigger_close(client->server, client->fd);
+        }
+        xSemaphoreGive(client->send_lock);
+    }
+
+    xSemaphoreTake(live_mutex, portMAX_DELAY);
+    vQueueDelete(client->queue);
+    vSemaphoreDelete(client->send_lock);
+    client->in_use = false;
+    live_client_count--;
+    xSemaphoreGive(live_mutex);
+    vTaskDelete(NULL);
+}
+
+/* -----------------------------------------------------------
+| live_get_handler
+|   HTTP server side handler for GET requests on /live
+------------------------------------------------------------*/
+esp_err_t live_get_handler(httpd_req_t *req)
+{
+    live_client_t *client = NULL;
+    uint8_t i;
+
+    if (live_mutex == NULL) {
+        live_mutex = xSemaphoreCreateMutex();
+    }
+    xSemaphoreTake(live_mutex, portMAX_DELAY);
+    for (i = 0; i < LIVE_MAX_CLIENTS; i++) {
+        if (live_clients[i].in_use == false) {
+            client = &live_clients[i];
+            break;
+        }
+    }
+    xSemaphoreGive(live_mutex);
+    if (client == NULL) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_sendstr(req, "Too many live clients");
+        return ESP_OK;
+    }
+
+    client->queue = xQueueCreate(LIVE_QUEUE_LEN, sizeof(live_msg_t));
+    client->send_lock = xSemaphoreCreateMutex();
+    if (client->queue == NULL || client->send_lock == NULL) {
+        if (client->queue != NULL) {
+            vQueueDelete(client->queue);
+        }
+        if (client->send_lock != NULL) {
+            vSemaphoreDelete(client->send_lock);
+        }
+        httpd_resp_send_500(req);
+        return ESP_OK;
+    }
+    client->fd = httpd_req_to_sockfd(req);
+    client->server = req->handle;
+    client->closed = false;
+    client->dropped = 0;
+    if (httpd_send(req, live_header, strlen(live_header)) < 0) {
+        vQueueDelete(client->queue);
+        vSemaphoreDelete(client->send_lock);
+        return ESP_FAIL;
+    }
+
+    // Only this task takes free slots, so the slot is still free
+    xSemaphoreTake(live_mutex, portMAX_DELAY);
+    client->in_use = true;
+    live_client_count++;
+    xSemaphoreGive(live_mutex);
+    if (xTaskCreate(&live_client_task, "live_client_task", LIVE_TASK_STACK_SIZE, client, LIVE_TASK_PRIORITY, NULL) != pdPASS) {
+        xSemaphoreTake(live_mutex, portMAX_DELAY);
+        vQueueDelete(client->queue);
+        vSemaphoreDelete(client->send_lock);
+        client->in_use = false;
+        live_client_count--;
+        xSemaphoreGive(live_mutex);
+        return ESP_FAIL; // The server closes the session
+    }
+    req->sess_ctx = client;
+    req->free_ctx = live_session_closed;
+    ESP_LOGI(TAG, "Streaming to socket %d", client->fd);
+    return ESP_OK;
+}
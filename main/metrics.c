@@ -0,0 +1,224 @@
+/**************************************************************
+* metrics.c
+*
+* Collects the resource usage of the firmware every
+* CONFIG_METRICS_PERIOD_S: the share of CPU time each task took
+* since the last collection, the lowest free stack (high-water
+* mark) of each task, and the free, minimum-ever free and
+* largest free block of the heap. The latest collection is
+* shown on the /info page, and a summary of it is published on
+* the query topic as a "metrics" message.
+*
+* Run time comes from the FreeRTOS run time stats, which count
+* esp_timer microseconds and wrap every ~71 minutes. That's why
+* CONFIG_METRICS_PERIOD_S is capped at an hour, and a collection
+* that comes late enough to span a wrap is skipped
+**************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/param.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "raahi.h"
+
+#define METRICS_SPARE_TASKS 4       // Room for tasks created between counting and listing them
+#define METRICS_RUN_TIME_WRAP_US (1LL << 32) // The run time counters are 32-bit microseconds
+
+static const char *TAG = "metrics";
+// Tasks with a row in the published message. aws_iot_task and native_mqtt_task don't run together
+static const char *metrics_published_tasks[] = {
+    "data_sampling_task", "aws_iot_task", "native_mqtt_task", "fragmented_ota_task", "uart_event"
+};
+
+typedef struct
+{
+    TaskHandle_t handle;
+    uint32_t run_time;
+}metrics_run_time_t;
+
+extern char user_mqtt_str[MAX_DEVICE_ID_LEN];
+
+static SemaphoreHandle_t metrics_mutex = NULL;
+static metrics_t metrics;
+static metrics_run_time_t last_run_time[METRICS_MAX_TASKS];
+static uint32_t last_total_run_time = 0;
+static int64_t last_collect_us = 0;
+
+/* -----------------------------------------------------------
+| metrics_last_run_time
+|   Run time counter of a task at the last collection, 0 for a
+|   task that didn't exist then
+------------------------------------------------------------*/
+static uint32_t metrics_last_run_time(TaskHandle_t handle)
+{
+    uint8_t i;
+
+    for (i = 0; i < METRICS_MAX_TASKS; i++) {
+        if (last_run_time[i].handle == handle) {
+            return last_run_time[i].run_time;
+        }
+    }
+    return 0;
+}
+
+/* -----------------------------------------------------------
+| metrics_save_run_times
+|   Keeps the run time counters the next collection works out
+|   the CPU shares from
+------------------------------------------------------------*/
+static void metrics_save_run_times(const TaskStatus_t *task_status, UBaseType_t task_count, uint32_t total_run_time)
+{
+    UBaseType_t i;
+
+    for (i = 0; i < METRICS_MAX_TASKS; i++) {
+        last_run_time[i].handle = (i < task_count) ? task_status[i].xHandle : NULL;
+        last_run_time[i].run_time = (i < task_count) ? task_status[i].ulRunTimeCounter : 0;
+    }
+    last_total_run_time = total_run_time;
+}
+
+/* -----------------------------------------------------------
+| metrics_is_published_task
+|   Whether a task is one of the few that get a row of their own
+|   in the published message. Task names are truncated to
+|   METRICS_TASK_NAME_LEN - 1 characters
+------------------------------------------------------------*/
+static bool metrics_is_published_task(const char *name)
+{
+    uint8_t i;
+
+    for (i = 0; i < sizeof(metrics_published_tasks) / sizeof(metrics_published_tasks[0]); i++) {
+        if (strncmp(name, metrics_published_tasks[i], METRICS_TASK_NAME_LEN - 1) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* -----------------------------------------------------------
+| metrics_publish
+|   Queues the collection on the query topic as one message: the
+|   heap, a row for each of metrics_published_tasks and the CPU
+|   share of all the other tasks but the idle ones. The rows of
+|   every task are on /info and /metrics. Doesn't wait for room
+|   in the queue, the next collection is only a period away
+------------------------------------------------------------*/
+static void metrics_publish(const metrics_t *m)
+{
+    char json[QUERY_JSON_STR_SIZE];
+    size_t json_len;
+    uint32_t other_cpu = 0;
+    bool first = true;
+    uint8_t i;
+
+    for (i = 0; i < m->task_count; i++) {
+        if (metrics_is_published_task(m->tasks[i].name) == false && strncmp(m->tasks[i].name, "IDLE", 4) != 0) {
+            other_cpu += m->tasks[i].cpu_percent;
+        }
+    }
+    json_len = snprintf(json, sizeof(json), "{\"deviceId\": \"%s\", \"timestamp\": %lu, \"type\": \"metrics\", "
+                        "\"heap\": [%u, %u, %u], \"other_cpu\": %u, \"tasks\": [", user_mqtt_str, time(NULL),
+                        m->heap_free, m->heap_min_free, m->heap_largest_block, other_cpu);
+    for (i = 0; i < m->task_count && json_len < sizeof(json); i++) {
+        if (metrics_is_published_task(m->tasks[i].name) == true) {
+            json_len += snprintf(&json[json_len], sizeof(json) - json_len, "%s[\"%s\", %u, %u]", first ? "" : ", ",
+                                 m->tasks[i].name, m->tasks[i].cpu_percent, m->tasks[i].stack_free);
+            first = false;
+        }
+    }
+    if (json_len + sizeof("]}") > sizeof(json)) {
+        ESP_LOGE(TAG, "Metrics message too long");
+        return;
+    }
+    strcpy(&json[json_len], "]}");
+    if (queue_mqtt_query(json) == false) {
+        ESP_LOGW(TAG, "Query queue full, metrics not published");
+    }
+}
+
+/* -----------------------------------------------------------
+| metrics_collect
+|   Called from the data sampling loop. Collects and publishes
+|   once every CONFIG_METRICS_PERIOD_S, does nothing otherwise
+------------------------------------------------------------*/
+void metrics_collect(void)
+{
+    TaskStatus_t *task_status;
+    UBaseType_t task_count, i;
+    uint32_t total_run_time;
+    uint64_t elapsed;
+    int64_t now_us = esp_timer_get_time();
+    bool wrapped;
+
+    if (last_collect_us != 0 && now_us - last_collect_us < CONFIG_METRICS_PERIOD_S * 1000000LL) {
+        return;
+    }
+    // Collections follow the sampling ticks, so the interval can be longer than the period, long enough for a wrap
+    wrapped = (now_us - last_collect_us >= METRICS_RUN_TIME_WRAP_US);
+    last_collect_us = now_us;
+    if (metrics_mutex == NULL) {
+        metrics_mutex = xSemaphoreCreateMutex();
+    }
+
+    task_count = uxTaskGetNumberOfTasks() + METRICS_SPARE_TASKS;
+    task_status = malloc(task_count * sizeof(TaskStatus_t));
+    if (task_status == NULL) {
+        ESP_LOGE(TAG, "No memory for the task list");
+        return;
+    }
+    task_count = uxTaskGetSystemState(task_status, task_count, &total_run_time);
+
+    if (wrapped == true) { // The deltas can't be told, start again from here
+        ESP_LOGW(TAG, "Run time counters wrapped since the last collection, skipping it");
+        metrics_save_run_times(task_status, MIN(task_count, METRICS_MAX_TASKS), total_run_time);
+        free(task_status);
+        return;
+    }
+
+    xSemaphoreTake(metrics_mutex, portMAX_DELAY);
+    // Both cores run tasks, so the whole of the period is twice its length
+    elapsed = (uint64_t)(total_run_time - last_total_run_time) * portNUM_PROCESSORS;
+    metrics.task_count = MIN(task_count, METRICS_MAX_TASKS);
+    for (i = 0; i < metrics.task_count; i++) {
+        strlcpy(metrics.tasks[i].name, task_status[i].pcTaskName, sizeof(metrics.tasks[i].name));
+        metrics.tasks[i].cpu_percent = (elapsed == 0) ? 0 :
+            (uint8_t)(((uint64_t)(task_status[i].ulRunTimeCounter - metrics_last_run_time(task_status[i].xHandle)) * 100) / elapsed);
+        metrics.tasks[i].stack_free = task_status[i].usStackHighWaterMark;
+    }
+    metrics_save_run_times(task_status, metrics.task_count, total_run_time);
+    metrics.heap_free = esp_get_free_heap_size();
+    metrics.heap_min_free = esp_get_minimum_free_heap_size();
+    metrics.heap_largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    metrics.collected_us = now_us;
+    xSemaphoreGive(metrics_mutex);
+    free(task_status);
+
+    if (task_count > METRICS_MAX_TASKS) {
+        ESP_LOGW(TAG, "%u tasks left out of the metrics", task_count - METRICS_MAX_TASKS);
+    }
+    metrics_publish(&metrics);
+}
+
+/* -----------------------------------------------------------
+| metrics_get
+|   Copies the latest collection. collected_us is 0 until the
+|   first one
+------------------------------------------------------------*/
+void metrics_get(metrics_t *m)
+{
+    if (metrics_mutex == NULL) {
+        memset(m, 0, sizeof(*m));
+        return;
+    }
+    xSemaphoreTake(metrics_mutex, portMAX_DELAY);
+    memcpy(m, &metrics, sizeof(*m));
+    xSemaphoreGive(metrics_mutex);
+}
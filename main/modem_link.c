@@ -0,0 +1,399 @@
+/**************************************************************
+* modem_link.c
+*
+* Supervises the PPP link and recovers it in place when it is
+* lost, instead of restarting the ESP. Recovery escalates from a
+* redial to a soft reset and a hard reset of the modem. Only when
+* all of them fail the ESP is restarted. Sampling and the MQTT
+* queues are untouched while this happens
+*
+* With CONFIG_MODEM_DUTY_CYCLE the link is also taken down on
+* purpose between uploads and the modem is put to sleep. Modem
+* awake time is accounted per hour in both modes
+**************************************************************/
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_task_wdt.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "raahi.h"
+
+#define LINK_UP_BIT BIT0
+#define LINK_DOWN_BIT BIT1
+#define LINK_SLEEP_BIT BIT2
+#define LINK_WAKE_BIT BIT3
+#define MODEM_RESET_READY_TIMEOUT_MS 20000
+#define MODEM_LINK_TASK_STACK_SIZE 4096
+#define MODEM_LINK_TASK_PRIORITY 7 // Above the AWS task so that it doesn't starve the recovery
+#define ESP_CORE_0 0
+#define MODEM_AWAKE_ACCOUNT_PERIOD_MS 60000 // How often the awake time is brought up to date
+#define HOUR_IN_US (3600 * 1000000LL)
+
+#ifdef CONFIG_MODEM_DUTY_CYCLE
+#define MODEM_UPLOAD_PERIOD_US (CONFIG_MODEM_UPLOAD_PERIOD * 1000000LL)
+#else
+#define MODEM_UPLOAD_PERIOD_US 0
+#endif
+
+static const char *TAG = "modem_link";
+
+// Recovery steps in the order they are tried
+enum link_recovery_step {
+    LINK_REDIAL = 0,
+    LINK_SOFT_RESET,
+    LINK_HARD_RESET,
+    LINK_RESTART
+};
+static const char *link_recovery_step_str[] = {"redial", "soft reset", "hard reset", "restart"};
+
+// External variables
+extern struct debug_data_struct debug_data;
+extern bool otaTaskCreated;
+extern zombie_info_struct zombie_info;
+
+// Function declarations
+extern void raahi_restart(void);
+extern void sim800_hardreset(void);
+extern void modem_status_poll(void);
+extern esp_err_t modem_ppp_dial(void);
+extern esp_err_t modem_ppp_hangup(void);
+extern esp_err_t modem_soft_reset(void);
+extern esp_err_t modem_wait_ready(uint32_t timeout_ms);
+extern esp_err_t modem_sleep_enter(void);
+extern esp_err_t modem_sleep_exit(void);
+
+static EventGroupHandle_t link_event_group = NULL;
+static TaskHandle_t modemLinkTaskHandle = NULL;
+static const char *link_down_reason = "";
+static int64_t link_down_at_us = 0;
+static volatile uint32_t link_generation = 0;
+static int64_t next_upload_us = 0;
+
+// Modem awake time accounting
+static bool modem_awake = true;
+static int64_t awake_mark_us = 0;       // Awake time is accounted up to here
+static int64_t awake_hour_start_us = 0;
+static int64_t awake_us_this_hour = 0;
+
+/* -----------------------------------------------------------
+| 	modem_awake_account()
+| 	Brings the modem awake time up to date and records whether
+| 	the modem is awake from now on. Every completed hour is
+| 	published in debug_data
+------------------------------------------------------------*/
+static void modem_awake_account(bool awake_from_now)
+{
+    int64_t now_us = esp_timer_get_time();
+    int64_t hour_end_us;
+
+    while ((now_us - awake_hour_start_us) >= HOUR_IN_US)
+    {
+        hour_end_us = awake_hour_start_us + HOUR_IN_US;
+        if (modem_awake) {
+            awake_us_this_hour += hour_end_us - awake_mark_us;
+        }
+        awake_mark_us = hour_end_us;
+        debug_data.modem_awake_s_last_hour = (uint32_t)(awake_us_this_hour / 1000000);
+        RAAHI_LOGI(TAG, "Modem awake %u s in the last hour, %u sleeps since boot", debug_data.modem_awake_s_last_hour,
+                   debug_data.modem_sleeps);
+        awake_us_this_hour = 0;
+        awake_hour_start_us = hour_end_us;
+    }
+    if (modem_awake) {
+        awake_us_this_hour += now_us - awake_mark_us;
+    }
+    awake_mark_us = now_us;
+    modem_awake = awake_from_now;
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_try()
+| 	Runs one recovery step. Returns ESP_OK when the link is
+| 	back up with an IP address
+------------------------------------------------------------*/
+static esp_err_t modem_link_try(enum link_recovery_step step)
+{
+    esp_task_wdt_reset(); // Only matters while the boot task is still subscribed
+    switch (step)
+    {
+        case LINK_REDIAL:
+            if (modem_ppp_hangup() != ESP_OK) {
+                return ESP_FAIL; // The modem doesn't answer, a redial won't help
+            }
+            break;
+
+        case LINK_SOFT_RESET:
+            modem_ppp_hangup();
+            if (modem_soft_reset() != ESP_OK) {
+                return ESP_FAIL;
+            }
+            vTaskDelay(1000 / portTICK_PERIOD_MS); // Don't let the first probe get answered before the reset
+            if (modem_wait_ready(MODEM_RESET_READY_TIMEOUT_MS) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            break;
+
+        case LINK_HARD_RESET:
+            modem_ppp_hangup(); // Puts the DTE back in command mode even when the modem is gone
+            sim800_hardreset();
+            if (modem_wait_ready(MODEM_RESET_READY_TIMEOUT_MS) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            break;
+
+        case LINK_RESTART:
+        default:
+            strcpy(zombie_info.esp_restart_reason, "Link Recovery Failed");
+            raahi_restart();
+            return ESP_FAIL;
+    }
+    esp_task_wdt_reset();
+    modem_status_poll(); // The modem is in command mode now, a good time to refresh the signal info
+    return modem_ppp_dial();
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_recover()
+| 	Brings the link back up, escalating through the recovery
+| 	steps. Blocks until the link is up. Restarts the ESP as the
+| 	last resort, so it doesn't return a failure
+------------------------------------------------------------*/
+esp_err_t modem_link_recover(const char *reason)
+{
+    enum link_recovery_step step;
+    uint32_t recovery_ms;
+
+    if (link_down_at_us == 0) { // Not reported through modem_link_report_down(), e.g. at boot
+        link_down_at_us = esp_timer_get_time();
+        link_down_reason = reason;
+    }
+    RAAHI_LOGW(TAG, "Link down (%s), recovering", reason);
+
+    for (step = LINK_REDIAL; step <= LINK_RESTART; step++)
+    {
+        ESP_LOGI(TAG, "Recovery step: %s", link_recovery_step_str[step]);
+        if (modem_link_try(step) == ESP_OK) {
+            break;
+        }
+    }
+
+    recovery_ms = (uint32_t)((esp_timer_get_time() - link_down_at_us) / 1000);
+    debug_data.link_recoveries++;
+    debug_data.last_link_recovery_ms = recovery_ms;
+    if (recovery_ms > debug_data.max_link_recovery_ms) {
+        debug_data.max_link_recovery_ms = recovery_ms;
+    }
+    RAAHI_LOGI(TAG, "Link recovered by %s in %u ms (%s). Recoveries: %u, max: %u ms", link_recovery_step_str[step],
+               recovery_ms, link_down_reason, debug_data.link_recoveries, debug_data.max_link_recovery_ms);
+    modem_link_set_up();
+    return ESP_OK;
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_doze()
+| 	Puts the modem to sleep till the next upload is due, or till
+| 	somebody asks for an early wake up. Then brings the link up
+| 	again, falling back to the recovery if that doesn't work
+------------------------------------------------------------*/
+static void modem_link_doze(void)
+{
+    int64_t now_us;
+    uint32_t wait_ms;
+    esp_err_t err;
+
+    if (otaTaskCreated == true || ota_is_downloading() == true) { // Started after the sleep was asked for
+        ESP_LOGI(TAG, "Firmware update in progress, modem kept awake");
+        debug_data.connected_to_internet = true; // PPP was never hung up
+        modem_link_set_up();
+        return;
+    }
+    xEventGroupClearBits(link_event_group, LINK_WAKE_BIT);
+    modem_ppp_hangup();
+    if (modem_sleep_enter() == ESP_OK) {
+        modem_awake_account(false);
+        debug_data.modem_sleeps++;
+    } else {
+        RAAHI_LOGW(TAG, "Modem didn't go to sleep, keeping it idle till the next upload");
+    }
+
+    now_us = esp_timer_get_time();
+    next_upload_us += MODEM_UPLOAD_PERIOD_US; // Keep the cadence, however long the last upload took
+    if (next_upload_us <= now_us) {
+        next_upload_us = now_us + MODEM_UPLOAD_PERIOD_US;
+    }
+    ESP_LOGI(TAG, "Modem sleeping for %lld s", (next_upload_us - now_us) / 1000000);
+    while ((now_us = esp_timer_get_time()) < next_upload_us)
+    {
+        wait_ms = (uint32_t)((next_upload_us - now_us) / 1000);
+        if (wait_ms > MODEM_AWAKE_ACCOUNT_PERIOD_MS) {
+            wait_ms = MODEM_AWAKE_ACCOUNT_PERIOD_MS;
+        }
+        if (xEventGroupWaitBits(link_event_group, LINK_WAKE_BIT, pdTRUE, pdTRUE, wait_ms / portTICK_PERIOD_MS)
+            & LINK_WAKE_BIT) {
+            ESP_LOGI(TAG, "Modem woken up ahead of the upload period");
+            next_upload_us = esp_timer_get_time();
+            break;
+        }
+        modem_awake_account(modem_awake);
+    }
+
+    err = modem_sleep_exit();
+    modem_awake_account(true);
+    if (err == ESP_OK && modem_ppp_dial() == ESP_OK) {
+        modem_link_set_up();
+        return;
+    }
+    modem_link_recover("Wake up failed");
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_task()
+| 	Waits for the link to be reported down or put to sleep and
+| 	acts on it. Keeps the awake time accounting going meanwhile
+------------------------------------------------------------*/
+static void modem_link_task(void *param)
+{
+    EventBits_t bits;
+
+    awake_hour_start_us = awake_mark_us = next_upload_us = esp_timer_get_time();
+    while (1)
+    {
+        bits = xEventGroupWaitBits(link_event_group, LINK_DOWN_BIT | LINK_SLEEP_BIT, pdTRUE, pdFALSE,
+                                   MODEM_AWAKE_ACCOUNT_PERIOD_MS / portTICK_PERIOD_MS);
+        modem_awake_account(modem_awake);
+        if (bits & LINK_DOWN_BIT) {
+            modem_link_recover(link_down_reason);
+        } else if (bits & LINK_SLEEP_BIT) {
+            modem_link_doze();
+        }
+    }
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_init()
+| 	Starts the link supervision. The link is considered down
+| 	until modem_link_set_up() is called
+------------------------------------------------------------*/
+void modem_link_init(void)
+{
+    if (link_event_group != NULL) {
+        return;
+    }
+    link_event_group = xEventGroupCreate();
+    xTaskCreatePinnedToCore(&modem_link_task, "modem_link_task", MODEM_LINK_TASK_STACK_SIZE, NULL,
+                            MODEM_LINK_TASK_PRIORITY, &modemLinkTaskHandle, ESP_CORE_0);
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_set_up()
+| 	Marks the link as up. Every transition to up bumps the link
+| 	generation so that users of the link can tell it was redone
+------------------------------------------------------------*/
+void modem_link_set_up(void)
+{
+    boot_trace_mark(BOOT_PHASE_LINK_UP);
+    link_generation++;
+    xEventGroupSetBits(link_event_group, LINK_UP_BIT);
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_report_down()
+| 	Hands the link to the recovery task. Doesn't block, so it
+| 	can be called from the modem event loop. Reports while the
+| 	link is already down or being recovered are ignored
+------------------------------------------------------------*/
+void modem_link_report_down(const char *reason)
+{
+    if (link_event_group == NULL) {
+        return;
+    }
+    // xEventGroupClearBits() returns the bits as they were before clearing, so only one caller wins
+    if ((xEventGroupClearBits(link_event_group, LINK_UP_BIT) & LINK_UP_BIT) == 0) {
+        return;
+    }
+    link_down_reason = reason;
+    link_down_at_us = esp_timer_get_time();
+    debug_data.connected_to_internet = false;
+    xEventGroupSetBits(link_event_group, LINK_DOWN_BIT);
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_sleep()
+| 	Takes the link down on purpose and lets the modem sleep till
+| 	the next upload. Only called when CONFIG_MODEM_DUTY_CYCLE is
+| 	set. Doesn't block, the modem link task does the work.
+| 	Ignored while a firmware update is using the link
+------------------------------------------------------------*/
+void modem_link_sleep(void)
+{
+    if (link_event_group == NULL || otaTaskCreated == true || ota_is_downloading() == true) {
+        return;
+    }
+    if ((xEventGroupClearBits(link_event_group, LINK_UP_BIT) & LINK_UP_BIT) == 0) {
+        return;
+    }
+    debug_data.connected_to_internet = false;
+    xEventGroupSetBits(link_event_group, LINK_SLEEP_BIT);
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_wake()
+| 	Asks for the sleeping modem to be woken up before the upload
+| 	period is over. Ignored while the modem is awake
+------------------------------------------------------------*/
+void modem_link_wake(void)
+{
+    if (link_event_group != NULL) {
+        xEventGroupSetBits(link_event_group, LINK_WAKE_BIT);
+    }
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_is_up()
+------------------------------------------------------------*/
+bool modem_link_is_up(void)
+{
+    return (link_event_group != NULL) && (xEventGroupGetBits(link_event_group) & LINK_UP_BIT);
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_wait_up()
+| 	Waits at most timeout_ms for the link to be up
+------------------------------------------------------------*/
+bool modem_link_wait_up(uint32_t timeout_ms)
+{
+    if (link_event_group == NULL) {
+        vTaskDelay(timeout_ms / portTICK_PERIOD_MS);
+        return false;
+    }
+    return (xEventGroupWaitBits(link_event_group, LINK_UP_BIT, pdFALSE, pdTRUE, timeout_ms / portTICK_PERIOD_MS)
+            & LINK_UP_BIT) != 0;
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_generation()
+| 	Number of times the link came up since boot
+------------------------------------------------------------*/
+uint32_t modem_link_generation(void)
+{
+    return link_generation;
+}
+
+/* -----------------------------------------------------------
+| 	modem_link_note_mqtt_up()
+| 	Called by the MQTT task when it is connected again after a
+| 	recovery. Completes the time-to-recover measurement
+------------------------------------------------------------*/
+void modem_link_note_mqtt_up(void)
+{
+    if (link_down_at_us == 0) {
+        return;
+    }
+    debug_data.last_mqtt_recovery_ms = (uint32_t)((esp_timer_get_time() - link_down_at_us) / 1000);
+    RAAHI_LOGI(TAG, "MQTT back %u ms after the link went down (%s)", debug_data.last_mqtt_recovery_ms, link_down_reason);
+    link_down_at_us = 0;
+}
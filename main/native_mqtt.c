@@ -0,0 +1,305 @@
+/**************************************************************
+* native_mqtt.c
+*
+* MQTT transport through the BG96's own MQTT/TLS stack, selected
+* with CONFIG_MQTT_TRANSPORT_BG96. The modem stays in command
+* mode, so there is no PPP, lwIP socket, mbedTLS session or AWS
+* IoT SDK on the ESP32. It replaces aws_iot_task and gets the
+* time over the modem's NTP client instead of SNTP
+**************************************************************/
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "esp_task_wdt.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_modem.h"
+#include "esp_modem_at.h"
+#include "bg96_mqtt.h"
+
+#include "raahi.h"
+
+#ifdef CONFIG_MQTT_TRANSPORT_BG96
+
+#define NATIVE_MQTT_KEEPALIVE_SEC 30
+#define NATIVE_MQTT_RETRY_DELAY_MS 5000
+#define NATIVE_MQTT_IDLE_WAIT_MS 1000 // How often the queues are checked when there is nothing to receive
+#define NATIVE_MQTT_RECV_QUEUE_SIZE 2
+#define NATIVE_MQTT_CA_FILE "raahi_ca.pem"
+#define NATIVE_MQTT_CERT_FILE "raahi_cert.pem"
+#define NATIVE_MQTT_KEY_FILE "raahi_key.pem"
+#define NTP_SERVER "pool.ntp.org"
+#define NTP_RETRY_COUNT 3
+#define NTP_WAIT_TIME_MS 30000 // The modem gives up on a server after about 20 sec
+#define NTP_DONE_BIT BIT0
+
+static const char *TAG = "native_mqtt";
+
+// Message received on the subscribed topic, handed from the UART event task to the MQTT task
+typedef struct {
+    char payload[QUERY_JSON_STR_SIZE];
+    uint16_t payload_len;
+} native_mqtt_msg_struct;
+
+// External variables
+extern struct debug_data_struct debug_data;
+extern zombie_info_struct zombie_info;
+extern struct data_json_struct data_json;
+extern struct event_json_struct event_json;
+extern struct query_json_struct query_json;
+extern uint8_t aws_failures_counter, other_aws_failures_counter;
+extern uint8_t modem_failures_counter;
+extern time_t last_publish_timestamp;
+extern char HostAddress[255];
+extern uint32_t port;
+extern modem_dce_t *dce_g;
+
+extern const uint8_t aws_root_ca_pem_start[] asm("_binary_aws_root_ca_pem_start");
+extern const uint8_t aws_root_ca_pem_end[] asm("_binary_aws_root_ca_pem_end");
+extern const uint8_t certificate_pem_crt_start[] asm("_binary_certificate_pem_crt_start");
+extern const uint8_t certificate_pem_crt_end[] asm("_binary_certificate_pem_crt_end");
+extern const uint8_t private_pem_key_start[] asm("_binary_private_pem_key_start");
+extern const uint8_t private_pem_key_end[] asm("_binary_private_pem_key_end");
+
+// Function declarations
+void set_status_LED(status_led_struct status_led);
+void raahi_restart(void);
+
+static QueueHandle_t native_mqtt_recv_queue = NULL;
+static EventGroupHandle_t ntp_event_group = NULL;
+static char ntp_time_str[32];
+static int ntp_result = -1;
+
+/* -----------------------------------------------------------
+| 	native_mqtt_ntp_urc()
+| 	+QNTP: <err>,"<yy/MM/dd,hh:mm:ss±zz>"
+------------------------------------------------------------*/
+static void native_mqtt_ntp_urc(const char *line, void *ctx)
+{
+    ntp_time_str[0] = '\0';
+    if (sscanf(line, "+QNTP: %d,\"%31[^\"]\"", &ntp_result, ntp_time_str) < 1) {
+        ntp_result = -1;
+    }
+    xEventGroupSetBits(ntp_event_group, NTP_DONE_BIT);
+}
+
+/* -----------------------------------------------------------
+| 	native_mqtt_obtain_time()
+| 	Sets the system time with the modem's NTP client. Replaces
+| 	SNTP, which needs PPP. Aborts like obtain_time() if the time
+| 	cannot be had
+------------------------------------------------------------*/
+void native_mqtt_obtain_time(void)
+{
+    struct tm utc = { 0 };
+    struct timeval tv = { 0 };
+    int quarters = 0;
+    char sign = '+';
+    int retry;
+
+    if (ntp_event_group == NULL) {
+        ntp_event_group = xEventGroupCreate();
+        esp_modem_at_register_urc("+QNTP:", native_mqtt_ntp_urc, NULL);
+    }
+    for (retry = 0; retry < NTP_RETRY_COUNT; retry++)
+    {
+        xEventGroupClearBits(ntp_event_group, NTP_DONE_BIT);
+        if (esp_modem_at_send("AT+QNTP=1,\"" NTP_SERVER "\",123\r", NULL, MODEM_COMMAND_TIMEOUT_DEFAULT, NULL, 0) == MODEM_AT_RESULT_OK
+            && (xEventGroupWaitBits(ntp_event_group, NTP_DONE_BIT, pdTRUE, pdTRUE, NTP_WAIT_TIME_MS / portTICK_PERIOD_MS) & NTP_DONE_BIT)
+            && ntp_result == 0
+            && sscanf(ntp_time_str, "%d/%d/%d,%d:%d:%d%c%d", &utc.tm_year, &utc.tm_mon, &utc.tm_mday,
+                      &utc.tm_hour, &utc.tm_min, &utc.tm_sec, &sign, &quarters) == 8)
+        {
+            break;
+        }
+        ESP_LOGI(TAG, "Waiting for the modem to get the time... (%d/%d)", retry + 1, NTP_RETRY_COUNT);
+    }
+	if (retry == NTP_RETRY_COUNT) {
+		ESP_LOGI(TAG, "NTP time could not be obtained through the modem");
+		abort();
+	}
+
+    // The modem reports local time with the zone in quarters of an hour. TZ isn't set yet, so mktime() works in UTC
+    utc.tm_year += (utc.tm_year < 100) ? 100 : -1900;
+    utc.tm_mon -= 1;
+    tv.tv_sec = mktime(&utc) - ((sign == '-') ? -quarters : quarters) * 15 * 60;
+    settimeofday(&tv, NULL);
+    RAAHI_LOGI(TAG, "Time set through the modem: %s", ntp_time_str);
+}
+
+/* -----------------------------------------------------------
+| 	native_mqtt_recv()
+| 	Runs in the UART event task. Hands the message over to the
+| 	MQTT task, which can block while acting on it
+------------------------------------------------------------*/
+static void native_mqtt_recv(const char *topic, const char *payload, size_t payload_len, void *ctx)
+{
+    native_mqtt_msg_struct msg;
+
+    if (payload_len >= sizeof(msg.payload)) {
+        ESP_LOGW(TAG, "Message on %s too long (%u)", topic, payload_len);
+        return;
+    }
+    memcpy(msg.payload, payload, payload_len + 1);
+    msg.payload_len = payload_len;
+    if (xQueueSend(native_mqtt_recv_queue, &msg, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Message on %s dropped", topic);
+    }
+}
+
+/* -----------------------------------------------------------
+| 	native_mqtt_connect()
+| 	Connects to the broker and subscribes
+------------------------------------------------------------*/
+static esp_err_t native_mqtt_connect(const char *subscribe_topic)
+{
+    if (bg96_mqtt_connect() != ESP_OK) {
+        return ESP_FAIL;
+    }
+    if (bg96_mqtt_subscribe(subscribe_topic, 0) != ESP_OK) {
+        bg96_mqtt_disconnect();
+        return ESP_FAIL;
+    }
+    RAAHI_LOGI(TAG, "Connected to %s through the BG96. Free heap: %u, min: %u", HostAddress, esp_get_free_heap_size(),
+               esp_get_minimum_free_heap_size());
+    return ESP_OK;
+}
+
+/* -----------------------------------------------------------
+| 	native_mqtt_drain()
+| 	Publishes the queued packets of one queue. Returns false on
+| 	a failed publish, the packet stays queued then. on_sent, if
+| 	given, is told the slot of each packet sent
+------------------------------------------------------------*/
+static bool native_mqtt_drain(const char *topic, char *packets, size_t packet_size, uint8_t queue_size,
+                              uint8_t *read_ptr, uint8_t *write_ptr, void (*on_sent)(uint8_t, int64_t))
+{
+    int64_t publish_start_us;
+    char *packet;
+
+    while (*read_ptr != *write_ptr)
+    {
+        packet = packets + (*read_ptr * packet_size);
+        publish_start_us = esp_timer_get_time();
+        if (bg96_mqtt_publish(topic, packet, 0) != ESP_OK) {
+            return false;
+        }
+        if (on_sent != NULL) {
+            on_sent(*read_ptr, publish_start_us);
+        }
+        note_mqtt_publish(strlen(packet), publish_start_us);
+        *read_ptr = (*read_ptr + 1) % queue_size;
+    }
+    return true;
+}
+
+/* -----------------------------------------------------------
+| 	native_mqtt_task()
+| 	Counterpart of aws_iot_task for the BG96 MQTT stack
+------------------------------------------------------------*/
+void native_mqtt_task(void *param)
+{
+	char data_topic[MAX_TOPIC_LEN + 1] = {'\0'};
+	char event_topic[MAX_TOPIC_LEN + 1] = {'\0'};
+	char query_topic[MAX_TOPIC_LEN + 1] = {'\0'};
+	char subscribe_topic[MAX_TOPIC_LEN + 1] = {'\0'};
+    native_mqtt_msg_struct msg;
+	status_led_struct status_led;
+    time_t now;
+    bool sent;
+    uint32_t connect_attempts = 0;
+    struct config_struct stored_config;
+    char client_id[MAX_CLIENT_ID_LEN + 1]; // The BG96 driver keeps this pointer, so it must not change under it
+    uint32_t client_id_generation = config_store_client_id_generation();
+
+    config_store_read(&stored_config);
+    strcpy(client_id, stored_config.client_id);
+    bg96_mqtt_config_t config = {
+        .host = HostAddress,
+        .port = (uint16_t)port,
+        .client_id = client_id,
+        .keepalive_s = NATIVE_MQTT_KEEPALIVE_SEC,
+        .recv_cb = native_mqtt_recv,
+        .recv_ctx = NULL,
+    };
+
+	compose_mqtt_topics(data_topic, event_topic, query_topic, subscribe_topic);
+    native_mqtt_recv_queue = xQueueCreate(NATIVE_MQTT_RECV_QUEUE_SIZE, sizeof(native_mqtt_msg_struct));
+
+    // The certificates are embedded as text, the trailing nul isn't part of the file
+    if (bg96_mqtt_init(dce_g, &config) != ESP_OK
+        || bg96_mqtt_store_file(NATIVE_MQTT_CA_FILE, (const char *)aws_root_ca_pem_start, aws_root_ca_pem_end - aws_root_ca_pem_start - 1) != ESP_OK
+        || bg96_mqtt_store_file(NATIVE_MQTT_CERT_FILE, (const char *)certificate_pem_crt_start, certificate_pem_crt_end - certificate_pem_crt_start - 1) != ESP_OK
+        || bg96_mqtt_store_file(NATIVE_MQTT_KEY_FILE, (const char *)private_pem_key_start, private_pem_key_end - private_pem_key_start - 1) != ESP_OK
+        || bg96_mqtt_set_tls(NATIVE_MQTT_CA_FILE, NATIVE_MQTT_CERT_FILE, NATIVE_MQTT_KEY_FILE) != ESP_OK)
+    {
+        strcpy(zombie_info.esp_restart_reason, "BG96 MQTT init failed");
+        raahi_restart();
+    }
+
+    while (1)
+    {
+        CHECK_ERROR_CODE(esp_task_wdt_reset(), ESP_OK);
+
+        if (client_id_generation != config_store_client_id_generation()) { // A new client ID was committed
+            client_id_generation = config_store_client_id_generation();
+            config_store_read(&stored_config);
+            if (bg96_mqtt_is_connected() == true) {
+                bg96_mqtt_disconnect();
+            }
+            strcpy(client_id, stored_config.client_id); // Only while disconnected, the next connect picks it up
+            RAAHI_LOGI(TAG, "Reconnecting to AWS as %s", client_id);
+        }
+
+        if (bg96_mqtt_is_connected() == false)
+        {
+			debug_data.connected_to_aws = false;
+            if (native_mqtt_connect(subscribe_topic) != ESP_OK) {
+                aws_failures_counter++;
+                vTaskDelay(NATIVE_MQTT_RETRY_DELAY_MS / portTICK_PERIOD_MS);
+                device_jitter_delay(CONFIG_RECONNECT_JITTER_MS, JITTER_RECONNECT + connect_attempts++);
+                continue;
+            }
+            debug_data.connected_to_aws = true;
+            boot_trace_mark(BOOT_PHASE_MQTT_CONNECTED);
+            status_led.colour = GREEN;
+            set_status_LED(status_led);
+        }
+
+        // Wait for a command from the cloud, or just pace the loop
+        if (xQueueReceive(native_mqtt_recv_queue, &msg, NATIVE_MQTT_IDLE_WAIT_MS / portTICK_PERIOD_MS) == pdTRUE) {
+            ESP_LOGI(TAG, "%s\t%.*s", subscribe_topic, msg.payload_len, msg.payload);
+            handle_subscribed_message(msg.payload, msg.payload_len);
+        }
+
+        sent = native_mqtt_drain(data_topic, (char *)data_json.packet, DATA_JSON_STR_SIZE, DATA_JSON_QUEUE_SIZE,
+                                 &data_json.read_ptr, &data_json.write_ptr, latency_note_sent)
+            && native_mqtt_drain(event_topic, (char *)event_json.packet, EVENT_JSON_STR_SIZE, EVENT_JSON_QUEUE_SIZE,
+                                 &event_json.read_ptr, &event_json.write_ptr, NULL)
+            && native_mqtt_drain(query_topic, (char *)query_json.packet, QUERY_JSON_STR_SIZE, QUERY_JSON_QUEUE_SIZE,
+                                 &query_json.read_ptr, &query_json.write_ptr, NULL);
+        if (sent == true) {
+            aws_failures_counter = 0;
+            other_aws_failures_counter = 0;
+            modem_failures_counter = 0;
+        } else {
+            aws_failures_counter++;
+            RAAHI_LOGE(TAG, "Publish through the BG96 failed");
+        }
+
+        time(&now);
+        if((now - last_publish_timestamp) > MAX_IDLING_TIME)
+        { // If there hasn't bee anything to send for a long time, data sampling task may be in a hung state
+			RAAHI_LOGE(TAG, "MQTT hasn't sent a message in a long time.");
+            strcpy(zombie_info.esp_restart_reason, "MQTT Long Idle (BG96)");
+            esp_restart();
+        }
+    }
+}
+
+#endif // CONFIG_MQTT_TRANSPORT_BG96
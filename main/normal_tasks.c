@@ -27,6 +27,7 @@
 #include "freertos/event_groups.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_vfs_fat.h"
 #include "tcpip_adapter.h"
 
@@ -37,6 +38,7 @@
 #include "aws_iot_version.h"
 #include "aws_iot_mqtt_client_interface.h"
 #include "esp_modem.h"
+#include "esp_modem_at.h"
 #include "sim800.h"
 #include "soc/uart_struct.h"
 #include <esp_http_server.h>
@@ -54,6 +56,25 @@
 #define SNTP_WAIT_TIME_IN_MS 30000
 #define WDT_TIMEOUT_IN_SEC 120 // Must be greater than IP_WAIT_TIME_MS+SNTP_WAIT_TIME_MS
 #define SIM800_RESET_GPIO GPIO_NUM_33
+#ifdef CONFIG_MODEM_DUTY_CYCLE
+#define MODEM_DTR_GPIO CONFIG_EXAMPLE_UART_MODEM_DTR_PIN
+#if MODEM_DTR_GPIO < 0
+#error "CONFIG_MODEM_DUTY_CYCLE needs the modem DTR pin, set CONFIG_EXAMPLE_UART_MODEM_DTR_PIN"
+#elif MODEM_DTR_GPIO == CONFIG_EXAMPLE_UART_MODEM_TX_PIN || MODEM_DTR_GPIO == CONFIG_EXAMPLE_UART_MODEM_RX_PIN \
+    || MODEM_DTR_GPIO == 18 || MODEM_DTR_GPIO == 19 || MODEM_DTR_GPIO == 21 || MODEM_DTR_GPIO == 22 \
+    || MODEM_DTR_GPIO == 23 || MODEM_DTR_GPIO == 25 || MODEM_DTR_GPIO == 26 || MODEM_DTR_GPIO == 27 \
+    || MODEM_DTR_GPIO == 32 || MODEM_DTR_GPIO == 33
+#error "CONFIG_EXAMPLE_UART_MODEM_DTR_PIN is a pin the board already uses (GPS, I2C, Modbus, LEDs or SIM800 reset)"
+#endif
+#endif
+#define MODEM_DTR_WAKE_DELAY_MS 100 // SIM800 takes AT commands 50 ms after DTR goes low
+#define MODEM_STATUS_POLL_TIMEOUT_MS 5000
+#define MODEM_READY_TIMEOUT_MS 20000 // Covers the worst case cold boot of the modem (was a fixed 10 + 2 sec wait)
+#define MODEM_READY_POLL_MS 200
+#define MODEM_OPERATOR_POLL_TIMEOUT_MS 2000 // AT+COPS? can take 75 sec while searching. The cached operator is used instead
+#define MODEM_NVS_NAMESPACE "modem"
+#define PPP_STOP_WAIT_TIME_MS 3000
+#define LINK_WAIT_SLICE_MS 5000 // Must be well below WDT_TIMEOUT_IN_SEC
 
 // Function declarations
 httpd_handle_t start_webserver(void);
@@ -87,6 +108,19 @@ static const char *TAG = "normal_task";
 modem_dte_t *dte_g;
 modem_dce_t *dce_g;
 static gpio_config_t sim800_reset_gpio;
+#ifdef CONFIG_MODEM_DUTY_CYCLE
+static gpio_config_t modem_dtr_gpio;
+#endif
+
+// Module identity which doesn't change between boots. Cached in NVS so that it needn't be queried before PPP
+typedef struct {
+    char name[MODEM_MAX_NAME_LENGTH];
+    char imei[MODEM_IMEI_LENGTH + 1];
+    char imsi[MODEM_IMSI_LENGTH + 1];
+    char oper[MODEM_MAX_OPERATOR_LENGTH];
+} modem_identity_struct;
+static modem_identity_struct modem_identity;
+static bool modem_identity_changed = false;
 
 char user_mqtt_str[MAX_DEVICE_ID_LEN] = {'\0'};
 
@@ -126,6 +160,7 @@ struct config_struct sysconfig;
 struct data_json_struct data_json;
 struct event_json_struct event_json;
 struct query_json_struct query_json;
+static portMUX_TYPE query_json_mux = portMUX_INITIALIZER_UNLOCKED; // Several tasks queue query messages
 struct debug_data_struct debug_data;
 int today, this_hour;
 /**
@@ -200,7 +235,11 @@ static void setup_sntp(void)
     // Is time set? If not, tm_year will be (1970 - 1900).
     //if (timeinfo.tm_year < (2016 - 1900)) {
     //    ESP_LOGI(TAG, "Time is not set yet. Connecting to GPRS and getting time over NTP.");
+#ifdef CONFIG_MQTT_TRANSPORT_BG96
+        native_mqtt_obtain_time(); // No PPP, so no SNTP
+#else
         obtain_time();
+#endif
         // update 'now' variable with current time
         time(&now);
     //}
@@ -214,6 +253,7 @@ static void setup_sntp(void)
     strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
     ESP_LOGI(TAG, "The current date/time in India is: %s", strftime_buf);
     xEventGroupSetBits(esp_event_group, SNTP_CONNECT_BIT);
+    boot_trace_mark(BOOT_PHASE_TIME_SET);
 }
 
 
@@ -228,7 +268,12 @@ void compose_mqtt_event(const char *TAG, char *msg)
         	"timestamp", now, \
 			"tag", TAG, \
 			"event_str", msg); 
+	live_publish("event", cPayload);
 	
+    if ((event_json.write_ptr + 1) % EVENT_JSON_QUEUE_SIZE == event_json.read_ptr) {
+        debug_data.event_json_dropped++; // Still in the event log
+        return;
+    }
 	strcpy(event_json.packet[event_json.write_ptr], cPayload);
 	event_json.write_ptr = (event_json.write_ptr+1) % EVENT_JSON_QUEUE_SIZE;
 } 
@@ -327,10 +372,8 @@ static void modem_event_handler(void *event_handler_arg, esp_event_base_t event_
     case MODEM_EVENT_PPP_DISCONNECT:
         ESP_LOGI(TAG, "Modem Disconnect from PPP Server");
 		debug_data.connected_to_internet = false;
-		// Restart modem
-        vTaskDelay(5000/portTICK_RATE_MS);
-        strcpy(zombie_info.esp_restart_reason, "Modem PPP Diconnect");
-		esp_restart();
+		// Recovered in place by the modem link task. Don't block here, this is the modem's event loop
+		modem_link_report_down("PPP disconnect");
 		break;
     case MODEM_EVENT_PPP_STOP:
         RAAHI_LOGI(TAG, "Modem PPP Stopped");
@@ -366,18 +409,28 @@ void execute_json_command(struct json_struct* parsed_json, uint8_t no_of_items)
 			char sysconfig_json[QUERY_JSON_STR_SIZE];
 
  			create_sysconfig_json(sysconfig_json, QUERY_JSON_STR_SIZE);
-			strcpy(query_json.packet[query_json.write_ptr], sysconfig_json);
-			query_json.write_ptr = (query_json.write_ptr+1) % QUERY_JSON_QUEUE_SIZE;
+			if (queue_mqtt_query(sysconfig_json) == false) {
+				RAAHI_LOGW(TAG, "Query queue full, sysconfig not sent");
+			}
 			
 		}
+        else if(strcmp(parsed_json[1].value, "send_event_log") == 0)
+        {
+            event_log_upload();
+        }
         else if (strcmp(parsed_json[1].value, "update_fw") == 0)
         {
+#ifdef CONFIG_MQTT_TRANSPORT_BG96
+            RAAHI_LOGW(TAG, "Firmware update needs PPP, not available with the BG96 MQTT transport");
+            return;
+#endif
             if (otaTaskCreated == true) // This implies that there is a a firmware update already in progress. Kill it. 
             { 
                 vTaskDelete(otaTaskHandle);
             }
             fragmented_ota_error_counter = 0; 
-	        xTaskCreatePinnedToCore(&ota_by_fragments, "fragmented_ota_task", 8192, NULL, 10, &otaTaskHandle, ESP_CORE_0);	
+	        xTaskCreatePinnedToCore(&ota_by_fragments, "fragmented_ota_task", 8192, NULL, CONFIG_OTA_TASK_PRIORITY, &otaTaskHandle, ESP_CORE_0);	
+            otaTaskCreated = true; // Cleared by the OTA task when it gives up
         }
         else
         {
@@ -386,14 +439,17 @@ void execute_json_command(struct json_struct* parsed_json, uint8_t no_of_items)
     }
 }
 
-void iot_subscribe_callback_handler(AWS_IoT_Client *pClient, char *topicName, uint16_t topicNameLen,
-                                    IoT_Publish_Message_Params *params, void *pData) {
+/* -----------------------------------------------------------
+| 	handle_subscribed_message()
+| 	Acts on a message received on the subscribed topic, 
+| 	whichever MQTT transport it came through
+------------------------------------------------------------*/
+void handle_subscribed_message(char *payload, uint16_t payload_len)
+{
     struct json_struct parsed_json[MAX_SUBSCRIBE_JSON_ITEMS];
     uint8_t no_of_items, item_idx;
 	
-    ESP_LOGI(TAG, "Subscribe callback");
-    ESP_LOGI(TAG, "%.*s\t%.*s", topicNameLen, topicName, (int) params->payloadLen, (char *)params->payload);
-    no_of_items = parseJson(params->payload, params->payloadLen, parsed_json);
+    no_of_items = parseJson(payload, payload_len, parsed_json);
     if (no_of_items > 0) {
         if (strcmp(parsed_json[0].key, "type") == 0 && strcmp(parsed_json[0].value, "config") == 0)
         {
@@ -417,6 +473,13 @@ void iot_subscribe_callback_handler(AWS_IoT_Client *pClient, char *topicName, ui
     } 
 }
 
+void iot_subscribe_callback_handler(AWS_IoT_Client *pClient, char *topicName, uint16_t topicNameLen,
+                                    IoT_Publish_Message_Params *params, void *pData) {
+    ESP_LOGI(TAG, "Subscribe callback");
+    ESP_LOGI(TAG, "%.*s\t%.*s", topicNameLen, topicName, (int) params->payloadLen, (char *)params->payload);
+    handle_subscribed_message(params->payload, params->payloadLen);
+}
+
 void disconnectCallbackHandler(AWS_IoT_Client *pClient, void *data) {
     ESP_LOGW(TAG, "MQTT Disconnect");
     IoT_Error_t rc = FAILURE;
@@ -442,20 +505,14 @@ void disconnectCallbackHandler(AWS_IoT_Client *pClient, void *data) {
 }
 
 
-void aws_iot_task(void *param) {
-
-	time_t now;
-    
+/* -----------------------------------------------------------
+| 	compose_mqtt_topics()
+| 	Topics used by the device. Each buffer must hold 
+| 	MAX_TOPIC_LEN + 1 chars
+------------------------------------------------------------*/
+void compose_mqtt_topics(char *data_topic, char *event_topic, char *query_topic, char *subscribe_topic)
+{
     char topic[MAX_TOPIC_LEN + 1] = {'\0'};
-	char data_topic[MAX_TOPIC_LEN + 1] = {'\0'};
-	char event_topic[MAX_TOPIC_LEN + 1] = {'\0'};
-	char query_topic[MAX_TOPIC_LEN + 1] = {'\0'};
-	char subscribe_topic[MAX_TOPIC_LEN + 1] = {'\0'};
-
-
-	char dPayload[DATA_JSON_STR_SIZE] = {'\0'};
-	char ePayload[EVENT_JSON_STR_SIZE] = {'\0'};
-	char qPayload[QUERY_JSON_STR_SIZE] = {'\0'};
 
 	strcat(topic, "/");
 	strcat(topic, CONFIG_MQTT_TOPIC_ROOT); 
@@ -475,6 +532,77 @@ void aws_iot_task(void *param) {
 	strcpy(subscribe_topic, topic);
 	strcat(subscribe_topic, "/");
 	strcat(subscribe_topic, user_mqtt_str);
+}
+
+/* -----------------------------------------------------------
+| 	queue_mqtt_query()
+| 	Puts a message on the query topic queue. Every producer goes
+| 	through here, so that two of them can't take the same slot.
+| 	Returns false if the queue is full. The MQTT task is the only
+| 	consumer and frees slots without the lock
+------------------------------------------------------------*/
+bool queue_mqtt_query(const char *json)
+{
+    bool queued = false;
+
+    portENTER_CRITICAL(&query_json_mux);
+    if ((query_json.write_ptr + 1) % QUERY_JSON_QUEUE_SIZE != query_json.read_ptr) {
+        strlcpy(query_json.packet[query_json.write_ptr], json, QUERY_JSON_STR_SIZE);
+        query_json.write_ptr = (query_json.write_ptr + 1) % QUERY_JSON_QUEUE_SIZE;
+        queued = true;
+    }
+    portEXIT_CRITICAL(&query_json_mux);
+    return queued;
+}
+
+/* -----------------------------------------------------------
+| 	note_mqtt_publish()
+| 	Accounts a successful publish. The transport stats make the
+| 	AWS SDK and the BG96 MQTT stack comparable. Publishes made
+| 	during a firmware download are also counted on their own
+------------------------------------------------------------*/
+void note_mqtt_publish(size_t payload_len, int64_t publish_start_us)
+{
+    uint32_t publish_ms = (uint32_t)((esp_timer_get_time() - publish_start_us) / 1000);
+
+    debug_data.mqtt_tx_msgs++;
+    debug_data.mqtt_tx_bytes += payload_len;
+    debug_data.mqtt_tx_time_ms += publish_ms;
+    if (publish_ms > debug_data.mqtt_tx_max_ms) {
+        debug_data.mqtt_tx_max_ms = publish_ms;
+    }
+    if (ota_is_downloading() == true) {
+        debug_data.mqtt_tx_msgs_during_ota++;
+        debug_data.mqtt_tx_time_ms_during_ota += publish_ms;
+        ota_yield_to_telemetry(); // Keep the download paused while the ack comes back
+    }
+	time(&last_publish_timestamp); // Update last publish timestamp
+	boot_trace_mark(BOOT_PHASE_FIRST_PUBLISH);
+}
+
+void aws_iot_task(void *param) {
+
+	time_t now;
+    
+    char topic[MAX_TOPIC_LEN + 1] = {'\0'};
+	char data_topic[MAX_TOPIC_LEN + 1] = {'\0'};
+	char event_topic[MAX_TOPIC_LEN + 1] = {'\0'};
+	char query_topic[MAX_TOPIC_LEN + 1] = {'\0'};
+	char subscribe_topic[MAX_TOPIC_LEN + 1] = {'\0'};
+	int64_t publish_start_us;
+	uint32_t connect_attempts = 0;
+	struct config_struct config;
+	char client_id[MAX_CLIENT_ID_LEN + 1];
+	uint32_t client_id_generation = config_store_client_id_generation();
+
+
+	char dPayload[DATA_JSON_STR_SIZE] = {'\0'};
+	char ePayload[EVENT_JSON_STR_SIZE] = {'\0'};
+	char qPayload[QUERY_JSON_STR_SIZE] = {'\0'};
+
+	strcat(topic, "/");
+	strcat(topic, CONFIG_MQTT_TOPIC_ROOT); 
+	compose_mqtt_topics(data_topic, event_topic, query_topic, subscribe_topic);
 	
 	IoT_Publish_Message_Params dataPacket;
 	IoT_Publish_Message_Params eventPacket;
@@ -486,7 +614,9 @@ void aws_iot_task(void *param) {
     IoT_Client_Init_Params mqttInitParams = iotClientInitParamsDefault;
     IoT_Client_Connect_Params connectParams = iotClientConnectParamsDefault;
 
-	if ((strlen(sysconfig.topic) + strlen(topic)) > (MAX_TOPIC_LEN - 2)) { // minus 2 for the two backward slashes
+	config_store_read(&config);
+	strcpy(client_id, config.client_id);
+	if ((strlen(config.topic) + strlen(topic)) > (MAX_TOPIC_LEN - 2)) { // minus 2 for the two backward slashes
 		ESP_LOGE(TAG, "MQTT topic is too long");
 		return;
 	}
@@ -525,8 +655,8 @@ void aws_iot_task(void *param) {
     connectParams.isCleanSession = true;
     connectParams.MQTTVersion = MQTT_3_1_1;
     /* Client ID is set in the menuconfig of the example */
-    connectParams.pClientID = sysconfig.client_id;
-    connectParams.clientIDLen = (uint16_t) strlen(sysconfig.client_id);
+    connectParams.pClientID = client_id; // Our own copy, as the config can change under a live connection
+    connectParams.clientIDLen = (uint16_t) strlen(client_id);
     connectParams.isWillMsgPresent = false;
 
     ESP_LOGI(TAG, "Connecting to AWS...");
@@ -535,10 +665,12 @@ void aws_iot_task(void *param) {
         if(SUCCESS != rc) {
             ESP_LOGE(TAG, "Error(%d) connecting to %s:%d", rc, mqttInitParams.pHostURL, mqttInitParams.port);
             vTaskDelay(1000 / portTICK_RATE_MS);
+            device_jitter_delay(CONFIG_RECONNECT_JITTER_MS, JITTER_RECONNECT + connect_attempts++); // Spread the fleet's retries
         }
     } while(SUCCESS != rc);
 
 	debug_data.connected_to_aws = true;
+	boot_trace_mark(BOOT_PHASE_MQTT_CONNECTED);
     /*
      * Enable Auto Reconnect functionality. Minimum and Maximum time of Exponential backoff are set in aws_iot_config.h
      *  #AWS_IOT_MQTT_MIN_RECONNECT_WAIT_INTERVAL
@@ -561,6 +693,7 @@ void aws_iot_task(void *param) {
 	RAAHI_LOGI(TAG, "RSSI: %u", debug_data.rssi);
 	RAAHI_LOGI(TAG, "BER: %u", debug_data.ber);
 	RAAHI_LOGI(TAG, "Battery Voltage: %u", debug_data.battery_voltage);
+	RAAHI_LOGI(TAG, "Free heap: %u, min: %u", esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
 
     //TODO: We have to send a hello message: sprintf(cPayload, "%s : %d ", "hello from SDK", i);
     dataPacket.qos = QOS0;
@@ -580,20 +713,80 @@ void aws_iot_task(void *param) {
 	status_led_struct status_led;
 	status_led.colour = GREEN;
 	set_status_LED(status_led);
+	uint32_t link_generation = modem_link_generation();
+	bool mqtt_recovery_pending = false;
     while(1) { 
         //Reset watchdog timer for _this_ task 
         CHECK_ERROR_CODE(esp_task_wdt_reset(), ESP_OK);	
 		
+		// While the modem link is being recovered there is nothing to do but wait. The queues keep filling up
+		if (modem_link_is_up() == false) {
+			debug_data.connected_to_aws = false;
+			modem_link_wait_up(LINK_WAIT_SLICE_MS);
+			continue;
+		}
+		if (link_generation != modem_link_generation()) { // Link came back after a recovery
+			link_generation = modem_link_generation();
+			time(&last_publish_timestamp); // Restart the idle clock along with the link
+			mqtt_recovery_pending = true;
+		}
+		if (mqtt_recovery_pending == true && aws_iot_mqtt_is_client_connected(&client) == false) {
+			// Don't wait for the auto reconnect backoff. It doesn't kick in at all after a manual disconnect.
+			// A network outage brings many devices back together, so each waits its own jitter first
+			device_jitter_delay(CONFIG_RECONNECT_JITTER_MS, JITTER_RECONNECT + connect_attempts++);
+			rc = aws_iot_mqtt_attempt_reconnect(&client);
+			ESP_LOGI(TAG, "MQTT reconnect after the link came up: %d", rc);
+			if (rc != SUCCESS && rc != NETWORK_RECONNECTED) {
+				vTaskDelay(1000 / portTICK_RATE_MS);
+			}
+			rc = SUCCESS;
+		}
+		if (client_id_generation != config_store_client_id_generation()) { // A new client ID was committed
+			config_store_read(&config);
+			strcpy(client_id, config.client_id);
+			connectParams.clientIDLen = (uint16_t) strlen(client_id);
+			RAAHI_LOGI(TAG, "Reconnecting to AWS as %s", client_id);
+			if (aws_iot_mqtt_is_client_connected(&client) == true) {
+				aws_iot_mqtt_disconnect(&client);
+			}
+			rc = aws_iot_mqtt_connect(&client, &connectParams);
+			if (rc == SUCCESS) {
+				rc = aws_iot_mqtt_autoreconnect_set_status(&client, true);
+			}
+			if (rc == SUCCESS) {
+				rc = aws_iot_mqtt_subscribe(&client, subscribe_topic, strlen(subscribe_topic), QOS0,
+				                            iot_subscribe_callback_handler, NULL);
+			}
+			if (rc == SUCCESS) {
+				client_id_generation = config_store_client_id_generation();
+			} else { // Try again on the next pass
+				RAAHI_LOGE(TAG, "Reconnect with the new client ID failed: %d", rc);
+				device_jitter_delay(CONFIG_RECONNECT_JITTER_MS, JITTER_RECONNECT + connect_attempts++);
+				rc = SUCCESS;
+			}
+		}
+
         //Max time the yield function will wait for read messages
         yield_rc = aws_iot_mqtt_yield(&client, 15000);
 		if (SUCCESS != yield_rc) {
 			ESP_LOGI(TAG, "MQTT yeild wasn't successful");
 		}
+		if (mqtt_recovery_pending == true && aws_iot_mqtt_is_client_connected(&client) == true) {
+			mqtt_recovery_pending = false;
+			modem_link_note_mqtt_up();
+			status_led.colour = GREEN;
+			set_status_LED(status_led);
+		}
 
 			
+		if (data_json.write_ptr != data_json.read_ptr || event_json.write_ptr != event_json.read_ptr 
+			|| query_json.write_ptr != query_json.read_ptr) {
+			ota_yield_to_telemetry(); // Publishes go ahead of a firmware download on the link
+		}
 		while ((data_json.write_ptr != data_json.read_ptr) && rc == SUCCESS){ // Implies there are unsent mqtt messages
 		    strcpy(dPayload, data_json.packet[data_json.read_ptr]);  
 		    dataPacket.payloadLen = strlen(dPayload);
+        	    publish_start_us = esp_timer_get_time();
         	    rc = aws_iot_mqtt_publish(&client, data_topic, strlen(data_topic), &dataPacket);
         	    if (rc == MQTT_REQUEST_TIMEOUT_ERROR) {
             	        ESP_LOGW(TAG, "publish ack not received.");
@@ -601,8 +794,9 @@ void aws_iot_task(void *param) {
         	    }
 			
 		    if (rc == SUCCESS) { 
+				latency_note_sent(data_json.read_ptr, publish_start_us);
 		        data_json.read_ptr = (data_json.read_ptr+1) % DATA_JSON_QUEUE_SIZE;
-				time(&last_publish_timestamp); // Update last publish timestamp
+				note_mqtt_publish(dataPacket.payloadLen, publish_start_us);
 				ESP_LOGI(TAG, "Sent a data json");
 		    }
 		}
@@ -610,6 +804,7 @@ void aws_iot_task(void *param) {
 		while ((event_json.write_ptr != event_json.read_ptr) && rc == SUCCESS) { // Implies there are unsent mqtt messages
 			strcpy(ePayload, event_json.packet[event_json.read_ptr]);     	
 			eventPacket.payloadLen = strlen(ePayload);
+        	    publish_start_us = esp_timer_get_time();
         	    rc = aws_iot_mqtt_publish(&client, event_topic, strlen(event_topic), &eventPacket);
         	    if (rc == MQTT_REQUEST_TIMEOUT_ERROR) {
             	        ESP_LOGW(TAG, "publish ack not received.");
@@ -618,7 +813,7 @@ void aws_iot_task(void *param) {
 			
 		    if (rc == SUCCESS) { 
 				event_json.read_ptr = (event_json.read_ptr+1) % EVENT_JSON_QUEUE_SIZE;
-				time(&last_publish_timestamp); // Update last publish timestamp
+				note_mqtt_publish(eventPacket.payloadLen, publish_start_us);
 				ESP_LOGI(TAG, "Sent an event json");
         	}
 		}
@@ -626,6 +821,7 @@ void aws_iot_task(void *param) {
 		while ((query_json.write_ptr != query_json.read_ptr) && rc == SUCCESS) { // Implies there are unsent mqtt messages
 			strcpy(qPayload, query_json.packet[query_json.read_ptr]);     	
 			queryPacket.payloadLen = strlen(qPayload);
+        	    publish_start_us = esp_timer_get_time();
         	    rc = aws_iot_mqtt_publish(&client, query_topic, strlen(query_topic), &queryPacket);
         	    if (rc == MQTT_REQUEST_TIMEOUT_ERROR) {
             	        ESP_LOGW(TAG, "publish ack not received.");
@@ -634,7 +830,7 @@ void aws_iot_task(void *param) {
 			
 		    if (rc == SUCCESS) { 
 				query_json.read_ptr = (query_json.read_ptr+1) % QUERY_JSON_QUEUE_SIZE;
-				time(&last_publish_timestamp); // Update last publish timestamp
+				note_mqtt_publish(queryPacket.payloadLen, publish_start_us);
 				ESP_LOGI(TAG, "Sent an query json");
         	}
 		}
@@ -657,7 +853,6 @@ void aws_iot_task(void *param) {
 				modem_failures_counter = 0;
 				debug_data.connected_to_aws = true;
 				debug_data.connected_to_internet = true;
-        		//ESP_LOGI(TAG, "Stack remaining for task '%s' is %d bytes", pcTaskGetTaskName(NULL), uxTaskGetStackHighWaterMark(NULL));
 				break; // End of case SUCCESS: ...
 	
 			case NETWORK_ATTEMPTING_RECONNECT:
@@ -676,6 +871,12 @@ void aws_iot_task(void *param) {
 
 			case TCP_SETUP_ERROR:
 			case TCP_CONNECTION_ERROR:
+				debug_data.connected_to_aws = false;
+    			RAAHI_LOGE(TAG, "Network error in AWS loop. rc = %d", rc);
+				modem_link_report_down("MQTT TCP error"); // Redial first, the modem link task escalates if that's not enough
+				rc = SUCCESS;
+				break;
+
 			case NULL_VALUE_ERROR:
 				debug_data.connected_to_aws = false;
 				debug_data.connected_to_internet = false;
@@ -691,11 +892,175 @@ void aws_iot_task(void *param) {
 
 		} // End of switch statement 
 
+#ifdef CONFIG_MODEM_DUTY_CYCLE
+		// Everything is uploaded. Let the modem sleep till the next upload, unless a firmware update needs the link
+		if (rc == SUCCESS && aws_iot_mqtt_is_client_connected(&client) == true
+			&& otaTaskCreated == false && ota_is_downloading() == false
+			&& data_json.write_ptr == data_json.read_ptr && event_json.write_ptr == event_json.read_ptr
+			&& query_json.write_ptr == query_json.read_ptr) {
+			aws_iot_mqtt_disconnect(&client);
+			debug_data.connected_to_aws = false;
+			modem_link_sleep();
+		}
+#endif
+
     } // End of infinite while loop
 
 }
 
 
+/* -----------------------------------------------------------
+| 	modem_urc_handler()
+| 	Unsolicited result codes which need the attention of the backend
+------------------------------------------------------------*/
+static void modem_urc_handler(const char *line, void *ctx)
+{
+    RAAHI_LOGW(TAG, "Modem URC: %s", line);
+}
+
+/* -----------------------------------------------------------
+| 	modem_csq_done()
+| 	Completion of the queued AT+CSQ status poll
+------------------------------------------------------------*/
+static void modem_csq_done(modem_at_result_t result, const char *response, void *ctx)
+{
+    uint32_t rssi = 0, ber = 0;
+
+    /* +CSQ: <rssi>,<ber> */
+    if (result != MODEM_AT_RESULT_OK || sscanf(response, "+CSQ: %u,%u", &rssi, &ber) != 2) {
+        RAAHI_LOGW(TAG, "Signal quality poll failed (%d)", result);
+        return;
+    }
+    ESP_LOGI(TAG, "rssi: %u, ber: %u", rssi, ber);
+	debug_data.rssi = rssi;
+	debug_data.ber = ber;
+}
+
+/* -----------------------------------------------------------
+| 	modem_cbc_done()
+| 	Completion of the queued AT+CBC status poll
+------------------------------------------------------------*/
+static void modem_cbc_done(modem_at_result_t result, const char *response, void *ctx)
+{
+    uint32_t bcs = 0, bcl = 0, voltage = 0;
+
+    /* +CBC: <bcs>,<bcl>,<voltage> */
+    if (result != MODEM_AT_RESULT_OK || sscanf(response, "+CBC: %u,%u,%u", &bcs, &bcl, &voltage) != 3) {
+        RAAHI_LOGW(TAG, "Battery status poll failed (%d)", result);
+        return;
+    }
+    ESP_LOGI(TAG, "Battery voltage: %d mV", voltage);
+	debug_data.battery_voltage = voltage;
+}
+
+/* -----------------------------------------------------------
+| 	modem_identity_load()
+| 	Reads the cached module identity from NVS. Returns false if
+| 	there is no complete cache (first boot, erased flash)
+------------------------------------------------------------*/
+static bool modem_identity_load(void)
+{
+    nvs_handle handle;
+    size_t len;
+    bool loaded = false;
+
+    if (nvs_open(MODEM_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+    len = sizeof(modem_identity.name);
+    if (nvs_get_str(handle, "name", modem_identity.name, &len) != ESP_OK) goto done;
+    len = sizeof(modem_identity.imei);
+    if (nvs_get_str(handle, "imei", modem_identity.imei, &len) != ESP_OK) goto done;
+    len = sizeof(modem_identity.imsi);
+    if (nvs_get_str(handle, "imsi", modem_identity.imsi, &len) != ESP_OK) goto done;
+    len = sizeof(modem_identity.oper);
+    if (nvs_get_str(handle, "oper", modem_identity.oper, &len) != ESP_OK) {
+        modem_identity.oper[0] = '\0'; // Operator is only a display value, it is refreshed every boot
+    }
+    loaded = (strlen(modem_identity.imei) == MODEM_IMEI_LENGTH);
+done:
+    nvs_close(handle);
+    return loaded;
+}
+
+/* -----------------------------------------------------------
+| 	modem_identity_store()
+| 	Writes the module identity to NVS
+------------------------------------------------------------*/
+static void modem_identity_store(void)
+{
+    nvs_handle handle;
+    esp_err_t err;
+
+    if ((err = nvs_open(MODEM_NVS_NAMESPACE, NVS_READWRITE, &handle)) != ESP_OK) {
+        RAAHI_LOGE(TAG, "Couldn't open modem identity cache (%d)", err);
+        return;
+    }
+    err = nvs_set_str(handle, "name", modem_identity.name);
+    err |= nvs_set_str(handle, "imei", modem_identity.imei);
+    err |= nvs_set_str(handle, "imsi", modem_identity.imsi);
+    err |= nvs_set_str(handle, "oper", modem_identity.oper);
+    err |= nvs_commit(handle);
+    nvs_close(handle);
+    if (err != ESP_OK) {
+        RAAHI_LOGE(TAG, "Couldn't update modem identity cache");
+    }
+}
+
+/* -----------------------------------------------------------
+| 	modem_identity_erase()
+| 	Drops the cache so that the next boot reads everything
+| 	from the module again
+------------------------------------------------------------*/
+static void modem_identity_erase(void)
+{
+    nvs_handle handle;
+
+    if (nvs_open(MODEM_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+        nvs_erase_all(handle);
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+}
+
+/* -----------------------------------------------------------
+| 	modem_refresh_done()
+| 	Completion of the queued AT+CGSN / AT+CIMI checks of the
+| 	cached identity. ctx points to the field to compare with
+------------------------------------------------------------*/
+static void modem_refresh_done(modem_at_result_t result, const char *response, void *ctx)
+{
+    char *field = (char *)ctx;
+
+    if (result != MODEM_AT_RESULT_OK || strlen(response) != MODEM_IMEI_LENGTH) { // IMEI and IMSI are both 15 digits
+        return;
+    }
+    if (strcmp(field, response) != 0) {
+        RAAHI_LOGW(TAG, "Modem identity changed: %s -> %s", field, response);
+        strcpy(field, response);
+        modem_identity_changed = true;
+    }
+}
+
+/* -----------------------------------------------------------
+| 	modem_cops_done()
+| 	Completion of the queued AT+COPS? poll
+------------------------------------------------------------*/
+static void modem_cops_done(modem_at_result_t result, const char *response, void *ctx)
+{
+    char oper[MODEM_MAX_OPERATOR_LENGTH] = {'\0'};
+
+    /* +COPS: <mode>[,<format>[,<oper>]] */
+    if (result != MODEM_AT_RESULT_OK || sscanf(response, "+COPS: %*d,%*d,\"%31[^\"]", oper) != 1) {
+        ESP_LOGW(TAG, "Operator not available yet, using the cached one");
+        return;
+    }
+    if (strcmp(modem_identity.oper, oper) != 0) {
+        strcpy(modem_identity.oper, oper);
+        modem_identity_changed = true;
+    }
+}
+
 void sim800_hardreset()
 {
     ESP_LOGI(TAG, "Hard resetting Sim800");
@@ -704,6 +1069,158 @@ void sim800_hardreset()
     gpio_set_level(SIM800_RESET_GPIO, 1);
 }
 
+/* -----------------------------------------------------------
+| 	modem_status_poll()
+| 	Refreshes signal quality and battery voltage. Only works 
+| 	while the modem is in command mode
+------------------------------------------------------------*/
+void modem_status_poll(void)
+{
+    esp_modem_at_submit("AT+CSQ\r", "+CSQ", MODEM_COMMAND_TIMEOUT_DEFAULT, modem_csq_done, NULL);
+    esp_modem_at_submit("AT+CBC\r", "+CBC", MODEM_COMMAND_TIMEOUT_DEFAULT, modem_cbc_done, NULL);
+    if (esp_modem_at_wait_idle(MODEM_STATUS_POLL_TIMEOUT_MS) != ESP_OK) {
+        RAAHI_LOGW(TAG, "Modem status poll did not complete");
+    }
+}
+
+/* -----------------------------------------------------------
+| 	modem_ppp_dial()
+| 	Switches the modem to PPP and waits for the IP address
+------------------------------------------------------------*/
+esp_err_t modem_ppp_dial(void)
+{
+    EventBits_t ipWaitBits;
+    esp_err_t err;
+
+    xEventGroupClearBits(modem_event_group, CONNECT_BIT | STOP_BIT);
+    if (esp_modem_at_lock(MODEM_STATUS_POLL_TIMEOUT_MS) != ESP_OK) {
+        return ESP_ERR_TIMEOUT;
+    }
+    err = esp_modem_setup_ppp(dte_g);
+    esp_modem_at_unlock();
+    if (err != ESP_OK) {
+		RAAHI_LOGE(TAG, "Modem PPP setup failed");
+        return ESP_FAIL;
+    }
+
+    /* Modem and HTTP server up */
+	status_led_struct status_led;
+	status_led.colour = BLUE;
+	set_status_LED(status_led);
+
+    /* Wait for IP address */
+    ipWaitBits = xEventGroupWaitBits(modem_event_group, CONNECT_BIT, pdTRUE, pdTRUE, IP_WAIT_TIME_MS/portTICK_PERIOD_MS);
+    if(!(ipWaitBits & CONNECT_BIT)) // If it timed out and we didn't get an IP address
+    {
+        RAAHI_LOGW(TAG, "IP not obtained");
+        return ESP_ERR_TIMEOUT;
+    }
+	debug_data.connected_to_internet = true;
+    return ESP_OK;
+}
+
+/* -----------------------------------------------------------
+| 	modem_ppp_hangup()
+| 	Drops the PPP session whether it is alive or already lost
+| 	and brings the modem back to command mode
+------------------------------------------------------------*/
+esp_err_t modem_ppp_hangup(void)
+{
+    esp_err_t err;
+
+	debug_data.connected_to_internet = false;
+    xEventGroupClearBits(modem_event_group, STOP_BIT);
+    if (esp_modem_at_lock(MODEM_COMMAND_TIMEOUT_HANG_UP) != ESP_OK) {
+        return ESP_ERR_TIMEOUT;
+    }
+    err = esp_modem_abort_ppp(dte_g);
+    esp_modem_at_unlock();
+    // lwIP releases the PPP control block asynchronously. It must be gone before the next dial
+    xEventGroupWaitBits(modem_event_group, STOP_BIT, pdTRUE, pdTRUE, PPP_STOP_WAIT_TIME_MS/portTICK_PERIOD_MS);
+    return err;
+}
+
+/* -----------------------------------------------------------
+| 	modem_soft_reset()
+| 	Restarts the modem with an AT command
+------------------------------------------------------------*/
+esp_err_t modem_soft_reset(void)
+{
+    esp_err_t err;
+
+    if (dce_g->reset == NULL) { // Not every DCE driver implements it
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (esp_modem_at_lock(MODEM_COMMAND_TIMEOUT_HANG_UP) != ESP_OK) {
+        return ESP_ERR_TIMEOUT;
+    }
+    err = dce_g->reset(dce_g);
+    esp_modem_at_unlock();
+    return err;
+}
+
+/* -----------------------------------------------------------
+| 	modem_wait_ready()
+| 	Probes the modem with AT until it answers, e.g. after a
+| 	reset. Turns echo off again since the reset restores it
+------------------------------------------------------------*/
+esp_err_t modem_wait_ready(uint32_t timeout_ms)
+{
+    int64_t probe_start_us = esp_timer_get_time();
+    esp_err_t err = ESP_ERR_TIMEOUT;
+
+    if (esp_modem_at_lock(MODEM_STATUS_POLL_TIMEOUT_MS) != ESP_OK) {
+        return ESP_ERR_TIMEOUT;
+    }
+    do
+    {
+        if (dce_g->sync(dce_g) == ESP_OK && dce_g->echo_mode(dce_g, false) == ESP_OK)
+        {
+            err = ESP_OK;
+            break;
+        }
+        vTaskDelay(MODEM_READY_POLL_MS / portTICK_PERIOD_MS);
+    } while ((esp_timer_get_time() - probe_start_us) < (timeout_ms * 1000LL));
+    esp_modem_at_unlock();
+    return err;
+}
+
+/* -----------------------------------------------------------
+| 	modem_sleep_enter()
+| 	Lets the modem sleep once DTR is high. Only works while the
+| 	modem is in command mode
+------------------------------------------------------------*/
+esp_err_t modem_sleep_enter(void)
+{
+#ifdef CONFIG_MODEM_DUTY_CYCLE
+#if CONFIG_EXAMPLE_MODEM_DEVICE_BG96
+    const char *sleep_cmd = "AT+QSCLK=1\r";
+#else
+    const char *sleep_cmd = "AT+CSCLK=1\r";
+#endif
+    if (esp_modem_at_send(sleep_cmd, NULL, MODEM_COMMAND_TIMEOUT_DEFAULT, NULL, 0) != MODEM_AT_RESULT_OK) {
+        return ESP_FAIL;
+    }
+    gpio_set_level(MODEM_DTR_GPIO, 1);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED; // DTR isn't set up
+#endif
+}
+
+/* -----------------------------------------------------------
+| 	modem_sleep_exit()
+| 	Wakes the modem up with DTR and waits till it answers
+------------------------------------------------------------*/
+esp_err_t modem_sleep_exit(void)
+{
+#ifdef CONFIG_MODEM_DUTY_CYCLE
+    gpio_set_level(MODEM_DTR_GPIO, 0);
+    vTaskDelay(MODEM_DTR_WAKE_DELAY_MS / portTICK_PERIOD_MS);
+#endif
+    return modem_wait_ready(MODEM_READY_TIMEOUT_MS);
+}
+
 void mobile_radio_init()
 {
 	dte_g = NULL;
@@ -731,50 +1248,108 @@ void mobile_radio_init()
     sim800_reset_gpio.pull_down_en = 0;
     gpio_config(&sim800_reset_gpio);
 
-    /* Wait for 2 secs for Modem info to populate*/
-     
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
-    uint8_t retries = 0;
-	for (retries = 0; retries < 5; retries++) 
+#ifdef CONFIG_MODEM_DUTY_CYCLE
+    // DTR low keeps the modem awake. It is only raised to let the modem sleep
+    modem_dtr_gpio.intr_type = GPIO_PIN_INTR_DISABLE;
+    modem_dtr_gpio.mode = GPIO_MODE_OUTPUT;
+    modem_dtr_gpio.pin_bit_mask = (1ULL << MODEM_DTR_GPIO);
+    modem_dtr_gpio.pull_up_en = 0;
+    modem_dtr_gpio.pull_down_en = 0;
+    gpio_config(&modem_dtr_gpio);
+    gpio_set_level(MODEM_DTR_GPIO, 0);
+#endif
+
+    /* Probe the modem with AT until it answers, instead of waiting a fixed time for it to boot.
+     * With a cached identity only sync and echo off are needed before PPP */
+    bool identity_cached = modem_identity_load();
+    int64_t probe_start_us = esp_timer_get_time();
+    do
     {
-        if((dce_g = sim800_init(dte_g)) != NULL) 
-	    {
+        dce_g = identity_cached ? sim800_init_minimal(dte_g) : sim800_init(dte_g);
+        if (dce_g != NULL)
+        {
             break;
         }
-    }
-    
-    if (retries == 5)
+        vTaskDelay(MODEM_READY_POLL_MS / portTICK_PERIOD_MS);
+    } while ((esp_timer_get_time() - probe_start_us) < (MODEM_READY_TIMEOUT_MS * 1000LL));
+
+    if (dce_g == NULL)
     {
         ESP_LOGE(TAG, "DCE initialization did not work\n");
         strcpy(zombie_info.esp_restart_reason, "DCE Init Failed");
+        modem_identity_erase();
         sim800_hardreset();
         vTaskDelay(30000 / portTICK_PERIOD_MS);
 		esp_restart();
 	}
+    modem_failures_counter = 0; // Unanswered probes while the modem boots are expected, not failures
+    ESP_LOGI(TAG, "Modem ready after %lld ms (identity %s)", (esp_timer_get_time() - probe_start_us) / 1000,
+             identity_cached ? "cached" : "queried");
+    boot_trace_mark(BOOT_PHASE_MODEM_READY);
+
+    if (identity_cached)
+    {
+        strcpy(dce_g->name, modem_identity.name);
+        strcpy(dce_g->imei, modem_identity.imei);
+        strcpy(dce_g->imsi, modem_identity.imsi);
+        strcpy(dce_g->oper, modem_identity.oper);
+    }
+    else
+    {
+        strcpy(modem_identity.name, dce_g->name);
+        strcpy(modem_identity.imei, dce_g->imei);
+        strcpy(modem_identity.imsi, dce_g->imsi);
+        strcpy(modem_identity.oper, dce_g->oper);
+        modem_identity_changed = true;
+    }
+
+    /* From here on AT commands go through the queued AT engine. Direct DCE method calls must hold its lock */
+    if (esp_modem_at_init(dce_g) != ESP_OK) {
+        strcpy(zombie_info.esp_restart_reason, "AT engine init failed");
+        esp_restart();
+    }
+    esp_modem_at_register_urc("UNDER-VOLTAGE", modem_urc_handler, NULL);
+    esp_modem_at_register_urc("OVER-VOLTAGE", modem_urc_handler, NULL);
+    esp_modem_at_register_urc("+CPIN: NOT READY", modem_urc_handler, NULL);
 
     //dte_g->change_mode(dte_g, MODEM_COMMAND_MODE);
-    ESP_ERROR_CHECK(dce_g->set_flow_ctrl(dce_g, MODEM_FLOW_CONTROL_NONE));
-    ESP_ERROR_CHECK(dce_g->store_profile(dce_g));
+    /* Queue the whole status poll at once; the engine sends each command as soon as the previous one completes */
+    esp_modem_at_submit("AT+IFC=0,0\r", NULL, MODEM_COMMAND_TIMEOUT_DEFAULT, NULL, NULL); // Flow control none
+    esp_modem_at_submit("AT&W\r", NULL, MODEM_COMMAND_TIMEOUT_DEFAULT, NULL, NULL);       // Store profile
+    esp_modem_at_submit("AT+CSQ\r", "+CSQ", MODEM_COMMAND_TIMEOUT_DEFAULT, modem_csq_done, NULL);
+    esp_modem_at_submit("AT+CBC\r", "+CBC", MODEM_COMMAND_TIMEOUT_DEFAULT, modem_cbc_done, NULL);
+#if defined(CONFIG_MODEM_DUTY_CYCLE) && CONFIG_EXAMPLE_MODEM_DEVICE_BG96
+    // eDRX on LTE-M with a 20.48 s cycle, so that the modem also saves power while it is registered. Not every network grants it
+    esp_modem_at_submit("AT+CEDRXS=1,4,\"0010\"\r", NULL, MODEM_COMMAND_TIMEOUT_DEFAULT, NULL, NULL);
+#endif
+    if (identity_cached)
+    {   // Catch a swapped module or SIM. Quick commands, unlike the operator search they replace
+        esp_modem_at_submit("AT+CGSN\r", NULL, MODEM_COMMAND_TIMEOUT_DEFAULT, modem_refresh_done, dce_g->imei);
+        esp_modem_at_submit("AT+CIMI\r", NULL, MODEM_COMMAND_TIMEOUT_DEFAULT, modem_refresh_done, dce_g->imsi);
+        esp_modem_at_submit("AT+COPS?\r", "+COPS", MODEM_OPERATOR_POLL_TIMEOUT_MS, modem_cops_done, NULL);
+    }
+
+    /* The status poll must be off the UART before the modem switches to PPP */
+    if (esp_modem_at_wait_idle(MODEM_STATUS_POLL_TIMEOUT_MS) != ESP_OK) {
+        RAAHI_LOGW(TAG, "Modem status poll did not complete");
+    }
+    boot_trace_mark(BOOT_PHASE_MODEM_STATUS);
+    if (modem_identity_changed)
+    {
+        strcpy(modem_identity.imei, dce_g->imei);
+        strcpy(modem_identity.imsi, dce_g->imsi);
+        strcpy(dce_g->oper, modem_identity.oper);
+        modem_identity_store();
+        modem_identity_changed = false;
+    }
+
     /* Print Module ID, Operator, IMEI, IMSI */
     ESP_LOGI(TAG, "Module: %s", dce_g->name);
     ESP_LOGI(TAG, "Operator: %s", dce_g->oper);
     ESP_LOGI(TAG, "IMEI: %s", dce_g->imei);
     ESP_LOGI(TAG, "IMSI: %s", dce_g->imsi);
-    /* Get signal quality */
-    uint32_t rssi = 0, ber = 0;
-    ESP_ERROR_CHECK(dce_g->get_signal_quality(dce_g, &rssi, &ber));
-    ESP_LOGI(TAG, "rssi: %u, ber: %u", rssi, ber);
-	
 	strcpy(debug_data.imei, dce_g->imei);
 	strcpy(debug_data.oper, dce_g->oper);
-	debug_data.rssi = rssi;
-	debug_data.ber = ber;
-
-    /* Get battery voltage */
-    uint32_t voltage = 0, bcs = 0, bcl = 0;
-    ESP_ERROR_CHECK(dce_g->get_battery_status(dce_g, &bcs, &bcl, &voltage));
-    ESP_LOGI(TAG, "Battery voltage: %d mV", voltage);
-	debug_data.battery_voltage = voltage;	
 
     // Send an SMS at the beginning 
     //char info_json[INFO_JSON_LEN];
@@ -783,35 +1358,26 @@ void mobile_radio_init()
     //ESP_LOGI(TAG, "Send message [%s] ok", info_json);
     //vTaskDelay(10000 / portTICK_PERIOD_MS);
 
-    /* Setup PPP environment */
-    if(esp_modem_setup_ppp(dte_g) == ESP_FAIL) {
-		ESP_LOGE(TAG, "Modem PPP setup failed");
-		abort();
-	}
-
-    /* Modem and HTTP server up */
-	status_led_struct status_led;
-	status_led.colour = BLUE;
-	set_status_LED(status_led);
-	
-    /* Wait for IP address */
-    EventBits_t ipWaitBits;
-    ipWaitBits = xEventGroupWaitBits(modem_event_group, CONNECT_BIT, pdTRUE, pdTRUE, IP_WAIT_TIME_MS/portTICK_PERIOD_MS);
-    if(!(ipWaitBits & CONNECT_BIT)) // If it timed out and we didn't get an IP address
-    {
-        strcpy(zombie_info.esp_restart_reason, "IP not obtained");
-		esp_restart();
+    /* Setup PPP environment and wait for the IP address. If that fails the link is recovered in place */
+    modem_link_init();
+#ifdef CONFIG_MQTT_TRANSPORT_BG96
+    /* The modem stays in command mode and runs MQTT itself */
+    debug_data.connected_to_internet = true;
+    modem_link_set_up();
+#else
+    if (modem_ppp_dial() == ESP_OK) {
+        modem_link_set_up();
+    } else {
+        modem_link_recover("IP not obtained");
     }
+#endif
 
-	debug_data.connected_to_internet = true;
 	/* Start NTP sync */
     setup_sntp();
 }
 
 void normal_tasks()
 {
-	static const char* config_file_name = "/spiffs/sysconfig.txt";
-	FILE* config_file = NULL;
 	FILE* ota_record_file = NULL;
  
     // Init (or Reinit) watchdog timer
@@ -820,6 +1386,10 @@ void normal_tasks()
     //Subscribe this task to TWDT, then check if it is subscribed
     CHECK_ERROR_CODE(esp_task_wdt_add(NULL), ESP_OK); // NULL implies _this_ task
     CHECK_ERROR_CODE(esp_task_wdt_status(NULL), ESP_OK);
+    boot_trace_mark(BOOT_PHASE_SOFTAP); // app_main() brings the soft AP up just before calling here
+
+    // Storage and NVS are up by now. The batch a reset left in RTC memory is still there
+    event_log_init();
 
     read_zombie_info();
 
@@ -836,9 +1406,7 @@ void normal_tasks()
 
 	read_sysconfig();
 
-	ESP_LOGI(TAG, "Waiting 10 sec for the modem to warm up");
-	vTaskDelay(10000 / portTICK_PERIOD_MS);
-    
+    // No fixed warm up delay here. mobile_radio_init() probes the modem until it answers
     modem_event_group = xEventGroupCreate();
     esp_event_group = xEventGroupCreate();
 
@@ -855,26 +1423,31 @@ void normal_tasks()
 	query_json.read_ptr = 0;
 	query_json.write_ptr = 0;
 
+	crash_report_init(); // Queues the summary of a core dump the last boot left, before the tasks start
+
 	xTaskCreatePinnedToCore(&data_sampling_task, "data_sampling_task", 8192, NULL, 9, &dataSamplingTaskHandle, ESP_CORE_1);	
     CHECK_ERROR_CODE(esp_task_wdt_add(dataSamplingTaskHandle), ESP_OK); 
     CHECK_ERROR_CODE(esp_task_wdt_status(dataSamplingTaskHandle), ESP_OK);
 	
 	mobile_radio_init();
 
-	if(strcmp(sysconfig.client_id, dce_g->imei) != 0) // This happens just once after erase_flash
-	{
-		strcpy(sysconfig.client_id, dce_g->imei);
-		
-        display_sysconfig(); // so that we will know in AWS if the changes have indeed taken place
-	    config_file = fopen(config_file_name, "wb");
+	struct config_struct shadow;
 
-	    if(fwrite(&sysconfig, sizeof(struct config_struct), 1, config_file) != 1) {
-	    	RAAHI_LOGE(TAG, "Couldn't update sysconfig file although it is present");
+	config_store_edit(&shadow);
+	if(strcmp(shadow.client_id, dce_g->imei) != 0) // This happens just once after erase_flash
+	{
+		strcpy(shadow.client_id, dce_g->imei);
+	    if(config_store_commit(&shadow) != ESP_OK) {
+	    	RAAHI_LOGE(TAG, "Couldn't update the config store");
 	    	abort();
 	    } else {
-	    	RAAHI_LOGI(TAG, "Successfully updated sysconfig file");
+	    	RAAHI_LOGI(TAG, "Successfully updated the config store");
 	    }
-	    fclose(config_file);
+        display_sysconfig(); // so that we will know in AWS if the changes have indeed taken place
+	}
+	else
+	{
+		config_store_drop();
 	}
     
     EventBits_t sntpWaitBits;
@@ -885,14 +1458,27 @@ void normal_tasks()
 		esp_restart();
     }
 
+#ifdef CONFIG_MQTT_TRANSPORT_BG96
+    // TLS and MQTT run on the modem, so this task needs far less stack than aws_iot_task
+    xTaskCreatePinnedToCore(&native_mqtt_task, "native_mqtt_task", 4096, NULL, 6, &awsTaskHandle, ESP_CORE_0);
+#else
     xTaskCreatePinnedToCore(&aws_iot_task, "aws_iot_task", 9216, NULL, 6, &awsTaskHandle, ESP_CORE_0);
+#endif
     CHECK_ERROR_CODE(esp_task_wdt_add(awsTaskHandle), ESP_OK); 
     CHECK_ERROR_CODE(esp_task_wdt_status(awsTaskHandle), ESP_OK);
     
     // If OTA was in progress before the reset/power cycle, restart OTA
     ota_record_file = fopen(OTA_RECORD_FILE_NAME, "rb");
+#ifdef CONFIG_MQTT_TRANSPORT_BG96
+    if (ota_record_file != NULL) {
+        RAAHI_LOGW(TAG, "Interrupted firmware update not resumed, it needs PPP");
+        fclose(ota_record_file);
+        ota_record_file = NULL;
+    }
+#endif
     if (ota_record_file != NULL) { // There was an OTA in progress before reboot.  
-	    xTaskCreatePinnedToCore(&ota_by_fragments, "fragmented_ota_task", 8192, NULL, 8, &otaTaskHandle, ESP_CORE_0);	
+	    xTaskCreatePinnedToCore(&ota_by_fragments, "fragmented_ota_task", 8192, NULL, CONFIG_OTA_TASK_PRIORITY, &otaTaskHandle, ESP_CORE_0);	
+        otaTaskCreated = true;
         CHECK_ERROR_CODE(esp_task_wdt_add(otaTaskHandle), ESP_OK); 
         CHECK_ERROR_CODE(esp_task_wdt_status(otaTaskHandle), ESP_OK);
     }
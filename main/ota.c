@@ -1,16 +1,20 @@
 
 #include <string.h>
+#include <sys/param.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "esp_task_wdt.h"
 #include "esp_system.h"
 #include "esp_event.h"
 #include "esp_event_loop.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_ota_ops.h"
 #include "esp_http_client.h"
 #include "esp_flash_partitions.h"
 #include "esp_partition.h"
+#include "esp_spi_flash.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "esp_spiffs.h"
@@ -18,45 +22,201 @@
 
 #include "raahi.h"
 #include "esp32/rom/crc.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/pk.h"
 
-#define BUFFSIZE 1024
+#define OTA_BUFFER_SIZE CONFIG_OTA_BUFFER_SIZE
+#define OTA_BUFFER_COUNT CONFIG_OTA_BUFFER_COUNT
+#define OTA_CHECKPOINT_SIZE (CONFIG_OTA_CHECKPOINT_KB * 1024)
+#define OTA_WRITER_STACK_SIZE 3072 // The writer also updates the OTA record on the storage partition
+#define OTA_RATE_LIMIT CONFIG_OTA_RATE_LIMIT_BPS // Bytes/s, 0 for no limit
+#define OTA_BUCKET_DEPTH (2 * OTA_BUFFER_SIZE)  // Largest burst after the download was idle
+#define OTA_TELEMETRY_HOLD_MS CONFIG_OTA_TELEMETRY_HOLD_MS
+#define ESP_CORE_0 0
 #define HASH_LEN 32 /* SHA-256 digest length */
-#define MAX_CRC32_HTTP_TRIES 5
-#define MAX_OTA_FRAGMENTS 20
-#define MAX_URL_LEN 100
+#define MAX_URL_LEN 128
 #define MAX_HTTP_TRIES 5
+#define HTTP_STATUS_OK 200
+#define HTTP_STATUS_PARTIAL_CONTENT 206
+#define HTTP_STATUS_NOT_MODIFIED 304
+#define MAX_VALIDATOR_LEN 64
+
+// The OTA header comes as a signed text manifest (tools/ota_manifest.py), one "<key> <values>" per line:
+//   raahi-ota-manifest 2
+//   fw_ver <version>
+//   image <size> <sha256> <url>
+//   patch <base fw_ver> <base size> <base crc32> <size> <url>     optional
+//   lz <window bits> <lookahead bits> <size> <url>                 optional
+//   fragment <offset> <size> <sha256>                              any number, in order, covering the image
+//   sig <ECDSA P-256 signature, DER, of the SHA-256 of all the lines before>
+#define OTA_MANIFEST_MAGIC "raahi-ota-manifest 2"
+#define OTA_MANIFEST_MAX_LINE 256
+#define OTA_MANIFEST_MAX_SIG_LEN 80
+#define OTA_MAX_FRAGMENTS CONFIG_OTA_MAX_FRAGMENTS
+
+// What is downloaded: the image itself, a patch against the running firmware (tools/ota_delta.py) or 
+// the image compressed (tools/ota_compress.py)
+#define OTA_FORMAT_FULL 0
+#define OTA_FORMAT_DELTA 1
+#define OTA_FORMAT_LZ 2
+
+// Patch ops. All numbers are little endian u32
+#define OTA_PATCH_OP_COPY 0x01      // <src offset in the running partition> <len>
+#define OTA_PATCH_OP_INSERT 0x02    // <len> followed by len bytes
+#define OTA_PATCH_COPY_HDR_LEN 9
+#define OTA_PATCH_INSERT_HDR_LEN 5
+
+// Compressed images are a heatshrink (LZSS) bit stream, MSB first: 1 <8 bit literal> or 
+// 0 <window_bits: offset - 1> <lookahead_bits: count - 1>. These are the fields being read
+#define OTA_LZ_TAG 0
+#define OTA_LZ_LITERAL 1
+#define OTA_LZ_INDEX 2
+#define OTA_LZ_COUNT 3
+#define OTA_LZ_WINDOW_SIZE (1 << CONFIG_OTA_LZ_MAX_WINDOW_BITS)
 
 static const char *TAG = "fragmented_ota";
-/*an ota data write buffer ready to write to the flash*/
-static char ota_write_data[BUFFSIZE + 1] = { 0 };
+/* Download buffers. While the OTA task fills one from the network, the writer task flashes and CRCs another */
+static char ota_buffers[OTA_BUFFER_COUNT][OTA_BUFFER_SIZE];
+static char ota_input[OTA_BUFFER_SIZE]; // What was downloaded, before it is decoded into the image
+static uint8_t ota_lz_window[OTA_LZ_WINDOW_SIZE]; // Last bytes of the image, which back references point into
+static uint32_t ota_lz_head;                    // Bytes of the image decompressed
+
+/* One HTTPS connection is kept for the header and the image. These are filled in from the responses by the event handler */
+static char ota_response_etag[MAX_VALIDATOR_LEN];
+static char ota_response_last_modified[MAX_VALIDATOR_LEN];
+static char ota_header_etag[MAX_VALIDATOR_LEN];          // Of the header last downloaded, for conditional requests
+static char ota_header_last_modified[MAX_VALIDATOR_LEN];
+static bool ota_server_closes;                          // The server closes the connection after this response
+static uint16_t ota_tls_handshakes;
 extern const uint8_t server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
 extern const uint8_t server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
+extern const uint8_t manifest_key_pem_start[] asm("_binary_ota_manifest_pub_pem_start");
+extern const uint8_t manifest_key_pem_end[] asm("_binary_ota_manifest_pub_pem_end");
 
 typedef struct
 {
     char fw_ver[32];
-    uint16_t no_of_fragments;
-    uint16_t max_fragment_size;
-    char fragments_root_url[MAX_URL_LEN];
-    char crc32_url[MAX_URL_LEN];
+    uint32_t image_size;
+    uint8_t image_sha256[HASH_LEN];
+    char image_url[MAX_URL_LEN];
+    char base_fw_ver[32];       // Firmware the patch applies to
+    uint32_t base_size;         // Bytes of the running partition the patch copies from
+    uint32_t base_crc32;        // CRC32 of those bytes
+    uint32_t patch_size;
+    char patch_url[MAX_URL_LEN]; // Empty if there is no patch
+    uint32_t lz_size;
+    uint8_t lz_window_bits;
+    uint8_t lz_lookahead_bits;
+    char lz_url[MAX_URL_LEN];   // Empty if there is no compressed image
 }ota_header_t;
 
+// Part of the image with its own hash in the manifest, so corruption shows before the whole image is in
+typedef struct
+{
+    uint32_t offset;
+    uint32_t size;
+    uint8_t sha256[HASH_LEN];
+}ota_fragment_t;
+
+// What is carried from one line of the manifest to the next
+typedef struct
+{
+    mbedtls_sha256_context sha256;  // Of the lines before the signature
+    uint16_t lines;
+    uint8_t signature[OTA_MANIFEST_MAX_SIG_LEN];
+    size_t signature_len;           // 0 until the signature line is read
+}ota_manifest_parser_t;
+
+// How far decoding of the download got. Saved together with wrote_size, so that both match
+typedef struct
+{
+    uint32_t stream_offset;     // Bytes of the download used up
+    uint8_t op_hdr[OTA_PATCH_COPY_HDR_LEN]; // Patch op header received so far
+    uint8_t op_hdr_len;
+    uint8_t op;                 // Patch op being carried out, or OTA_LZ_xxx field being read
+    uint32_t op_src;            // COPY: next byte of the running partition. LZ: back reference offset
+    uint32_t op_remaining;      // Bytes the op or back reference is still to produce
+    uint8_t lz_window_bits;     // Parameters of the compressed image
+    uint8_t lz_lookahead_bits;
+    uint8_t bit_byte;           // LZ: input byte being read bit by bit
+    uint8_t bit_mask;           // Next bit of it, 0 when used up
+    uint8_t field_bits;         // Bits of the field read so far
+    uint16_t field_acc;
+}ota_stream_state_t;
+
 typedef struct
 {
     char fw_ver_being_updated[32];
-    uint16_t fragments_completed;
     const esp_partition_t *part;
-    uint32_t wrote_size;
+    uint32_t image_size;
+    uint32_t wrote_size; // Bytes of the image in the partition
+    uint8_t format;      // OTA_FORMAT_xxx being downloaded
+    ota_stream_state_t stream;
+    mbedtls_sha256_context sha256;          // SHA-256 of the bytes written
+    mbedtls_sha256_context fragment_sha256; // and of those in the fragment being written
 }ota_record_t;
 
+typedef enum
+{
+    OTA_CHUNK_DATA,         // Write data at offset
+    OTA_CHUNK_CHECKPOINT,   // Save the record, with stream as the state after the data queued before
+    OTA_CHUNK_SYNC,         // Same as checkpoint, and report back
+    OTA_CHUNK_QUIT,         // Writer quits
+}ota_chunk_type_t;
+
+// One unit of work for the writer task
+typedef struct
+{
+    ota_chunk_type_t type;
+    char *data;
+    int len;
+    uint32_t offset;
+    ota_stream_state_t stream;
+}ota_chunk_t;
+
+// What the writer task reports when asked for progress
+typedef struct
+{
+    esp_err_t err;
+    uint32_t flash_time_ms;
+    uint32_t longest_op_ms; // Longest erase or write. Other tasks can't run from flash meanwhile
+}ota_write_result_t;
+
+static QueueHandle_t ota_free_queue = NULL;     // Buffers ready to be filled
+static QueueHandle_t ota_filled_queue = NULL;   // Chunks waiting to be written
+static QueueHandle_t ota_result_queue = NULL;
+static volatile TaskHandle_t ota_writer_task_handle = NULL;
+static ota_record_t *ota_writer_record;         // Owned by the writer task while it runs
+static uint32_t ota_erased_size;                // Sectors of the partition erased for the image so far, in bytes
+static mbedtls_sha256_context ota_sha256;       // Live hashes. The record has copies as of the last checkpoint
+static mbedtls_sha256_context ota_fragment_sha256;
+static uint16_t ota_fragment_index;             // Fragment being written
+static ota_fragment_t ota_fragments[OTA_MAX_FRAGMENTS]; // From the manifest
+static uint16_t ota_fragment_count;
+
+/* Shapes the image download, so that it leaves room on the PPP link for telemetry */
+typedef struct
+{
+    int32_t tokens;             // Bytes that may be read now. Negative after a read larger than what was there
+    int64_t refill_us;          // When tokens were last added
+    uint32_t shaped_ms;         // Time reads waited on the rate limit
+    uint32_t yielded_ms;        // Time reads waited for telemetry
+    uint32_t read_max_ms;       // Longest single read from the network
+}ota_shaper_t;
+static ota_shaper_t ota_shaper;
+static volatile TickType_t ota_hold_until; // Telemetry is being published until then. Set by the MQTT task
+static volatile bool ota_downloading;
+
 extern uint8_t fragmented_ota_error_counter;
+extern bool otaTaskCreated;
+extern struct debug_data_struct debug_data;
 
-static esp_err_t prepare_for_ota(int data_read, ota_record_t* ota_record);
+static void ota_pipeline_stop(void);
+static esp_err_t prepare_for_ota(const char* data, int data_read, ota_record_t* ota_record);
 static void read_flash_ota_record(ota_record_t* ota_record);
 static void update_flash_ota_record(ota_record_t* ota_record);
-static void get_ota_header(esp_http_client_config_t url_config, ota_header_t* ota_header, uint16_t storage_size); 
-static void get_ota_crc32(esp_http_client_config_t url_config, uint32_t* ota_crc32, uint16_t storage_size); 
-static esp_err_t transfer_url_contents_to_local(esp_http_client_config_t url_config, char* local_var, uint16_t storage_size); 
+static bool get_ota_header(esp_http_client_handle_t client, ota_header_t* ota_header); 
+static esp_err_t ota_fetch_manifest(esp_http_client_handle_t client, const char* url, ota_header_t* ota_header, bool* modified);
 
 static void http_cleanup(esp_http_client_handle_t client)
 {
@@ -64,9 +224,63 @@ static void http_cleanup(esp_http_client_handle_t client)
     esp_http_client_cleanup(client);
 }
 
+/* -----------------------------------------------------------
+| ota_http_event_handler
+|   Counts the TLS handshakes and picks the validators and the
+|   Connection header out of the responses
+------------------------------------------------------------*/
+static esp_err_t ota_http_event_handler(esp_http_client_event_t *evt)
+{
+    switch (evt->event_id) {
+        case HTTP_EVENT_ON_CONNECTED:
+            ota_tls_handshakes++;
+            break;
+        case HTTP_EVENT_ON_HEADER:
+            if (strcasecmp(evt->header_key, "ETag") == 0) {
+                strlcpy(ota_response_etag, evt->header_value, sizeof(ota_response_etag));
+            } else if (strcasecmp(evt->header_key, "Last-Modified") == 0) {
+                strlcpy(ota_response_last_modified, evt->header_value, sizeof(ota_response_last_modified));
+            } else if (strcasecmp(evt->header_key, "Connection") == 0) {
+                ota_server_closes = (strcasecmp(evt->header_value, "close") == 0);
+            }
+            break;
+        default:
+            break;
+    }
+    return ESP_OK;
+}
+
+/* -----------------------------------------------------------
+| ota_start_request
+|   Points the client at url. The connection stays up if the 
+|   host is the same as before
+------------------------------------------------------------*/
+static void ota_start_request(esp_http_client_handle_t client, const char *url)
+{
+    ota_response_etag[0] = '\0';
+    ota_response_last_modified[0] = '\0';
+    ota_server_closes = false;
+    esp_http_client_set_url(client, url);
+}
+
+/* -----------------------------------------------------------
+| ota_end_request
+|   Done with a response. Keeps the connection for the next
+|   request unless the server is closing it
+------------------------------------------------------------*/
+static void ota_end_request(esp_http_client_handle_t client)
+{
+    if (ota_server_closes) {
+        esp_http_client_close(client);
+    }
+}
+
 static void __attribute__((noreturn)) task_fatal_error()
 {
     ESP_LOGE(TAG, "Exiting task due to fatal error...");
+    ota_pipeline_stop();
+    ota_downloading = false;
+    otaTaskCreated = false; // The modem may sleep again
     (void)vTaskDelete(NULL);
 
     while (1) {
@@ -74,27 +288,583 @@ static void __attribute__((noreturn)) task_fatal_error()
     }
 }
 
+/* -----------------------------------------------------------
+| ota_account_flash_op
+|   Adds a flash operation that started at start_us to the
+|   writer's statistics
+------------------------------------------------------------*/
+static void ota_account_flash_op(ota_write_result_t *result, int64_t start_us)
+{
+    uint32_t op_ms = (esp_timer_get_time() - start_us) / 1000;
+
+    result->flash_time_ms += op_ms;
+    result->longest_op_ms = MAX(result->longest_op_ms, op_ms);
+}
+
+/* -----------------------------------------------------------
+| ota_hash_chunk
+|   Adds bytes written at offset to the SHA-256 of the image
+|   and of the fragment they belong to. Each fragment is checked
+|   against the manifest as soon as it is complete
+------------------------------------------------------------*/
+static esp_err_t ota_hash_chunk(const uint8_t *data, uint32_t offset, uint32_t len)
+{
+    const ota_fragment_t *fragment;
+    uint8_t digest[HASH_LEN];
+    uint32_t n;
+
+    mbedtls_sha256_update_ret(&ota_sha256, data, len);
+    while (len > 0 && ota_fragment_index < ota_fragment_count) {
+        fragment = &ota_fragments[ota_fragment_index];
+        n = MIN(len, fragment->offset + fragment->size - offset);
+        mbedtls_sha256_update_ret(&ota_fragment_sha256, data, n);
+        data += n;
+        offset += n;
+        len -= n;
+        if (offset == fragment->offset + fragment->size) {
+            mbedtls_sha256_finish_ret(&ota_fragment_sha256, digest);
+            if (memcmp(digest, fragment->sha256, HASH_LEN) != 0) {
+                ESP_LOGE(TAG, "Fragment %u (%u bytes at %u) doesn't match the manifest", ota_fragment_index, fragment->size, fragment->offset);
+                return ESP_ERR_INVALID_CRC;
+            }
+            mbedtls_sha256_starts_ret(&ota_fragment_sha256, 0);
+            ota_fragment_index++;
+        }
+    }
+    return ESP_OK;
+}
+
+/* -----------------------------------------------------------
+| ota_writer_task
+|   Flashes the chunks queued by the OTA task, keeps the
+|   SHA-256 of the image so far and hands the buffers back.
+|   Sectors are erased one at a time just before the first
+|   write into them. Saves the progress to the OTA record when
+|   the OTA task asks for it
+------------------------------------------------------------*/
+static void ota_writer_task(void *pvParameter)
+{
+    ota_chunk_t chunk;
+    ota_write_result_t result = { ESP_OK, 0, 0 };
+    int64_t op_start_us;
+
+    while (1)
+    {
+        xQueueReceive(ota_filled_queue, &chunk, portMAX_DELAY);
+        if (chunk.type == OTA_CHUNK_QUIT) {
+            break;
+        }
+        if (chunk.type == OTA_CHUNK_DATA) {
+            while (result.err == ESP_OK && ota_erased_size < chunk.offset + chunk.len) {
+                op_start_us = esp_timer_get_time();
+                result.err = esp_partition_erase_range(ota_writer_record->part, ota_erased_size, SPI_FLASH_SEC_SIZE);
+                ota_account_flash_op(&result, op_start_us);
+                ota_erased_size += SPI_FLASH_SEC_SIZE;
+            }
+            if (result.err == ESP_OK) { // After a failed erase or write, the rest is only drained
+                op_start_us = esp_timer_get_time();
+                result.err = esp_partition_write(ota_writer_record->part, chunk.offset, (const uint8_t*)chunk.data, chunk.len);
+                if (result.err == ESP_OK) {
+                    ota_writer_record->wrote_size += chunk.len;
+                    result.err = ota_hash_chunk((const uint8_t*)chunk.data, chunk.offset, chunk.len);
+                }
+                ota_account_flash_op(&result, op_start_us);
+            }
+            xQueueSend(ota_free_queue, &chunk.data, portMAX_DELAY);
+            continue;
+        }
+        if (result.err == ESP_OK) { // Checkpoint or sync
+            ota_writer_record->stream = chunk.stream;
+            mbedtls_sha256_clone(&ota_writer_record->sha256, &ota_sha256);
+            mbedtls_sha256_clone(&ota_writer_record->fragment_sha256, &ota_fragment_sha256);
+            update_flash_ota_record(ota_writer_record);
+        }
+        if (chunk.type == OTA_CHUNK_SYNC) {
+            xQueueSend(ota_result_queue, &result, portMAX_DELAY);
+            result = (ota_write_result_t) { ESP_OK, 0, 0 };
+        }
+    }
+    ota_writer_task_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+/* -----------------------------------------------------------
+| ota_pipeline_stop
+|   Makes the writer task quit once it's done with the chunk it
+|   is on. Never deleted from outside, so it can't be killed in
+|   the middle of a flash operation
+------------------------------------------------------------*/
+static void ota_pipeline_stop(void)
+{
+    ota_chunk_t quit = { .type = OTA_CHUNK_QUIT };
+
+    if (ota_writer_task_handle == NULL) {
+        return;
+    }
+    xQueueReset(ota_filled_queue);
+    xQueueSend(ota_filled_queue, &quit, portMAX_DELAY);
+    while (ota_writer_task_handle != NULL) {
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+}
+
+/* -----------------------------------------------------------
+| ota_pipeline_start
+|   Starts the writer task with all buffers free. A writer left
+|   behind by an OTA task that was killed is stopped first
+------------------------------------------------------------*/
+static void ota_pipeline_start(ota_record_t *ota_record)
+{
+    uint8_t i;
+    char *buffer;
+
+    if (ota_free_queue == NULL) {
+        ota_free_queue = xQueueCreate(OTA_BUFFER_COUNT, sizeof(char *));
+        ota_filled_queue = xQueueCreate(OTA_BUFFER_COUNT + 2, sizeof(ota_chunk_t)); // + 2 for a checkpoint and the sync
+        ota_result_queue = xQueueCreate(1, sizeof(ota_write_result_t));
+        assert(ota_free_queue != NULL && ota_filled_queue != NULL && ota_result_queue != NULL);
+    }
+    ota_pipeline_stop();
+    xQueueReset(ota_free_queue);
+    xQueueReset(ota_filled_queue);
+    xQueueReset(ota_result_queue);
+    for (i = 0; i < OTA_BUFFER_COUNT; i++) {
+        buffer = ota_buffers[i];
+        xQueueSend(ota_free_queue, &buffer, 0);
+    }
+    ota_writer_record = ota_record;
+    // Whatever was written before a resume was erased first. Written bytes past wrote_size, if any, get the same data again
+    ota_erased_size = (ota_record->wrote_size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+    mbedtls_sha256_free(&ota_sha256);
+    mbedtls_sha256_init(&ota_sha256);
+    mbedtls_sha256_clone(&ota_sha256, &ota_record->sha256);
+    mbedtls_sha256_free(&ota_fragment_sha256);
+    mbedtls_sha256_init(&ota_fragment_sha256);
+    mbedtls_sha256_clone(&ota_fragment_sha256, &ota_record->fragment_sha256);
+    for (ota_fragment_index = 0; ota_fragment_index < ota_fragment_count
+         && ota_fragments[ota_fragment_index].offset + ota_fragments[ota_fragment_index].size <= ota_record->wrote_size; ota_fragment_index++) {
+        ;
+    }
+    if (xTaskCreatePinnedToCore(&ota_writer_task, "ota_writer_task", OTA_WRITER_STACK_SIZE, NULL, uxTaskPriorityGet(NULL),
+                                (TaskHandle_t *)&ota_writer_task_handle, ESP_CORE_0) != pdPASS) {
+        ESP_LOGE(TAG, "Couldn't create the OTA writer task");
+        task_fatal_error();
+    }
+}
+
+/* -----------------------------------------------------------
+| ota_pipeline_sync
+|   Waits until the writer has flashed everything queued so far
+|   and saved the record with the given stream state. The OTA
+|   record is then owned by the caller again until the next 
+|   chunk is queued
+------------------------------------------------------------*/
+static ota_write_result_t ota_pipeline_sync(const ota_stream_state_t *stream)
+{
+    ota_chunk_t chunk = { .type = OTA_CHUNK_SYNC, .stream = *stream };
+    ota_write_result_t result;
+
+    xQueueSend(ota_filled_queue, &chunk, portMAX_DELAY);
+    xQueueReceive(ota_result_queue, &result, portMAX_DELAY);
+    return result;
+}
+
+static uint32_t ota_get_u32(const uint8_t *bytes)
+{
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+/* -----------------------------------------------------------
+| ota_needs_input
+|   Whether decoding can only go on with more downloaded bytes.
+|   A patch COPY produces image bytes from the running partition,
+|   an LZ back reference from the window
+------------------------------------------------------------*/
+static bool ota_needs_input(uint8_t format, const ota_stream_state_t *stream)
+{
+    if (format == OTA_FORMAT_DELTA) {
+        return !(stream->op == OTA_PATCH_OP_COPY && stream->op_remaining > 0);
+    } else if (format == OTA_FORMAT_LZ) {
+        return stream->op_remaining == 0 && stream->bit_mask == 0;
+    }
+    return true;
+}
+
+/* -----------------------------------------------------------
+| ota_lz_restore_window
+|   Reloads the LZ window with the last bytes of the image from
+|   the partition, at the start of every download session
+------------------------------------------------------------*/
+static esp_err_t ota_lz_restore_window(const esp_partition_t *part, uint32_t wrote_size, uint8_t window_bits)
+{
+    uint32_t window_size = 1 << window_bits;
+    uint32_t pos = (wrote_size > window_size) ? wrote_size - window_size : 0;
+    uint32_t idx, n;
+    esp_err_t err = ESP_OK;
+
+    memset(ota_lz_window, 0, sizeof(ota_lz_window));
+    ota_lz_head = wrote_size;
+    for (; pos < wrote_size && err == ESP_OK; pos += n) {
+        idx = pos & (window_size - 1);
+        n = MIN(window_size - idx, wrote_size - pos);
+        err = esp_partition_read(part, pos, ota_lz_window + idx, n);
+    }
+    return err;
+}
+
+/* -----------------------------------------------------------
+| ota_lz_decode
+|   Decompresses into out until it is full or the input is used
+|   up. Fields and back references cut short are carried over in
+|   the stream state
+------------------------------------------------------------*/
+static void ota_lz_decode(ota_stream_state_t *stream, const char *in, size_t in_len, size_t *consumed, 
+                          char *out, size_t out_len, size_t *produced)
+{
+    uint32_t mask = (1 << stream->lz_window_bits) - 1;
+    size_t in_pos = 0, out_pos = 0;
+    uint8_t field_len, byte;
+
+    while (out_pos < out_len)
+    {
+        if (stream->op_remaining > 0) { // Copy from the window
+            byte = ota_lz_window[(ota_lz_head - stream->op_src) & mask];
+            ota_lz_window[ota_lz_head++ & mask] = byte;
+            out[out_pos++] = byte;
+            stream->op_remaining--;
+            continue;
+        }
+        field_len = (stream->op == OTA_LZ_TAG) ? 1 : (stream->op == OTA_LZ_LITERAL) ? 8 :
+                    (stream->op == OTA_LZ_INDEX) ? stream->lz_window_bits : stream->lz_lookahead_bits;
+        while (stream->field_bits < field_len) {
+            if (stream->bit_mask == 0) {
+                if (in_pos == in_len) {
+                    goto out_of_input;
+                }
+                stream->bit_byte = in[in_pos++];
+                stream->bit_mask = 0x80;
+            }
+            stream->field_acc = (stream->field_acc << 1) | ((stream->bit_byte & stream->bit_mask) ? 1 : 0);
+            stream->bit_mask >>= 1;
+            stream->field_bits++;
+        }
+        switch (stream->op) {
+            case OTA_LZ_TAG:
+                stream->op = (stream->field_acc == 1) ? OTA_LZ_LITERAL : OTA_LZ_INDEX;
+                break;
+            case OTA_LZ_LITERAL:
+                ota_lz_window[ota_lz_head++ & mask] = stream->field_acc;
+                out[out_pos++] = stream->field_acc;
+                stream->op = OTA_LZ_TAG;
+                break;
+            case OTA_LZ_INDEX:
+                stream->op_src = stream->field_acc + 1;
+                stream->op = OTA_LZ_COUNT;
+                break;
+            default:
+                stream->op_remaining = stream->field_acc + 1;
+                stream->op = OTA_LZ_TAG;
+                break;
+        }
+        stream->field_acc = 0;
+        stream->field_bits = 0;
+    }
+out_of_input:
+    *consumed = in_pos;
+    *produced = out_pos;
+}
+
+/* -----------------------------------------------------------
+| ota_decode
+|   Turns downloaded bytes into image bytes. A full image is
+|   taken as it is, a compressed one is decompressed. A patch is
+|   a sequence of COPY ops, which take bytes from the running 
+|   partition, and INSERT ops, which carry new bytes. Stops when
+|   the input is used up or the output is full. Ops cut short
+|   are carried over in the stream state
+------------------------------------------------------------*/
+static esp_err_t ota_decode(uint8_t format, ota_stream_state_t *stream, const esp_partition_t *base,
+                            const char *in, size_t in_len, size_t *consumed, char *out, size_t out_len, size_t *produced)
+{
+    size_t in_pos = 0, out_pos = 0, n;
+    uint8_t hdr_len;
+    esp_err_t err = ESP_OK;
+
+    if (format == OTA_FORMAT_FULL) {
+        in_pos = out_pos = MIN(in_len, out_len);
+        memcpy(out, in, out_pos);
+    } else if (format == OTA_FORMAT_LZ) {
+        ota_lz_decode(stream, in, in_len, &in_pos, out, out_len, &out_pos);
+    }
+    while (format == OTA_FORMAT_DELTA && out_pos < out_len && err == ESP_OK)
+    {
+        if (stream->op_remaining == 0) { // Between two ops
+            if (in_pos == in_len) {
+                break;
+            }
+            stream->op_hdr[stream->op_hdr_len++] = in[in_pos++];
+            hdr_len = (stream->op_hdr[0] == OTA_PATCH_OP_COPY) ? OTA_PATCH_COPY_HDR_LEN :
+                      (stream->op_hdr[0] == OTA_PATCH_OP_INSERT) ? OTA_PATCH_INSERT_HDR_LEN : 0;
+            if (hdr_len == 0) {
+                ESP_LOGE(TAG, "Unknown patch op 0x%02x at %u", stream->op_hdr[0], stream->stream_offset + in_pos - 1);
+                err = ESP_FAIL;
+            } else if (stream->op_hdr_len == hdr_len) {
+                stream->op = stream->op_hdr[0];
+                if (stream->op == OTA_PATCH_OP_COPY) {
+                    stream->op_src = ota_get_u32(&stream->op_hdr[1]);
+                    stream->op_remaining = ota_get_u32(&stream->op_hdr[5]);
+                } else {
+                    stream->op_remaining = ota_get_u32(&stream->op_hdr[1]);
+                }
+                stream->op_hdr_len = 0;
+            }
+            continue;
+        }
+        if (stream->op == OTA_PATCH_OP_COPY) {
+            n = MIN(stream->op_remaining, out_len - out_pos);
+            if (stream->op_src + n > base->size) {
+                ESP_LOGE(TAG, "Patch copies from beyond the running partition");
+                err = ESP_FAIL;
+                break;
+            }
+            err = esp_partition_read(base, stream->op_src, out + out_pos, n);
+            stream->op_src += n;
+        } else {
+            n = MIN(stream->op_remaining, MIN(out_len - out_pos, in_len - in_pos));
+            if (n == 0) {
+                break;
+            }
+            memcpy(out + out_pos, in + in_pos, n);
+            in_pos += n;
+        }
+        out_pos += n;
+        stream->op_remaining -= n;
+    }
+    stream->stream_offset += in_pos;
+    *consumed = in_pos;
+    *produced = out_pos;
+    return err;
+}
+
+/* -----------------------------------------------------------
+| ota_choose_lz
+|   The compressed image if there is one this firmware can 
+|   decompress, otherwise the full image
+------------------------------------------------------------*/
+static uint8_t ota_choose_lz(const ota_header_t *ota_header)
+{
+    if (ota_header->lz_url[0] == '\0') {
+        return OTA_FORMAT_FULL;
+    }
+    if (ota_header->lz_window_bits > CONFIG_OTA_LZ_MAX_WINDOW_BITS || ota_header->lz_window_bits < 4
+        || ota_header->lz_lookahead_bits >= ota_header->lz_window_bits || ota_header->lz_lookahead_bits < 3) {
+        ESP_LOGW(TAG, "Compressed image with window %u, lookahead %u not supported. Downloading the full image",
+                 ota_header->lz_window_bits, ota_header->lz_lookahead_bits);
+        return OTA_FORMAT_FULL;
+    }
+    ESP_LOGI(TAG, "Downloading the compressed image, %u bytes instead of %u", ota_header->lz_size, ota_header->image_size);
+    return OTA_FORMAT_LZ;
+}
+
+/* -----------------------------------------------------------
+| ota_choose_format
+|   Goes for the patch if there is one for exactly what is
+|   running. Otherwise for the compressed image if its window
+|   fits, and the full image as the last resort
+------------------------------------------------------------*/
+static uint8_t ota_choose_format(const ota_header_t *ota_header, const esp_partition_t *running)
+{
+    esp_app_desc_t running_app_info;
+    uint32_t crc32 = 0, offset, n;
+
+    if (ota_header->patch_url[0] == '\0') {
+        return ota_choose_lz(ota_header);
+    }
+    if (esp_ota_get_partition_description(running, &running_app_info) != ESP_OK
+        || strncmp(running_app_info.version, ota_header->base_fw_ver, sizeof(running_app_info.version)) != 0
+        || ota_header->base_size > running->size) {
+        ESP_LOGW(TAG, "The patch is for firmware %s. Not using it", ota_header->base_fw_ver);
+        return ota_choose_lz(ota_header);
+    }
+    for (offset = 0; offset < ota_header->base_size; offset += n) { // Same version string doesn't guarantee the same build
+        n = MIN(OTA_BUFFER_SIZE, ota_header->base_size - offset);
+        if (esp_partition_read(running, offset, ota_input, n) != ESP_OK) {
+            return ota_choose_lz(ota_header);
+        }
+        crc32 = crc32_le(crc32, (const uint8_t*)ota_input, n);
+    }
+    if (crc32 != ota_header->base_crc32) {
+        ESP_LOGW(TAG, "Running image differs from the base of the patch. Not using it");
+        return ota_choose_lz(ota_header);
+    }
+    ESP_LOGI(TAG, "Downloading a patch of %u bytes instead of the %u byte image", ota_header->patch_size, ota_header->image_size);
+    return OTA_FORMAT_DELTA;
+}
+
 void print_ota_header(ota_header_t* ota_header)
 {
     printf("fw_ver: %s\n", ota_header->fw_ver);
-    printf("no_of_fragments: %u\n", ota_header->no_of_fragments);
-    printf("max_fragment_size: %u\n", ota_header->max_fragment_size);
-    printf("fragments_root_url: %s\n", ota_header->fragments_root_url);
-    printf("crc32_url: %s\n", ota_header->crc32_url);
+    printf("image_size: %u\n", ota_header->image_size);
+    printf("image_url: %s\n", ota_header->image_url);
+    printf("base_fw_ver: %s\n", ota_header->base_fw_ver);
+    printf("patch_size: %u\n", ota_header->patch_size);
+    printf("patch_url: %s\n", ota_header->patch_url);
+    printf("lz_size: %u (window %u, lookahead %u)\n", ota_header->lz_size, ota_header->lz_window_bits, ota_header->lz_lookahead_bits);
+    printf("lz_url: %s\n", ota_header->lz_url);
+    printf("fragments: %u\n", ota_fragment_count);
+}
+
+/* -----------------------------------------------------------
+| ota_open_image
+|   Requests the download from the first byte not used yet.
+|   Returns the number of bytes the server will send before 
+|   that byte, i.e. 0 if it honoured the Range header, or -1 on
+|   error
+------------------------------------------------------------*/
+static int ota_open_image(esp_http_client_handle_t client, uint32_t offset)
+{
+    char range[32];
+    esp_err_t err;
+    int status;
+
+    if (offset > 0) {
+        sprintf(range, "bytes=%u-", offset);
+        esp_http_client_set_header(client, "Range", range);
+    }
+    err = esp_http_client_open(client, 0);
+    esp_http_client_delete_header(client, "Range");
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        return -1;
+    }
+    esp_http_client_fetch_headers(client);
+    status = esp_http_client_get_status_code(client);
+    if (status == HTTP_STATUS_PARTIAL_CONTENT) {
+        ESP_LOGI(TAG, "Resuming download at byte %u", offset);
+        return 0;
+    } else if (status == HTTP_STATUS_OK) {
+        if (offset > 0) {
+            ESP_LOGW(TAG, "Server ignored the Range header. Skipping %u bytes", offset);
+        }
+        return offset;
+    }
+    ESP_LOGE(TAG, "Unexpected HTTP status %d", status);
+    return -1;
+}
+
+/* -----------------------------------------------------------
+| ota_verify_image
+|   Compares the SHA-256 worked out while the image was written
+|   with the one in the signed manifest. This checks the image
+|   against the manifest without reading the partition. The
+|   partition is still read back once: by
+|   esp_ota_set_boot_partition(), which verifies the image
+|   before switching to it
+------------------------------------------------------------*/
+static esp_err_t ota_verify_image(ota_record_t *ota_record, const ota_header_t *ota_header)
+{
+    uint8_t digest[HASH_LEN];
+
+    mbedtls_sha256_finish_ret(&ota_record->sha256, digest);
+    if (memcmp(digest, ota_header->image_sha256, HASH_LEN) != 0) {
+        ESP_LOGE(TAG, "SHA-256 of the image doesn't match the manifest");
+        return ESP_ERR_IMAGE_INVALID;
+    }
+    ESP_LOGI(TAG, "SHA-256 of the image matches the manifest");
+    return ESP_OK;
+}
+
+/* -----------------------------------------------------------
+| ota_yield_to_telemetry
+|   Called by the MQTT task while it has messages to publish.
+|   The image download pauses until OTA_TELEMETRY_HOLD_MS after
+|   the last call, so publishes and their acks are not queued
+|   behind image data on the link
+------------------------------------------------------------*/
+void ota_yield_to_telemetry(void)
+{
+    ota_hold_until = xTaskGetTickCount() + pdMS_TO_TICKS(OTA_TELEMETRY_HOLD_MS);
+}
+
+bool ota_is_downloading(void)
+{
+    return ota_downloading;
 }
 
+/* -----------------------------------------------------------
+| ota_shaper_start
+|   Starts a download session with a full bucket
+------------------------------------------------------------*/
+static void ota_shaper_start(void)
+{
+    ota_shaper = (ota_shaper_t) { .tokens = OTA_BUCKET_DEPTH, .refill_us = esp_timer_get_time() };
+}
+
+/* -----------------------------------------------------------
+| ota_shaped_read
+|   esp_http_client_read() behind a token bucket of
+|   OTA_RATE_LIMIT bytes/s. While the bucket is empty or
+|   telemetry is being published, the download is not read, so
+|   TCP flow control slows the server down as well. The task
+|   watchdog is fed while it waits
+------------------------------------------------------------*/
+static int ota_shaped_read(esp_http_client_handle_t client, char *buffer, int len)
+{
+    int64_t now_us, start_us;
+    TickType_t wait;
+    int data_read;
+
+    start_us = esp_timer_get_time();
+    while ((int32_t)(ota_hold_until - xTaskGetTickCount()) > 0) {
+        esp_task_wdt_reset();
+        vTaskDelay(ota_hold_until - xTaskGetTickCount());
+    }
+    now_us = esp_timer_get_time();
+    ota_shaper.yielded_ms += (now_us - start_us) / 1000;
+
+    if (OTA_RATE_LIMIT > 0) {
+        start_us = now_us;
+        while (1) {
+            ota_shaper.tokens = MIN(OTA_BUCKET_DEPTH, ota_shaper.tokens + (now_us - ota_shaper.refill_us) * OTA_RATE_LIMIT / 1000000);
+            ota_shaper.refill_us = now_us;
+            if (ota_shaper.tokens > 0) {
+                break;
+            }
+            wait = pdMS_TO_TICKS((1 - ota_shaper.tokens) * 1000 / OTA_RATE_LIMIT);
+            esp_task_wdt_reset();
+            vTaskDelay(MAX(wait, 1));
+            now_us = esp_timer_get_time();
+        }
+        ota_shaper.shaped_ms += (now_us - start_us) / 1000;
+        len = MIN(len, ota_shaper.tokens);
+    }
+
+    data_read = esp_http_client_read(client, buffer, len);
+    ota_shaper.read_max_ms = MAX(ota_shaper.read_max_ms, (uint32_t)((esp_timer_get_time() - now_us) / 1000));
+    if (data_read > 0) {
+        ota_shaper.tokens -= data_read;
+    }
+    return data_read;
+}
 
 /* -----------------------------------------------------------
 | ota_by_fragments
-|   This is the main function for fragmented OTA update. It
-|   interacts with the designated http server to obtain firmware
-|   update header, ensure that the firmware is a newer one than
-|   what is currently running, get one fragment of the new fw
-|   at a time and maintain records in flash so that the update
-|   can continue even if there is a power recycle or an abort.
-|   Finally, when all the fragments have been received, it 
-|   checks if the SHA is correct, changes the fw entry point to
-|   the new firmware and restarts ESP
+|   This is the main function for OTA update. It interacts with
+|   the designated http server to obtain firmware update header,
+|   ensure that the firmware is a newer one than what is 
+|   currently running, and download the image, or a patch to
+|   the running firmware when there is one. The header and the
+|   image share one kept-alive HTTPS connection, and the header
+|   is rechecked with a conditional request. A dropped 
+|   connection resumes at the exact byte it stopped at with an
+|   HTTP Range request, and the progress is checkpointed in the
+|   OTA record so that the update can continue even if there is
+|   a power recycle or an abort. Finally, when the whole image
+|   is in the partition, it checks the SHA-256 against the
+|   manifest,
+|   changes the fw entry point to the new firmware and restarts
+|   ESP. The download is rate limited and gives way to telemetry
+|   publishes, see ota_shaped_read()
 ------------------------------------------------------------*/
 void ota_by_fragments(void *pvParameter)
 {
@@ -106,12 +876,20 @@ void ota_by_fragments(void *pvParameter)
     ota_header_t ota_header; 
     ota_record_t ota_record;
 
-    esp_http_client_config_t header_url_config, crc32_url_config, fragment_url_config;
+    esp_http_client_config_t http_config;
     esp_http_client_handle_t client;
-    char url_temp[MAX_URL_LEN];
-    int data_read;
-    uint32_t crc32_original[MAX_OTA_FRAGMENTS];
-    char fragments_completed_str[4]; // 1 element for '_' char and 3 for storing the number of fragments completed. So this can support upto 999 fragments.
+    const char *url;
+    int data_read, skip;
+    char *buffer;
+    size_t in_len, in_pos, out_len, consumed, produced;
+    ota_stream_state_t stream;
+    ota_chunk_t chunk;
+    ota_write_result_t result;
+    uint32_t queued_size, checkpoint_size, session_start, session_stream_start;
+    int64_t session_start_us, wait_start_us;
+    uint32_t session_ms, buffer_wait_ms, header_ms;
+    uint16_t session_handshakes;
+    bool header_changed;
 
     // Get running partition info and the next update partition
     running = esp_ota_get_running_partition();
@@ -125,43 +903,58 @@ void ota_by_fragments(void *pvParameter)
              update_partition->subtype, update_partition->address);
     assert(update_partition != NULL);
     
-    const esp_partition_pos_t part_pos = { 
-      .offset = update_partition->address,
-      .size = update_partition->size,
-    };  
+    // Devices told to update at the same moment don't all hit the download server at once
+    device_jitter_delay(CONFIG_OTA_START_JITTER_S * 1000, JITTER_OTA_START);
 
-    // Get the fragmented OTA header that has info about new firmware version, number of fragments etc. 
-    header_url_config = (esp_http_client_config_t) {
+    // Get the OTA header that has info about new firmware version, where the image is etc. 
+    http_config = (esp_http_client_config_t) {
         .url = (const char*)CONFIG_OTA_HEADER_URL,
         .cert_pem = (char *)server_cert_pem_start,
+        .event_handler = ota_http_event_handler,
     };
-    get_ota_header(header_url_config, &ota_header, sizeof(ota_header_t));
+    client = esp_http_client_init(&http_config);
+    if (client == NULL) {
+        ESP_LOGE(TAG, "Failed to initialise HTTP client");
+        task_fatal_error();
+    }
+    ota_header_etag[0] = ota_header_last_modified[0] = '\0';
+    ota_tls_handshakes = 0;
+    get_ota_header(client, &ota_header);
     print_ota_header(&ota_header);
+    if (ota_header.image_size > update_partition->size)
+    {
+        ESP_LOGE(TAG, "Image of %u bytes doesn't fit the partition", ota_header.image_size);
+        http_cleanup(client);
+        task_fatal_error();
+    }
 
     // Check if a ota record file already exists. If it does, populates local structure. Otherwise creates one with initial values
+    memset(&ota_record, 0, sizeof(ota_record_t));
     strcpy(ota_record.fw_ver_being_updated, ota_header.fw_ver); //memcpy is less error (ovrflow) prone than strcpy
-    ota_record.fragments_completed = 0;
     ota_record.part = update_partition;   
-    ota_record.wrote_size = 0;
+    ota_record.image_size = ota_header.image_size;
+    mbedtls_sha256_init(&ota_record.sha256);
+    mbedtls_sha256_starts_ret(&ota_record.sha256, 0);
+    mbedtls_sha256_init(&ota_record.fragment_sha256);
+    mbedtls_sha256_starts_ret(&ota_record.fragment_sha256, 0);
+    ota_record.format = ota_choose_format(&ota_header, running);
+    if (ota_record.format == OTA_FORMAT_LZ) {
+        ota_record.stream.lz_window_bits = ota_header.lz_window_bits;
+        ota_record.stream.lz_lookahead_bits = ota_header.lz_lookahead_bits;
+    }
     read_flash_ota_record(&ota_record);
-    if (ota_record.fragments_completed >= ota_header.no_of_fragments)
+    if (ota_record.wrote_size > ota_record.image_size)
     {
-        ESP_LOGE(TAG, "Fragments completed is greater than or equal to the number of fragments specified in the header");
+        ESP_LOGE(TAG, "OTA record says more bytes were written than the image has");
         remove(OTA_RECORD_FILE_NAME);
+        http_cleanup(client);
         task_fatal_error();
     }
+    url = (ota_record.format == OTA_FORMAT_DELTA) ? ota_header.patch_url : 
+          (ota_record.format == OTA_FORMAT_LZ) ? ota_header.lz_url : ota_header.image_url;
 
-    crc32_url_config = (esp_http_client_config_t) {
-        .url = (const char*) ota_header.crc32_url,
-        .cert_pem = (char *)server_cert_pem_start,
-    };
-    
-    // Get the CRC32 checksums
-    get_ota_crc32(crc32_url_config, crc32_original, ota_header.no_of_fragments*sizeof(crc32_original[0]));
-
-    bool partition_readied = false;
-    uint32_t fragment_crc32 = 0;
-    while(1) // Loop until failure counters overflow and monitoring task restarts ESP
+    bool partition_readied = (ota_record.wrote_size > 0); // The image was checked before the first byte was written
+    while(ota_record.wrote_size < ota_record.image_size) // Loop until done, or failure counters overflow and monitoring task restarts ESP
     {
         //Reset watchdog timer for _this_ task 
         CHECK_ERROR_CODE(esp_task_wdt_reset(), ESP_OK);	
@@ -171,184 +964,430 @@ void ota_by_fragments(void *pvParameter)
         {
             ESP_LOGE(TAG, "Too many fragmented OTA update errors. Quitting OTA update");
             remove(OTA_RECORD_FILE_NAME);
+            http_cleanup(client);
             task_fatal_error();
         }
  
-        // Get header in every iteration to ensure that FW hasn't changed in the mean time
-        get_ota_header(header_url_config, &ota_header, sizeof(ota_header_t));
+        // Get header in every iteration to ensure that FW hasn't changed in the mean time. Usually the server answers 304 Not Modified
+        session_start_us = esp_timer_get_time();
+        session_handshakes = ota_tls_handshakes;
+        header_changed = get_ota_header(client, &ota_header);
+        header_ms = (esp_timer_get_time() - session_start_us) / 1000;
        
         // If firmware has indeed changed, then we need to start from the beginning 
-        if (strcmp(ota_record.fw_ver_being_updated, ota_header.fw_ver) != 0) // FW version mismatch. Restart with new FW
+        if (strcmp(ota_record.fw_ver_being_updated, ota_header.fw_ver) != 0 || ota_record.image_size != ota_header.image_size) // FW version mismatch. Restart with new FW
         { // The only difference between what we are doing here and what we did before the beginning of the infinite while loop is that,
           // we don't have access flash unnecessarily. This will improve flash lifetime
             remove(OTA_RECORD_FILE_NAME);
+            http_cleanup(client);
             task_fatal_error(); 
         } 
       
-        strcpy(url_temp, ota_header.fragments_root_url);
-        sprintf(fragments_completed_str, "_%02hu", ota_record.fragments_completed + 1); // Fragment numbering will start from 1
-        strcat(url_temp, fragments_completed_str);
-
-        // Proceed with OTA for a given fragment        
-        fragment_url_config = (esp_http_client_config_t) { 
-            .url = (const char*) url_temp,
-            .cert_pem = (char *)server_cert_pem_start,
-        };
-        client = esp_http_client_init(&fragment_url_config);
-        if (client == NULL) {
-            ESP_LOGE(TAG, "Failed to initialise HTTP connection to %s", url_temp);
-            http_cleanup(client);
+        // Proceed with OTA from the first byte not used yet, on the same connection
+        ota_start_request(client, url);
+        skip = ota_open_image(client, ota_record.stream.stream_offset);
+        if (skip < 0) {
+            esp_http_client_close(client);
             fragmented_ota_error_counter++;
             vTaskDelay(1000 / portTICK_PERIOD_MS);
             continue;
         }
-        err = esp_http_client_open(client, 0);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        ESP_LOGI(TAG, "Header %s in %u ms. Image request answered after %u ms in all, %u TLS handshakes", 
+                 header_changed ? "downloaded" : "not modified", header_ms, 
+                 (uint32_t)((esp_timer_get_time() - session_start_us) / 1000), ota_tls_handshakes - session_handshakes);
+
+        // Decode what is downloaded into a free buffer and queue it for the writer task, which flashes the previous one meanwhile
+        stream = ota_record.stream;
+        if (ota_record.format == OTA_FORMAT_LZ 
+            && ota_lz_restore_window(update_partition, ota_record.wrote_size, stream.lz_window_bits) != ESP_OK) {
+            ESP_LOGE(TAG, "Fatal error: Couldn't read back the partition");
             http_cleanup(client);
-            fragmented_ota_error_counter++;
-            vTaskDelay(1000 / portTICK_PERIOD_MS);
-            continue;
+            task_fatal_error();
         }
-        esp_http_client_fetch_headers(client);
-
-        // Read data from the URL and write to OTA partition
-        while((data_read = esp_http_client_read(client, ota_write_data, BUFFSIZE)) > 0 )
+        ota_pipeline_start(&ota_record);
+        ota_shaper_start();
+        ota_downloading = true;
+        queued_size = checkpoint_size = session_start = ota_record.wrote_size;
+        session_stream_start = stream.stream_offset;
+        buffer_wait_ms = 0;
+        in_len = in_pos = out_len = 0;
+        buffer = NULL;
+        while(queued_size < ota_record.image_size)
         {
-            if(ota_record.fragments_completed == 0 &&  partition_readied == false) // Do error checks and begin OTA
+            // A session can run for minutes at the rate limit. Not checked, the task is only subscribed when resuming after a reset
+            esp_task_wdt_reset();
+            if (in_pos == in_len && ota_needs_input(ota_record.format, &stream)) {
+                data_read = ota_shaped_read(client, ota_input, (skip > 0) ? MIN(OTA_BUFFER_SIZE, skip) : OTA_BUFFER_SIZE);
+                if (data_read <= 0) {
+                    break;
+                }
+                if (skip > 0) { // Already used
+                    skip -= data_read;
+                    continue;
+                }
+                in_len = data_read;
+                in_pos = 0;
+            }
+            if (buffer == NULL) {
+                wait_start_us = esp_timer_get_time();
+                xQueueReceive(ota_free_queue, &buffer, portMAX_DELAY);
+                buffer_wait_ms += (esp_timer_get_time() - wait_start_us) / 1000; // Time the network waited on the flash
+                out_len = 0;
+            }
+            err = ota_decode(ota_record.format, &stream, running, ota_input + in_pos, in_len - in_pos, &consumed, buffer + out_len,
+                             MIN(OTA_BUFFER_SIZE - out_len, ota_record.image_size - queued_size - out_len), &produced);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Fatal error: The download is corrupt");
+                http_cleanup(client);
+                remove(OTA_RECORD_FILE_NAME);
+                task_fatal_error();
+            }
+            in_pos += consumed;
+            out_len += produced;
+            if (out_len < OTA_BUFFER_SIZE && queued_size + out_len < ota_record.image_size) {
+                continue;
+            }
+
+            if(partition_readied == false) // Do error checks and begin OTA
             {
-                err = prepare_for_ota(data_read, &ota_record);
+                err = prepare_for_ota(buffer, out_len, &ota_record);
                 if (err != ESP_OK) {
-                    ESP_LOGE(TAG, "Fatal error: Erasing designated partition failed. Partition Subtype: %d", update_partition->subtype); 
+                    ESP_LOGE(TAG, "Fatal error: Image is not the one expected. Partition Subtype: %d", update_partition->subtype); 
+                    http_cleanup(client);
                     task_fatal_error(); 
                 }
                 partition_readied = true;
             }
-            
-            err = esp_partition_write(ota_record.part, ota_record.wrote_size, (const uint8_t*) ota_write_data, data_read);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Fatal error: Writing into designated partition failed. Partition Subtype: %d", update_partition->subtype); 
-                http_cleanup(client);
-                task_fatal_error();
+            chunk = (ota_chunk_t) { .type = OTA_CHUNK_DATA, .data = buffer, .len = out_len, .offset = queued_size };
+            xQueueSend(ota_filled_queue, &chunk, portMAX_DELAY);
+            queued_size += out_len;
+            buffer = NULL;
+            ESP_LOGD(TAG, "Queued so far %d bytes", queued_size);
+            if (queued_size - checkpoint_size >= OTA_CHECKPOINT_SIZE) {
+                chunk = (ota_chunk_t) { .type = OTA_CHUNK_CHECKPOINT, .stream = stream };
+                xQueueSend(ota_filled_queue, &chunk, portMAX_DELAY);
+                checkpoint_size = queued_size;
+            }
+        }
+        if (buffer != NULL) { // Connection dropped. Flash what was decoded so far, so that the stream state matches wrote_size
+            if (out_len > 0 && partition_readied == true) {
+                chunk = (ota_chunk_t) { .type = OTA_CHUNK_DATA, .data = buffer, .len = out_len, .offset = queued_size };
+                xQueueSend(ota_filled_queue, &chunk, portMAX_DELAY);
+            } else {
+                xQueueSend(ota_free_queue, &buffer, portMAX_DELAY);
+                if (partition_readied == false) { // Too little to check the image. Start over
+                    stream = ota_record.stream;
+                }
             }
-            ota_record.wrote_size += data_read;
-            ESP_LOGD(TAG, "Written so far %d bytes", ota_record.wrote_size);
-            fragment_crc32 = crc32_le(fragment_crc32, (const uint8_t*)ota_write_data, data_read);
         }
-        if (data_read < 0)
+
+        // Wait for the writer to catch up. The record then tells exactly how far the image got
+        result = ota_pipeline_sync(&stream);
+        ota_pipeline_stop();
+        ota_downloading = false;
+        if (result.err == ESP_ERR_INVALID_CRC) { // What was written can't be trusted. Start over
+            ESP_LOGE(TAG, "Fatal error: The image is corrupt");
+            remove(OTA_RECORD_FILE_NAME);
+            http_cleanup(client);
+            task_fatal_error();
+        } else if (result.err != ESP_OK) {
+            ESP_LOGE(TAG, "Fatal error: Writing into designated partition failed. Partition Subtype: %d", update_partition->subtype);
+            http_cleanup(client);
+            task_fatal_error();
+        }
+        session_ms = (esp_timer_get_time() - session_start_us) / 1000;
+        debug_data.ota_rate_bps = (session_ms == 0) ? 0 : (ota_record.stream.stream_offset - session_stream_start) * 1000 / session_ms;
+        debug_data.ota_shaped_ms += ota_shaper.shaped_ms;
+        debug_data.ota_yielded_ms += ota_shaper.yielded_ms;
+        debug_data.ota_read_max_ms = MAX(debug_data.ota_read_max_ms, ota_shaper.read_max_ms);
+        ESP_LOGI(TAG, "%u of %u bytes. Got %u bytes from %u downloaded in %u ms (%u B/s). Flash busy %u ms (longest operation %u ms), download stalled on flash %u ms", 
+                 ota_record.wrote_size, ota_record.image_size, ota_record.wrote_size - session_start, 
+                 ota_record.stream.stream_offset - session_stream_start, session_ms, 
+                 debug_data.ota_rate_bps, 
+                 result.flash_time_ms, result.longest_op_ms, buffer_wait_ms);
+        ESP_LOGI(TAG, "Download held back %u ms by the rate limit, %u ms for telemetry. Longest read %u ms", 
+                 ota_shaper.shaped_ms, ota_shaper.yielded_ms, ota_shaper.read_max_ms);
+        if (ota_record.wrote_size < ota_record.image_size)
         {
-            ESP_LOGE(TAG, "Error: SSL data read error");
+            ESP_LOGE(TAG, "Error: SSL data read error. Resuming at byte %u", ota_record.stream.stream_offset);
+            esp_http_client_close(client); // Whatever is left of the response is of no use
             fragmented_ota_error_counter++;
+            vTaskDelay(1000 / portTICK_PERIOD_MS);
             continue;
         }    
-        
-        // One fragment received successfully and written to OTA partition. Now make sure it isnt corrup 
-        http_cleanup(client);
-        if (fragment_crc32 != crc32_original[ota_record.fragments_completed]) // Checksum failed
-        {
-            ESP_LOGE(TAG, "Checksum error on fragment number %u. Expected %#06X. Got %#06X.", ota_record.fragments_completed + 1, fragment_crc32, crc32_original[ota_record.fragments_completed]);            
-            fragment_crc32 = 0;
-        }
-
-        // Update our records
-        fragment_crc32 = 0;
-        ota_record.fragments_completed++;
-        ESP_LOGI(TAG, "Successfully completed %u fragment(s) out of %u fragments", ota_record.fragments_completed, ota_header.no_of_fragments);
-        update_flash_ota_record(&ota_record);
+        ota_end_request(client);
+    } // End of while loop
+    http_cleanup(client);
 
-        // Check if we have all the fragments
-        if (ota_record.fragments_completed == ota_header.no_of_fragments) // it means we are done
-        {
-            esp_image_metadata_t metadata;
-       
-            err = esp_image_verify(ESP_IMAGE_VERIFY, &part_pos, &metadata);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "esp_ota_end failed!");
-                remove(OTA_RECORD_FILE_NAME);
-                task_fatal_error();
-            }
+    // The whole image is in the partition. Now make sure it isn't corrupt
+    err = ota_verify_image(&ota_record, &ota_header);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Image verification failed!");
+        remove(OTA_RECORD_FILE_NAME);
+        task_fatal_error();
+    }
 
-            err = esp_ota_set_boot_partition(update_partition);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
-                task_fatal_error(); 
-            }
-            ESP_LOGI(TAG, "Prepare to restart system!");
-            remove(OTA_RECORD_FILE_NAME);
-            esp_restart();
-            return ;
-        }
-    } // End of infitie while loop
+    // Reads the whole image back through esp_image_verify() once more. IDF has no way to switch partitions without it
+    err = esp_ota_set_boot_partition(update_partition);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
+        task_fatal_error(); 
+    }
+    ESP_LOGI(TAG, "Prepare to restart system!");
+    remove(OTA_RECORD_FILE_NAME);
+    esp_restart();
 }
 
 /* -----------------------------------------------------------
-| get_ota_header 
-|   Opens a url containing the header for fragmented OTA update
-|   and copies the contents to a local header variable
+| get_ota_header
+|   Downloads the manifest for OTA update into the local header
+|   variable. Once there is a header, the request is made
+|   conditional and the header is left as it is if the server
+|   says it has not changed. Returns whether it was downloaded
 ------------------------------------------------------------*/
-static void get_ota_header(esp_http_client_config_t url_config, ota_header_t* ota_header, uint16_t storage_size) 
+static bool get_ota_header(esp_http_client_handle_t client, ota_header_t* ota_header)
 {
     esp_err_t err;
+    bool modified;
 
     ESP_LOGI(TAG, "Getting the header");
-    err = transfer_url_contents_to_local(url_config, (char*)ota_header, storage_size);
+    err = ota_fetch_manifest(client, CONFIG_OTA_HEADER_URL, ota_header, &modified);
     if(err != ESP_OK)
     {
         ESP_LOGE(TAG, "Failed to get the header");
+        http_cleanup(client);
         task_fatal_error();
     }
-    if (ota_header->no_of_fragments > MAX_OTA_FRAGMENTS)
-    {
-        ESP_LOGE(TAG, "Number of OTA fragments more than what this code can handle");
-        task_fatal_error();
+    if (modified == false) {
+        return false;
     }
-    
+    strcpy(ota_header_etag, ota_response_etag);
+    strcpy(ota_header_last_modified, ota_response_last_modified);
+    return true;
 }
 
 /* -----------------------------------------------------------
-| get_ota_crc32
-|   Opens a url containing the crc32s for fragmented OTA update
-|   and copies the contents to a local variable
+| ota_hex_to_bytes
+|   Decodes hex into len bytes. False unless hex is exactly
+|   that long
 ------------------------------------------------------------*/
-static void get_ota_crc32(esp_http_client_config_t url_config, uint32_t* ota_crc32, uint16_t storage_size) 
+static bool ota_hex_to_bytes(const char *hex, uint8_t *bytes, size_t len)
 {
-    esp_err_t err;
+    unsigned int byte;
+    size_t i;
 
-    ESP_LOGI(TAG, "Getting the CRC32 file");
-    err = transfer_url_contents_to_local(url_config, (char *)ota_crc32, storage_size);
-    if(err != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Failed to get the CRC32 values");
-        task_fatal_error(); 
+    if (strlen(hex) != 2 * len || strspn(hex, "0123456789abcdefABCDEF") != 2 * len) {
+        return false;
+    }
+    for (i = 0; i < len; i++) {
+        sscanf(&hex[2 * i], "%2x", &byte);
+        bytes[i] = byte;
     }
+    return true;
+}
+
+/* -----------------------------------------------------------
+| ota_parse_manifest_line
+|   Takes the values of one manifest line into the header or
+|   the fragment table. Keys this firmware doesn't know are
+|   skipped, so the manifest can grow within its version.
+|   Returns false if the line is malformed. The scanf widths are
+|   the sizes of the fields less one
+------------------------------------------------------------*/
+static bool ota_parse_manifest_line(const char *line, ota_header_t *ota_header)
+{
+    char hex[2 * HASH_LEN + 1];
+    unsigned int window_bits, lookahead_bits;
+    ota_fragment_t *fragment;
+
+    if (strncmp(line, "fw_ver ", 7) == 0) {
+        return sscanf(line, "fw_ver %31s", ota_header->fw_ver) == 1;
+    } else if (strncmp(line, "image ", 6) == 0) {
+        return sscanf(line, "image %u %64s %127s", &ota_header->image_size, hex, ota_header->image_url) == 3
+               && ota_hex_to_bytes(hex, ota_header->image_sha256, HASH_LEN);
+    } else if (strncmp(line, "patch ", 6) == 0) {
+        return sscanf(line, "patch %31s %u %x %u %127s", ota_header->base_fw_ver, &ota_header->base_size,
+                      &ota_header->base_crc32, &ota_header->patch_size, ota_header->patch_url) == 5;
+    } else if (strncmp(line, "lz ", 3) == 0) {
+        if (sscanf(line, "lz %u %u %u %127s", &window_bits, &lookahead_bits, &ota_header->lz_size, ota_header->lz_url) != 4
+            || window_bits > UINT8_MAX || lookahead_bits > UINT8_MAX) {
+            return false;
+        }
+        ota_header->lz_window_bits = window_bits;
+        ota_header->lz_lookahead_bits = lookahead_bits;
+        return true;
+    } else if (strncmp(line, "fragment ", 9) == 0) {
+        if (ota_fragment_count == OTA_MAX_FRAGMENTS) {
+            ESP_LOGE(TAG, "Manifest has more than %d fragments", OTA_MAX_FRAGMENTS);
+            return false;
+        }
+        fragment = &ota_fragments[ota_fragment_count++];
+        return sscanf(line, "fragment %u %u %64s", &fragment->offset, &fragment->size, hex) == 3
+               && ota_hex_to_bytes(hex, fragment->sha256, HASH_LEN);
+    }
+    return true;
+}
+
+/* -----------------------------------------------------------
+| ota_manifest_line
+|   Handles one line of the manifest, without its newline. All
+|   lines before the signature are hashed as they were sent
+------------------------------------------------------------*/
+static bool ota_manifest_line(ota_manifest_parser_t *parser, char *line, size_t len, ota_header_t *ota_header)
+{
+    if (parser->signature_len > 0) {
+        ESP_LOGE(TAG, "Manifest goes on after the signature");
+        return false;
+    }
+    if (strncmp(line, "sig ", 4) != 0) {
+        mbedtls_sha256_update_ret(&parser->sha256, (const unsigned char*)line, len);
+        mbedtls_sha256_update_ret(&parser->sha256, (const unsigned char*)"\n", 1);
+    }
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    line[len] = '\0';
+    if (parser->lines++ == 0) {
+        if (strcmp(line, OTA_MANIFEST_MAGIC) != 0) {
+            ESP_LOGE(TAG, "Not a version 2 manifest: %s", line);
+            return false;
+        }
+        return true;
+    }
+    if (strncmp(line, "sig ", 4) == 0) {
+        parser->signature_len = strlen(&line[4]) / 2;
+        return parser->signature_len > 0 && parser->signature_len <= sizeof(parser->signature)
+               && ota_hex_to_bytes(&line[4], parser->signature, parser->signature_len);
+    }
+    if (line[0] == '\0' || line[0] == '#') {
+        return true;
+    }
+    if (ota_parse_manifest_line(line, ota_header) == false) {
+        ESP_LOGE(TAG, "Malformed manifest line %u: %s", parser->lines, line);
+        return false;
+    }
+    return true;
+}
 
+/* -----------------------------------------------------------
+| ota_check_manifest
+|   Checks the signature, and that the header has what an
+|   update needs, with fragments that cover the image exactly
+------------------------------------------------------------*/
+static esp_err_t ota_check_manifest(ota_manifest_parser_t *parser, const ota_header_t *ota_header)
+{
+    mbedtls_pk_context key;
+    uint8_t digest[HASH_LEN];
+    uint32_t offset = 0;
+    uint16_t i;
+    int ret;
+
+    if (parser->signature_len == 0) {
+        ESP_LOGE(TAG, "Manifest is not signed");
+        return ESP_FAIL;
+    }
+    mbedtls_sha256_finish_ret(&parser->sha256, digest);
+    mbedtls_pk_init(&key);
+    ret = mbedtls_pk_parse_public_key(&key, manifest_key_pem_start, manifest_key_pem_end - manifest_key_pem_start);
+    if (ret == 0) {
+        ret = mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, digest, HASH_LEN, parser->signature, parser->signature_len);
+    }
+    mbedtls_pk_free(&key);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Manifest signature is not valid (-0x%04x)", -ret);
+        return ESP_FAIL;
+    }
+
+    if (ota_header->fw_ver[0] == '\0' || ota_header->image_size == 0 || ota_header->image_url[0] == '\0') {
+        ESP_LOGE(TAG, "Manifest has no image");
+        return ESP_FAIL;
+    }
+    for (i = 0; i < ota_fragment_count; i++) {
+        if (ota_fragments[i].offset != offset || ota_fragments[i].size == 0) {
+            break;
+        }
+        offset += ota_fragments[i].size;
+    }
+    if (ota_fragment_count > 0 && (i < ota_fragment_count || offset != ota_header->image_size)) {
+        ESP_LOGE(TAG, "Manifest fragments don't cover the image");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/* -----------------------------------------------------------
+| ota_read_manifest
+|   Parses the manifest line by line as it arrives, so only a
+|   line is held in memory whatever its length
+------------------------------------------------------------*/
+static esp_err_t ota_read_manifest(esp_http_client_handle_t client, ota_header_t *ota_header)
+{
+    ota_manifest_parser_t parser;
+    char line[OTA_MANIFEST_MAX_LINE];
+    size_t line_len = 0;
+    int data_read = 0, i;
+    bool ok = true;
+
+    memset(ota_header, 0, sizeof(ota_header_t));
+    ota_fragment_count = 0;
+    memset(&parser, 0, sizeof(parser));
+    mbedtls_sha256_init(&parser.sha256);
+    mbedtls_sha256_starts_ret(&parser.sha256, 0);
+    while (ok && (data_read = esp_http_client_read(client, ota_input, OTA_BUFFER_SIZE)) > 0)
+    {
+        for (i = 0; i < data_read && ok; i++) {
+            if (ota_input[i] == '\n') {
+                ok = ota_manifest_line(&parser, line, line_len, ota_header);
+                line_len = 0;
+            } else if (line_len < sizeof(line) - 1) {
+                line[line_len++] = ota_input[i];
+            } else {
+                ESP_LOGE(TAG, "Manifest line %u is too long", parser.lines + 1);
+                ok = false;
+            }
+        }
+    }
+    if (ok && line_len > 0) { // Last line without a newline
+        ok = ota_manifest_line(&parser, line, line_len, ota_header);
+    }
+    if (ok && data_read < 0) {
+        ESP_LOGE(TAG, "Error: SSL data read error while getting the manifest");
+        ok = false;
+    }
+    if (ok) {
+        ok = (ota_check_manifest(&parser, ota_header) == ESP_OK);
+    }
+    mbedtls_sha256_free(&parser.sha256);
+    return ok ? ESP_OK : ESP_FAIL;
 }
 
 /* -----------------------------------------------------------
-| transfer_url_contents_to_local 
-|   Opens a url and copies the contents to a local variable
+| ota_fetch_manifest
+|   Requests the manifest on the OTA connection and parses it
+|   into the header. The request is conditional on the
+|   validators of the last header, if there are any. modified
+|   is false if the server answered 304 Not Modified
 ------------------------------------------------------------*/
-static esp_err_t transfer_url_contents_to_local(esp_http_client_config_t url_config, char* local_var, uint16_t storage_size) 
+static esp_err_t ota_fetch_manifest(esp_http_client_handle_t client, const char* url, ota_header_t* ota_header, bool* modified)
 {
     uint8_t try_count;
-    char* temp_data;
-    esp_http_client_handle_t client;
     esp_err_t err;
-    uint16_t data_idx;
-    int data_read;
+    int status;
 
-    client = esp_http_client_init(&url_config);
-    if (client == NULL) {
-        ESP_LOGE(TAG, "Failed to initialise HTTP connection to %s", url_config.url);
-        fragmented_ota_error_counter++;
-        return(ESP_FAIL); 
-    }
-      
     for(try_count = 0; try_count < MAX_HTTP_TRIES; try_count++)
     {
+        ota_start_request(client, url);
+        if (ota_header_etag[0] != '\0') {
+            esp_http_client_set_header(client, "If-None-Match", ota_header_etag);
+        } else if (ota_header_last_modified[0] != '\0') {
+            esp_http_client_set_header(client, "If-Modified-Since", ota_header_last_modified);
+        }
         err = esp_http_client_open(client, 0);
+        esp_http_client_delete_header(client, "If-None-Match");
+        esp_http_client_delete_header(client, "If-Modified-Since");
         if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to open HTTP connection to %s due to %s", url_config.url, esp_err_to_name(err));
+            ESP_LOGE(TAG, "Failed to open HTTP connection to %s due to %s", url, esp_err_to_name(err));
+            esp_http_client_close(client); // The next try reconnects, in case the server dropped the kept-alive connection
             fragmented_ota_error_counter++;
             vTaskDelay(1000 / portTICK_PERIOD_MS);
             continue;
@@ -361,70 +1400,53 @@ static esp_err_t transfer_url_contents_to_local(esp_http_client_config_t url_con
     if (try_count == MAX_HTTP_TRIES)
     {
         ESP_LOGE(TAG, "Exhausted number of http tries");
-        http_cleanup(client); 
         return(ESP_FAIL);
     }
 
     // We have successfully opened the http connection
     esp_http_client_fetch_headers(client);
-    data_idx = 0;
-    temp_data = (char *)calloc(storage_size, sizeof(char));
-    while(data_idx < storage_size)
+    status = esp_http_client_get_status_code(client);
+    if (status == HTTP_STATUS_NOT_MODIFIED)
     {
-        data_read = esp_http_client_read(client, temp_data, storage_size); 
-        if (data_read < 0)
-        {
-            ESP_LOGE(TAG, "Error: SSL data read error while accessing url values");
-            free(temp_data);
-            http_cleanup(client);
-            return(ESP_FAIL);
-        }
-        else if (data_read == 0)
-        {
-            break;
-        }    
-        else if (data_read > storage_size - data_idx)
-        {
-            ESP_LOGE(TAG, "More data read than what local variable can accommodte");
-            free(temp_data);
-            http_cleanup(client);
-            return(ESP_FAIL);
-        } 
-        
-        memcpy(&local_var[data_idx], temp_data, data_read);  
-        data_idx = data_idx + data_read;
+        *modified = false;
+        ota_end_request(client);
+        return(ESP_OK);
     }
-    if (data_idx != storage_size)
+    else if (status != HTTP_STATUS_OK)
     {
-        ESP_LOGE(TAG, "Data sent by url is %u bytes, which is less than expected %u bytes", data_idx, storage_size);
-        free(temp_data);
-        http_cleanup(client);
+        ESP_LOGE(TAG, "Unexpected HTTP status %d from %s", status, url);
+        esp_http_client_close(client);
         return(ESP_FAIL);
     }
-    
-    free(temp_data);
-    http_cleanup(client);
-    return(ESP_OK); 
+    *modified = true;
+    if (ota_read_manifest(client, ota_header) != ESP_OK || esp_http_client_is_complete_data_received(client) == false)
+    {
+        esp_http_client_close(client);
+        return(ESP_FAIL);
+    }
+    ota_end_request(client);
+    return(ESP_OK);
 }
-  
+
 /* -----------------------------------------------------------
 | prepare_for_ota
-|   Does some error checks and initializes ota related params
+|   Does some error checks on the start of the image. The 
+|   partition is not erased up front: the writer task erases
+|   each sector just before it writes into it
 ------------------------------------------------------------*/
-static esp_err_t prepare_for_ota(int data_read, ota_record_t* ota_record)
+static esp_err_t prepare_for_ota(const char* data, int data_read, ota_record_t* ota_record)
 {
     esp_app_desc_t new_app_info;
-    esp_err_t err;
 
     if (data_read > sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
 
-        if(ESP_IMAGE_HEADER_MAGIC != ota_write_data[0])
+        if(ESP_IMAGE_HEADER_MAGIC != (uint8_t)data[0])
         {
-            ESP_LOGE(TAG, "OTA image has invalid magic byte (expected 0xE9, saw 0x%02x", ota_write_data[0]);
+            ESP_LOGE(TAG, "OTA image has invalid magic byte (expected 0xE9, saw 0x%02x", (uint8_t)data[0]);
             return(ESP_FAIL);
         }
         // check current version with downloading
-        memcpy(&new_app_info, &ota_write_data[sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)], sizeof(esp_app_desc_t));
+        memcpy(&new_app_info, &data[sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)], sizeof(esp_app_desc_t));
         ESP_LOGI(TAG, "New firmware version: %s", new_app_info.version);
 
         if (strcmp(new_app_info.version, ota_record->fw_ver_being_updated) != 0)
@@ -433,13 +1455,7 @@ static esp_err_t prepare_for_ota(int data_read, ota_record_t* ota_record)
             return(ESP_FAIL);
         }
 
-        err = esp_partition_erase_range(ota_record->part, 0, ota_record->part->size);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "esp_ota_begin failed. Partition couldn't be erased");
-            return(ESP_FAIL);
-        }
-        
-        ESP_LOGI(TAG, "esp_ota_begin succeeded");
+        ESP_LOGI(TAG, "Image checks passed");
         return(ESP_OK);
     } else {
         ESP_LOGE(TAG, "received package is not fit len");
@@ -498,6 +1514,18 @@ static void read_flash_ota_record(ota_record_t* ota_record)
     	            ESP_LOGI(TAG, "OTA record file had a different FW version that one being updated. Creating new file default values");
                     update_flash_ota_record(ota_record);
                 }
+                else if (ota_record_temp.format != ota_record->format)
+                {
+			        fclose(ota_record_file);
+    	            ESP_LOGI(TAG, "OTA record file was for a different download (image or patch). Creating new file default values");
+                    update_flash_ota_record(ota_record);
+                }
+                else if (ota_record_temp.image_size != ota_record->image_size)
+                {
+			        fclose(ota_record_file);
+    	            ESP_LOGI(TAG, "OTA record file had a different image size than one being updated. Creating new file default values");
+                    update_flash_ota_record(ota_record);
+                }
                 else if (ota_record_temp.part != ota_record->part)
                 {
 			        fclose(ota_record_file);
@@ -523,23 +1551,10 @@ static void read_flash_ota_record(ota_record_t* ota_record)
 ------------------------------------------------------------*/
 static void update_flash_ota_record(ota_record_t* ota_record)
 {
-	FILE* ota_record_file = NULL;
-    
-    ota_record_file = fopen(OTA_RECORD_FILE_NAME, "wb");
-
-    if (ota_record_file == NULL)
-    {
-        ESP_LOGE(TAG, "Could not create %s", OTA_RECORD_FILE_NAME);
-        abort();
-    }
-    
-    if (fwrite(ota_record, sizeof(ota_record_t), 1, ota_record_file) != 1) {
-    	ESP_LOGE(TAG, "Couldn't write to Spiffs ota file");
-    	fclose(ota_record_file);
+    if (storage_write_file(OTA_RECORD_FILE_NAME, ota_record, sizeof(ota_record_t)) != ESP_OK) {
+    	ESP_LOGE(TAG, "Couldn't write to %s", OTA_RECORD_FILE_NAME);
     	abort();
-    } else {
-    	ESP_LOGI(TAG, "OTA file successfully updated");
-    	fclose(ota_record_file);
-    } 
+    }
+    ESP_LOGI(TAG, "OTA file successfully updated");
 }
 
@@ -33,12 +33,16 @@
 #define MAX_KEY_LEN 25
 #define MAX_VALUE_LEN 25
 
-#define OTA_RECORD_FILE_NAME (const char*)"/spiffs/otarecord.txt"
+#define STORAGE_BASE_PATH "/storage" // Mount point of the storage partition, SPIFFS or LittleFS
+#define OTA_RECORD_FILE_NAME (const char*)STORAGE_BASE_PATH "/otarecord.txt"
+#define ZOMBIE_FILE_NAME STORAGE_BASE_PATH "/zombie_info.txt"
+#define LEGACY_CONFIG_FILE_NAME STORAGE_BASE_PATH "/sysconfig.txt" // Raw struct config_struct, before config_store.c
 
 char raahi_log_str[EVENT_JSON_STR_SIZE];
 #define RAAHI_LOGE( tag, format, ... ) do {\
 	ESP_LOGE(tag, format, ##__VA_ARGS__);\
 	sprintf(raahi_log_str, format, ##__VA_ARGS__);\
+	event_log_append(tag, ESP_LOG_ERROR, raahi_log_str);\
 	strcat(raahi_log_str, " | ESP_LOGE");\
 	compose_mqtt_event(tag, raahi_log_str);\
 	}while(0)
@@ -46,6 +50,7 @@ char raahi_log_str[EVENT_JSON_STR_SIZE];
 #define RAAHI_LOGW( tag, format, ... ) do {\
 	ESP_LOGW(tag, format, ##__VA_ARGS__);\
 	sprintf(raahi_log_str, format, ##__VA_ARGS__);\
+	event_log_append(tag, ESP_LOG_WARN, raahi_log_str);\
 	strcat(raahi_log_str, " | ESP_LOGW");\
 	compose_mqtt_event(tag, raahi_log_str);\
 	}while(0)
@@ -53,6 +58,7 @@ char raahi_log_str[EVENT_JSON_STR_SIZE];
 #define RAAHI_LOGI(tag, format, ... ) do {\
 	ESP_LOGI(tag, format, ##__VA_ARGS__);\
 	sprintf(raahi_log_str, format, ##__VA_ARGS__);\
+	event_log_append(tag, ESP_LOG_INFO, raahi_log_str);\
 	strcat(raahi_log_str, " | ESP_LOGI");\
 	compose_mqtt_event(tag, raahi_log_str);\
 	}while(0)
@@ -60,6 +66,7 @@ char raahi_log_str[EVENT_JSON_STR_SIZE];
 #define RAAHI_LOGD( tag, format, ... ) do {\
 	ESP_LOGD(tag, format, ##__VA_ARGS__);\
 	sprintf(raahi_log_str, format, ##__VA_ARGS__);\
+	event_log_append(tag, ESP_LOG_DEBUG, raahi_log_str);\
 	strcat(raahi_log_str, " | ESP_LOGD");\
 	compose_mqtt_event(tag, raahi_log_str);\
 	}while(0)
@@ -67,6 +74,7 @@ char raahi_log_str[EVENT_JSON_STR_SIZE];
 #define RAAHI_LOGV( tag, format, ... ) do {\
 	ESP_LOGV(tag, format, ##__VA_ARGS__);\
 	sprintf(raahi_log_str, format, ##__VA_ARGS__);\
+	event_log_append(tag, ESP_LOG_VERBOSE, raahi_log_str);\
 	strcat(raahi_log_str, " | ESP_LOGV");\
 	compose_mqtt_event(tag, raahi_log_str);\
 	}while(0)
@@ -80,6 +88,102 @@ char raahi_log_str[EVENT_JSON_STR_SIZE];
 
 // Function declarations
 void compose_mqtt_event(const char *TAG, char *msg);
+bool queue_mqtt_query(const char *json);
+void compose_mqtt_topics(char *data_topic, char *event_topic, char *query_topic, char *subscribe_topic);
+void handle_subscribed_message(char *payload, uint16_t payload_len);
+void note_mqtt_publish(size_t payload_len, int64_t publish_start_us);
+
+// utilities.c: per-device jitter, so the fleet doesn't act in lockstep
+enum jitter_salt {JITTER_DAILY_RESTART = 0, JITTER_OTA_START, JITTER_RECONNECT};
+uint32_t device_jitter_ms(uint32_t window_ms, uint32_t salt);
+void device_jitter_delay(uint32_t window_ms, uint32_t salt);
+
+// modem_link.c: PPP link supervision and in-place recovery
+void modem_link_init(void);
+void modem_link_set_up(void);
+void modem_link_report_down(const char *reason);
+esp_err_t modem_link_recover(const char *reason);
+bool modem_link_is_up(void);
+bool modem_link_wait_up(uint32_t timeout_ms);
+uint32_t modem_link_generation(void);
+void modem_link_note_mqtt_up(void);
+void modem_link_sleep(void);
+void modem_link_wake(void);
+
+// storage.c: the filesystem on the storage partition
+esp_err_t init_storage(void);
+esp_err_t storage_write_file(const char *path, const void *contents, size_t size);
+
+// event_log.c: RAAHI_LOGx events kept on the storage partition across restarts
+void event_log_init(void);
+void event_log_append(const char *tag, esp_log_level_t level, const char *msg);
+void event_log_flush(bool force);
+void event_log_upload(void);
+
+// boot_trace.c: when each phase of the boot was first reached
+#define BOOT_TRACE_STR_SIZE 120
+typedef enum {BOOT_PHASE_STORAGE = 0, BOOT_PHASE_SOFTAP, BOOT_PHASE_MODEM_READY, BOOT_PHASE_MODEM_STATUS,
+              BOOT_PHASE_LINK_UP, BOOT_PHASE_TIME_SET, BOOT_PHASE_MQTT_CONNECTED, BOOT_PHASE_FIRST_PUBLISH, BOOT_PHASE_COUNT} boot_phase_t;
+void boot_trace_mark(boot_phase_t phase);
+void boot_trace_format(char *str, size_t str_len);
+
+// metrics.c: per-task CPU and stack, and heap usage, collected periodically
+#define METRICS_MAX_TASKS 24
+#define METRICS_TASK_NAME_LEN 16 // CONFIG_FREERTOS_MAX_TASK_NAME_LEN
+typedef struct {
+    char name[METRICS_TASK_NAME_LEN];
+    uint8_t cpu_percent; // Of both cores, since the previous collection
+    uint32_t stack_free; // Lowest ever, bytes
+} task_metrics_t;
+typedef struct {
+    int64_t collected_us;
+    uint32_t heap_free;
+    uint32_t heap_min_free;
+    uint32_t heap_largest_block;
+    uint8_t task_count;
+    task_metrics_t tasks[METRICS_MAX_TASKS];
+} metrics_t;
+void metrics_collect(void);
+void metrics_get(metrics_t *m);
+
+// latency.c: how long samples take from the sensor to MQTT, per stage
+#define LATENCY_BUCKETS 20 // Power-of-two ms buckets, the last one is for 262 s and over
+typedef enum {LATENCY_READ = 0, LATENCY_QUEUE, LATENCY_PUBLISH, LATENCY_TOTAL, LATENCY_STAGES} latency_stage_t;
+typedef struct {
+    uint32_t samples;
+    uint32_t count[LATENCY_STAGES][LATENCY_BUCKETS];
+    uint64_t sum_ms[LATENCY_STAGES];
+    uint32_t max_ms[LATENCY_STAGES];
+} latency_hist_t;
+extern const char *latency_stage_names[LATENCY_STAGES];
+void latency_note_sent(uint8_t slot, int64_t publish_start_us);
+void latency_report(void);
+void latency_get(latency_hist_t *hist);
+
+// live.c: data and events streamed to local clients on /live
+void live_publish(const char *type, const char *json);
+
+// crash_report.c: core dump of the last crash summarized and published
+void crash_report_init(void);
+void crash_report_sample_stacks(void);
+void crash_report_check_sent(void);
+
+// config_store.c: sysconfig in NVS, one key per field, updated through a shadow copy
+struct config_struct;
+void config_store_load(struct config_struct *config);
+void config_store_read(struct config_struct *copy);
+void config_store_edit(struct config_struct *shadow);
+void config_store_drop(void);
+esp_err_t config_store_commit(const struct config_struct *shadow);
+uint32_t config_store_client_id_generation(void);
+
+// ota.c: telemetry has priority over the image download on the shared link
+void ota_yield_to_telemetry(void);
+bool ota_is_downloading(void);
+
+// native_mqtt.c: MQTT through the BG96's own stack (CONFIG_MQTT_TRANSPORT_BG96)
+void native_mqtt_task(void *param);
+void native_mqtt_obtain_time(void);
 
 // Data type definitions
 enum adc_port_type {NONE = 0, FOURTWENTY, RESISTIVE, DIRECT};
@@ -111,6 +215,8 @@ struct config_struct {
 
 struct data_json_struct {
 	char packet[DATA_JSON_QUEUE_SIZE][DATA_JSON_STR_SIZE];
+	int64_t capture_us[DATA_JSON_QUEUE_SIZE]; // esp_timer time the sample was read, see latency.c
+	int64_t enqueue_us[DATA_JSON_QUEUE_SIZE];
 	uint8_t read_ptr;
 	uint8_t write_ptr;
 };
@@ -136,6 +242,9 @@ enum slave_status{
 struct slave_info_struct {
 	enum slave_status status;
 	uint16_t data[MAX_MODBUS_REGISTERS]; 
+	uint32_t reads_ok; // Register reads since boot, by outcome
+	uint32_t crc_errors;
+	uint32_t timeouts;
 };
 
 struct debug_data_struct {
@@ -149,6 +258,24 @@ struct debug_data_struct {
 	bool connected_to_internet;
 	bool connected_to_aws;
     char reset_reason_str[30];
+	uint16_t link_recoveries; // PPP link recoveries since boot
+	uint32_t last_link_recovery_ms; // Link down to IP address of the last recovery
+	uint32_t max_link_recovery_ms;
+	uint32_t last_mqtt_recovery_ms; // Link down to MQTT connected of the last recovery
+	uint16_t modem_sleeps; // Duty-cycled sleeps since boot
+	uint32_t modem_awake_s_last_hour; // Modem awake time in the last completed hour
+	uint32_t mqtt_tx_msgs; // MQTT transport stats, comparable between the AWS SDK and the BG96 stack
+	uint32_t mqtt_tx_bytes;
+	uint32_t mqtt_tx_time_ms; // Time spent in publish calls
+	uint32_t mqtt_tx_max_ms; // Longest publish call
+	uint32_t mqtt_tx_msgs_during_ota; // Publishes while an image was downloading, to compare their latency
+	uint32_t mqtt_tx_time_ms_during_ota;
+	uint32_t ota_rate_bps; // Download rate of the last OTA session
+	uint32_t ota_shaped_ms; // OTA download time held back by the rate limit
+	uint32_t ota_yielded_ms; // OTA download time held back for telemetry
+	uint32_t ota_read_max_ms; // Longest OTA network read
+	uint32_t data_json_dropped; // Packets dropped for a full queue, since boot
+	uint32_t event_json_dropped;
 };
 
 typedef struct {
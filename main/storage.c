@@ -0,0 +1,343 @@
+/**************************************************************
+* storage.c
+*
+* Mounts the "storage" partition that holds the zombie info, the
+* OTA record and the legacy sysconfig file, as SPIFFS or, with
+* CONFIG_STORAGE_LITTLEFS, as LittleFS (the esp_littlefs component).
+* LittleFS is copy-on-write, so a power cut leaves a file as it
+* was before or after a write.
+*
+* A device that switches to LittleFS still has SPIFFS on the
+* partition. On that first boot the known files are stashed in
+* NVS, the partition is formatted as LittleFS and the files are
+* written back. The stash is only dropped after that, so a power
+* cut anywhere in between finishes the migration on the next boot:
+* a complete stash means the format may not have finished, and
+* the stash is written back without looking at SPIFFS again
+*
+* Files are replaced with storage_write_file(): the new contents
+* go to a temporary file that is then renamed over the old one.
+* init_storage() finishes or drops an interrupted replace
+**************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_spiffs.h"
+#ifdef CONFIG_STORAGE_LITTLEFS
+#include "esp_littlefs.h"
+#endif
+#include "nvs.h"
+
+#include "raahi.h"
+
+#define STORAGE_PARTITION_LABEL "storage"
+#define STORAGE_TMP_SUFFIX ".tmp"
+#define STORAGE_MAX_PATH 64
+#define STORAGE_STASH_NAMESPACE "fsmigrate"
+#define STORAGE_STASH_DONE_KEY "done"   // Set once every file is in the stash
+#define STORAGE_MAX_FILE_SIZE 4000     // Largest file the stash takes, well over any of the files below
+
+static const char *TAG = "storage";
+
+// Files that survive a change of filesystem
+typedef struct
+{
+    const char *path;
+    const char *key;            // In the NVS stash, at most 15 characters
+}storage_file_t;
+
+static const storage_file_t storage_files[] = {
+    { ZOMBIE_FILE_NAME, "zombie" },
+    { OTA_RECORD_FILE_NAME, "otarecord" },
+    { LEGACY_CONFIG_FILE_NAME, "sysconfig" },
+};
+#define STORAGE_FILE_COUNT (sizeof(storage_files) / sizeof(storage_files[0]))
+
+
+/* -----------------------------------------------------------
+| storage_mount_spiffs
+|   Mounts the partition as SPIFFS, formatting it if asked to
+|   when it doesn't mount
+------------------------------------------------------------*/
+static esp_err_t storage_mount_spiffs(bool format_if_mount_failed)
+{
+    esp_vfs_spiffs_conf_t conf = {
+      .base_path = STORAGE_BASE_PATH,
+      .partition_label = STORAGE_PARTITION_LABEL,
+      .max_files = 5,   // This decides the maximum number of files that can be created on the storage
+      .format_if_mount_failed = format_if_mount_failed
+    };
+    size_t total = 0, used = 0;
+    esp_err_t ret;
+
+    ret = esp_vfs_spiffs_register(&conf);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (esp_spiffs_info(STORAGE_PARTITION_LABEL, &total, &used) == ESP_OK) {
+        ESP_LOGI(TAG, "SPIFFS partition size: total: %d, used: %d", total, used);
+    }
+    return ESP_OK;
+}
+
+#ifdef CONFIG_STORAGE_LITTLEFS
+/* -----------------------------------------------------------
+| storage_mount_littlefs
+|   Mounts the partition as LittleFS, formatting it if asked to
+|   when it doesn't mount
+------------------------------------------------------------*/
+static esp_err_t storage_mount_littlefs(bool format_if_mount_failed)
+{
+    esp_vfs_littlefs_conf_t conf = {
+        .base_path = STORAGE_BASE_PATH,
+        .partition_label = STORAGE_PARTITION_LABEL,
+        .format_if_mount_failed = format_if_mount_failed,
+    };
+    size_t total = 0, used = 0;
+    esp_err_t ret;
+
+    ret = esp_vfs_littlefs_register(&conf);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (esp_littlefs_info(STORAGE_PARTITION_LABEL, &total, &used) == ESP_OK) {
+        ESP_LOGI(TAG, "LittleFS partition size: total: %d, used: %d", total, used);
+    }
+    return ESP_OK;
+}
+
+/* -----------------------------------------------------------
+| storage_stash_complete
+|   Whether NVS holds a complete stash, which is only dropped
+|   once it is written back
+------------------------------------------------------------*/
+static bool storage_stash_complete(void)
+{
+    nvs_handle handle;
+    uint8_t done = 0;
+
+    if (nvs_open(STORAGE_STASH_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+    if (nvs_get_u8(handle, STORAGE_STASH_DONE_KEY, &done) != ESP_OK) {
+        done = 0;
+    }
+    nvs_close(handle);
+    return done != 0;
+}
+
+/* -----------------------------------------------------------
+| storage_stash_files
+|   Copies the known files from the mounted SPIFFS into NVS.
+|   Returns ESP_OK only if all of them (that exist) are there
+------------------------------------------------------------*/
+static esp_err_t storage_stash_files(void)
+{
+    nvs_handle handle;
+    struct stat st;
+    FILE *file;
+    uint8_t *contents;
+    esp_err_t err;
+    uint8_t i;
+
+    err = nvs_open(STORAGE_STASH_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_erase_all(handle); // Leftovers of a stash that was interrupted
+    for (i = 0; i < STORAGE_FILE_COUNT && err == ESP_OK; i++) {
+        if (stat(storage_files[i].path, &st) != 0) {
+            continue;
+        }
+        if (st.st_size > STORAGE_MAX_FILE_SIZE) {
+            ESP_LOGW(TAG, "%s is %ld bytes, too large to migrate", storage_files[i].path, st.st_size);
+            continue;
+        }
+        contents = malloc(st.st_size + 1); // + 1 so an empty file doesn't get a NULL
+        file = fopen(storage_files[i].path, "rb");
+        if (contents == NULL || file == NULL || fread(contents, 1, st.st_size, file) != st.st_size) {
+            ESP_LOGE(TAG, "Couldn't read %s", storage_files[i].path);
+            err = ESP_FAIL;
+        } else {
+            err = nvs_set_blob(handle, storage_files[i].key, contents, st.st_size);
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        free(contents);
+    }
+    if (err == ESP_OK) {
+        err = nvs_set_u8(handle, STORAGE_STASH_DONE_KEY, 1);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+/* -----------------------------------------------------------
+| storage_restore_files
+|   Writes a complete stash back to the mounted filesystem and
+|   drops it. Does nothing if there is no complete stash
+------------------------------------------------------------*/
+static void storage_restore_files(void)
+{
+    nvs_handle handle;
+    uint8_t done = 0;
+    uint8_t *contents;
+    size_t size;
+    esp_err_t err = ESP_OK;
+    uint8_t i;
+
+    if (nvs_open(STORAGE_STASH_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_u8(handle, STORAGE_STASH_DONE_KEY, &done) != ESP_OK || done == 0) {
+        nvs_close(handle);
+        return;
+    }
+    for (i = 0; i < STORAGE_FILE_COUNT && err == ESP_OK; i++) {
+        if (nvs_get_blob(handle, storage_files[i].key, NULL, &size) != ESP_OK) {
+            continue; // The file wasn't there on SPIFFS either
+        }
+        contents = malloc(size + 1);
+        if (contents == NULL || nvs_get_blob(handle, storage_files[i].key, contents, &size) != ESP_OK) {
+            err = ESP_FAIL;
+        } else {
+            err = storage_write_file(storage_files[i].path, contents, size);
+        }
+        free(contents);
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "Migrated %s, %u bytes", storage_files[i].path, size);
+        }
+    }
+    if (err == ESP_OK) { // Otherwise keep the stash for the next boot
+        nvs_erase_all(handle);
+        nvs_commit(handle);
+    } else {
+        ESP_LOGE(TAG, "Couldn't write back the migrated files");
+    }
+    nvs_close(handle);
+}
+#endif
+
+/* -----------------------------------------------------------
+| storage_recover_writes
+|   Finishes or drops a storage_write_file() that a restart
+|   interrupted. A temporary file next to its target may not be
+|   complete, so the target wins. A temporary file on its own
+|   was complete, as the target is only removed after that
+------------------------------------------------------------*/
+static void storage_recover_writes(void)
+{
+    char tmp_path[STORAGE_MAX_PATH];
+    struct stat st;
+    uint8_t i;
+
+    for (i = 0; i < STORAGE_FILE_COUNT; i++) {
+        snprintf(tmp_path, sizeof(tmp_path), "%s" STORAGE_TMP_SUFFIX, storage_files[i].path);
+        if (stat(tmp_path, &st) != 0) {
+            continue;
+        }
+        if (stat(storage_files[i].path, &st) == 0) {
+            ESP_LOGW(TAG, "Dropping an unfinished write of %s", storage_files[i].path);
+            remove(tmp_path);
+        } else {
+            ESP_LOGW(TAG, "Finishing an interrupted write of %s", storage_files[i].path);
+            rename(tmp_path, storage_files[i].path);
+        }
+    }
+}
+
+/* -----------------------------------------------------------
+| storage_write_file
+|   Replaces the contents of a file so that a restart at any
+|   point leaves either the old or the new contents. LittleFS
+|   renames over the old file atomically. SPIFFS can't rename
+|   over an existing file, so the old one is removed first and
+|   storage_recover_writes() covers the gap
+------------------------------------------------------------*/
+esp_err_t storage_write_file(const char *path, const void *contents, size_t size)
+{
+    char tmp_path[STORAGE_MAX_PATH];
+    FILE *file;
+    bool written;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s" STORAGE_TMP_SUFFIX, path);
+    file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        ESP_LOGE(TAG, "Could not create %s", tmp_path);
+        return ESP_FAIL;
+    }
+    written = (fwrite(contents, 1, size, file) == size);
+    if (fclose(file) != 0 || written == false) {
+        ESP_LOGE(TAG, "Couldn't write %s", tmp_path);
+        remove(tmp_path);
+        return ESP_FAIL;
+    }
+#ifndef CONFIG_STORAGE_LITTLEFS
+    remove(path);
+#endif
+    if (rename(tmp_path, path) != 0) {
+        ESP_LOGE(TAG, "Couldn't rename %s to %s", tmp_path, path);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/* -----------------------------------------------------------
+| init_storage
+|   Mounts the storage partition with the configured filesystem,
+|   migrating SPIFFS to LittleFS if that is still on it
+------------------------------------------------------------*/
+esp_err_t init_storage(void)
+{
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t ret;
+
+#ifdef CONFIG_STORAGE_LITTLEFS
+    ESP_LOGI(TAG, "Initializing LittleFS");
+    ret = storage_mount_littlefs(false);
+    if (ret != ESP_OK) {
+        // Not LittleFS yet: SPIFFS of an older firmware, a migration that was cut short or a blank partition.
+        // With a complete stash the format was cut short. What SPIFFS still holds then can't be trusted
+        if (storage_stash_complete() == true) {
+            ESP_LOGW(TAG, "Finishing an interrupted migration to LittleFS");
+        } else if (storage_mount_spiffs(false) == ESP_OK) {
+            ESP_LOGW(TAG, "Migrating the storage partition from SPIFFS to LittleFS");
+            ret = storage_stash_files();
+            esp_vfs_spiffs_unregister(STORAGE_PARTITION_LABEL);
+            if (ret != ESP_OK) {
+                ESP_LOGE(TAG, "Couldn't stash the files in NVS (%s)", esp_err_to_name(ret));
+                return ESP_FAIL;
+            }
+        }
+        ret = storage_mount_littlefs(true);
+    }
+    if (ret == ESP_OK) {
+        storage_restore_files();
+    }
+#else
+    ESP_LOGI(TAG, "Initializing SPIFFS");
+    ret = storage_mount_spiffs(true);
+#endif
+    if (ret != ESP_OK) {
+        if (ret == ESP_FAIL) {
+            ESP_LOGE(TAG, "Failed to mount or format filesystem");
+        } else if (ret == ESP_ERR_NOT_FOUND) {
+            ESP_LOGE(TAG, "Failed to find the %s partition", STORAGE_PARTITION_LABEL);
+        } else {
+            ESP_LOGE(TAG, "Failed to initialize the filesystem (%s)", esp_err_to_name(ret));
+        }
+        return ESP_FAIL;
+    }
+    storage_recover_writes();
+    ESP_LOGI(TAG, "Storage mounted in %lld us", esp_timer_get_time() - start_us);
+    boot_trace_mark(BOOT_PHASE_STORAGE);
+    return ESP_OK;
+}
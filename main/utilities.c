@@ -4,6 +4,7 @@
 **************************************************************/
 
 #include <string.h>
+#include <sys/param.h>
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_vfs_fat.h"
@@ -14,6 +15,7 @@
 #include "raahi.h"
 #include "freertos/task.h"
 #include "esp_sntp.h"
+#include "esp_task_wdt.h"
 
 #define RGB_LED_GREEN_PIN 27 // TODO: Move this to sdkconfig
 #define RGB_LED_RED_PIN 32 // TODO: Move this to sdkconfig
@@ -238,33 +240,35 @@ void create_info_json(char* json_str, uint16_t json_str_len)
 void display_sysconfig(void)
 {
 	uint8_t slave_id_idx, reg_address_idx;
+	struct config_struct config;
 
+	config_store_read(&config);
 	RAAHI_LOGI(TAG, "**************** Syconfig Data ******************");
 
 	// Display slave IDs	
 	for (slave_id_idx = 0; slave_id_idx < MAX_MODBUS_SLAVES; slave_id_idx++)
 	{	
-		if (sysconfig.slave_id[slave_id_idx] == 0) {// Slave ID of 0 is considered to be an uninitialized entry
+		if (config.slave_id[slave_id_idx] == 0) {// Slave ID of 0 is considered to be an uninitialized entry
 			break;
 		}
-		RAAHI_LOGI(TAG, "Slave ID of Slave %d = %d", slave_id_idx + 1, sysconfig.slave_id[slave_id_idx]);
+		RAAHI_LOGI(TAG, "Slave ID of Slave %d = %d", slave_id_idx + 1, config.slave_id[slave_id_idx]);
 	}
 	
 	// Display register addresses
 	for (reg_address_idx = 0; reg_address_idx < MAX_MODBUS_REGISTERS; reg_address_idx++)
 	{
-		if (sysconfig.reg_address[reg_address_idx] == 0) {// reg address 0 is considered to be unintialized entry
+		if (config.reg_address[reg_address_idx] == 0) {// reg address 0 is considered to be unintialized entry
 			break;
 		}
-		RAAHI_LOGI(TAG, "Reg Address %d is 0x%.4X", reg_address_idx + 1, sysconfig.reg_address[reg_address_idx]);
+		RAAHI_LOGI(TAG, "Reg Address %d is 0x%.4X", reg_address_idx + 1, config.reg_address[reg_address_idx]);
 	}
 
 	// Display the rest of the information
-	RAAHI_LOGI(TAG, "Sampling period (sec): %d", sysconfig.sampling_period_in_sec);
+	RAAHI_LOGI(TAG, "Sampling period (sec): %d", config.sampling_period_in_sec);
 
-	RAAHI_LOGI(TAG, "Client ID: %s", sysconfig.client_id);	
-	RAAHI_LOGI(TAG, "Topic: %s", sysconfig.topic);
-	RAAHI_LOGI(TAG, "Apn: %s", sysconfig.apn);
+	RAAHI_LOGI(TAG, "Client ID: %s", config.client_id);	
+	RAAHI_LOGI(TAG, "Topic: %s", config.topic);
+	RAAHI_LOGI(TAG, "Apn: %s", config.apn);
 	
 	RAAHI_LOGI(TAG, "*************************************************");
 }
@@ -273,15 +277,14 @@ void display_sysconfig(void)
 | 	read_zombie_info()
 | 	We store all the debug info we want to survive a restart
 | 	into a struct which is then stored into a file in the  
-|   SPIFFS. We then retrieve it on every boot
+|   storage partition. We then retrieve it on every boot
 ------------------------------------------------------------*/
 void read_zombie_info()
 {
-	static const char* zombie_file_name = "/spiffs/zombie_info.txt";
 	FILE* zombie_file = NULL;
 	size_t content_size;
     
-	zombie_file = fopen(zombie_file_name, "rb");
+	zombie_file = fopen(ZOMBIE_FILE_NAME, "rb");
 	if (zombie_file == NULL) 
     { // If zombie file isnt' present, fill zombie struct with default values
         zombie_info.esp_restart_reason[0] = '\0';
@@ -303,108 +306,29 @@ void read_zombie_info()
 | 	write_zombie_info()
 | 	We store all the debug info we want to survive a restart
 | 	into a struct which is then stored into a file in the  
-|   SPIFFS. We then retrieve it on every boot
+|   storage partition. We then retrieve it on every boot
 ------------------------------------------------------------*/
 void write_zombie_info()
 {
-	static const char* zombie_file_name = "/spiffs/zombie_info.txt";
-	FILE* zombie_file = NULL;
-    
-	zombie_file = fopen(zombie_file_name, "wb");
-	if (fwrite(&zombie_info, sizeof(zombie_info_struct), 1, zombie_file) != 1) {
-		ESP_LOGE(TAG, "Couldn't write to Spiffs file zombie_info.txt");
-		fclose(zombie_file);
+	if (storage_write_file(ZOMBIE_FILE_NAME, &zombie_info, sizeof(zombie_info_struct)) != ESP_OK) {
+		ESP_LOGE(TAG, "Couldn't write to %s", ZOMBIE_FILE_NAME);
 		abort();
-	} else {
-		fclose(zombie_file);
 	}
 }
 
 
 /* -----------------------------------------------------------
 | 	read_sysconfig()
-| 	We store all the system configuration options that can be
-| 	changed at run-time to a file in spiffs so that it can 
-|	persist between boots 
+| 	Loads the system configuration options that can be changed
+| 	at run-time from the config store (config_store.c), so that
+|	they persist between boots 
 ------------------------------------------------------------*/
 void read_sysconfig()
 {
-	static const char* config_file_name = "/spiffs/sysconfig.txt";
-	FILE* config_file = NULL;
-	struct config_struct default_config;
-	size_t content_size;
-
-	// Populate the default config
-	default_config.slave_id[0] = CONFIG_FIRST_SLAVE_ID; // From sdkconfig	
-	default_config.slave_id[1] = CONFIG_SECOND_SLAVE_ID;
-	default_config.reg_address[0] = CONFIG_FIRST_REG;
-	default_config.reg_address[1] = CONFIG_SECOND_REG;
-	default_config.reg_address[2] = CONFIG_THIRD_REG;
-	default_config.sampling_period_in_sec = CONFIG_SAMPLING_PERIOD;
-	
-	default_config.analog_sensor_type[0] = NONE;
-	default_config.analog_sensor_type[1] = NONE;
-	default_config.analog_sensor_type[2] = NONE;
-	default_config.analog_sensor_type[3] = NONE;
-	
-	strcpy(default_config.client_id, "raahi_new");
-	strcpy(default_config.topic, CONFIG_MQTT_TOPIC_ROOT);
-	strcpy(default_config.apn, CONFIG_EXAMPLE_MODEM_APN);
-
-	config_file = fopen(config_file_name, "rb");
-	if (config_file == NULL) { // If config file isnt' present, create one with default values
-		ESP_LOGI(TAG, "Config file not present. Creating one with default values");
-		config_file = fopen(config_file_name, "wb");
-		
-		if (fwrite(&default_config, sizeof(struct config_struct), 1, config_file) != 1) {
-			ESP_LOGE(TAG, "Couldn't write to Spiffs file sysconfig.txt");
-			fclose(config_file);
-			abort();
-		} else {
-			ESP_LOGI(TAG, "Config file successfully populated with default values");
-			sysconfig = default_config; // Also populate the global variable that will be used by many functions
-			fclose(config_file);
-		}
-
-	} else { // sysconfig.txt file is present. So populate global variable with data from it
-		fseek(config_file, 0, SEEK_END);
-		unsigned int file_size = ftell(config_file);
-		fseek(config_file, 0, SEEK_SET);
-
-		printf("File Size: %u\n", file_size);
-		printf("Sysconfig Size: %u\n",  sizeof(struct config_struct));
-
-		if (file_size != sizeof(struct config_struct)) // If sysconfig file in the flash is old
-		{
-			fclose(config_file);
-			
-			ESP_LOGI(TAG, "Config file belonged to old firmware version. Overwriting it with default values of the new firmware");
-			config_file = fopen(config_file_name, "wb");
-			
-			if (fwrite(&default_config, sizeof(struct config_struct), 1, config_file) != 1) {
-				ESP_LOGE(TAG, "Couldn't write to Spiffs file sysconfig.txt");
-				fclose(config_file);
-				abort();
-			} else {
-				ESP_LOGI(TAG, "Config file successfully populated with default values");
-				sysconfig = default_config; // Also populate the global variable that will be used by many functions
-				fclose(config_file);
-			}
-		}
-		else
-		{
-			if((content_size = fread(&sysconfig, sizeof(struct config_struct), 1, config_file)) != 1) {
-				ESP_LOGE(TAG, "Couldn't read sysconfig.txt contents");
-				abort();
-			} else {
-				ESP_LOGI(TAG, "Successfully read sysconfig.txt contents into internal variable");
-				// Display what was read
-				display_sysconfig();
-				fclose(config_file);
-			}
-		}
-	}
+	config_store_load(&sysconfig);
+	display_sysconfig();
 }
+
 uint8_t parseJson(char* json_str, uint16_t json_str_len, struct json_struct* parsed_result)
 {
     uint16_t char_count = 0;
@@ -480,64 +404,79 @@ uint8_t parseJson(char* json_str, uint16_t json_str_len, struct json_struct* par
     return(item_count);
 } // End of parse_Json function
 
+/* -----------------------------------------------------------
+| 	sysconfig_copy_str()
+| 	Copies a string value into a sysconfig field, unless it
+| 	doesn't fit
+------------------------------------------------------------*/
+static void sysconfig_copy_str(char* field, const char* value, size_t field_size)
+{
+	if (strlen(value) >= field_size) {
+		RAAHI_LOGE(TAG, "%s is longer than %u characters. Not used", value, field_size - 1);
+		return;
+	}
+	strcpy(field, value);
+}
+
 void sysconfig_json_write(struct json_struct* parsed_json, uint8_t no_of_items)
 {
     uint8_t item_idx;
     int32_t tmpVal;
-	static const char* config_file_name = "/spiffs/sysconfig.txt";
-	FILE* config_file = NULL;
-    bool client_id_updated = false;
+    struct config_struct shadow;
 
+    if(no_of_items <= 1) { // Just a protection against a json that only has type field
+        return;
+    }
+    config_store_edit(&shadow);
     for(item_idx = 1; item_idx < no_of_items; item_idx++) // We are starting from 1 because the 0th index contained type info that has already been parsed
     {
         if(strcmp(parsed_json[item_idx].key, "first_slave_id") == 0)
         {
 	        if((tmpVal = str2num(parsed_json[item_idx].value, '\0', 4)) >= 0) { // Update only if the value is not negative (indicating conversion error)
-		        sysconfig.slave_id[0] = (uint8_t)tmpVal;
+		        shadow.slave_id[0] = (uint8_t)tmpVal;
 	        }
         }
         else if(strcmp(parsed_json[item_idx].key, "second_slave_id") == 0)
         {
 	        if((tmpVal = str2num(parsed_json[item_idx].value, '\0', 4)) >= 0) {
-		        sysconfig.slave_id[1] = (uint8_t)tmpVal;
+		        shadow.slave_id[1] = (uint8_t)tmpVal;
 	        }
         }
         else if(strcmp(parsed_json[item_idx].key, "first_reg_address") == 0)
         {
 	        if((tmpVal = str2num(parsed_json[item_idx].value, '\0', 6)) >= 0) {
-		        sysconfig.reg_address[0] = (uint16_t)tmpVal;
+		        shadow.reg_address[0] = (uint16_t)tmpVal;
 	        }
         }
         else if(strcmp(parsed_json[item_idx].key, "second_reg_address") == 0)
         {
 	        if((tmpVal = str2num(parsed_json[item_idx].value, '\0', 6)) >= 0) {
-		        sysconfig.reg_address[1] = (uint16_t)tmpVal;
+		        shadow.reg_address[1] = (uint16_t)tmpVal;
 	        }
         }
         else if(strcmp(parsed_json[item_idx].key, "third_reg_address") == 0)
         {
 	        if((tmpVal = str2num(parsed_json[item_idx].value, '\0', 6)) >= 0) {
-		        sysconfig.reg_address[2] = (uint16_t)tmpVal;
+		        shadow.reg_address[2] = (uint16_t)tmpVal;
 	        }
         }
         else if(strcmp(parsed_json[item_idx].key, "sampling_period_in_sec") == 0)
         {
 	        if((tmpVal = str2num(parsed_json[item_idx].value, '\0', 4)) >= 0) {
-		        sysconfig.sampling_period_in_sec = (uint8_t)tmpVal;
+		        shadow.sampling_period_in_sec = (uint16_t)tmpVal;
 	        }
         }
         else if(strcmp(parsed_json[item_idx].key, "client_id") == 0)
         {
-            strcpy(sysconfig.client_id,  parsed_json[item_idx].value);
-            client_id_updated = true;
+            sysconfig_copy_str(shadow.client_id, parsed_json[item_idx].value, sizeof(shadow.client_id));
         }
         else if(strcmp(parsed_json[item_idx].key, "topic") == 0)
         {
-            strcpy(sysconfig.topic,  parsed_json[item_idx].value);
+            sysconfig_copy_str(shadow.topic, parsed_json[item_idx].value, sizeof(shadow.topic));
         }
         else if(strcmp(parsed_json[item_idx].key, "apn") == 0)
         {
-            strcpy(sysconfig.apn,  parsed_json[item_idx].value);
+            sysconfig_copy_str(shadow.apn, parsed_json[item_idx].value, sizeof(shadow.apn));
         }
         else // Error check
         {
@@ -545,27 +484,14 @@ void sysconfig_json_write(struct json_struct* parsed_json, uint8_t no_of_items)
         }
     }
 
-    if(no_of_items > 1) // Just a protection against a json that only has type field
-    {
-        display_sysconfig(); // so that we will know in AWS if the changes have indeed taken place
-	    config_file = fopen(config_file_name, "wb");
-
-	    if(fwrite(&sysconfig, sizeof(struct config_struct), 1, config_file) != 1) {
-	    	RAAHI_LOGE(TAG, "Couldn't update sysconfig file although it is present");
-	    	abort();
-	    } else {
-	    	RAAHI_LOGI(TAG, "Successfully updated sysconfig file");
-	    }
-	    fclose(config_file);
-
-	    if(client_id_updated == true) {
-	    	ESP_LOGI(TAG, "Client ID updated. So restarting");
-            strcpy(zombie_info.esp_restart_reason, "Client ID Updated (Util)");
-           	vTaskDelay(5000 / portTICK_RATE_MS);
-	    	raahi_restart();
-	    }
+    // All the changes are applied together, or none if any of them is invalid. A new client ID is
+    // picked up by the MQTT task, which reconnects with it
+    if(config_store_commit(&shadow) != ESP_OK) {
+    	RAAHI_LOGE(TAG, "Sysconfig update rejected, nothing changed");
+    } else {
+    	RAAHI_LOGI(TAG, "Successfully updated the config store");
     }
-
+    display_sysconfig(); // so that we will know in AWS if the changes have indeed taken place
 }
 
 void create_sysconfig_json(char* json_str, uint16_t json_str_len)
@@ -575,8 +501,10 @@ void create_sysconfig_json(char* json_str, uint16_t json_str_len)
 	uint16_t running_str_len;
 	char tempStr[MAX_KEY_LEN + MAX_VALUE_LEN];  
   	time_t now;
+	struct config_struct config;
 
 	time(&now);
+	config_store_read(&config);
 
 	sprintf(sysconfig_json[no_of_items].key, "\"deviceId\"");
 	sprintf(sysconfig_json[no_of_items].value, "\"%s\"", user_mqtt_str);
@@ -587,39 +515,39 @@ void create_sysconfig_json(char* json_str, uint16_t json_str_len)
 	no_of_items++;
 	
 	sprintf(sysconfig_json[no_of_items].key, "\"first_slave_id\"");
-	sprintf(sysconfig_json[no_of_items].value, "%u", sysconfig.slave_id[0]);
+	sprintf(sysconfig_json[no_of_items].value, "%u", config.slave_id[0]);
 	no_of_items++;
 
 	sprintf(sysconfig_json[no_of_items].key, "\"second_slave_id\"");
-	sprintf(sysconfig_json[no_of_items].value, "%u", sysconfig.slave_id[1]);
+	sprintf(sysconfig_json[no_of_items].value, "%u", config.slave_id[1]);
 	no_of_items++;
 
 	sprintf(sysconfig_json[no_of_items].key, "\"first_reg_address\"");
-	sprintf(sysconfig_json[no_of_items].value, "%u", sysconfig.reg_address[0]);
+	sprintf(sysconfig_json[no_of_items].value, "%u", config.reg_address[0]);
 	no_of_items++;
 	
 	sprintf(sysconfig_json[no_of_items].key, "\"second_reg_address\"");
-	sprintf(sysconfig_json[no_of_items].value, "%u", sysconfig.reg_address[1]);
+	sprintf(sysconfig_json[no_of_items].value, "%u", config.reg_address[1]);
 	no_of_items++;
 	
 	sprintf(sysconfig_json[no_of_items].key, "\"third_reg_address\"");
-	sprintf(sysconfig_json[no_of_items].value, "%u", sysconfig.reg_address[2]);
+	sprintf(sysconfig_json[no_of_items].value, "%u", config.reg_address[2]);
 	no_of_items++;
 
 	sprintf(sysconfig_json[no_of_items].key, "\"sampling_period_in_sec\"");
-	sprintf(sysconfig_json[no_of_items].value, "%u", sysconfig.sampling_period_in_sec);
+	sprintf(sysconfig_json[no_of_items].value, "%u", config.sampling_period_in_sec);
 	no_of_items++;
 	
 	sprintf(sysconfig_json[no_of_items].key, "\"client_id\"");
-	sprintf(sysconfig_json[no_of_items].value, "\"%s\"", sysconfig.client_id);
+	sprintf(sysconfig_json[no_of_items].value, "\"%s\"", config.client_id);
 	no_of_items++;
 	
 	sprintf(sysconfig_json[no_of_items].key, "\"topic\"");
-	sprintf(sysconfig_json[no_of_items].value, "\"%s\"", sysconfig.topic);
+	sprintf(sysconfig_json[no_of_items].value, "\"%s\"", config.topic);
 	no_of_items++;
 	
 	sprintf(sysconfig_json[no_of_items].key, "\"apn\"");
-	sprintf(sysconfig_json[no_of_items].value, "\"%s\"", sysconfig.apn);
+	sprintf(sysconfig_json[no_of_items].value, "\"%s\"", config.apn);
 	no_of_items++;
 	
 	json_str[0] = '\0';
@@ -656,6 +584,51 @@ void create_sysconfig_json(char* json_str, uint16_t json_str_len)
 
 
 
+/* -----------------------------------------------------------
+| 	device_jitter_ms()
+| 	A delay in [0, window_ms) that is the same on every call for
+| 	this device and salt, and spread evenly over the fleet. It is
+| 	an FNV-1a hash of the MAC address, so restarts, reconnects
+| 	and OTA starts of different devices don't line up
+------------------------------------------------------------*/
+uint32_t device_jitter_ms(uint32_t window_ms, uint32_t salt)
+{
+	uint8_t mac[6];
+	uint32_t hash = 2166136261u;
+	uint8_t i;
+
+	if (window_ms == 0) {
+		return 0;
+	}
+	esp_read_mac(mac, ESP_MAC_WIFI_STA);
+	for (i = 0; i < sizeof(mac); i++) {
+		hash = (hash ^ mac[i]) * 16777619u;
+	}
+	for (i = 0; i < sizeof(salt); i++) {
+		hash = (hash ^ ((salt >> (8 * i)) & 0xFF)) * 16777619u;
+	}
+	return (uint32_t)(((uint64_t)hash * window_ms) >> 32);
+}
+
+/* -----------------------------------------------------------
+| 	device_jitter_delay()
+| 	Waits device_jitter_ms(window_ms, salt), feeding the task
+| 	watchdog of the calling task if it has one
+------------------------------------------------------------*/
+void device_jitter_delay(uint32_t window_ms, uint32_t salt)
+{
+	uint32_t delay_ms = device_jitter_ms(window_ms, salt);
+	uint32_t slice_ms;
+
+	ESP_LOGI(TAG, "Waiting %u ms of %u ms jitter", delay_ms, window_ms);
+	while (delay_ms > 0) {
+		slice_ms = MIN(delay_ms, 1000);
+		vTaskDelay(slice_ms / portTICK_PERIOD_MS);
+		delay_ms -= slice_ms;
+		esp_task_wdt_reset();
+	}
+}
+
 void getMacAddress(char* macAddress) {
 	uint8_t baseMac[6];
 	// Get MAC address for WiFi station
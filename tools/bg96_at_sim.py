@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+"""
+bg96_at_sim.py
+
+Host-side stand-in for a BG96 for exercising the native MQTT transport
+(CONFIG_MQTT_TRANSPORT_BG96) without a modem or a broker. It answers the
+AT commands the firmware sends, acknowledges AT+QMTxxx with the URCs a real
+module produces and keeps count of what was published.
+
+Run it on a pty and point a USB-serial adapter (or a socat bridge) at it:
+    python3 tools/bg96_at_sim.py
+    python3 tools/bg96_at_sim.py --serial /dev/ttyUSB1 --baud 115200
+Options to provoke the error paths:
+    --drop-after N   report +QMTSTAT (connection closed) after N publishes
+    --command JSON   deliver JSON with +QMTRECV once the subscription is made
+    --pub-delay S    time the "network" takes to acknowledge a publish
+"""
+import argparse
+import os
+import pty
+import re
+import sys
+import time
+import tty
+
+IMEI = "866425031234567"
+IMSI = "404450123456789"
+CTRL_Z = 0x1A
+ESC = 0x1B
+
+
+class Bg96Sim:
+    def __init__(self, fd, args):
+        self.fd = fd
+        self.args = args
+        self.buf = b""
+        self.files = {}
+        self.connected = False
+        self.subscribed = None
+        self.publishes = 0
+        self.pub_bytes = 0
+        self.start = time.time()
+
+    # Wire helpers
+    def write(self, text):
+        os.write(self.fd, text.encode() if isinstance(text, str) else text)
+
+    def line(self, text):
+        self.write("\r\n" + text + "\r\n")
+
+    def ok(self):
+        self.line("OK")
+
+    def error(self):
+        self.line("ERROR")
+
+    def read_bytes(self, count=None, until=None):
+        """Read raw data after CONNECT or "> ", either a byte count or up to a terminator"""
+        while True:
+            if count is not None and len(self.buf) >= count:
+                data, self.buf = self.buf[:count], self.buf[count:]
+                return data
+            if until is not None:
+                for term in until:
+                    pos = self.buf.find(bytes([term]))
+                    if pos >= 0:
+                        data, self.buf = self.buf[:pos], self.buf[pos + 1:]
+                        return data, term
+            self.buf += os.read(self.fd, 1024)
+
+    def stats(self):
+        elapsed = max(time.time() - self.start, 1e-3)
+        print("  publishes: %d, bytes: %d, %.1f B/s" % (self.publishes, self.pub_bytes,
+                                                       self.pub_bytes / elapsed))
+
+    # Command handling
+    def handle(self, cmd):
+        print("<< " + cmd)
+        m = None
+
+        def match(pattern):
+            nonlocal m
+            m = re.fullmatch(pattern, cmd)
+            return m is not None
+
+        if cmd in ("AT", "ATE0", "AT&W", "AT+IFC=0,0", "AT+CFUN=1", "AT+QSCLK=1") or match(r"AT\+CGDCONT=.*") \
+                or match(r"AT\+CEDRXS=.*"):
+            self.ok()
+        elif cmd == "AT+CGMM":
+            self.line("BG96")
+            self.ok()
+        elif cmd == "AT+CGSN":
+            self.line(IMEI)
+            self.ok()
+        elif cmd == "AT+CIMI":
+            self.line(IMSI)
+            self.ok()
+        elif cmd == "AT+COPS?":
+            self.line('+COPS: 0,0,"SIM AIRTEL",8')
+            self.ok()
+        elif cmd == "AT+CSQ":
+            self.line("+CSQ: 21,99")
+            self.ok()
+        elif cmd == "AT+CBC":
+            self.line("+CBC: 0,80,3900")
+            self.ok()
+        elif cmd == "AT+CFUN=1,1":
+            self.ok()
+            time.sleep(1)
+            self.line("RDY")
+        elif match(r'AT\+QNTP=1,"([^"]+)",(\d+)'):
+            self.ok()
+            time.sleep(0.5)
+            local = time.localtime()
+            quarters = -time.altzone // 900 if local.tm_isdst else -time.timezone // 900
+            self.line('+QNTP: 0,"%s%+03d"' % (time.strftime("%Y/%m/%d,%H:%M:%S", local), quarters))
+        # File system
+        elif match(r'AT\+QFLST="([^"]+)"'):
+            name = m.group(1)
+            if name in self.files:
+                self.line('+QFLST: "UFS:%s",%d' % (name, len(self.files[name])))
+                self.ok()
+            else:
+                self.line("+CME ERROR: 405")
+        elif match(r'AT\+QFDEL="([^"]+)"'):
+            self.files.pop(m.group(1), None)
+            self.ok()
+        elif match(r'AT\+QFUPL="([^"]+)",(\d+)(?:,(\d+))?'):
+            name, size = m.group(1), int(m.group(2))
+            self.line("CONNECT")
+            self.files[name] = self.read_bytes(count=size)
+            print("   stored %s (%d bytes)" % (name, size))
+            self.line("+QFUPL: %d,%x" % (size, sum(self.files[name]) & 0xFFFF))
+            self.ok()
+        # TLS and MQTT
+        elif match(r"AT\+QSSLCFG=.*") or match(r"AT\+QMTCFG=.*"):
+            self.ok()
+        elif match(r'AT\+QMTOPEN=(\d),"([^"]+)",(\d+)'):
+            self.ok()
+            time.sleep(0.5)
+            self.line("+QMTOPEN: %s,0" % m.group(1))
+        elif match(r'AT\+QMTCONN=(\d),"([^"]+)".*'):
+            self.ok()
+            time.sleep(0.2)
+            self.connected = True
+            self.line("+QMTCONN: %s,0,0" % m.group(1))
+        elif match(r'AT\+QMTSUB=(\d),(\d+),"([^"]+)",(\d)'):
+            self.ok()
+            self.subscribed = m.group(3)
+            self.line("+QMTSUB: %s,%s,0,%s" % (m.group(1), m.group(2), m.group(4)))
+            if self.args.command:
+                time.sleep(1)
+                self.line('+QMTRECV: %s,0,"%s","%s"' % (m.group(1), self.subscribed, self.args.command))
+        elif match(r'AT\+QMTPUB=(\d),(\d+),(\d),(\d),"([^"]+)"'):
+            client, msgid, topic = m.group(1), m.group(2), m.group(5)
+            self.write("\r\n> ")
+            payload, term = self.read_bytes(until=(CTRL_Z, ESC))
+            if term == ESC:
+                print("   publish cancelled")
+                self.ok()
+                return
+            if not self.connected:
+                self.error()
+                return
+            self.ok()
+            time.sleep(self.args.pub_delay)
+            self.line("+QMTPUB: %s,%s,0" % (client, msgid))
+            self.publishes += 1
+            self.pub_bytes += len(payload)
+            print("   %s: %s" % (topic, payload.decode(errors="replace")))
+            self.stats()
+            if self.args.drop_after and self.publishes % self.args.drop_after == 0:
+                self.connected = False
+                self.line("+QMTSTAT: %s,1" % client)
+        elif match(r"AT\+QMTDISC=(\d)"):
+            self.ok()
+            self.connected = False
+            self.line("+QMTDISC: %s,0" % m.group(1))
+        else:
+            self.error()
+
+    def run(self):
+        self.line("RDY")
+        while True:
+            pos = self.buf.find(b"\r")
+            if pos < 0:
+                self.buf += os.read(self.fd, 1024)
+                continue
+            cmd, self.buf = self.buf[:pos].strip(b"\n"), self.buf[pos + 1:]
+            if cmd:
+                self.handle(cmd.decode(errors="replace"))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="BG96 AT command simulator for the native MQTT transport")
+    parser.add_argument("--serial", help="serial port to serve instead of a new pty")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--drop-after", type=int, default=0, help="report +QMTSTAT after every N publishes")
+    parser.add_argument("--command", help="JSON sent to the device with +QMTRECV after it subscribes")
+    parser.add_argument("--pub-delay", type=float, default=0.3, help="seconds before +QMTPUB is reported")
+    args = parser.parse_args()
+
+    if args.serial:
+        import serial  # pyserial, only needed for a real port
+        port = serial.Serial(args.serial, args.baud)
+        fd = port.fileno()
+    else:
+        fd, slave = pty.openpty()
+        tty.setraw(slave)
+        print("Simulated BG96 on %s" % os.ttyname(slave))
+    try:
+        Bg96Sim(fd, args).run()
+    except KeyboardInterrupt:
+        sys.exit(0)
+
+
+if __name__ == "__main__":
+    main()
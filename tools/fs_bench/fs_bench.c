@@ -0,0 +1,534 @@
+/**************************************************************
+* fs_bench.c
+*
+* Host benchmark of SPIFFS against LittleFS on a RAM model of the
+* 256 KB storage partition (partitions.csv), with the settings
+* ESP-IDF and esp_littlefs use on the device. It makes the writes
+* the firmware makes: a ~300 byte OTA record replaced at every
+* download checkpoint and the zombie info now and then, next to a
+* file that fills part of the partition. Reports:
+*
+*   - mount time, on an empty and on a used partition
+*   - latency of each file replace: mean, 99th percentile and the
+*     worst case, which is where garbage collection shows up
+*   - what a power cut in the middle of a replace leaves behind,
+*     with the plain fopen("wb") replace and with the temporary
+*     file and rename of storage_write_file()
+*
+* Times are modelled from the flash operations each filesystem
+* makes, with the typical timings of the W25Q32 on the board
+* (sector erase 45 ms, page program 0.4 ms, 40 MHz quad reads),
+* so the results don't depend on the host.
+*
+*   ./fs_bench [--writes N] [--fill PERCENT] [--trials N]
+**************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "spiffs.h"
+#include "spiffs_nucleus.h"
+#include "lfs.h"
+
+#define FLASH_SIZE (256 * 1024)
+#define FLASH_SECTOR 4096
+#define FLASH_PAGE 256
+#define ERASE_US 45000.0        // Per 4 KB sector
+#define PROG_US 400.0           // Per 256 byte page
+#define READ_US_PER_BYTE 0.05   // 40 MHz QIO
+#define READ_US_PER_CALL 10.0   // SPI transaction set up
+
+#define OTA_RECORD_SIZE 296
+#define ZOMBIE_INFO_SIZE 30
+#define ZOMBIE_EVERY 64         // OTA record writes per zombie info write, a 1 MB image at 16 KB checkpoints
+#define MAX_FILES 5             // As in init_storage()
+
+static uint8_t flash[FLASH_SIZE];
+static double flash_us;         // Modelled time of the flash operations so far
+static uint32_t flash_erases;
+static long flash_ops;          // Program and erase operations so far
+static long cut_at = -1;        // flash_ops of the operation the power is cut in, -1 for none
+static bool power_off;
+
+/* -----------------------------------------------------------
+| NOR flash model. Programming only clears bits. A power cut
+| lands in the middle of an operation: half of a program or an
+| erase is done, and nothing after it until power_on()
+------------------------------------------------------------*/
+static bool flash_power_cut(void)
+{
+    if (power_off == false && flash_ops++ == cut_at) {
+        power_off = true;
+        return true;
+    }
+    return false;
+}
+
+static void power_on(void)
+{
+    power_off = false;
+    cut_at = -1;
+}
+
+static int flash_read(uint32_t addr, uint32_t size, uint8_t *dst)
+{
+    if (addr + size > FLASH_SIZE) {
+        return -1;
+    }
+    memcpy(dst, &flash[addr], size);
+    flash_us += READ_US_PER_CALL + size * READ_US_PER_BYTE;
+    return 0;
+}
+
+static int flash_prog(uint32_t addr, uint32_t size, const uint8_t *src)
+{
+    uint32_t i;
+
+    if (addr + size > FLASH_SIZE || power_off == true) {
+        return -1;
+    }
+    if (flash_power_cut() == true) {
+        size /= 2;
+    }
+    for (i = 0; i < size; i++) {
+        flash[addr + i] &= src[i];
+    }
+    flash_us += PROG_US * ((addr % FLASH_PAGE + size + FLASH_PAGE - 1) / FLASH_PAGE);
+    return power_off == true ? -1 : 0;
+}
+
+static int flash_erase(uint32_t addr, uint32_t size)
+{
+    for (; size >= FLASH_SECTOR; addr += FLASH_SECTOR, size -= FLASH_SECTOR) {
+        if (power_off == true) {
+            return -1;
+        }
+        if (flash_power_cut() == true) {
+            memset(&flash[addr], 0xff, FLASH_SECTOR / 2);
+            return -1;
+        }
+        memset(&flash[addr], 0xff, FLASH_SECTOR);
+        flash_us += ERASE_US;
+        flash_erases++;
+    }
+    return 0;
+}
+
+// What the benchmark needs of a filesystem
+typedef struct
+{
+    const char *name;
+    int (*format)(void);
+    int (*mount)(void);
+    void (*unmount)(void);
+    int (*write)(const char *path, const void *data, size_t size);  // Truncate and write
+    int (*read)(const char *path, void *data, size_t size);         // Bytes read, < 0 if missing
+    int (*rename)(const char *from, const char *to);
+    int (*remove)(const char *path);
+    bool rename_replaces;       // Renaming over an existing file is allowed, and atomic
+}fs_t;
+
+/* -----------------------------------------------------------
+| SPIFFS as esp_vfs_spiffs_register() sets it up
+------------------------------------------------------------*/
+static spiffs spiffs_fs;
+static uint8_t spiffs_work[2 * FLASH_PAGE];
+static uint8_t spiffs_fds[MAX_FILES * sizeof(spiffs_fd)];
+static uint8_t spiffs_cache_buffer[sizeof(spiffs_cache) + MAX_FILES * (sizeof(spiffs_cache_page) + FLASH_PAGE)];
+
+static s32_t spiffs_hal_read(u32_t addr, u32_t size, u8_t *dst)
+{
+    return flash_read(addr, size, dst) == 0 ? SPIFFS_OK : SPIFFS_ERR_INTERNAL;
+}
+
+static s32_t spiffs_hal_write(u32_t addr, u32_t size, u8_t *src)
+{
+    return flash_prog(addr, size, src) == 0 ? SPIFFS_OK : SPIFFS_ERR_INTERNAL;
+}
+
+static s32_t spiffs_hal_erase(u32_t addr, u32_t size)
+{
+    return flash_erase(addr, size) == 0 ? SPIFFS_OK : SPIFFS_ERR_INTERNAL;
+}
+
+static int spiffs_bench_mount(void)
+{
+    spiffs_config cfg = {
+        .hal_read_f = spiffs_hal_read,
+        .hal_write_f = spiffs_hal_write,
+        .hal_erase_f = spiffs_hal_erase,
+        .phys_size = FLASH_SIZE,
+        .phys_addr = 0,
+        .phys_erase_block = FLASH_SECTOR,
+        .log_block_size = FLASH_SECTOR,
+        .log_page_size = FLASH_PAGE,
+    };
+
+    memset(&spiffs_fs, 0, sizeof(spiffs_fs));
+    return SPIFFS_mount(&spiffs_fs, &cfg, spiffs_work, spiffs_fds, sizeof(spiffs_fds), spiffs_cache_buffer,
+                        sizeof(spiffs_cache_buffer), NULL);
+}
+
+static int spiffs_bench_format(void)
+{
+    spiffs_bench_mount(); // Sets up the configuration, and fails on a blank partition
+    SPIFFS_unmount(&spiffs_fs);
+    return SPIFFS_format(&spiffs_fs);
+}
+
+static void spiffs_bench_unmount(void)
+{
+    SPIFFS_unmount(&spiffs_fs);
+}
+
+static int spiffs_bench_write(const char *path, const void *data, size_t size)
+{
+    spiffs_file fd;
+    int res;
+
+    fd = SPIFFS_open(&spiffs_fs, path, SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_WRONLY, 0);
+    if (fd < 0) {
+        return fd;
+    }
+    res = SPIFFS_write(&spiffs_fs, fd, (void *)data, size);
+    if (SPIFFS_close(&spiffs_fs, fd) < 0 && res >= 0) {
+        res = -1;
+    }
+    return res == (int)size ? 0 : -1;
+}
+
+static int spiffs_bench_read(const char *path, void *data, size_t size)
+{
+    spiffs_file fd;
+    int res;
+
+    fd = SPIFFS_open(&spiffs_fs, path, SPIFFS_RDONLY, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    res = SPIFFS_read(&spiffs_fs, fd, data, size);
+    SPIFFS_close(&spiffs_fs, fd);
+    return res;
+}
+
+static int spiffs_bench_rename(const char *from, const char *to)
+{
+    return SPIFFS_rename(&spiffs_fs, from, to);
+}
+
+static int spiffs_bench_remove(const char *path)
+{
+    return SPIFFS_remove(&spiffs_fs, path);
+}
+
+static const fs_t spiffs_bench = {
+    "SPIFFS", spiffs_bench_format, spiffs_bench_mount, spiffs_bench_unmount, spiffs_bench_write, spiffs_bench_read,
+    spiffs_bench_rename, spiffs_bench_remove, false
+};
+
+/* -----------------------------------------------------------
+| LittleFS with the esp_littlefs defaults
+------------------------------------------------------------*/
+static lfs_t lfs;
+static uint8_t lfs_read_buffer[512], lfs_prog_buffer[512], lfs_lookahead_buffer[128];
+
+static int lfs_bd_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    return flash_read(block * FLASH_SECTOR + off, size, buffer) == 0 ? 0 : LFS_ERR_IO;
+}
+
+static int lfs_bd_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer,
+                       lfs_size_t size)
+{
+    return flash_prog(block * FLASH_SECTOR + off, size, buffer) == 0 ? 0 : LFS_ERR_IO;
+}
+
+static int lfs_bd_erase(const struct lfs_config *c, lfs_block_t block)
+{
+    return flash_erase(block * FLASH_SECTOR, FLASH_SECTOR) == 0 ? 0 : LFS_ERR_IO;
+}
+
+static int lfs_bd_sync(const struct lfs_config *c)
+{
+    return 0;
+}
+
+static const struct lfs_config lfs_cfg = {
+    .read = lfs_bd_read,
+    .prog = lfs_bd_prog,
+    .erase = lfs_bd_erase,
+    .sync = lfs_bd_sync,
+    .read_size = 128,
+    .prog_size = 128,
+    .block_size = FLASH_SECTOR,
+    .block_count = FLASH_SIZE / FLASH_SECTOR,
+    .block_cycles = 512,
+    .cache_size = 512,
+    .lookahead_size = 128,
+    .read_buffer = lfs_read_buffer, // Static, so a mount after a power cut doesn't leak the caches
+    .prog_buffer = lfs_prog_buffer,
+    .lookahead_buffer = lfs_lookahead_buffer,
+};
+
+static int lfs_bench_format(void)
+{
+    return lfs_format(&lfs, &lfs_cfg);
+}
+
+static int lfs_bench_mount(void)
+{
+    return lfs_mount(&lfs, &lfs_cfg);
+}
+
+static void lfs_bench_unmount(void)
+{
+    lfs_unmount(&lfs);
+}
+
+static int lfs_bench_write(const char *path, const void *data, size_t size)
+{
+    lfs_file_t file;
+    int res;
+
+    res = lfs_file_open(&lfs, &file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (res < 0) {
+        return res;
+    }
+    res = lfs_file_write(&lfs, &file, data, size);
+    if (lfs_file_close(&lfs, &file) < 0 && res >= 0) {
+        res = -1;
+    }
+    return res == (int)size ? 0 : -1;
+}
+
+static int lfs_bench_read(const char *path, void *data, size_t size)
+{
+    lfs_file_t file;
+    int res;
+
+    if (lfs_file_open(&lfs, &file, path, LFS_O_RDONLY) < 0) {
+        return -1;
+    }
+    res = lfs_file_read(&lfs, &file, data, size);
+    lfs_file_close(&lfs, &file);
+    return res;
+}
+
+static int lfs_bench_rename(const char *from, const char *to)
+{
+    return lfs_rename(&lfs, from, to);
+}
+
+static int lfs_bench_remove(const char *path)
+{
+    return lfs_remove(&lfs, path);
+}
+
+static const fs_t lfs_bench = {
+    "LittleFS", lfs_bench_format, lfs_bench_mount, lfs_bench_unmount, lfs_bench_write, lfs_bench_read,
+    lfs_bench_rename, lfs_bench_remove, true
+};
+
+/* -----------------------------------------------------------
+| The replace of storage_write_file(), and the recovery of
+| storage_recover_writes() at mount
+------------------------------------------------------------*/
+static int replace_file(const fs_t *fs, bool atomic, const char *path, const void *data, size_t size)
+{
+    char tmp_path[40];
+
+    if (atomic == false) {
+        return fs->write(path, data, size);
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if (fs->write(tmp_path, data, size) != 0) {
+        return -1;
+    }
+    if (fs->rename_replaces == false) {
+        fs->remove(path);
+    }
+    return fs->rename(tmp_path, path) < 0 ? -1 : 0;
+}
+
+static void recover_file(const fs_t *fs, const char *path)
+{
+    char tmp_path[40];
+    uint8_t byte;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if (fs->read(tmp_path, &byte, 1) < 0) {
+        return;
+    }
+    if (fs->read(path, &byte, 1) >= 0) {
+        fs->remove(tmp_path);
+    } else {
+        fs->rename(tmp_path, path);
+    }
+}
+
+static int compare_us(const void *a, const void *b)
+{
+    double d = *(const double *)a - *(const double *)b;
+    return (d > 0) - (d < 0);
+}
+
+/* -----------------------------------------------------------
+| Mount times and replace latencies
+------------------------------------------------------------*/
+static void bench_latency(const fs_t *fs, int writes, int fill_percent)
+{
+    uint8_t record[OTA_RECORD_SIZE], zombie[ZOMBIE_INFO_SIZE];
+    double *latency_us = calloc(writes, sizeof(double));
+    size_t fill_size = (size_t)FLASH_SIZE * fill_percent / 100;
+    uint8_t *fill = malloc(fill_size + 1);
+    double start_us, mount_empty_us, mount_used_us, total_us = 0;
+    uint32_t erases;
+    int i;
+
+    memset(flash, 0xff, sizeof(flash));
+    memset(fill, 0x5a, fill_size);
+    memset(zombie, 'z', sizeof(zombie));
+    power_on();
+    if (fs->format() < 0) {
+        printf("%-9s format failed\n", fs->name);
+        return;
+    }
+    start_us = flash_us;
+    if (fs->mount() < 0) {
+        printf("%-9s mount failed\n", fs->name);
+        return;
+    }
+    mount_empty_us = flash_us - start_us;
+    if (fill_size > 0 && fs->write("fill", fill, fill_size) != 0) {
+        printf("%-9s %d%% doesn't fit\n", fs->name, fill_percent);
+        fs->unmount();
+        return;
+    }
+    fs->write("zombie_info.txt", zombie, sizeof(zombie));
+
+    erases = flash_erases;
+    for (i = 0; i < writes; i++) {
+        memset(record, i, sizeof(record));
+        start_us = flash_us;
+        if (replace_file(fs, true, "otarecord.txt", record, sizeof(record)) != 0) {
+            printf("%-9s write %d failed\n", fs->name, i);
+            break;
+        }
+        if (i % ZOMBIE_EVERY == ZOMBIE_EVERY - 1) {
+            replace_file(fs, true, "zombie_info.txt", zombie, sizeof(zombie));
+        }
+        latency_us[i] = flash_us - start_us;
+        total_us += latency_us[i];
+    }
+    erases = flash_erases - erases;
+    fs->unmount();
+    start_us = flash_us;
+    fs->mount();
+    mount_used_us = flash_us - start_us;
+    fs->unmount();
+
+    qsort(latency_us, i, sizeof(double), compare_us);
+    printf("%-9s %10.1f %10.1f %10.2f %10.2f %10.1f %8u\n", fs->name, mount_empty_us / 1000, mount_used_us / 1000,
+           i > 0 ? total_us / i / 1000 : 0, i > 0 ? latency_us[i * 99 / 100] / 1000 : 0,
+           i > 0 ? latency_us[i - 1] / 1000 : 0, erases);
+    free(latency_us);
+    free(fill);
+}
+
+/* -----------------------------------------------------------
+| Power cuts at a random flash operation of a replace
+------------------------------------------------------------*/
+static void bench_power_cut(const fs_t *fs, bool atomic, int trials)
+{
+    uint8_t old_record[OTA_RECORD_SIZE], new_record[OTA_RECORD_SIZE], record[OTA_RECORD_SIZE];
+    static uint8_t formatted[FLASH_SIZE];
+    int outcome_old = 0, outcome_new = 0, outcome_lost = 0, outcome_unmountable = 0;
+    long ops;
+    int i, res;
+
+    memset(old_record, 'o', sizeof(old_record));
+    memset(new_record, 'n', sizeof(new_record));
+    memset(flash, 0xff, sizeof(flash));
+    power_on();
+    fs->format();
+    fs->mount();
+    fs->write("otarecord.txt", old_record, sizeof(old_record));
+    fs->unmount();
+    memcpy(formatted, flash, sizeof(flash));
+
+    // Count the operations of one replace, to place the cuts within it
+    fs->mount();
+    ops = flash_ops;
+    replace_file(fs, atomic, "otarecord.txt", new_record, sizeof(new_record));
+    ops = flash_ops - ops;
+    fs->unmount();
+
+    for (i = 0; i < trials; i++) {
+        memcpy(flash, formatted, sizeof(flash));
+        fs->mount();
+        cut_at = flash_ops + rand() % ops;
+        replace_file(fs, atomic, "otarecord.txt", new_record, sizeof(new_record));
+        fs->unmount(); // Can't write anything any more
+        power_on(); // Restart: whatever was in RAM is gone
+        if (fs->mount() < 0) {
+            outcome_unmountable++;
+            continue;
+        }
+        if (atomic == true) {
+            recover_file(fs, "otarecord.txt");
+        }
+        res = fs->read("otarecord.txt", record, sizeof(record));
+        if (res == sizeof(record) && memcmp(record, old_record, sizeof(record)) == 0) {
+            outcome_old++;
+        } else if (res == sizeof(record) && memcmp(record, new_record, sizeof(record)) == 0) {
+            outcome_new++;
+        } else {
+            outcome_lost++;
+        }
+        fs->unmount();
+    }
+    printf("%-9s %-12s %6ld %8d %8d %8d %8d\n", fs->name, atomic ? "tmp+rename" : "fopen wb", ops, outcome_old,
+           outcome_new, outcome_lost, outcome_unmountable);
+}
+
+int main(int argc, char **argv)
+{
+    const fs_t *filesystems[] = { &spiffs_bench, &lfs_bench };
+    int writes = 2000, fill_percent = 50, trials = 500;
+    int i;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--writes") == 0) {
+            writes = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--fill") == 0) {
+            fill_percent = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--trials") == 0) {
+            trials = atoi(argv[i + 1]);
+        } else {
+            break;
+        }
+    }
+    if (i < argc || writes <= 0 || fill_percent < 0 || fill_percent > 90 || trials <= 0) {
+        fprintf(stderr, "usage: %s [--writes N] [--fill PERCENT] [--trials N]\n", argv[0]);
+        return 1;
+    }
+    srand(1);
+
+    printf("%d replaces of a %d byte file, partition %d%% full. Times in ms\n\n", writes, OTA_RECORD_SIZE,
+           fill_percent);
+    printf("%-9s %10s %10s %10s %10s %10s %8s\n", "", "mount", "mount", "write", "write", "write", "sector");
+    printf("%-9s %10s %10s %10s %10s %10s %8s\n", "", "empty", "used", "mean", "p99", "max (GC)", "erases");
+    for (i = 0; i < 2; i++) {
+        bench_latency(filesystems[i], writes, fill_percent);
+    }
+
+    printf("\nPower cut during a replace, %d trials each. What the file holds after the restart\n\n", trials);
+    printf("%-9s %-12s %6s %8s %8s %8s %8s\n", "", "replace", "ops", "old", "new", "lost", "no mount");
+    for (i = 0; i < 2; i++) {
+        bench_power_cut(filesystems[i], false, trials);
+        bench_power_cut(filesystems[i], true, trials);
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""
+ota_compress.py
+
+Compresses a firmware image for compressed OTA. The device decompresses it
+while it downloads it (ota_lz_decode() in main/ota.c), keeping only the last
+2^window_bits bytes of the image in RAM. The format is the heatshrink bit
+stream, so images from the heatshrink tool (-e -w <window> -l <lookahead>)
+work as well. Bits are MSB first:
+
+    1 <8 bits>                                 literal byte
+    0 <window_bits: offset-1> <lookahead_bits: count-1>
+                                               copy count bytes from offset back
+
+The window the device can take is CONFIG_OTA_LZ_MAX_WINDOW_BITS. Matching is
+greedy, over hash chains of 3 byte prefixes. The output is decompressed back
+before it is written, and must reproduce the image exactly.
+
+    python3 tools/ota_compress.py build/raahi_fw.bin build/raahi_fw.lz --window 11 --lookahead 4
+"""
+import argparse
+import sys
+import zlib
+
+CHAIN = 32  # Candidates tried per position
+
+
+def compress(data, window_bits=11, lookahead_bits=4):
+    window = 1 << window_bits
+    max_count = 1 << lookahead_bits
+    # A back reference must be cheaper than the same bytes as literals
+    min_count = (1 + window_bits + lookahead_bits) // 9 + 1
+    chains = {}
+    out = bytearray()
+    acc = 0
+    nbits = 0
+
+    def put(value, bits):
+        nonlocal acc, nbits
+        acc = (acc << bits) | value
+        nbits += bits
+        while nbits >= 8:
+            nbits -= 8
+            out.append((acc >> nbits) & 0xFF)
+        acc &= (1 << nbits) - 1
+
+    def insert(pos):
+        chain = chains.setdefault(data[pos:pos + 3], [])
+        chain.append(pos)
+        if len(chain) > CHAIN:
+            del chain[0]
+
+    pos = 0
+    while pos < len(data):
+        best_count, best_offset = 0, 0
+        limit = min(max_count, len(data) - pos)
+        for cand in reversed(chains.get(data[pos:pos + 3], ())):
+            if pos - cand > window:
+                break
+            # Only candidates that beat the best so far are worth extending
+            if data[cand:cand + best_count + 1] != data[pos:pos + best_count + 1]:
+                continue
+            count = best_count + 1
+            while count < limit and data[cand + count] == data[pos + count]:
+                count += 1
+            best_count, best_offset = count, pos - cand
+            if count == limit:
+                break
+        if best_count >= min_count:
+            put(0, 1)
+            put(best_offset - 1, window_bits)
+            put(best_count - 1, lookahead_bits)
+        else:
+            best_count = 1
+            put(1, 1)
+            put(data[pos], 8)
+        for i in range(pos, pos + best_count):
+            insert(i)
+        pos += best_count
+    if nbits:
+        put(0, 8 - nbits)
+    return bytes(out)
+
+
+def decompress(data, window_bits, lookahead_bits, size):
+    out = bytearray()
+    bit_pos = 0
+
+    def get(bits):
+        nonlocal bit_pos
+        value = 0
+        for _ in range(bits):
+            value = (value << 1) | ((data[bit_pos >> 3] >> (7 - (bit_pos & 7))) & 1)
+            bit_pos += 1
+        return value
+
+    while len(out) < size:
+        if get(1):
+            out.append(get(8))
+        else:
+            offset = get(window_bits) + 1
+            count = get(lookahead_bits) + 1
+            for _ in range(count):
+                out.append(out[-offset])
+    return bytes(out[:size])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compress an image for compressed OTA")
+    parser.add_argument("image", help="application binary, e.g. build/raahi_fw.bin")
+    parser.add_argument("output", help="compressed image to write")
+    parser.add_argument("--window", type=int, default=11, help="window bits, at most CONFIG_OTA_LZ_MAX_WINDOW_BITS")
+    parser.add_argument("--lookahead", type=int, default=4, help="lookahead bits, less than the window bits")
+    args = parser.parse_args()
+
+    image = open(args.image, "rb").read()
+    packed = compress(image, args.window, args.lookahead)
+    if decompress(packed, args.window, args.lookahead, len(image)) != image:
+        sys.exit("Compressed image doesn't reproduce the image")
+    open(args.output, "wb").write(packed)
+    print("%s: %d bytes, %.1f%% of the %d byte image (CRC32 %08x), window %d, lookahead %d" %
+          (args.output, len(packed), 100.0 * len(packed) / len(image), len(image), zlib.crc32(image),
+           args.window, args.lookahead))
+
+
+if __name__ == "__main__":
+    main()
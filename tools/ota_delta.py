@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""
+ota_delta.py
+
+Makes a patch that turns one firmware image into another, for delta OTA.
+The device applies it against its running partition while it downloads it
+(ota_decode() in main/ota.c). A patch is a sequence of ops, all numbers
+little endian u32:
+
+    0x01 <src> <len>    COPY len bytes of the running image from offset src
+    0x02 <len> <bytes>  INSERT len new bytes
+
+Matching is rsync style: the base image is indexed in blocks, the new image
+is scanned for those blocks at every offset and matches are grown in both
+directions. The patch is applied back to the base before it is written, and
+must reproduce the new image exactly.
+
+    python3 tools/ota_delta.py old/raahi_fw.bin build/raahi_fw.bin build/raahi_fw.patch
+"""
+import argparse
+import struct
+import sys
+import zlib
+
+OP_COPY = 0x01
+OP_INSERT = 0x02
+BLOCK = 16      # Bytes of the base indexed per entry
+MIN_COPY = 24   # A shorter match costs more as a COPY op than the bytes themselves
+
+
+def make_patch(base, new):
+    index = {}
+    for pos in range(0, len(base) - BLOCK + 1, BLOCK):
+        index.setdefault(base[pos:pos + BLOCK], pos)
+
+    ops = []
+    literal_start = 0
+    pos = 0
+    while pos <= len(new) - BLOCK:
+        src = index.get(new[pos:pos + BLOCK])
+        if src is None:
+            pos += 1
+            continue
+        # Grow the match forward, then backward into the pending literal bytes
+        end, src_end = pos + BLOCK, src + BLOCK
+        while end < len(new) and src_end < len(base) and new[end] == base[src_end]:
+            end += 1
+            src_end += 1
+        start, src_start = pos, src
+        while start > literal_start and src_start > 0 and new[start - 1] == base[src_start - 1]:
+            start -= 1
+            src_start -= 1
+        if end - start < MIN_COPY:
+            pos += 1
+            continue
+        if start > literal_start:
+            ops.append((OP_INSERT, new[literal_start:start]))
+        ops.append((OP_COPY, src_start, end - start))
+        literal_start = pos = end
+    if literal_start < len(new):
+        ops.append((OP_INSERT, new[literal_start:]))
+
+    patch = bytearray()
+    for op in ops:
+        if op[0] == OP_COPY:
+            patch += struct.pack("<BII", OP_COPY, op[1], op[2])
+        else:
+            patch += struct.pack("<BI", OP_INSERT, len(op[1])) + op[1]
+    return bytes(patch)
+
+
+def apply_patch(base, patch):
+    out = bytearray()
+    pos = 0
+    while pos < len(patch):
+        op = patch[pos]
+        if op == OP_COPY:
+            src, length = struct.unpack_from("<II", patch, pos + 1)
+            out += base[src:src + length]
+            pos += 9
+        elif op == OP_INSERT:
+            (length,) = struct.unpack_from("<I", patch, pos + 1)
+            out += patch[pos + 5:pos + 5 + length]
+            pos += 5 + length
+        else:
+            raise ValueError("unknown op 0x%02x at %d" % (op, pos))
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Make a delta OTA patch")
+    parser.add_argument("base", help="image the devices are running")
+    parser.add_argument("new", help="image to update them to")
+    parser.add_argument("patch", help="patch to write")
+    args = parser.parse_args()
+
+    base = open(args.base, "rb").read()
+    new = open(args.new, "rb").read()
+    patch = make_patch(base, new)
+    if apply_patch(base, patch) != new:
+        sys.exit("Patch doesn't reproduce the new image")
+    open(args.patch, "wb").write(patch)
+    print("%s: %d bytes, %.1f%% of the %d byte image. Base %d bytes, CRC32 %08x" %
+          (args.patch, len(patch), 100.0 * len(patch) / len(new), len(new), len(base), zlib.crc32(base)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""
+ota_manifest.py
+
+Makes the signed manifest that tells devices about a firmware update
+(get_ota_header() in main/ota.c). It is text, one "<key> <values>" line each:
+
+    raahi-ota-manifest 2
+    fw_ver <version>
+    image <size> <sha256> <url>
+    patch <base fw_ver> <base size> <base crc32> <size> <url>     optional
+    lz <window bits> <lookahead bits> <size> <url>                 optional
+    fragment <offset> <size> <sha256>                              in order, covering the image
+    sig <ECDSA P-256 signature, DER in hex, of the SHA-256 of all the lines before>
+
+The device checks each fragment as soon as it is written, and the whole image
+against the image SHA-256. The signature is made with openssl and the private
+key matching main/certs/ota_manifest_pub.pem, then verified with the public key
+when --pub is given.
+
+    python3 tools/ota_manifest.py build/raahi_fw.bin https://download.example.com/fw.bin \\
+        --key ota_manifest_key.pem --pub main/certs/ota_manifest_pub.pem -o build/manifest.txt
+"""
+import argparse
+import hashlib
+import os
+import subprocess
+import sys
+import tempfile
+import zlib
+
+MAGIC = "raahi-ota-manifest 2"
+FW_VER_LEN = 32
+MAX_URL_LEN = 128
+# esp_image_header_t + esp_image_segment_header_t, then esp_app_desc_t with the version at offset 16
+APP_DESC_OFFSET = 24 + 8
+APP_VERSION_OFFSET = APP_DESC_OFFSET + 16
+
+
+def fw_version(image):
+    return image[APP_VERSION_OFFSET:APP_VERSION_OFFSET + FW_VER_LEN].split(b"\0")[0].decode()
+
+
+def openssl(args, data):
+    with tempfile.NamedTemporaryFile(delete=False) as body:
+        body.write(data)
+    try:
+        return subprocess.run(["openssl", "dgst", "-sha256"] + args + [body.name], stdout=subprocess.PIPE,
+                              check=True).stdout
+    finally:
+        os.unlink(body.name)
+
+
+def sign(body, key):
+    return openssl(["-sign", key], body)
+
+
+def verify(manifest, pub):
+    body, _, sig = manifest.rpartition(b"sig ")
+    with tempfile.NamedTemporaryFile(delete=False) as sig_file:
+        sig_file.write(bytes.fromhex(sig.decode().strip()))
+    try:
+        return b"Verified OK" in openssl(["-verify", pub, "-signature", sig_file.name], body)
+    except subprocess.CalledProcessError:
+        return False
+    finally:
+        os.unlink(sig_file.name)
+
+
+def make_manifest(image, image_url, key, fragment_size=64 * 1024, base=None, patch=b"", patch_url="", lz=b"",
+                  lz_window=0, lz_lookahead=0, lz_url=""):
+    for url in (image_url, patch_url, lz_url):
+        if len(url) >= MAX_URL_LEN or " " in url:
+            sys.exit("URL too long or with spaces for the manifest: " + url)
+    lines = [MAGIC,
+             "fw_ver %s" % fw_version(image),
+             "image %d %s %s" % (len(image), hashlib.sha256(image).hexdigest(), image_url)]
+    if patch_url:
+        lines.append("patch %s %d %08x %d %s" % (fw_version(base), len(base), zlib.crc32(base), len(patch), patch_url))
+    if lz_url:
+        lines.append("lz %d %d %d %s" % (lz_window, lz_lookahead, len(lz), lz_url))
+    for offset in range(0, len(image), fragment_size):
+        fragment = image[offset:offset + fragment_size]
+        lines.append("fragment %d %d %s" % (offset, len(fragment), hashlib.sha256(fragment).hexdigest()))
+    body = "".join(line + "\n" for line in lines).encode()
+    return body + b"sig " + sign(body, key).hex().encode() + b"\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Make a signed OTA manifest")
+    parser.add_argument("image", help="application binary, e.g. build/raahi_fw.bin")
+    parser.add_argument("url", help="URL the devices download the image from")
+    parser.add_argument("--key", required=True, help="EC P-256 private key (PEM) to sign with")
+    parser.add_argument("--pub", help="public key (PEM) to check the signature with")
+    parser.add_argument("--fragment-kb", type=int, default=64, help="fragment size, at most CONFIG_OTA_MAX_FRAGMENTS "
+                        "fragments per image")
+    parser.add_argument("-o", "--output", required=True, help="manifest to write")
+    args = parser.parse_args()
+
+    image = open(args.image, "rb").read()
+    manifest = make_manifest(image, args.url, args.key, args.fragment_kb * 1024)
+    if args.pub and not verify(manifest, args.pub):
+        sys.exit("Signature doesn't verify with " + args.pub)
+    open(args.output, "wb").write(manifest)
+    print("%s: %s, %d byte image in %d fragments" % (args.output, fw_version(image), len(image),
+                                                     (len(image) + args.fragment_kb * 1024 - 1) //
+                                                     (args.fragment_kb * 1024)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+"""
+ota_server.py
+
+Local HTTPS server for OTA, for trying out and benchmarking firmware
+updates without the production download server. It serves an application
+image together with the signed manifest that ota_by_fragments() expects:
+
+    /manifest.txt the manifest (tools/ota_manifest.py), signed with --sign-key
+    /fw.bin       the image, with support for "Range: bytes=<start>-"
+    /fw.patch     with --base, a patch from that image (tools/ota_delta.py)
+    /fw.lz        with --compress, the image compressed (tools/ota_compress.py)
+
+The certificate given with --cert must be signed by main/certs/ca_cert.pem, and
+CONFIG_OTA_HEADER_URL must point at <url>/manifest.txt. Every transfer is logged
+with its throughput; --rate caps the throughput to emulate a 2G/GPRS link, so
+the device's "... B/s" logs can be compared for different CONFIG_OTA_BUFFER_SIZE
+/ CONFIG_OTA_BUFFER_COUNT settings. --drop-every cuts each transfer after that
+many bytes to exercise resuming.
+
+Connections are kept alive (HTTP/1.1), and every file has an ETag so the
+manifest can be rechecked with If-None-Match. Each request is logged with the
+number of requests its connection has served, which shows how many TLS
+handshakes an update takes.
+
+    python3 tools/ota_server.py build/raahi_fw.bin --url https://192.168.1.10:8443 \
+        --cert server.pem --key server.key --sign-key ota_manifest_key.pem --rate 8000 --drop-every 100000 --base old/raahi_fw.bin --compress
+"""
+import argparse
+import http.server
+import re
+import ssl
+import time
+import zlib
+
+from ota_compress import compress
+from ota_delta import make_patch
+from ota_manifest import fw_version, make_manifest
+
+
+class OtaHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    files = {}
+    rate = 0
+    drop_every = 0
+
+    def setup(self):
+        super().setup()
+        self.requests = 0
+
+    def do_GET(self):
+        self.requests += 1
+        self.log_message("%s: request %d on this connection", self.path, self.requests)
+        body = self.files.get(self.path)
+        if body is None:
+            self.send_error(404)
+            return
+        etag = '"%08x-%x"' % (zlib.crc32(body), len(body))
+        if self.headers.get("If-None-Match") == etag:
+            self.send_response(304)
+            self.send_header("ETag", etag)
+            self.end_headers()
+            return
+        start_byte = 0
+        match = re.fullmatch(r"bytes=(\d+)-", self.headers.get("Range", ""))
+        if match:
+            start_byte = int(match.group(1))
+            if start_byte >= len(body):
+                self.send_error(416)
+                return
+            self.send_response(206)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start_byte, len(body) - 1, len(body)))
+        else:
+            self.send_response(200)
+        self.send_header("Content-Length", str(len(body) - start_byte))
+        self.send_header("ETag", etag)
+        self.end_headers()
+
+        start = time.time()
+        sent = 0
+        chunk = 1024
+        for pos in range(start_byte, len(body), chunk):
+            if self.drop_every and sent >= self.drop_every:
+                self.log_message("%s: dropping the connection", self.path)
+                self.close_connection = True
+                break
+            self.wfile.write(body[pos:pos + chunk])
+            sent += len(body[pos:pos + chunk])
+            if self.rate:
+                # Sleep off whatever is ahead of the target rate
+                ahead = sent / self.rate - (time.time() - start)
+                if ahead > 0:
+                    time.sleep(ahead)
+        elapsed = max(time.time() - start, 1e-3)
+        self.log_message("%s: %d bytes from %d in %.2f s, %.0f B/s", self.path, sent, start_byte, elapsed,
+                         sent / elapsed)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="HTTPS server for OTA")
+    parser.add_argument("image", help="application binary, e.g. build/raahi_fw.bin")
+    parser.add_argument("--url", required=True, help="base URL the device reaches this server at")
+    parser.add_argument("--port", type=int, default=8443)
+    parser.add_argument("--cert", required=True, help="server certificate (PEM)")
+    parser.add_argument("--key", required=True, help="server private key (PEM)")
+    parser.add_argument("--sign-key", required=True, help="private key (PEM) the manifest is signed with")
+    parser.add_argument("--fragment-kb", type=int, default=64, help="fragment size in the manifest")
+    parser.add_argument("--rate", type=int, default=0, help="throughput cap in bytes/s, 0 for none")
+    parser.add_argument("--drop-every", type=int, default=0, help="cut transfers after this many bytes, 0 for never")
+    parser.add_argument("--base", help="image the devices run, to offer a patch from")
+    parser.add_argument("--compress", action="store_true", help="offer the image compressed as well")
+    parser.add_argument("--window", type=int, default=11, help="window bits of the compressed image")
+    parser.add_argument("--lookahead", type=int, default=4, help="lookahead bits of the compressed image")
+    args = parser.parse_args()
+
+    image = open(args.image, "rb").read()
+    version = fw_version(image)
+    base = args.url.rstrip("/")
+
+    OtaHandler.files = {"/fw.bin": image}
+    manifest = {}
+    if args.base:
+        base_image = open(args.base, "rb").read()
+        patch = make_patch(base_image, image)
+        OtaHandler.files["/fw.patch"] = patch
+        manifest.update(base=base_image, patch=patch, patch_url=base + "/fw.patch")
+        print("Patch from %s (%s): %d bytes" % (args.base, fw_version(base_image), len(patch)))
+    if args.compress:
+        lz = compress(image, args.window, args.lookahead)
+        OtaHandler.files["/fw.lz"] = lz
+        manifest.update(lz=lz, lz_window=args.window, lz_lookahead=args.lookahead, lz_url=base + "/fw.lz")
+        print("Compressed with window %d, lookahead %d: %d bytes" % (args.window, args.lookahead, len(lz)))
+    OtaHandler.files["/manifest.txt"] = make_manifest(image, base + "/fw.bin", args.sign_key, args.fragment_kb * 1024,
+                                                      **manifest)
+    OtaHandler.rate = args.rate
+    OtaHandler.drop_every = args.drop_every
+
+    server = http.server.ThreadingHTTPServer(("", args.port), OtaHandler)
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(args.cert, args.key)
+    server.socket = context.wrap_socket(server.socket, server_side=True)
+    print("Serving %s (%s, %d bytes, CRC32 %08x) on port %d" % (args.image, version, len(image), zlib.crc32(image),
+                                                                args.port))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()